@@ -0,0 +1,48 @@
+/**
+ * @file delta.h
+ * @brief Streaming decoder of binary wasm deltas. The patch is applied chunk by chunk while it is received,
+ * so neither the patch nor the new module has to fit into RAM.
+ * Patch format (big endian, encoder: BLE-communication/server/src/delta.cpp):
+ * | size of the new module (4 bytes) | size of the base module (4 bytes) | instructions |
+ * - ADD:  | n - 1 (0x00..0x7F) | n literal bytes |
+ * - COPY: | 0x80 | offset in the base module (3 bytes) | length (2 bytes) |
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Receives the new module as it is written, e.g. to hash it (see integrity.h)
+ */
+typedef void (*DeltaOutput)(const uint8_t *data, size_t len, void *context);
+
+/**
+ * @fn
+ * Start applying a patch.
+ * @param basePath const char *, module the patch refers to. It is not modified.
+ * @param outputPath const char *, new module
+ * @param output DeltaOutput, NULL if unused
+ * @param context void *, of output
+ * @return false if a file cannot be opened
+ */
+bool deltaBegin(const char *basePath, const char *outputPath, DeltaOutput output, void *context);
+
+/**
+ * @fn
+ * Apply the next part of the patch. Instructions may be split at any byte.
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return false if the patch is invalid (it does not belong to the base module, or a COPY is out of range)
+ */
+bool deltaFeed(const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Close the files after the last part of the patch.
+ * @return true if the new module is complete
+ */
+bool deltaFinish();
+
+#endif
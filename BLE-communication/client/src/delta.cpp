@@ -0,0 +1,125 @@
+/**
+ * @file delta.cpp
+ * @brief Streaming delta decoder (see delta.h). Holds only the parse state of the current instruction.
+ */
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "delta.h"
+
+#define DELTA_HEADER_SIZE 8
+#define DELTA_COPY_SIZE 6
+#define DELTA_COPY_BUFFER_SIZE 64
+
+static File baseFile;
+static File outputFile;
+static DeltaOutput outputObserver = NULL;
+static void *outputContext = NULL;
+static bool deltaValid = false;
+static uint8_t instruction[DELTA_HEADER_SIZE]; //header or COPY instruction being parsed
+static uint8_t instructionLength = 0;
+static bool headerDone = false;
+static uint8_t addRemaining = 0; //literal bytes of the current ADD
+static uint32_t newSize = 0;
+static uint32_t baseSize = 0;
+static uint32_t written = 0;
+
+bool deltaBegin(const char *basePath, const char *outputPath, DeltaOutput output, void *context)
+{
+  baseFile = SPIFFS.open(basePath, "r");
+  outputFile = SPIFFS.open(outputPath, "w");
+  outputObserver = output;
+  outputContext = context;
+  instructionLength = 0;
+  headerDone = false;
+  addRemaining = 0;
+  written = 0;
+  deltaValid = baseFile && outputFile;
+  return deltaValid;
+}
+
+static void writeOutput(const uint8_t *data, size_t len)
+{
+  outputFile.write(data, len);
+  if (outputObserver)
+    outputObserver(data, len, outputContext);
+}
+
+static bool copyFromBase(uint32_t offset, uint16_t length)
+{
+  if (offset + length > baseSize || written + length > newSize)
+    return false;
+  uint8_t buffer[DELTA_COPY_BUFFER_SIZE];
+  baseFile.seek(offset);
+  while (length)
+  {
+    size_t n = baseFile.read(buffer, min((size_t) length, sizeof(buffer)));
+    if (!n)
+      return false;
+    writeOutput(buffer, n);
+    written += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool deltaFeed(const uint8_t *data, size_t len)
+{
+  while (deltaValid && len)
+  {
+    if (!headerDone)
+    {
+      instruction[instructionLength++] = *data++;
+      len--;
+      if (instructionLength == DELTA_HEADER_SIZE)
+      {
+        newSize = (uint32_t) instruction[0] << 24 | (uint32_t) instruction[1] << 16 | instruction[2] << 8 | instruction[3];
+        baseSize = (uint32_t) instruction[4] << 24 | (uint32_t) instruction[5] << 16 | instruction[6] << 8 | instruction[7];
+        deltaValid = baseSize == baseFile.size();
+        headerDone = true;
+        instructionLength = 0;
+      }
+    }
+    else if (addRemaining)
+    {
+      size_t n = min(len, (size_t) addRemaining);
+      if (written + n > newSize)
+        deltaValid = false;
+      writeOutput(data, n);
+      written += n;
+      addRemaining -= n;
+      data += n;
+      len -= n;
+    }
+    else if (instructionLength)
+    {
+      instruction[instructionLength++] = *data++;
+      len--;
+      if (instructionLength == DELTA_COPY_SIZE)
+      {
+        uint32_t offset = (uint32_t) instruction[1] << 16 | instruction[2] << 8 | instruction[3];
+        uint16_t length = instruction[4] << 8 | instruction[5];
+        deltaValid = copyFromBase(offset, length);
+        instructionLength = 0;
+      }
+    }
+    else
+    {
+      uint8_t op = *data++;
+      len--;
+      if (op & 0x80)
+        instruction[instructionLength++] = op;
+      else
+        addRemaining = op + 1;
+    }
+  }
+  return deltaValid;
+}
+
+bool deltaFinish()
+{
+  bool complete = deltaValid && headerDone && !addRemaining && !instructionLength && written == newSize;
+  baseFile.close();
+  outputFile.close();
+  deltaValid = false;
+  return complete;
+}
@@ -3,6 +3,7 @@
  * @brief Client for Wasm binrary transmission between ESP32s using BLE.
  * Platform IO currently does not support Arduino v2.0 or later, so setMTU in BLEClient is not available from the original packege.
  * https://github.com/platformio/platform-espressif32/issues/619
+ * Instead, the local MTU is set by BLEDevice::setMTU(), and BLEClient of v1.0.6 requests it from the server while connecting.
  * 
  * Links of references:
  + https://randomnerdtutorials.com/esp32-ble-server-client/
@@ -27,14 +28,54 @@
 #include <SPIFFS.h>
 #include <EEPROM.h>
 
+#include "delta.h"
+#include "dlog.h"
+#include "event_loop.h"
+#include "integrity.h"
+#include "lzss.h"
+#include "metrics.h"
+#include "staging.h"
+#include "transfer.h"
+#include "wasm_budget.h"
+#include "wasm_call.h"
+#include "wasm_imports.h"
+#include "wasm_partition.h"
+#include "wasm_validate.h"
+
 #define WASM_STACK_SLOTS    4000
 #define CALC_INPUT  2
+#define CALC_RESULT_SIZE 4 //i32 result of calcWasm() in a batch output block
+#define CALC_BATCH_BUFFER_SIZE 1024 //bytes of the batch region of a module (see wasm_call.h)
 #define FATAL(func, msg) { Serial.print("Fatal: " func " "); Serial.println(msg);}
-//#define BLE_MTU 100 //default: 23Byte (20Byte for notify), max. 512Byte
+#define BLE_MTU 247 //default: 23Byte (20Byte for notify). 247: a notification fills a link layer packet with data length extension. Max. 261, so a payload length fits in uint8_t.
 #define bleServerName "Wasm_ESP32"
 #define EEPROM_SIZE 2 //save static status in the flash
 #define WASM_INVALID_FLAG_OFFSET 0x00
 #define WASM_VERSION_ID_OFFSET 0x01
+#define MAX_PAYLOAD_SIZE (BLE_MTU - 6) //payload of a wasm packet with BLE_MTU (3 Byte notify header, 3 Byte packet header)
+#define DEFAULT_PAYLOAD_SIZE 17 //payload of a wasm packet with the default MTU (23 Byte - 3 Byte notify header - 3 Byte packet header)
+#ifndef TRANSMIT_WINDOW_SIZE
+#define TRANSMIT_WINDOW_SIZE 32 //Max. number of buffered out-of-order packets. Must not be smaller than the window of the server.
+#endif
+//A BLE client does not relay modules, so there is no rollout mode: an intermediate node would also need the server role.
+//Multi-hop rollouts are relayed by the ESP-NOW mesh (see startRelay() and selectRolloutMode() in esp-now/src/main.cpp).
+#define WASM_TASK_INTERVAL 1000 //ms between two calls of wasm_task()
+#define WASM_CALL_FUEL 2000000 //instructions per call of the module, a runaway module traps instead of blocking loop() (see wasm_budget.h)
+#ifdef WASM_MEMORY_LIMIT
+#define MODULE_MEMORY_LIMIT WASM_MEMORY_LIMIT
+#else
+#define MODULE_MEMORY_LIMIT 0 //the runtime allocates the whole initial memory of a module
+#endif
+#define WASM_CALL_TIME 200000 //us per call of the module
+#ifndef DLOG_BINARY
+#define DLOG_BINARY 0 //1: the log is written as binary frames, expanded on the host by esp-now/tools/dlog_decode.cpp (see dlog.h)
+#endif
+#ifndef METRICS_SERIAL_INTERVAL
+#define METRICS_SERIAL_INTERVAL 0 //ms between two binary dumps of the metrics over serial, 0: off (build_flags = -DMETRICS_SERIAL_INTERVAL=n, see esp-now/tools/metrics_decode.cpp)
+#endif
+//events which wake loop() (see event_loop.h)
+#define EVENT_RECEIVE 0x01 //a notification of the server (wasmNotifyCallback())
+#define EVENT_CONNECT 0x02 //the server was found (MyAdvertisedDeviceCallbacks)
 
 // BLE Service. Set your service's UUID
 static BLEUUID serviceUUID("ed6a9e2f-2408-4b78-a3d6-3aa55f71a38a");
@@ -42,6 +83,9 @@ static BLEUUID serviceUUID("ed6a9e2f-2408-4b78-a3d6-3aa55f71a38a");
 // Wasm Characteristic
 static BLEUUID wasmCharacteristicUUID("f5703842-3515-4da8-ab2e-d40fbf457105");
 
+// ACK Characteristic
+static BLEUUID ackCharacteristicUUID("0b7c7b0e-5b6a-4f4b-9d0e-6f2c1a3e8d51");
+
 //Flags stating if should begin connecting and if the connection is up
 static boolean doConnect = false;
 static boolean connected = false;
@@ -51,6 +95,7 @@ static BLEAddress *pServerAddress;
  
 //Characteristicd that we want to read
 static BLERemoteCharacteristic* wasmCharacteristic;
+static BLERemoteCharacteristic* ackCharacteristic;
 
 //Activate notify
 const uint8_t notificationOn[] = {0x1, 0x0};
@@ -64,18 +109,49 @@ IM3Environment env;
 IM3Runtime runtime;
 IM3Module module;
 IM3Function calcWasm;
+WasmBatch wasmBatch; //batch entry point of the running module, function is NULL if it has none
+int wasmSlot = -1; //wasm partition slot of the running module
+WasmBudget wasmBudget; //of the calls of the running module and their statistics
+bool wasmSwapPending = false; //a received module is loaded in loop()
+
+//Metrics of the hot paths (see metrics.h), dumped over serial (see dumpMetrics())
+Metric wasmInstallTime = {"wasm_install_us", NULL, "Time to instrument and write a module into a wasm partition", METRIC_HISTOGRAM};
+Metric wasmLoadTime = {"wasm_load_us", NULL, "Time to parse, load and link a module", METRIC_HISTOGRAM};
+Metric wasmCallTime = {"wasm_call_us", NULL, "Latency of a call of the module", METRIC_HISTOGRAM};
+Metric heapFree = {"heap_free_bytes", NULL, "Free heap", METRIC_GAUGE};
+Metric heapMinFree = {"heap_min_free_bytes", NULL, "Lowest free heap since the start", METRIC_GAUGE};
+Metric stackFree = {"stack_min_free_bytes", "task=\"loop\"", "Lowest free stack of a task since its start", METRIC_GAUGE};
+unsigned long lastMetricsDump = 0;
 int wasmResult = 0;
 
 // Variable to store if sending data was successful
 String success;
 
-//For wasm binary transmission
-int currentTransmitOffset = 0;
-int numberOfPackets = 0;
-byte sendNextPacketFlag = 0;
+//For wasm binary transmission. Out-of-order packets wait in receiveBuffer until the gap is filled (see transfer.h).
+TransferReceiver receiver;
 bool wasmUpdateFlag = false;
 uint8_t wasmUpdateVersion = 0;
-
+bool deltaReception = false; //the payload is a delta from the current /main.wasm, applied into /main.new
+bool receiveFailed = false; //the received data cannot be decompressed or applied
+uint8_t receiveCodec = CODEC_NONE; //codec of the running reception, advertised in the header
+LzssDecoder lzssDecoder;
+IntegrityCheck moduleCheck; //digest of the running reception (see integrity.h)
+bool receiveTrailingDigest = false; //the header has no room for the digest (default MTU), the last packet of the transfer carries it
+//a module which cannot run is rejected while it streams in (see wasm_validate.h)
+const WasmValidateConfig moduleValidation = {"calcWasm", CALC_INPUT, 1, MODULE_MEMORY_LIMIT, WASM_STACK_SLOTS};
+WasmValidator moduleValidator;
+WasmFuelInfo receivedFuelInfo; //scan of the received /main.wasm, its install does not scan it again
+bool receivedFuelInfoValid = false;
+bool versionReportPending = false;
+uint8_t receiveTransferId = 0;
+uint16_t receivePayloadSize = DEFAULT_PAYLOAD_SIZE; //advertised in the header, depends on the negotiated MTU
+uint8_t receiveBuffer[TRANSMIT_WINDOW_SIZE * MAX_PAYLOAD_SIZE];
+bool ackPending = false;
+uint8_t ackMessage[TRANSFER_ACK_SIZE(TRANSMIT_WINDOW_SIZE)]; //built in wasmNotifyCallback, written in loop()
+uint8_t ackMessageLength = 0;
+portMUX_TYPE ackMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t advertisedCredit = TRANSMIT_WINDOW_SIZE; //credit of the last ACK
+unsigned long lastWasmTaskMillis = 0;
 
 //EEPROM.read(0x00) == 1 => Wasm file is invalid
 static void setWasmInvalidFlag(){
@@ -102,6 +178,100 @@ uint8_t getWasmVersionId(){
 }
 
 
+/**
+ * @fn
+ * DeltaOutput (see delta.h): the new module is validated and hashed as the delta writes it
+ */
+static void hashDeltaOutput(const uint8_t *data, size_t len, void *context){
+  if (wasmValidateFeed(&moduleValidator, data, len))
+    integrityModule(&moduleCheck, data, len);
+}
+
+/**
+ * @fn
+ * LzssWriter for the received module: apply it as delta or validate and stage it for the file (see staging.h).
+ * @param data const uint8_t *
+ * @param len size_t
+ * @param context void *, unused
+ */
+static void writeDecodedData(const uint8_t *data, size_t len, void *context){
+  if (!deltaReception)
+  {
+    if (!wasmValidateFeed(&moduleValidator, data, len))
+      return;
+    integrityModule(&moduleCheck, data, len);
+    stagingWrite(data, len);
+  }
+  else if (!receiveFailed && !deltaFeed(data, len))
+    receiveFailed = true;
+}
+
+/**
+ * @fn
+ * Pass received data to writeDecodedData(), decompressed if the header advertised a codec. The packets arrive in order,
+ * so the transfer CRC of the reception is updated here (see integrity.h).
+ * An invalid module (see wasm_validate.h) fails the reception at once.
+ */
+static void writeModuleData(const uint8_t *data, size_t len){
+  integrityTransfer(&moduleCheck, data, len);
+  if (receiveCodec == CODEC_NONE)
+    writeDecodedData(data, len, NULL);
+  else if (!receiveFailed && !lzssDecode(&lzssDecoder, data, len, writeDecodedData, NULL))
+  {
+    DLOG_WARN("Invalid compressed data");
+    receiveFailed = true;
+  }
+  if (moduleValidator.error && !receiveFailed)
+  {
+    DLOG_WARN("Received module rejected: %s", moduleValidator.error);
+    receiveFailed = true;
+  }
+}
+
+/**
+ * @fn
+ * TransferWriter of the receiver: the packets arrive in order (see transfer.h). The trailing digest packet is not module data.
+ */
+static void writeReceivedPacket(void *context, uint16_t offset, const uint8_t *data, size_t len){
+  (void) context;
+  if (!receiveTrailingDigest || offset < receiver.numberOfPackets)
+    writeModuleData(data, len);
+  else if (len == INTEGRITY_DIGEST_SIZE)
+    integrityExpect(&moduleCheck, data);
+  else
+    receiveFailed = true;
+}
+
+/**
+ * @fn
+ * Packets the client can take now: the receive window, reduced while loop() has not written the full staging buffer to flash
+ * (see staging.h). With this credit the server sends as fast as the link and the flash allow, without fixed delays.
+ * The estimate ignores the decompression, a larger module is staged synchronously by stagingWrite().
+ * @return uint8_t, at least 1
+ */
+static uint8_t receiveCredit(){
+  if (deltaReception)
+    return TRANSMIT_WINDOW_SIZE;
+  size_t packets = stagingSpace() / receivePayloadSize;
+  if (packets >= TRANSMIT_WINDOW_SIZE)
+    return TRANSMIT_WINDOW_SIZE;
+  return packets ? packets : 1;
+}
+
+/**
+ * @fn
+ * Take a snapshot of the reception state as ACK packet (see transferBuildAck()). It is written to the ACK characteristic in loop().
+ * The credit tells the server how many packets the client can take now (see receiveCredit()).
+ */
+static void queueAck(){
+  uint8_t credit = receiveCredit();
+  portENTER_CRITICAL(&ackMux);
+  ackMessageLength = transferBuildAck(&receiver, credit, ackMessage);
+  advertisedCredit = credit;
+  ackPending = true;
+  portEXIT_CRITICAL(&ackMux);
+}
+
 /**
  * @fn 
  * Called when the BLE Server sends a new Wasm file with the notify property
@@ -112,54 +282,144 @@ uint8_t getWasmVersionId(){
  */
 static void wasmNotifyCallback(BLERemoteCharacteristic* pBLERemoteCharacteristic, uint8_t* data, size_t len, bool isNotify){
 
-  Serial.println("EntryNotifyCallback");
-  Serial.print("Payload size: ");
-  Serial.println(len);
-
   switch (*data++)
   {
     case 0x01:
-      Serial.println("Start of new file transmit");
-      currentTransmitOffset = 0;
-      numberOfPackets = (*data++) << 8 | *data;
-      wasmUpdateFlag = (*++data != getWasmVersionId());
-      if(wasmUpdateFlag || !isWasmExecutable()){
-        wasmUpdateVersion = *data;
-        Serial.println("currentNumberOfPackets = " + String(numberOfPackets));
-        SPIFFS.remove("/main.wasm");
+    {
+      if (len < 5)
+        break;
+      //a repeated header of the running transfer must not restart the reception
+      if (data[3] == receiveTransferId && receiver.numberOfPackets)
+      {
+        queueAck();
         break;
       }
+      DLOG_INFO("Start of new file transmit");
+      receiveTransferId = data[3];
+      uint16_t numberOfPackets = data[0] << 8 | data[1];
+      wasmUpdateFlag = (data[2] != getWasmVersionId());
+      deltaReception = len >= 7 && data[4] == 1;
+      receiveFailed = false;
+      receiveCodec = len >= 8 ? data[6] : CODEC_NONE;
+      receivePayloadSize = len >= 10 ? data[7] << 8 | data[8] : DEFAULT_PAYLOAD_SIZE;
+      if (receivePayloadSize > MAX_PAYLOAD_SIZE)
+        receivePayloadSize = MAX_PAYLOAD_SIZE; //larger packets are dropped, cannot happen with the MTU of this client
+      integrityBegin(&moduleCheck, len >= 10 + INTEGRITY_DIGEST_SIZE ? data + 9 : NULL);
+      receiveTrailingDigest = len >= 10 && !moduleCheck.advertised;
+      wasmValidateBegin(&moduleValidator, &moduleValidation);
+      lzssDecoderInit(&lzssDecoder);
+      receiver.payloadSize = receivePayloadSize;
+      transferReceiverStart(&receiver, receiveTransferId, numberOfPackets);
+      if(deltaReception && (data[5] != getWasmVersionId() || !isWasmExecutable() || !deltaBegin("/main.wasm", "/main.new", hashDeltaOutput, NULL))){
+        DLOG_WARN("Delta does not match the current wasm file");
+        deltaReception = false;
+        transferReceiverSkip(&receiver); //acknowledge the whole file, the version is reported again after reconnecting
+      }
+      else if(wasmUpdateFlag || !isWasmExecutable()){
+        wasmUpdateVersion = data[2];
+        DLOG_INFO("currentNumberOfPackets = %u", numberOfPackets);
+        if (!deltaReception && !stagingBegin("/main.new"))
+          DLOG_ERROR("Error opening file ...");
+      }
+      else {
+        transferReceiverSkip(&receiver); //up to date: acknowledge the whole file
+      }
+      queueAck();
+      break;
+    }
     case 0x02:
-      if(wasmUpdateFlag || !isWasmExecutable()){
-        currentTransmitOffset = (*data++) << 8 | *data++; 
-        File file = SPIFFS.open("/main.wasm",FILE_APPEND);
-        if (!file)
-          Serial.println("Error opening file ...");
-          
-        for (int i=0; i < (len-3); i++)
+    {
+      //a duplicate, a gap, used up credit and the last packet need an ACK at once
+      bool wasReceived = transferReceiverDone(&receiver);
+      if (transferReceive(&receiver, data - 1, len, writeReceivedPacket, NULL))
+        queueAck();
+      //the rest of a failed reception is not needed, it is acknowledged as a whole so the server stops
+      if (!wasReceived && receiveFailed && !transferReceiverDone(&receiver))
+      {
+        transferReceiverSkip(&receiver);
+        queueAck();
+      }
+
+      if (!wasReceived && transferReceiverDone(&receiver))
+      {
+        DLOG_INFO("done wasm file transfer");
+        bool complete;
+        if (deltaReception)
         {
-          //byte dat = *data++;
-          //Serial.println(dat);
-          file.write(*data++);
+          deltaReception = false;
+          complete = deltaFinish() && !receiveFailed;
+          if (!complete)
+            DLOG_WARN("Delta update failed");
         }
-        file.close();
-
-        if (currentTransmitOffset == numberOfPackets)
+        else
         {
-          Serial.println("done wasm file transfer");
-          File file = SPIFFS.open("/main.wasm");
-          Serial.println(file.size());
-          file.close();
-          setWasmValidFlag();
-          setWasmVersionId(wasmUpdateVersion);
-          ESP.restart();
+          size_t size = stagingFinish();
+          DLOG_INFO("%u bytes", (uint32_t) size);
+          complete = !receiveFailed;
+          if (!complete)
+            DLOG_WARN("Wasm reception failed");
         }
-        break;
+        //the current module stays untouched unless the new one is complete, matches the digest of the header or of the trailing
+        //digest packet and is valid
+        const char *error = !complete ? NULL : receiveTrailingDigest && !moduleCheck.advertised ? "no digest" : integrityVerify(&moduleCheck);
+        if (error)
+        {
+          DLOG_WARN("Received module rejected: %s", error);
+          versionReportPending = true; //the server sends the module again
+        }
+        else if (complete && (error = wasmValidateFinish(&moduleValidator)))
+          DLOG_WARN("Received module rejected: %s", error);
+        if (!complete || error)
+        {
+          SPIFFS.remove("/main.new");
+          break;
+        }
+        const WasmFuelInfo *fuelInfo = wasmValidateFuelInfo(&moduleValidator);
+        receivedFuelInfoValid = fuelInfo != NULL;
+        if (fuelInfo)
+          receivedFuelInfo = *fuelInfo;
+        wasmSwapPending = true; //swapWasm() loads /main.new and replaces /main.wasm
       }
+      break;
+    }
 
     default: break;
 
   } 
+  //loop() writes the ACK and switches to a received module at once
+  eventPost(EVENT_RECEIVE);
+}
+
+/**
+ * @fn
+ * Write the wasm version to the server after connecting, so it can send a delta.
+ * Message structure (uint8_t *):
+ * | message flag (0x05) | wasm version ID | 1 if the wasm file is executable, otherwise 0 |
+ */
+void sendVersionReport(){
+  if (!versionReportPending || ackCharacteristic == nullptr)
+    return;
+  versionReportPending = false;
+  uint8_t message[] = {0x05, getWasmVersionId(), isWasmExecutable()};
+  ackCharacteristic->writeValue(message, sizeof(message), false);
+}
+
+/**
+ * @fn
+ * Write the pending ACK to the server. Called in loop(), since a write must not block the notify callback.
+ */
+void sendAck(){
+  if (!ackPending || ackCharacteristic == nullptr)
+    return;
+
+  uint8_t messageArray[TRANSFER_ACK_SIZE(TRANSMIT_WINDOW_SIZE)];
+  portENTER_CRITICAL(&ackMux);
+  uint8_t messageLength = ackMessageLength;
+  memcpy(messageArray, ackMessage, messageLength);
+  ackPending = false;
+  portEXIT_CRITICAL(&ackMux);
+
+  ackCharacteristic->writeValue(messageArray, messageLength, false);
 }
 
 
@@ -170,10 +430,11 @@ static void wasmNotifyCallback(BLERemoteCharacteristic* pBLERemoteCharacteristic
  */
 bool connectToServer(BLEAddress pAddress) {
    BLEClient* pClient = BLEDevice::createClient();
-   //BLEDevice::setMTU(250);
-  // Connect to the remove BLE Server.
+  // Connect to the remove BLE Server. The MTU is negotiated meanwhile, a server without bulk mode keeps the default MTU.
   pClient->connect(pAddress);
   Serial.println("Connected to server");
+  Serial.print("MTU: ");
+  Serial.println(pClient->getMTU());
  
   // Obtain a reference to the service we are after in the remote BLE server.
   BLERemoteService* pRemoteService = pClient->getService(serviceUUID);
@@ -190,6 +451,11 @@ bool connectToServer(BLEAddress pAddress) {
     Serial.print("Failed to find our characteristic UUID");
     return false;
   }
+  ackCharacteristic = pRemoteService->getCharacteristic(ackCharacteristicUUID);
+  if (ackCharacteristic == nullptr) {
+    Serial.print("Failed to find our ACK characteristic UUID");
+    return false;
+  }
   Serial.println("Found our characteristics");
  
   //Assign callback functions for the Characteristics
@@ -205,100 +471,300 @@ class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
       pServerAddress = new BLEAddress(advertisedDevice.getAddress()); //Address of advertiser is the one we need
       doConnect = true; //Set indicator, stating that we are ready to connect
       Serial.println("Device found. Connecting!");
+      eventPost(EVENT_CONNECT);
     }
   }
 };
 
 /**
  * @fn 
- * WASM setup using wasm3
+ * WASM setup using wasm3: load a module file into a new runtime next to the running one, then switch to it (A/B slots, see wasm_partition.h).
+ * Called in setup() and loop(), so the switch happens between two wasm_task() calls. The running module stays active if the new one fails.
+ * @param path const char *, /main.wasm, or /main.new for a received module
+ * @param fuelInfo const WasmFuelInfo *, scan of the file if it is known (a validated reception, see wasm_validate.h), NULL: the file is scanned at its install
+ * @return false if the new module cannot be loaded
  */
-static void run_wasm(void*)
+static bool load_wasm(const char *path, const WasmFuelInfo *fuelInfo)
 {
-  // load wasm from SPIFFS
-  /* If default CONFIG_ARDUINO_LOOP_STACK_SIZE 8192 < wasmFile,
-  a new size must be given in  \Users\<user>\.platformio\packages\framework-arduinoespressif32\tools\sdk\include\config\sdkconfig.h
-  https://community.platformio.org/t/esp32-stack-configuration-reloaded/20994/2
-  */
-  File wasmFile = SPIFFS.open("/main.wasm", "r");
-  unsigned int build_main_wasm_len = wasmFile.size();
+  // the module is executed from the memory-mapped flash, so it is not copied into RAM
+  unsigned long start = micros();
+  int slot = wasmPartitionInstall(path, WASM_PARTITION_SLOT_MASK(wasmSlot), fuelInfo);
+  if (slot >= 0)
+    metricRecord(&wasmInstallTime, micros() - start);
+  size_t build_main_wasm_len = 0;
+  const uint8_t *build_main_wasm = slot < 0 ? NULL : wasmPartitionMap(slot, &build_main_wasm_len);
+  if (!build_main_wasm) {
+    Serial.println("Fatal: wasmPartitionMap failed");
+    return false;
+  }
   Serial.println("wasm_length:");
   Serial.println(build_main_wasm_len);
-  // read file
-  unsigned char build_main_wasm[build_main_wasm_len];
-  wasmFile.readBytes((char *) build_main_wasm, build_main_wasm_len);
-
-  Serial.println("Loading WebAssembly was successful");
   Serial.print("Wasm Version ID: ");
   Serial.println(getWasmVersionId());
 
-  M3Result result = m3Err_none;
-
-  //it warks also without using variable
-  //uint8_t* wasm = (uint8_t*)build_app_wasm;
-
-  env = m3_NewEnvironment ();
-  if (!env) {setWasmInvalidFlag(); FATAL("NewEnvironment", "failed"); ESP.restart();}
-
-  runtime = m3_NewRuntime (env, WASM_STACK_SLOTS, NULL);
-  if (!runtime) {setWasmInvalidFlag(); FATAL("m3_NewRuntime", "failed"); ESP.restart();}
+  start = micros();
+  IM3Environment newEnv = m3_NewEnvironment ();
+  IM3Runtime newRuntime = newEnv ? m3_NewRuntime (newEnv, WASM_STACK_SLOTS, NULL) : NULL;
+  if (!newRuntime) {
+    Serial.println("Fatal: m3_NewRuntime failed");
+    if (newEnv) m3_FreeEnvironment(newEnv);
+    wasmPartitionUnmap(slot);
+    return false;
+  }
 
   #ifdef WASM_MEMORY_LIMIT
-    runtime->memoryLimit = WASM_MEMORY_LIMIT;
+    newRuntime->memoryLimit = WASM_MEMORY_LIMIT;
   #endif
 
-   result = m3_ParseModule (env, &module, build_main_wasm, build_main_wasm_len);
-   if (result) {setWasmInvalidFlag(); FATAL("m3_ParseModule", result); ESP.restart();}
-
-   result = m3_LoadModule (runtime, module);
-   if (result) {setWasmInvalidFlag(); FATAL("m3_LoadModule", result); ESP.restart();}
-
-   // link
-   //result = LinkArduino (runtime);
-   //if (result) FATAL("LinkArduino", result);
+  IM3Module newModule;
+  IM3Function newCalcWasm;
+  const char *step = "m3_ParseModule";
+  M3Result result = m3_ParseModule (newEnv, &newModule, build_main_wasm, build_main_wasm_len);
+  if (!result) {
+    step = "m3_LoadModule";
+    result = m3_LoadModule (newRuntime, newModule);
+    if (result) m3_FreeModule(newModule);
+  }
 
+  // link the host functions the module imports (see wasm_imports.h)
+  if (!result) {
+    step = "wasmLinkImports";
+    result = wasmLinkImports(newModule);
+  }
 
-   result = m3_FindFunction (&calcWasm, runtime, "calcWasm");
-   if (result) {setWasmInvalidFlag(); FATAL("m3_FindFunction(calcWasm)", result); ESP.restart();}
+  // the budget of the calls, the module is metered (see wasm_fuel.h)
+  if (!result) {
+    step = "wasmBudgetLink";
+    result = wasmBudgetLink(newModule, &wasmBudget);
+  }
 
-   Serial.println("Running WebAssembly...");
+  if (!result) {
+    step = "m3_FindFunction(calcWasm)";
+    result = m3_FindFunction (&newCalcWasm, newRuntime, "calcWasm");
+  }
+  if (result) {
+    Serial.print("Fatal: ");
+    Serial.print(step);
+    Serial.print(" ");
+    Serial.println(result);
+    m3_FreeRuntime(newRuntime);
+    m3_FreeEnvironment(newEnv);
+    wasmPartitionUnmap(slot);
+    return false;
+  }
+  metricRecord(&wasmLoadTime, micros() - start);
+
+  // modules without calcBatch() are called once per sample
+  const WasmBudgetConfig budgetConfig = {WASM_CALL_FUEL, WASM_CALL_TIME};
+  wasmBudgetInit(&wasmBudget, &budgetConfig);
+  WasmBatch newBatch;
+  wasmBudgetBegin(&wasmBudget);
+  M3Result batchResult = wasmBudgetEnd(&wasmBudget, wasmBatchInit(&newBatch, newRuntime, CALC_BATCH_BUFFER_SIZE));
+  Serial.print("Batch calls: ");
+  Serial.println(batchResult ? batchResult : "yes");
+
+  // switch to the new module, then release the previous one
+  IM3Environment previousEnv = env;
+  IM3Runtime previousRuntime = runtime;
+  int previousSlot = wasmSlot;
+  env = newEnv;
+  runtime = newRuntime;
+  module = newModule;
+  calcWasm = newCalcWasm;
+  wasmBatch = newBatch;
+  wasmSlot = slot;
+  if (previousRuntime) m3_FreeRuntime(previousRuntime);
+  if (previousEnv) m3_FreeEnvironment(previousEnv);
+  wasmPartitionUnmap(previousSlot);
+
+  Serial.println("Running WebAssembly...");
+  return true;
+}
 
+/**
+ * @fn
+ * Stop the running module and release it, e.g. after it exceeded its budget
+ */
+static void unload_wasm()
+{
+  if (runtime) m3_FreeRuntime(runtime);
+  if (env) m3_FreeEnvironment(env);
+  wasmPartitionUnmap(wasmSlot);
+  env = NULL;
+  runtime = NULL;
+  module = NULL;
+  calcWasm = NULL;
+  wasmBatch.function = NULL;
+  wasmSlot = -1;
 }
 
-  /**
- * @fn 
- * Call WASM task
+/**
+ * @fn
+ * Print the call statistics of the running module (see wasm_budget.h)
  */
+void printBudget(){
+  if (!wasmBudget.calls)
+    return;
+  DLOG_INFO("Calls: %u, last %u us, mean %u us, max. %u us, budget exceeded %u (fuel) %u (time)", wasmBudget.calls, wasmBudget.lastTime,
+            (uint32_t) (wasmBudget.totalTime / wasmBudget.calls), wasmBudget.maxTime, wasmBudget.fuelTraps, wasmBudget.timeTraps);
+}
 
-  void wasm_task(){
-    const void *i_argptrs[CALC_INPUT];
-    byte inputBytes[CALC_INPUT] = {0x01, 0x02};
-    M3Result result = m3Err_none;
-    
-    for(int i=0; i<CALC_INPUT ;i++){
-      i_argptrs[i] = &inputBytes[i];
+/**
+ * @fn
+ * Run calcWasm() on a block of samples. A module with calcBatch() is entered once per CALC_BATCH_BUFFER_SIZE bytes of samples,
+ * otherwise once per sample (see wasm_call.h). Each call has the budget of the module, a call which exceeds it traps (see wasm_budget.h).
+ * @param inputs const uint8_t [][CALC_INPUT]
+ * @param results int32_t *, output
+ * @param count int
+ * @return number of processed samples, less than count if a call failed
+ */
+static int calcSamples(const uint8_t inputs[][CALC_INPUT], int32_t *results, int count)
+{
+  int done = 0;
+  while (done < count)
+  {
+    M3Result result;
+    if (wasmBatch.function)
+    {
+      uint32_t blockCount = min((uint32_t) (count - done), wasmBatchCapacity(&wasmBatch, CALC_INPUT, CALC_RESULT_SIZE));
+      uint32_t processed = 0;
+      wasmBudgetBegin(&wasmBudget);
+      result = wasmBudgetEnd(&wasmBudget, wasmBatchCall(&wasmBatch, inputs[done], CALC_INPUT, results + done, CALC_RESULT_SIZE, blockCount, &processed));
+      metricRecord(&wasmCallTime, wasmBudget.lastTime);
+      done += processed;
+      if (!result && processed == blockCount)
+        continue;
     }
-
-    /*
-    m3_Call(function, number_of_arguments, arguments_array)
-    To get return, one have to call a function with m3_Call first, then call m3_GetResultsV(function, adress).
-    (Apparently) m3_Call stores the result in the liner memory, then m3_GetResultsV accesses the address.
-    */
-    result = m3_Call(calcWasm,CALC_INPUT,i_argptrs);                       
-    if(result){
-      setWasmInvalidFlag();
-      FATAL("m3_Call(calcWasm):", result);
-      ESP.restart();
+    else
+    {
+      WasmArgs args;
+      wasmArgsInit(&args);
+      for (int i = 0; i < CALC_INPUT; i++)
+        wasmArgsAdd(&args, (uint32_t) inputs[done][i]);
+      wasmBudgetBegin(&wasmBudget);
+      result = wasmBudgetEnd(&wasmBudget, wasmCallArgs(calcWasm, &args));
+      metricRecord(&wasmCallTime, wasmBudget.lastTime);
+      if (!result)
+        result = m3_GetResultsV(calcWasm, &results[done]);
+      if (!result)
+      {
+        done++;
+        continue;
+      }
     }
+    DLOG_ERROR("Fatal: calcWasm %s", result ? result : "incomplete batch");
+    if (wasmBudgetExceeded(result))
+      printBudget();
+    break;
+  }
+  return done;
+}
 
-    result = m3_GetResultsV(calcWasm, &wasmResult);
-    if(result){
-      setWasmInvalidFlag();
-      FATAL("m3_GetResultsV(calcWasm):", result);
+/**
+ * @fn 
+ * Call WASM task. A module which exceeded its budget is stopped and marked invalid, so the server sends it again,
+ * otherwise a failed call restarts the node.
+ * @return false if the call failed
+ */
+bool wasm_task(){
+  const uint8_t inputs[1][CALC_INPUT] = {{0x01, 0x02}};
+  int32_t results[1];
+  uint32_t budgetTraps = wasmBudget.fuelTraps + wasmBudget.timeTraps;
+  if (calcSamples(inputs, results, 1) != 1){
+    setWasmInvalidFlag();
+    if (wasmBudget.fuelTraps + wasmBudget.timeTraps == budgetTraps)
+    {
+      dlogFlush(100);
       ESP.restart();
     }
+    DLOG_WARN("Stop the wasm module");
+    unload_wasm();
+    versionReportPending = true;
+    return false;
+  }
+  wasmResult = results[0];
+  return true;
+}
 
+/**
+ * @fn
+ * Switch to a received module (see load_wasm()) instead of restarting. Called in loop().
+ * The received module replaces /main.wasm only once it is loaded, so a failed module is not loaded at the next boot.
+ * The version is reported again, so the server sends the next delta from the running version.
+ */
+void swapWasm(){
+  if (!wasmSwapPending)
+    return;
+  wasmSwapPending = false;
+  if (load_wasm("/main.new", receivedFuelInfoValid ? &receivedFuelInfo : NULL)) {
+    SPIFFS.remove("/main.wasm");
+    SPIFFS.rename("/main.new", "/main.wasm");
+    setWasmValidFlag();
+    setWasmVersionId(wasmUpdateVersion);
+    lastWasmTaskMillis = millis() - WASM_TASK_INTERVAL; //the new module runs at once
+  }
+  else {
+    SPIFFS.remove("/main.new");
+    if (calcWasm)
+      Serial.println("Keep the running wasm module"); //its file stays valid for the next boot
+    else
+      setWasmInvalidFlag();
   }
+  versionReportPending = true;
+}
+
+/**
+ * @fn
+ * Read an ADC pin for a wasm module (import sensorRead, see wasm_imports.h)
+ * @return -1 if the pin has no ADC channel
+ */
+int32_t sensorReadHook(int32_t channel){
+  if (channel < 0 || digitalPinToAnalogChannel(channel) < 0)
+    return -1;
+  return analogRead(channel);
+}
+
+/**
+ * @fn
+ * DlogWriter (see dlog.h) of the drain task
+ */
+void writeLog(void *context, const uint8_t *data, size_t len){
+  Serial.write(data, len);
+}
+
+/**
+ * @fn
+ * Write a binary frame of the metrics (see metrics.h) to serial every METRICS_SERIAL_INTERVAL ms. Called in loop().
+ */
+void dumpMetrics(){
+  if (!METRICS_SERIAL_INTERVAL || millis() - lastMetricsDump < METRICS_SERIAL_INTERVAL)
+    return;
+  lastMetricsDump = millis();
+  metricSet(&heapFree, ESP.getFreeHeap());
+  metricSet(&heapMinFree, ESP.getMinFreeHeap());
+  metricSet(&stackFree, uxTaskGetStackHighWaterMark(NULL));
+  size_t size = metricsFrameSize();
+  uint8_t *frame = (uint8_t *) malloc(size);
+  if (!frame)
+    return;
+  size_t len = metricsFrame(frame, size, lastMetricsDump);
+  Serial.write(frame, len);
+  free(frame);
+}
+
+/**
+ * @fn
+ * Time until the next call of wasm_task() or the next dump of the metrics. Receptions and connections wake loop() (see event_loop.h).
+ * @return ms
+ */
+uint32_t nextLoopTimeout(){
+  uint32_t timeout = EVENT_WAIT_FOREVER;
+  if (calcWasm)
+    timeout = (uint32_t) max((int32_t) (lastWasmTaskMillis + WASM_TASK_INTERVAL - millis()), (int32_t) 0);
+  if (METRICS_SERIAL_INTERVAL)
+    timeout = min(timeout, (uint32_t) max((int32_t) (lastMetricsDump + METRICS_SERIAL_INTERVAL - millis()), (int32_t) 0));
+  return timeout;
+}
 
  /**
  * @fn 
@@ -306,19 +772,34 @@ static void run_wasm(void*)
  */
 void setup(){
 
+  dlogInit();
   Serial.begin(115200);
+  dlogStart(writeLog, NULL, DLOG_BINARY);
+  eventLoopInit();
+  metricsAdd(&wasmInstallTime);
+  metricsAdd(&wasmLoadTime);
+  metricsAdd(&wasmCallTime);
+  metricsAdd(&stagingWriteTime);
+  metricsAdd(&heapFree);
+  metricsAdd(&heapMinFree);
+  metricsAdd(&stackFree);
 
   SPIFFS.begin();
   EEPROM.begin(EEPROM_SIZE);
+  transferReceiverInit(&receiver, TRANSMIT_WINDOW_SIZE, receiveBuffer, DEFAULT_PAYLOAD_SIZE);
 
-  //set up for wasm
+  //set up for wasm, there is no mesh to send to
+  const WasmHostHooks hooks = {NULL, sensorReadHook};
+  wasmImportsInit(&hooks);
   if(isWasmExecutable()){
     Serial.println("Loading wasm");
-    run_wasm(NULL);
+    if (!load_wasm("/main.wasm", NULL))
+      setWasmInvalidFlag();
   }
 
   //Init BLE device
   BLEDevice::init("");
+  BLEDevice::setMTU(BLE_MTU);
 
   Serial.println("ble initilized");
 
@@ -345,20 +826,34 @@ void loop(){
       //Activate the Notify property of Characteristic
       wasmCharacteristic->getDescriptor(BLEUUID((uint16_t)0x2902))->writeValue((uint8_t*)notificationOn, 2, true);
       connected = true;
+      versionReportPending = true;
     } else {
-      //TODO: Consider disconnecting while running, e.g., restart of the server. (If an ESP is an intermediate node, it must restart after receiving a new wasm, then must advertise)
+      //TODO: Consider disconnecting while running, e.g., restart of the server.
       Serial.println("We have failed to connect to the server; Restart your device to scan for nearby BLE server again.");
     }
     doConnect = false;
   }
 
   
-  if(isWasmExecutable()) {
-    wasm_task();
-    Serial.println("Wasm result:");
-    Serial.println(wasmResult);
+  sendVersionReport();
+  sendAck();
+  stagingFlush();
+  //window update: the server stopped at the credit of the last ACK, which was reduced by a full staging buffer
+  if (receiver.numberOfPackets && !transferReceiverDone(&receiver) && advertisedCredit < TRANSMIT_WINDOW_SIZE && receiveCredit() > advertisedCredit)
+    queueAck();
+  swapWasm();
+
+  if(calcWasm && millis() - lastWasmTaskMillis >= WASM_TASK_INTERVAL) {
+    lastWasmTaskMillis = millis();
+    if (wasm_task()) {
+      DLOG_INFO("Wasm result: %d", wasmResult);
+      printBudget();
+    }
   }
 
-  delay(1000);
+  dumpMetrics();
+
+  //ACKs are written in loop(), so it runs at once after a notification instead of after a delay
+  eventWait(nextLoopTimeout());
 }
 
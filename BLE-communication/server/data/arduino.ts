@@ -0,0 +1,55 @@
+// Host functions of the sketch (see wasm_imports.h), import them with: import { fir, crc32 } from "./arduino"
+// A buffer is a pointer into the linear memory, aligned to its element size (f32: 4 bytes, Q15 i16: 2 bytes).
+// A buffer out of the memory or not aligned traps the call.
+
+// FIR filter, output may be the input
+// @ts-ignore: decorator
+@external("arduino", "fir")
+export declare function fir(input: usize, output: usize, count: i32, coefficients: usize, taps: i32): void;
+
+// biquad filter in place, coefficients: b0, b1, b2, a1, a2 (f32), state: 2 x f32, 0 before the first block
+// @ts-ignore: decorator
+@external("arduino", "biquad")
+export declare function biquad(data: usize, count: i32, coefficients: usize, state: usize): void;
+
+// FFT in place of n complex f32 values (real, imaginary, ...), n a power of two up to 4096, 0 or -1
+// @ts-ignore: decorator
+@external("arduino", "fft")
+export declare function fft(data: usize, n: i32, inverse: bool): i32;
+
+// result: mean, variance, minimum, maximum (4 x f32)
+// @ts-ignore: decorator
+@external("arduino", "statistics")
+export declare function statistics(data: usize, count: i32, result: usize): void;
+
+// CRC-32 (IEEE 802.3), crc 0 for the first block
+// @ts-ignore: decorator
+@external("arduino", "crc32")
+export declare function crc32(crc: u32, data: usize, len: i32): u32;
+
+// Q15 vector math (i16, 1.0 = 32768), saturating, output may be an input
+// @ts-ignore: decorator
+@external("arduino", "q15Add")
+export declare function q15Add(a: usize, b: usize, output: usize, count: i32): void;
+
+// @ts-ignore: decorator
+@external("arduino", "q15Mul")
+export declare function q15Mul(a: usize, b: usize, output: usize, count: i32): void;
+
+// @ts-ignore: decorator
+@external("arduino", "q15Scale")
+export declare function q15Scale(a: usize, scale: i16, output: usize, count: i32): void;
+
+// @ts-ignore: decorator
+@external("arduino", "q15Dot")
+export declare function q15Dot(a: usize, b: usize, count: i32): i32;
+
+// send data to a node of the mesh, 0 or -1 (always -1 without a mesh)
+// @ts-ignore: decorator
+@external("arduino", "meshSend")
+export declare function meshSend(node: i32, data: usize, len: i32): i32;
+
+// read an ADC pin, -1 if the pin has no ADC channel
+// @ts-ignore: decorator
+@external("arduino", "sensorRead")
+export declare function sensorRead(channel: i32): i32;
@@ -0,0 +1,25 @@
+/**
+ * @file delta.h
+ * @brief Binary delta of wasm modules (encoder). The client applies the patch while receiving it.
+ * Patch format (big endian):
+ * | size of the new module (4 bytes) | size of the base module (4 bytes) | instructions |
+ * - ADD:  | n - 1 (0x00..0x7F) | n literal bytes |
+ * - COPY: | 0x80 | offset in the base module (3 bytes) | length (2 bytes) |
+ * BLE-communication/tools/delta_check.cpp round-trips this encoder with the decoder of the client on a host.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#define DELTA_MIN_COPY 8 //shorter matches are cheaper as ADD
+
+/**
+ * @fn
+ * Encode the patch from the base module to the new module.
+ * @param basePath const char *, module the receiver has
+ * @param newPath const char *, module the receiver should have
+ * @param patchPath const char *, output file
+ * @return false if a file cannot be read or written, or there is not enough memory
+ */
+bool encodeDelta(const char *basePath, const char *newPath, const char *patchPath);
+
+#endif
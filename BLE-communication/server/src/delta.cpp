@@ -0,0 +1,119 @@
+/**
+ * @file delta.cpp
+ * @brief Greedy delta encoder (see delta.h). Both modules are held in RAM, matches are found with a hash table of 4-byte sequences of the base module.
+ */
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "delta.h"
+
+#define DELTA_HASH_BITS 10
+#define DELTA_MAX_ADD 128
+#define DELTA_MAX_COPY 0xFFFF
+
+static inline uint16_t hash4(const uint8_t *p)
+{
+  uint32_t v = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | p[2] << 8 | p[3];
+  return (uint32_t) (v * 2654435761u) >> (32 - DELTA_HASH_BITS);
+}
+
+/**
+ * @fn
+ * Read a whole file into a new buffer.
+ * @return buffer (free() by the caller), nullptr on error
+ */
+static uint8_t *readFile(const char *path, size_t *size)
+{
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return nullptr;
+  *size = file.size();
+  uint8_t *buffer = (uint8_t *) malloc(*size ? *size : 1);
+  if (buffer && file.read(buffer, *size) != *size) {
+    free(buffer);
+    buffer = nullptr;
+  }
+  file.close();
+  return buffer;
+}
+
+static void writeAdd(File &patch, const uint8_t *literal, size_t length)
+{
+  while (length)
+  {
+    uint8_t n = min(length, (size_t) DELTA_MAX_ADD);
+    patch.write(n - 1);
+    patch.write(literal, n);
+    literal += n;
+    length -= n;
+  }
+}
+
+static void writeCopy(File &patch, uint32_t offset, size_t length)
+{
+  while (length)
+  {
+    uint16_t n = min(length, (size_t) DELTA_MAX_COPY);
+    uint8_t instruction[] = {0x80, (uint8_t) (offset >> 16), (uint8_t) (offset >> 8), (uint8_t) offset, (uint8_t) (n >> 8), (uint8_t) n};
+    patch.write(instruction, sizeof(instruction));
+    offset += n;
+    length -= n;
+  }
+}
+
+bool encodeDelta(const char *basePath, const char *newPath, const char *patchPath)
+{
+  size_t baseSize = 0, newSize = 0;
+  uint8_t *base = readFile(basePath, &baseSize);
+  uint8_t *target = readFile(newPath, &newSize);
+  int32_t *table = (int32_t *) malloc(sizeof(int32_t) << DELTA_HASH_BITS);
+  File patch = SPIFFS.open(patchPath, "w");
+  bool ok = base && target && table && patch && baseSize < (1UL << 24);
+
+  if (ok)
+  {
+    uint8_t header[] = {(uint8_t) (newSize >> 24), (uint8_t) (newSize >> 16), (uint8_t) (newSize >> 8), (uint8_t) newSize,
+                        (uint8_t) (baseSize >> 24), (uint8_t) (baseSize >> 16), (uint8_t) (baseSize >> 8), (uint8_t) baseSize};
+    patch.write(header, sizeof(header));
+
+    for (int i = 0; i < (1 << DELTA_HASH_BITS); i++)
+      table[i] = -1;
+    for (size_t j = 0; j + 4 <= baseSize; j++)
+    {
+      uint16_t h = hash4(base + j);
+      if (table[h] < 0) //keep the first occurrence
+        table[h] = j;
+    }
+
+    size_t literalStart = 0;
+    size_t i = 0;
+    while (i < newSize)
+    {
+      size_t matchLength = 0;
+      int32_t candidate = i + 4 <= newSize ? table[hash4(target + i)] : -1;
+      if (candidate >= 0)
+      {
+        while (candidate + matchLength < baseSize && i + matchLength < newSize && base[candidate + matchLength] == target[i + matchLength])
+          matchLength++;
+      }
+      if (matchLength >= DELTA_MIN_COPY)
+      {
+        writeAdd(patch, target + literalStart, i - literalStart);
+        writeCopy(patch, candidate, matchLength);
+        i += matchLength;
+        literalStart = i;
+      }
+      else
+      {
+        i++;
+      }
+    }
+    writeAdd(patch, target + literalStart, newSize - literalStart);
+  }
+
+  if (patch)
+    patch.close();
+  free(base);
+  free(target);
+  free(table);
+  return ok;
+}
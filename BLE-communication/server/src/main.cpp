@@ -20,15 +20,52 @@
 #include <ESPAsyncWebServer.h>
 #include <ESPmDNS.h>
 #include <SPIFFS.h>
+#include <EEPROM.h>
+
+#include "chunk_source.h"
+#include "delta.h"
+#include "dlog.h"
+#include "event_loop.h"
+#include "integrity.h"
+#include "lzss.h"
+#include "transfer.h"
 
 #define CALC_INPUT  2
 #define FATAL(func, msg) { Serial.print("Fatal: " func " "); Serial.println(msg); return; }
 #define CHANNEL 0
-//Default MTU of BLE is 23 Byte. Max. size is not usable due to packet's structure. Furthermore, notfy allows only max. 20 Byte. (It also sends packets flag, total packet size, offset, etc.)
-#define MAX_PAYLOAD_SIZE 17
+//Default MTU of BLE is 23 Byte. Furthermore, notfy allows only max. 20 Byte. (It also sends packets flag, total packet size, offset, etc.)
+#define DEFAULT_PAYLOAD_SIZE 17 //a client which does not negotiate the MTU gets the default MTU
+//Bulk mode: a client with the same BLE_MTU gets 241 byte instead of 17 byte per packet, so the header overhead per link layer packet drops from about 37% to 4%.
+#define BLE_MTU 247 //local ATT MTU, one notification fills a link layer packet of BLE_DATA_LENGTH (247 + 4 byte L2CAP header)
+#define BLE_DATA_LENGTH 251 //max. link layer payload with data length extension (default 27)
 #define NOTIFY_OVERHEAD_SIZE 3 //Notify header needs 3 byte
 #define WASM_PACKET_HEADER_SIZE 3 //offset and message flag need 3 byte
+#define TRANSMIT_HEADER_SIZE 10 //header of a transfer without the digest (see startTransmit())
 #define bleServerName "Wasm_ESP32"
+#ifndef TRANSMIT_WINDOW_SIZE
+#define TRANSMIT_WINDOW_SIZE 32 //Max. number of unacknowledged packets. Must not be larger than the window of the client.
+#endif
+#ifndef TRANSFER_COMPRESSION
+#define TRANSFER_COMPRESSION 1 //1: send the module (or delta) LZSS compressed if it gets smaller (see lzss.h)
+#endif
+#ifndef DLOG_BINARY
+#define DLOG_BINARY 0 //1: the log is written as binary frames, expanded on the host by esp-now/tools/dlog_decode.cpp (see dlog.h)
+#endif
+#define RETRANSMIT_TIMEOUT 1000 //ms without ACK until an unacknowledged packet is notified again
+#define MAX_CLIENTS 3 //simultaneous connections, below CONFIG_BT_ACL_CONNECTIONS (default 4)
+#define CLIENT_SETTLE_TIME 1000 //ms after connecting until the first packet if the client does not report its version. Client node cannot get a first packet before it has subscribed, the version report is written after subscribing.
+#define TRANSMIT_BURST 4 //max. packets per client and loop(), so the clients share the controller buffer
+#define LOOP_RETRY_DELAY 1 //ms until loop() serves again a client which has more packets due than TRANSMIT_BURST or whose packet the stack did not take
+#define EEPROM_SIZE 1 //save static status in the flash
+#define WASM_VERSION_ID_OFFSET 0x00
+#define WASM_VERSION_ID_FIRST 101 //ID of the module before the first upload
+//IDs wrap from WASM_VERSION_ID_MAX to WASM_VERSION_ID_MIN: 0 and 0xff are the erased EEPROM (of the server and of a client)
+#define WASM_VERSION_ID_MIN 1
+#define WASM_VERSION_ID_MAX 254
+#define UPLOADED_MODULE_PATH "/main.up" //upload of a module, renamed to "/main.wasm" when it is complete
+//events which wake loop() (see event_loop.h)
+#define EVENT_CLIENT 0x01 //a connection, an ACK, a version report or the end of a congestion (gattsEventHandler())
+#define EVENT_UPLOAD 0x02 //an upload is complete (handleUpload())
 
 // See the following for generating UUIDs:
 // https://www.uuidgenerator.net/
@@ -38,10 +75,13 @@
 // Wasm Characteristic and Descriptor
 BLECharacteristic wasmCharacteristics("f5703842-3515-4da8-ab2e-d40fbf457105", BLECharacteristic::PROPERTY_NOTIFY);
 BLEDescriptor wasmDescriptor(BLEUUID((uint16_t)0x2901));
-uint16_t wasmPayloadSize = 17;//default MTU is 23byte. Notify header needs 3 byte, offset and message flag need 3 byte => 23-3-3=17 byte
+// ACK Characteristic, written by the client (see transferSenderAck())
+BLECharacteristic ackCharacteristics("0b7c7b0e-5b6a-4f4b-9d0e-6f2c1a3e8d51", BLECharacteristic::PROPERTY_WRITE_NR);
+esp_gatt_if_t gattsInterface = 0; //GATT interface of the server, needed to notify a single connection
 
-//TODO: Update if overwritten by WebIDE. The current ID in flash. 
-uint8_t wasmVersionID = 101;
+uint8_t wasmVersionID = WASM_VERSION_ID_FIRST; //ID of "/main.wasm", incremented at every upload, saved in the EEPROM
+IntegrityDigest moduleDigest; //size and hash of "/main.wasm" (see integrity.h), the transfer CRC is the one of each transfer
+bool moduleDigestValid = false; //computed before the first transfer of a module
 
 int wasmResult = 0;
 
@@ -52,16 +92,36 @@ String success;
 int wl_status = WL_IDLE_STATUS;
 AsyncWebServer server(80);
 
-//For wasm binary transmission
-int currentTransmitOffset = 0;
-int numberOfPackets = 0;
-byte sendNextPacketFlag = 0;
-
-//! If a client is connected to the server, the state is true. If the client disconnects, the boolean variable changes to false.
-bool deviceConnected = false;
-
-//! This flag == true: a new wasm file is available.
-bool newWasmAvailable = true;
+//For wasm binary transmission (selective repeat, see transfer.h). Sequence number 0 is the header packet, 1..number of packets are payload packets.
+//Every connection has its own transfer, the clients are served in turns (see loop()).
+typedef struct {
+  bool connected;
+  uint16_t connId;
+  unsigned long connectedMillis;
+  uint16_t payloadSize; //negotiated MTU - NOTIFY_OVERHEAD_SIZE - WASM_PACKET_HEADER_SIZE. Default MTU is 23byte => 23-3-3=17 byte, BLE_MTU => 241 byte
+  //! This flag == true: the client may need the module (after connecting and after an upload).
+  bool moduleDue;
+  //Version reported by the client (see handleVersionReport()). The previous module is kept as "/v<ID>.wasm", so a client with this version gets a delta.
+  bool versionReported;
+  uint8_t versionID;
+  bool wasmExecutable;
+  //transfer
+  char transmitFilePath[16]; //"/main.wasm", "/delta<n>.bin" for a delta transfer, "/transmit<n>.lz" if compressed (n: client index)
+  bool transmitDelta;
+  uint8_t transmitCodec;
+  uint16_t transmitPayloadSize; //payloadSize when the transfer started
+  IntegrityDigest transmitDigest; //advertised in the header, or in the trailing digest packet
+  bool trailingDigest; //the digest does not fit into the header (default MTU), the last packet of the transfer carries it
+  TransferSender sender; //sender.active: a transfer is running
+  TransferLink link; //notifications to this connection (see sendData())
+  ChunkSource source; //transmitFilePath, read once per transmission
+  bool sourceOpen;
+  bool congested; //the controller buffer of the connection is full (ESP_GATTS_CONGEST_EVT)
+} ClientSession;
+ClientSession clients[MAX_CLIENTS];
+uint8_t nextClient = 0; //first client served in the next loop()
+uint8_t transmitTransferId = 0; //ID of the last started transfer
+portMUX_TYPE transmitMux = portMUX_INITIALIZER_UNLOCKED; //connections and ACKs are handled in the BLE task, the windows are filled in loop()
 
 /**
  * @fn 
@@ -130,29 +190,34 @@ void setupWifi() {
 
 /**
  * @fn
- * reset transmission status (after disconnecting)
+ * Find the session of a connection. Must be called within transmitMux.
+ * @param connId uint16_t
+ * @return ClientSession *, NULL if the connection is unknown
  */
-void resetTransmissionStatus(){
-  currentTransmitOffset = 0;
-  sendNextPacketFlag = 0;
+ClientSession *findClient(uint16_t connId)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (clients[i].connected && clients[i].connId == connId)
+      return &clients[i];
+  }
+  return NULL;
 }
 
 /**
  * @class MyServerCallbacks
  * @brief Setup callbacks onConnect and onDisconnect. (BLEServerCallbacks)
+ * The state of the connections is kept in gattsEventHandler(), which knows their connection IDs.
  */
 
 class MyServerCallbacks: public BLEServerCallbacks {
   void onConnect(BLEServer* pServer) {
-    wasmPayloadSize = pServer->getPeerMTU(pServer->getConnId()) - NOTIFY_OVERHEAD_SIZE - WASM_PACKET_HEADER_SIZE;//Negotiate the mtu size with a client.
-    Serial.print("Received payload size: ");
-    Serial.println(wasmPayloadSize);
-    deviceConnected = true;
+    //advertising stops at a connection, the next client must find the server as well
+    if (pServer->getConnectedCount() < MAX_CLIENTS)
+      pServer->getAdvertising()->start();
   };
   void onDisconnect(BLEServer* pServer) {
-    resetTransmissionStatus();
     pServer->getAdvertising()->start();
-    deviceConnected = false;
   }
 };
 
@@ -160,118 +225,446 @@ class MyServerCallbacks: public BLEServerCallbacks {
 /**
  * @fn
  * send and check the sending statement
- * @param dataArray uint8_t *, payload
- * @param dataArrayLength uint8_t, payload length 
+ * The packet is notified to one connection only, every client has its own transfer. TransferLink.send of a client (see transfer.h).
+ * @param context void *, ClientSession *
+ * @param dataArray const uint8_t *, packet
+ * @param dataArrayLength size_t, packet length 
+ * @return false if the connection is congested or the stack did not take the packet (no buffer left)
 */
 
-void sendData(uint8_t * dataArray, uint8_t dataArrayLength) {
-    wasmCharacteristics.setValue(dataArray, dataArrayLength);
-    wasmCharacteristics.notify();
-    sendNextPacketFlag = 1;
+bool sendData(void *context, const uint8_t * dataArray, size_t dataArrayLength) {
+    ClientSession *client = (ClientSession *) context;
+    if (client->congested)
+      return false;
+    return esp_ble_gatts_send_indicate(gattsInterface, client->connId, wasmCharacteristics.getHandle(), dataArrayLength, (uint8_t *) dataArray, false) == ESP_OK;
+}
+
+/**
+ * @fn
+ * TransferLink.lock of a client: connections and ACKs are handled in the BLE task
+ * @param context void *, unused
+ */
+void lockTransmit(void *context)
+{
+  portENTER_CRITICAL(&transmitMux);
+}
+
+/**
+ * @fn
+ * TransferLink.unlock of a client
+ * @param context void *, unused
+ */
+void unlockTransmit(void *context)
+{
+  portEXIT_CRITICAL(&transmitMux);
+}
+
+/**
+ * @fn
+ * Store the wasm version of the client. The client writes it after connecting, after rejecting a received module and after stopping its module.
+ * Message structure (uint8_t *):
+ * | message flag (0x05) | wasm version ID | 1 if the wasm file is executable, otherwise 0 |
+ * Must be called within transmitMux.
+ * @param client ClientSession *, writer of the report
+ * @param data const uint8_t *, version report
+ * @param len size_t
+ */
+void handleVersionReport(ClientSession *client, const uint8_t *data, size_t len)
+{
+  if (len < 3)
+    return;
+  client->versionID = data[1];
+  client->wasmExecutable = data[2];
+  client->versionReported = true;
+  //a client which rejected or stopped its module reports again and gets the module again (see prepareTransmit())
+  if (!client->sender.active)
+    client->moduleDue = true;
+}
+
+/**
+ * @fn
+ * GATT server events of the BLE stack, called before the callbacks of the BLE library.
+ * The library does not tell which connection wrote a characteristic, so the connections, their MTU and the writes
+ * of the ACK characteristic (ACK packets and version reports) are handled here.
+ * @param event esp_gatts_cb_event_t
+ * @param gatts_if esp_gatt_if_t
+ * @param param esp_ble_gatts_cb_param_t *
+ */
+void gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+  //only the sessions are updated under the lock: calls of the BLE stack allocate and post to its queue, so they are made after it
+  bool setDataLength = false;
+  esp_bd_addr_t remoteAddress;
+  portENTER_CRITICAL(&transmitMux);
+  switch (event)
+  {
+    case ESP_GATTS_CONNECT_EVT:
+    {
+      gattsInterface = gatts_if;
+      ClientSession *client = NULL;
+      for (int i = 0; i < MAX_CLIENTS && !client; i++)
+      {
+        if (!clients[i].connected && !clients[i].sender.active)
+          client = &clients[i];
+      }
+      if (!client)
+        break;
+      client->connected = true;
+      client->connId = param->connect.conn_id;
+      client->connectedMillis = millis();
+      client->payloadSize = DEFAULT_PAYLOAD_SIZE;
+      client->versionReported = false;
+      client->moduleDue = true;
+      client->congested = false;
+      memcpy(remoteAddress, param->connect.remote_bda, sizeof(remoteAddress));
+      setDataLength = true;
+      break;
+    }
+    case ESP_GATTS_DISCONNECT_EVT:
+    {
+      ClientSession *client = findClient(param->disconnect.conn_id);
+      if (client)
+      {
+        client->connected = false;
+        client->sender.active = false;
+      }
+      break;
+    }
+    case ESP_GATTS_MTU_EVT:
+    {
+      //Negotiate the mtu size with a client (min. of both local MTUs). A running transfer keeps its payload size.
+      //The client requests it while connecting, so it is known before the version report starts the transfer.
+      ClientSession *client = findClient(param->mtu.conn_id);
+      if (client)
+        client->payloadSize = param->mtu.mtu - NOTIFY_OVERHEAD_SIZE - WASM_PACKET_HEADER_SIZE;
+      break;
+    }
+    case ESP_GATTS_CONGEST_EVT:
+    {
+      ClientSession *client = findClient(param->congest.conn_id);
+      if (client)
+        client->congested = param->congest.congested;
+      break;
+    }
+    case ESP_GATTS_WRITE_EVT:
+    {
+      ClientSession *client = findClient(param->write.conn_id);
+      if (!client || param->write.handle != ackCharacteristics.getHandle() || !param->write.len)
+        break;
+      if (param->write.value[0] == 0x05)
+        handleVersionReport(client, param->write.value, param->write.len);
+      else
+        transferSenderAck(&client->sender, param->write.value, param->write.len); //see transfer.h
+      break;
+    }
+    default:
+      break;
+  }
+  portEXIT_CRITICAL(&transmitMux);
+  //longer link layer packets if the controller of the client supports it, otherwise the MTU is split into 27 byte packets
+  if (setDataLength)
+    esp_ble_gap_set_pkt_data_len(remoteAddress, BLE_DATA_LENGTH);
+  eventPost(EVENT_CLIENT);
+}
+
+
+/**
+ * @fn
+ * Path of a kept module version
+ * @param id uint8_t, wasm version ID
+ */
+String versionPath(uint8_t id)
+{
+  return "/v" + String(id) + ".wasm";
+}
+
+/**
+ * @fn
+ * Wasm version ID after an ID, wraps from WASM_VERSION_ID_MAX to WASM_VERSION_ID_MIN
+ * @param id uint8_t
+ */
+uint8_t nextVersionID(uint8_t id)
+{
+  return id >= WASM_VERSION_ID_MAX || id < WASM_VERSION_ID_MIN ? WASM_VERSION_ID_MIN : id + 1;
+}
+
+/**
+ * @fn
+ * Wasm version ID before an ID, wraps from WASM_VERSION_ID_MIN to WASM_VERSION_ID_MAX
+ * @param id uint8_t
+ */
+uint8_t previousVersionID(uint8_t id)
+{
+  return id <= WASM_VERSION_ID_MIN || id > WASM_VERSION_ID_MAX ? WASM_VERSION_ID_MAX : id - 1;
+}
+
+
+/**
+ * @fn
+ * Choose what to send to a client, before startTransmit().
+ * - Client did not report its version: whole module
+ * - Client has the current version: nothing, moduleDue is cleared
+ * - The version of the client is kept as "/v<ID>.wasm": delta from this version (see delta.h), if it is smaller than the module
+ * - Otherwise: whole module
+ * @param client ClientSession *
+ */
+void prepareTransmit(ClientSession *client)
+{
+  int index = client - clients;
+  strcpy(client->transmitFilePath, "/main.wasm");
+  client->transmitDelta = false;
+  client->transmitCodec = CODEC_NONE;
+  if (!client->versionReported)
+    return;
+
+  if (client->versionID == wasmVersionID && client->wasmExecutable)
+  {
+    DLOG_INFO("Client %d is up to date", index);
+    client->moduleDue = false;
+    return;
+  }
+
+  String basePath = versionPath(client->versionID);
+  if (!client->wasmExecutable || !SPIFFS.exists(basePath.c_str()))
+    return;
+  char deltaPath[16];
+  snprintf(deltaPath, sizeof(deltaPath), "/delta%d.bin", index);
+  if (!encodeDelta(basePath.c_str(), "/main.wasm", deltaPath))
+  {
+    DLOG_WARN("Failed to encode delta");
+    return;
+  }
+
+  File module = SPIFFS.open("/main.wasm", "r");
+  File patch = SPIFFS.open(deltaPath, "r");
+  size_t moduleSize = module.size();
+  size_t patchSize = patch.size();
+  module.close();
+  patch.close();
+  DLOG_INFO("Delta from version %u: %u instead of %u", client->versionID, (uint32_t) patchSize, (uint32_t) moduleSize);
+  if (patchSize < moduleSize)
+  {
+    strcpy(client->transmitFilePath, deltaPath);
+    client->transmitDelta = true;
+  }
+}
+
+
+/**
+ * @fn
+ * Replace the file chosen by prepareTransmit() with its LZSS compressed version ("/transmit<n>.lz") if TRANSFER_COMPRESSION is set and it is smaller.
+ * @param client ClientSession *
+ */
+void compressTransmitFile(ClientSession *client)
+{
+#if TRANSFER_COMPRESSION
+  char compressedPath[16];
+  snprintf(compressedPath, sizeof(compressedPath), "/transmit%d.lz", (int) (client - clients));
+  File file = SPIFFS.open(client->transmitFilePath, "r");
+  size_t fileSize = file ? file.size() : 0;
+  file.close();
+  size_t compressedSize = lzssCompressFile(client->transmitFilePath, compressedPath);
+  if (compressedSize && compressedSize < fileSize)
+  {
+    DLOG_INFO("Compressed: %u", (uint32_t) compressedSize);
+    strcpy(client->transmitFilePath, compressedPath);
+    client->transmitCodec = CODEC_LZSS;
+  }
+#endif
+}
+
+
+/**
+ * @fn
+ * Size and FNV-1a hash of a module file, for the digest of the header (see integrity.h)
+ * @param path const char *
+ * @param digest IntegrityDigest *, output: moduleSize and moduleHash
+ * @return false if the file cannot be read
+ */
+bool hashModuleFile(const char *path, IntegrityDigest *digest)
+{
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return false;
+  digest->moduleSize = file.size();
+  digest->moduleHash = INTEGRITY_HASH_SEED;
+  uint8_t buffer[256];
+  size_t n;
+  while ((n = file.read(buffer, sizeof(buffer))) > 0)
+    digest->moduleHash = integrityHash(digest->moduleHash, buffer, n);
+  file.close();
+  return true;
 }
 
 
 /**
  * @fn
  * Starting transmission. The first message just imforms the number of packets. (without main data)
+ * Packets are notified by transmitWindow() with a sliding window of TRANSMIT_WINDOW_SIZE packets (selective repeat, see transfer.h).
  * Message structure (uint8_t *):
- * - First message
- * | message flag | second byte of the number of packets | first byte of the number of packets |
- * - Other messages 
+ * - First message (sequence number 0)
+ * | message flag | second byte of the number of packets | first byte of the number of packets | wasm version ID | transfer ID | transfer mode | base version ID | codec | second byte of the payload size | first byte of the payload size | digest |
+ * Transfer mode 0: the payload is the module, 1: the payload is a delta from the module with the base version ID (see prepareTransmit()).
+ * Codec CODEC_LZSS: the payload is LZSS compressed (see compressTransmitFile()).
+ * Payload size: bytes per payload packet (except the last one), set by the negotiated MTU of the client.
+ * Digest (INTEGRITY_DIGEST_SIZE bytes): the client verifies the module before replacing its module (see integrity.h).
+ * With the default MTU the header has no room for it, and the last packet of the transfer is the digest packet.
+ * - Other messages (sequence number = offset, 1..number of packets)
  * | message flag | second byte of the number of offset | first byte of the offset | payload |
+ * - Trailing digest packet (sequence number = number of packets, without room for the digest in the header)
+ * | message flag | second byte of the number of offset | first byte of the offset | digest |
  * Flag for the first message: 0x01
  * Otherwise: 0x02
+ * The client answers with ACK packets (flag 0x03, see transfer.h).
+ * @param client ClientSession *
 */
-void startTransmit()
+void startTransmit(ClientSession *client)
 {
-  Serial.println("Starting transmit");
-  File file = SPIFFS.open("/main.wasm", "r");
-  if (!file) {
-    Serial.println("Failed to open file in reading mode");
+  DLOG_INFO("Starting transmit to client %d", (int) (client - clients));
+  portENTER_CRITICAL(&transmitMux);
+  uint16_t payloadSize = client->payloadSize;
+  portEXIT_CRITICAL(&transmitMux);
+  client->sourceOpen = true;
+  if (!moduleDigestValid)
+    moduleDigestValid = hashModuleFile("/main.wasm", &moduleDigest);
+  client->transmitDigest = moduleDigest;
+  if (!moduleDigestValid || !chunkSourceOpen(&client->source, client->transmitFilePath, payloadSize) || !chunkSourceCrc(&client->source, &client->transmitDigest.transferCrc)) {
+    DLOG_ERROR("Failed to open file in reading mode");
     return;
   }
-  Serial.println(file.size());
-  double fileSize = file.size();
-  file.close();
-  currentTransmitOffset = 0;
-  numberOfPackets = ceil(fileSize/wasmPayloadSize); //split binary data into the MTU size
-  Serial.println(numberOfPackets);
-  //TODO: Read the current wasmVersionID from flash !!
-  //integer value must be splitted into uint_8 because of esp_now_send(). the bit shift >>8 means that it takes second byte. 
-  uint8_t message[] = {0x01, numberOfPackets >> 8, (byte) numberOfPackets, wasmVersionID};
-  sendData(message, sizeof(message));
+  DLOG_INFO("%u bytes", (uint32_t) client->source.size);
+  bool trailingDigest = payloadSize + WASM_PACKET_HEADER_SIZE < TRANSMIT_HEADER_SIZE + INTEGRITY_DIGEST_SIZE;
+  uint16_t numberOfPackets = transferPacketCount(client->source.size, payloadSize) + trailingDigest; //split binary data into the MTU size
+  client->link = {sendData, lockTransmit, unlockTransmit, client};
+
+  portENTER_CRITICAL(&transmitMux);
+  client->transmitPayloadSize = payloadSize;
+  client->trailingDigest = trailingDigest;
+  transmitTransferId = (transmitTransferId + random(1, 256)) % 256; //a restarted server must not repeat the ID of the last transfer
+  //the header only, the payload follows the credit of the first ACK
+  transferSenderStart(&client->sender, numberOfPackets, transmitTransferId, TRANSMIT_WINDOW_SIZE, RETRANSMIT_TIMEOUT, true);
+  //the client may have disconnected meanwhile
+  client->sender.active = client->connected;
+  portEXIT_CRITICAL(&transmitMux);
+  DLOG_INFO("%u packets", numberOfPackets);
 }
 
 
 /**
  * @fn
- * This function will be called in loop() after calling startTransimit() and start to send the payload.
- * It compares current offset of the sent packet and the total number of packets.
- * If offset < total, then continues transmission using the flag. (The flag will be set to 1 in OnDataSent, i.e., after calling startTransimit())
+ * Build the packet of a sequence number. TransferBuilder of a client (see transfer.h).
+ * @param context void *, ClientSession *
+ * @param sequence uint16_t, 0: header packet, otherwise offset of the payload packet
+ * @param messageArray uint8_t *, buffer of at least transmitPayloadSize + WASM_PACKET_HEADER_SIZE bytes
+ * @return packet length, 0 if the file cannot be read
 */
-void sendNextPacket()
+uint16_t buildPacket(void *context, uint16_t sequence, uint8_t * messageArray)
 {
-  // claer the flag
-  sendNextPacketFlag = 0;
+  ClientSession *client = (ClientSession *) context;
+  uint16_t numberOfPackets = client->sender.numberOfPackets;
+  if (sequence == 0)
+  {
+    transferBuildHeader(numberOfPackets, messageArray);
+    messageArray[3] = wasmVersionID;
+    messageArray[4] = client->sender.transferId;
+    messageArray[5] = client->transmitDelta;
+    messageArray[6] = client->versionID;
+    messageArray[7] = client->transmitCodec;
+    messageArray[8] = client->transmitPayloadSize >> 8;
+    messageArray[9] = (uint8_t) client->transmitPayloadSize;
+    //a client with the default MTU gets the digest in the last packet
+    if (client->trailingDigest)
+      return TRANSMIT_HEADER_SIZE;
+    integrityPut(&client->transmitDigest, messageArray + TRANSMIT_HEADER_SIZE);
+    return TRANSMIT_HEADER_SIZE + INTEGRITY_DIGEST_SIZE;
+  }
+  if (client->trailingDigest && sequence == numberOfPackets)
+  {
+    uint8_t digest[INTEGRITY_DIGEST_SIZE];
+    integrityPut(&client->transmitDigest, digest);
+    return transferBuildData(sequence, digest, INTEGRITY_DIGEST_SIZE, messageArray);
+  }
 
-  // if got to AFTER the last package
-  if (currentTransmitOffset == numberOfPackets)
+  // set array size.
+  uint16_t numberOfDataPackets = numberOfPackets - client->trailingDigest;
+  int fileDataSize = client->transmitPayloadSize; // if its the last package - we adjust the size !!!
+  if (sequence == numberOfDataPackets)
   {
-    currentTransmitOffset = 0;
-    numberOfPackets = 0;
-    newWasmAvailable = false;
-    Serial.println("Done submiting files");
-    //takeNextPhotoFlag = 1;
-    return;
-  } //end if
+    fileDataSize = client->source.size - ((numberOfDataPackets - 1) * client->transmitPayloadSize);
+  }
 
-  //first read the data.
-  File file = SPIFFS.open("/main.wasm", "r");
-  if (!file) {
-    Serial.println("Failed to open file in writing mode");
-    return;
+  const uint8_t *payload = chunkSourceView(&client->source, (sequence - 1) * client->transmitPayloadSize, fileDataSize);
+  if (!payload) {
+    DLOG_ERROR("END !!!");
+    return 0;
   }
+  return transferBuildData(sequence, payload, fileDataSize, messageArray);
+}
 
-  // set array size.
-  int fileDataSize = wasmPayloadSize; // if its the last package - we adjust the size !!!
-  if (currentTransmitOffset == numberOfPackets - 1)
+
+/**
+ * @fn
+ * This function will be called in loop() after calling startTransimit() and notifies the due packets of a client (see transferSenderPoll()),
+ * up to TRANSMIT_BURST packets and as long as the stack takes them. No delay is needed: the credit of the client limits new packets,
+ * and a congested connection is served again in the next loop().
+ * The window moves forward with the ACKs (see gattsEventHandler()). The transmission is done if all packets (header and payload) are acknowledged.
+ * @param client ClientSession *
+*/
+void transmitWindow(ClientSession *client)
+{
+  portENTER_CRITICAL(&transmitMux);
+  bool done = transferSenderDone(&client->sender);
+  if (done)
   {
-    Serial.println("*************************");
-    Serial.println(file.size());
-    Serial.println(numberOfPackets - 1);
-    Serial.println((numberOfPackets - 1)*wasmPayloadSize);
-    fileDataSize = file.size() - ((numberOfPackets - 1) * wasmPayloadSize);
+    client->sender.active = false;
+    client->moduleDue = false;
   }
+  portEXIT_CRITICAL(&transmitMux);
 
-  // define message array
-  uint8_t messageArray[fileDataSize + 3];
-  messageArray[0] = 0x02;
+  if (done)
+  {
+    chunkSourceClose(&client->source);
+    client->sourceOpen = false;
+    DLOG_INFO("Done submiting files to client %d", (int) (client - clients));
+    return;
+  }
+  transferSenderPoll(&client->sender, &client->link, buildPacket, client, client->sender.numberOfPackets, millis(), TRANSMIT_BURST);
+}
 
-  //offset
-  file.seek(currentTransmitOffset * wasmPayloadSize);
-  currentTransmitOffset++;
+/**
+ * @fn
+ * Serve a client: start a transfer if it may need the module, otherwise notify its next packet.
+ * @param client ClientSession *
+ */
+void serveClient(ClientSession *client)
+{
+  portENTER_CRITICAL(&transmitMux);
+  bool connected = client->connected;
+  bool active = client->sender.active;
+  portEXIT_CRITICAL(&transmitMux);
 
-  messageArray[1] = currentTransmitOffset >> 8;
-  messageArray[2] = (byte) currentTransmitOffset;
-  for (int i = 0; i < fileDataSize; i++)
+  //the transfer was dropped by a disconnect or an upload
+  if (!active && client->sourceOpen)
   {
-    if (file.available())
-    {
-      messageArray[3 + i] = file.read();
-    } //end if available
-    else
+    chunkSourceClose(&client->source);
+    client->sourceOpen = false;
+  }
+  if (!connected)
+    return;
+  if (active)
+  {
+    transmitWindow(client);
+    return;
+  }
+  if (client->moduleDue && (client->versionReported || millis() - client->connectedMillis >= CLIENT_SETTLE_TIME))
+  {
+    prepareTransmit(client);
+    if (client->moduleDue)
     {
-      Serial.println("END !!!");
-      break;
+      compressTransmitFile(client);
+      startTransmit(client);
     }
-  } //end for
-
-  sendData(messageArray, sizeof(messageArray));
-  Serial.print("Next packet transmitted! ");
-  Serial.print(numberOfPackets - currentTransmitOffset);
-  Serial.println(" packets remain");
-  file.close();
-
+  }
 }
 
 //TODO: If the simultaneous run of WiFi and BLE is possible, set true to newWasm flag after uploading
@@ -286,32 +679,67 @@ void sendNextPacket()
  * @param final bool
  */
 void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+    static bool uploadFailed = false;
+    bool module = filename == "main.wasm";
     if (!index) {
         Serial.println((String)"UploadStart: " + filename);
-        // open the file on first call and store the file handle in the request object
-        request->_tempFile = SPIFFS.open("/" + filename, "w");
+        // open the file on first call and store the file handle in the request object.
+        // A module is written to UPLOADED_MODULE_PATH, so "/main.wasm" stays intact until the upload is complete.
+        request->_tempFile = SPIFFS.open(module ? UPLOADED_MODULE_PATH : "/" + filename, "w");
+        uploadFailed = !request->_tempFile;
     }
-    if (len) {
+    if (len && !uploadFailed) {
         // stream the incoming chunk to the opened file
-        request->_tempFile.write(data, len);
+        uploadFailed = request->_tempFile.write(data, len) != len;
     }
     if (final) {
         Serial.println((String)"UploadEnd: " + filename + "," + index+len);
         // close the file handle as the upload is now done
         request->_tempFile.close();
+        if (uploadFailed) {
+          Serial.println("Failed to write the upload");
+          SPIFFS.remove(module ? UPLOADED_MODULE_PATH : ("/" + filename).c_str());
+          request->send(500, "text/plain", "Failed to write the file");
+          return;
+        }
+        if (!module) {
+          request->send(200, "text/plain", "File Uploaded !");
+          return;
+        }
+        if (SPIFFS.exists("/main.wasm")) {
+          // keep the previous module as base of deltas (only one, the flash is small)
+          SPIFFS.remove(versionPath(previousVersionID(wasmVersionID)).c_str());
+          SPIFFS.remove(versionPath(wasmVersionID).c_str());
+          SPIFFS.rename("/main.wasm", versionPath(wasmVersionID).c_str());
+        }
+        SPIFFS.rename(UPLOADED_MODULE_PATH, "/main.wasm");
+        wasmVersionID = nextVersionID(wasmVersionID);
+        EEPROM.write(WASM_VERSION_ID_OFFSET, wasmVersionID);
+        EEPROM.commit();
+        moduleDigestValid = false;
         request->send(200, "text/plain", "File Uploaded !");
         Serial.println((String)"Start transmission");
-        startTransmit();
+        //loop() prepares and starts the transmission of the new module to every client, the running ones are dropped
+        portENTER_CRITICAL(&transmitMux);
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+          clients[i].sender.active = false;
+          clients[i].moduleDue = true;
+        }
+        portEXIT_CRITICAL(&transmitMux);
+        eventPost(EVENT_UPLOAD);
     }
 }
 
 void ble_start(){
   // Create the BLE Device
   BLEDevice::init(bleServerName);
+  BLEDevice::setMTU(BLE_MTU);
 
   Serial.println("ble initilized");
 
   // Create the BLE Server
+  BLEDevice::setCustomGattsHandler(gattsEventHandler);
   BLEServer *pServer = BLEDevice::createServer();
   pServer->setCallbacks(new MyServerCallbacks());
 
@@ -322,6 +750,7 @@ void ble_start(){
   wasmService->addCharacteristic(&wasmCharacteristics);
   wasmDescriptor.setValue("Upload Wasm file");
   wasmCharacteristics.addDescriptor(new BLE2902());
+  wasmService->addCharacteristic(&ackCharacteristics);
 
   // Start the service
   wasmService->start();
@@ -334,18 +763,59 @@ void ble_start(){
 }
 
 
+/**
+ * @fn
+ * Time until loop() must serve a client without an event: a retransmission, or the end of CLIENT_SETTLE_TIME of a client
+ * which did not report its version. ACKs, version reports and the end of a congestion wake loop() (see event_loop.h).
+ * @return ms
+ */
+uint32_t nextLoopTimeout(){
+  unsigned long now = millis();
+  uint32_t timeout = EVENT_WAIT_FOREVER;
+  portENTER_CRITICAL(&transmitMux);
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    ClientSession *client = &clients[i];
+    if (!client->connected || client->congested)
+      continue;
+    if (client->sender.active)
+      timeout = min(timeout, transferSenderNextTimeout(&client->sender, client->sender.numberOfPackets, now));
+    else if (client->moduleDue && !client->versionReported)
+      timeout = min(timeout, (uint32_t) max((int32_t) (client->connectedMillis + CLIENT_SETTLE_TIME - now), (int32_t) 0));
+  }
+  portEXIT_CRITICAL(&transmitMux);
+  return max(timeout, (uint32_t) LOOP_RETRY_DELAY);
+}
+
+/**
+ * @fn
+ * DlogWriter (see dlog.h) of the drain task
+ */
+void writeLog(void *context, const uint8_t *data, size_t len){
+  Serial.write(data, len);
+}
+
 /**
  * @fn
  * setup function
 */ 
 void setup(){
 
+  dlogInit();
   Serial.begin(115200);
+  dlogStart(writeLog, NULL, DLOG_BINARY);
+  eventLoopInit();
   Serial.println(WiFi.macAddress());
 
   //setupWifi();
 
   SPIFFS.begin();
+  EEPROM.begin(EEPROM_SIZE);
+  //the ID survives a reboot, so "/v<ID>.wasm" stays the base of the version it is named after
+  wasmVersionID = EEPROM.read(WASM_VERSION_ID_OFFSET);
+  if (wasmVersionID < WASM_VERSION_ID_MIN || wasmVersionID > WASM_VERSION_ID_MAX)
+    wasmVersionID = WASM_VERSION_ID_FIRST;
+  DLOG_INFO("Wasm version ID %u", wasmVersionID);
 
 
   /*if ( !MDNS.begin("esp-net") ) {
@@ -396,18 +866,12 @@ void setup(){
 void loop(){
 
 
-  if (deviceConnected) {
-      if(newWasmAvailable){
-        if(currentTransmitOffset == 0 && !sendNextPacketFlag){
-          delay(1000); //Client node cannot get a first packet if the packet is sent just after connecting.
-          startTransmit();
-        }
-        else if(sendNextPacketFlag){
-          sendNextPacket();
-        }
-    }
-  }
+  //round robin: every client gets a burst per loop, so N clients are served in about the time of one transfer
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    serveClient(&clients[(nextClient + i) % MAX_CLIENTS]);
+  nextClient = (nextClient + 1) % MAX_CLIENTS;
 
-  delay(50); //Packet loss causes very often if no delay time given
+  //packets are paced by the credit of the clients and the congestion of the stack (see transmitWindow()), loop() sleeps until one of them moves on
+  eventWait(nextLoopTimeout());
 }
 
@@ -0,0 +1,182 @@
+/**
+ * @file delta_check.cpp
+ * @brief Host round trip of the binary delta of wasm modules with the sources of the sketches: the patch is encoded by
+ * encodeDelta() of server/src/delta.cpp and applied by the streaming decoder of client/src/delta.cpp, over the SPIFFS stand-in of
+ * esp-now/tools/host. The patch is fed in chunks of the payload sizes (17 and 241 bytes, 1 byte: every instruction split), as
+ * wasmNotifyCallback() feeds deltaFeed(). The new module and the data passed to the DeltaOutput have to match the target.
+ * Every ordered pair of the given modules is checked, and every module against edited copies of itself (bytes changed, inserted,
+ * removed and appended, as a small code edit does). A patch applied to another base and a truncated patch have to be rejected.
+ *
+ * Build and run (from BLE-communication/; the encoder and the decoder have their own delta.h):
+ *   g++ -O2 -I../esp-now/tools/host -Iserver/include -c server/src/delta.cpp -o delta_encoder.o
+ *   g++ -O2 -I../esp-now/tools/host -Iclient/include tools/delta_check.cpp client/src/delta.cpp delta_encoder.o -o delta_check
+ *   ./delta_check [module.wasm ...]
+ *
+ * Without arguments, the sample modules of the sketches are used. The files are written to a new directory in /tmp.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <SPIFFS.h>
+#include "delta.h"
+
+//encoder, server/include/delta.h
+bool encodeDelta(const char *basePath, const char *newPath, const char *patchPath);
+
+typedef std::vector<uint8_t> Bytes;
+
+static const char *sampleModules[] = {"client/data/main.wasm", "server/data/main.wasm", "../esp-now/data/main.wasm"};
+static const size_t chunkSizes[] = {17, 241, 1};
+
+static std::string directory;
+static int failures = 0;
+
+static bool readFile(const std::string &path, Bytes *data)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  data->clear();
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data->insert(data->end(), buffer, buffer + n);
+  fclose(file);
+  return true;
+}
+
+static bool writeFile(const std::string &path, const Bytes &data)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  bool ok = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+  if (file)
+    fclose(file);
+  return ok;
+}
+
+static void appendOutput(const uint8_t *data, size_t len, void *context)
+{
+  Bytes *output = (Bytes *) context;
+  output->insert(output->end(), data, data + len);
+}
+
+static void check(const std::string &name, bool ok)
+{
+  failures += !ok;
+  printf("  %-66s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+}
+
+/**
+ * @fn
+ * Apply a patch in chunks as the client does
+ * @param output Bytes *, data passed to the DeltaOutput
+ * @param result Bytes *, new module as written to the file
+ * @return result of deltaFinish(), false if deltaFeed() rejected the patch
+ */
+static bool apply(const Bytes &patch, size_t chunkSize, Bytes *output, Bytes *result)
+{
+  output->clear();
+  if (!deltaBegin("/base.wasm", "/out.wasm", appendOutput, output))
+    return false;
+  bool valid = true;
+  for (size_t offset = 0; offset < patch.size() && valid; offset += chunkSize)
+    valid = deltaFeed(patch.data() + offset, patch.size() - offset < chunkSize ? patch.size() - offset : chunkSize);
+  bool complete = deltaFinish();
+  readFile(directory + "/out.wasm", result);
+  return valid && complete;
+}
+
+/**
+ * @fn
+ * Encode the patch from base to target and apply it in every chunk size
+ */
+static void roundTrip(const std::string &name, const Bytes &base, const Bytes &target)
+{
+  writeFile(directory + "/base.wasm", base);
+  writeFile(directory + "/new.wasm", target);
+  Bytes patch;
+  bool ok = encodeDelta("/base.wasm", "/new.wasm", "/patch.bin") && readFile(directory + "/patch.bin", &patch);
+  for (size_t c = 0; c < sizeof(chunkSizes) / sizeof(chunkSizes[0]) && ok; c++)
+  {
+    Bytes output, result;
+    ok = apply(patch, chunkSizes[c], &output, &result) && result == target && output == target;
+  }
+  char sizes[64];
+  snprintf(sizes, sizeof(sizes), " (%zu -> %zu bytes, patch %zu)", base.size(), target.size(), patch.size());
+  check(name + sizes, ok);
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<std::string> paths(argv + 1, argv + argc);
+  if (paths.empty())
+  {
+    for (const char *path : sampleModules)
+      paths.push_back(path);
+  }
+  std::vector<Bytes> modules(paths.size());
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    if (!readFile(paths[i], &modules[i]) || modules[i].size() < 64)
+    {
+      printf("Cannot read %s\n", paths[i].c_str());
+      return 1;
+    }
+  }
+
+  char temporary[] = "/tmp/wasm_delta_XXXXXX";
+  if (!mkdtemp(temporary))
+  {
+    printf("Cannot create a directory in /tmp\n");
+    return 1;
+  }
+  directory = temporary;
+  setenv("SPIFFS_DIR", temporary, 1);
+
+  printf("pairs of modules\n");
+  for (size_t i = 0; i < modules.size(); i++)
+  {
+    for (size_t j = 0; j < modules.size(); j++)
+      roundTrip(paths[i] + " -> " + paths[j], modules[i], modules[j]);
+  }
+
+  printf("edits\n");
+  for (size_t i = 0; i < modules.size(); i++)
+  {
+    const Bytes &module = modules[i];
+    size_t middle = module.size() / 2;
+    Bytes changed(module);
+    changed[middle] ^= 0x01;
+    changed[middle + 20] ^= 0x80;
+    roundTrip(paths[i] + " bytes changed", module, changed);
+    Bytes inserted(module);
+    inserted.insert(inserted.begin() + middle, module.begin() + 10, module.begin() + 50);
+    roundTrip(paths[i] + " 40 bytes inserted", module, inserted);
+    Bytes removed(module);
+    removed.erase(removed.begin() + middle, removed.begin() + middle + 30);
+    roundTrip(paths[i] + " 30 bytes removed", module, removed);
+    Bytes appended(module);
+    for (int k = 0; k < 300; k++)
+      appended.push_back(k * 7);
+    roundTrip(paths[i] + " 300 bytes appended", module, appended);
+  }
+
+  printf("damaged patches\n");
+  const Bytes &module = modules[0];
+  Bytes edited(module);
+  edited[module.size() / 2] ^= 0x01;
+  writeFile(directory + "/base.wasm", module);
+  writeFile(directory + "/new.wasm", edited);
+  Bytes patch, output, result;
+  encodeDelta("/base.wasm", "/new.wasm", "/patch.bin");
+  readFile(directory + "/patch.bin", &patch);
+  Bytes truncated(patch.begin(), patch.end() - 3);
+  check("truncated patch rejected", !apply(truncated, 17, &output, &result));
+  Bytes otherBase(module);
+  otherBase.push_back(0);
+  writeFile(directory + "/base.wasm", otherBase);
+  check("patch of another base rejected", !apply(patch, 17, &output, &result));
+  return failures ? 1 : 0;
+}
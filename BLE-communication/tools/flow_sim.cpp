@@ -0,0 +1,316 @@
+/**
+ * @file flow_sim.cpp
+ * @brief Host simulation of the BLE module transfer (server/src/main.cpp -> client/src/main.cpp) over a modeled link.
+ * Compares the fixed pacing (one notification per 50 ms loop and 1 s before the first packet) with the credit-based flow control.
+ *
+ * Build and run (from BLE-communication/):
+ *   g++ -O2 tools/flow_sim.cpp -o flow_sim && ./flow_sim [module size] [loss %] [flash ms]
+ *
+ * Link model:
+ * - Every CONNECTION_INTERVAL ms a connection event carries up to PACKETS_PER_EVENT packets in each direction.
+ * - The controller of the server queues up to CONTROLLER_BUFFER notifications. A notification beyond that is dropped
+ *   (fixed pacing does not check it) or refused, which the credit-based server sees as congestion.
+ * - A notification is lost with the given probability (host stack, corrupted event).
+ * Client model: the notify callback stages the data in two STAGING_BUFFER_SIZE buffers (see staging.h). loop() writes a full
+ * buffer to flash in [flash ms] (default 12 ms). If both are full, the callback writes synchronously and the client stops receiving meanwhile.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <algorithm>
+
+#define PAYLOAD_SIZE 17 //default MTU
+#define PACKETS_PER_EVENT 6
+#define CONTROLLER_BUFFER 10
+#define STAGING_BUFFER_SIZE 1024
+#define RETRANSMIT_TIMEOUT 1000
+#define MAX_WINDOW 64
+#define TRANSMIT_BURST 4 //packets per client and loop() of the server
+#define TIME_LIMIT 600000
+
+struct Config {
+  const char *name;
+  bool credit;
+  int window;
+  int pacing; //ms between two notifications, 0: as fast as the controller takes them
+  int settle; //ms after connecting until the first packet, 0: after the version report
+  int clientLoop; //ms per loop() of the client
+};
+
+struct Ack {
+  int nextExpected;
+  bool buffered[MAX_WINDOW];
+  int credit;
+};
+
+enum PacketState { PACKET_PENDING, PACKET_SENT, PACKET_ACKED };
+
+struct Result {
+  int time;
+  int notifications;
+  int dropped;
+  int stalls;
+};
+
+static double lossProbability = 0;
+static int flashWriteTime = 12; //ms per staging buffer
+
+static double uniform()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+static Result simulate(const Config &config, int connectionInterval, int moduleSize)
+{
+  int numberOfPackets = (moduleSize + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+  int window = config.window;
+  Result result = {0, 0, 0, 0};
+
+  //server
+  int windowBase = 0;
+  int nextSequence = 0;
+  int creditLimit = config.credit ? 1 : 1 << 30; //the header only until the client tells its credit
+  PacketState packetState[MAX_WINDOW];
+  int packetSentMillis[MAX_WINDOW];
+  std::deque<int> controller;
+  bool started = false;
+
+  //client
+  std::deque<int> inbox;
+  std::deque<Ack> uplink;
+  bool headerReceived = false;
+  int currentOffset = 0;
+  bool bufferedSlot[MAX_WINDOW] = {false};
+  int packetsSinceAck = 0;
+  bool ackPending = false;
+  int advertisedCredit = window;
+  int clientCreditLimit = 0;
+  int fillLength = 0;
+  bool otherFull = false;
+  int busyUntil = 0; //synchronous flash write in the callback
+  int loopBusyUntil = 0; //flash write in loop()
+  bool flushing = false;
+  int connectTime = connectionInterval; //version report after subscribing
+
+  auto receiveCredit = [&]() {
+    int space = STAGING_BUFFER_SIZE - fillLength + (otherFull ? 0 : STAGING_BUFFER_SIZE);
+    return std::min(window, std::max(1, space / PAYLOAD_SIZE));
+  };
+  auto queueAck = [&]() {
+    ackPending = true;
+    packetsSinceAck = 0;
+  };
+  auto buildAck = [&]() {
+    Ack ack;
+    ack.nextExpected = currentOffset + 1;
+    for (int i = 0; i < window - 1; i++)
+      ack.buffered[i] = bufferedSlot[(ack.nextExpected + 1 + i) % window];
+    ack.credit = config.credit ? receiveCredit() : window;
+    advertisedCredit = ack.credit;
+    clientCreditLimit = ack.nextExpected + ack.credit;
+    return ack;
+  };
+  auto stage = [&](int now) {
+    fillLength += PAYLOAD_SIZE;
+    if (fillLength >= STAGING_BUFFER_SIZE)
+    {
+      if (otherFull)
+      {
+        busyUntil = std::max(now, busyUntil) + flashWriteTime;
+        result.stalls++;
+      }
+      otherFull = true;
+      fillLength -= STAGING_BUFFER_SIZE;
+    }
+  };
+  auto receive = [&](int sequence, int now) {
+    if (sequence == 0)
+    {
+      headerReceived = true;
+      queueAck();
+      return;
+    }
+    if (!headerReceived)
+      return;
+    if (sequence <= currentOffset)
+    {
+      queueAck();
+      return;
+    }
+    if (sequence > currentOffset + window)
+      return;
+    bufferedSlot[sequence % window] = true;
+    if (sequence != currentOffset + 1)
+    {
+      queueAck();
+      return;
+    }
+    while (bufferedSlot[(currentOffset + 1) % window] && currentOffset < numberOfPackets)
+    {
+      bufferedSlot[(currentOffset + 1) % window] = false;
+      currentOffset++;
+      packetsSinceAck++;
+      stage(now);
+    }
+    if (packetsSinceAck >= window / 2 || currentOffset == numberOfPackets)
+      queueAck();
+    else if (config.credit && currentOffset + 1 >= clientCreditLimit)
+      queueAck(); //credit used up
+  };
+  auto handleAck = [&](const Ack &ack) {
+    if (ack.nextExpected < windowBase || ack.nextExpected > nextSequence)
+      return;
+    windowBase = ack.nextExpected;
+    if (config.credit)
+      creditLimit = ack.nextExpected + ack.credit;
+    int highestBuffered = -1;
+    for (int i = 0; i < window - 1; i++)
+    {
+      int sequence = windowBase + 1 + i;
+      if (sequence >= nextSequence)
+        break;
+      if (ack.buffered[i])
+      {
+        packetState[sequence % window] = PACKET_ACKED;
+        highestBuffered = i;
+      }
+    }
+    for (int i = -1; i < highestBuffered; i++)
+    {
+      int slot = (windowBase + 1 + i) % window;
+      if (packetState[slot] == PACKET_SENT)
+        packetState[slot] = PACKET_PENDING;
+    }
+  };
+  auto nextPacketToSend = [&](int now) {
+    for (int sequence = windowBase; sequence < nextSequence; sequence++)
+    {
+      int slot = sequence % window;
+      if (packetState[slot] == PACKET_PENDING || (packetState[slot] == PACKET_SENT && now - packetSentMillis[slot] >= RETRANSMIT_TIMEOUT))
+        return sequence;
+    }
+    if (nextSequence <= numberOfPackets && nextSequence < windowBase + window && nextSequence < creditLimit)
+    {
+      packetState[nextSequence % window] = PACKET_PENDING;
+      return nextSequence++;
+    }
+    return -1;
+  };
+
+  for (int now = 0; now < TIME_LIMIT; now++)
+  {
+    //connection event
+    if (now % connectionInterval == 0)
+    {
+      for (int i = 0; i < PACKETS_PER_EVENT && !controller.empty(); i++)
+      {
+        if (uniform() >= lossProbability)
+          inbox.push_back(controller.front());
+        controller.pop_front();
+      }
+      for (int i = 0; i < PACKETS_PER_EVENT && !uplink.empty(); i++)
+      {
+        handleAck(uplink.front());
+        uplink.pop_front();
+      }
+    }
+
+    //client: notify callback and loop()
+    while (!inbox.empty() && now >= busyUntil)
+    {
+      receive(inbox.front(), now);
+      inbox.pop_front();
+    }
+    if (now % config.clientLoop == 0 && now >= loopBusyUntil)
+    {
+      if (flushing)
+      {
+        flushing = false;
+        otherFull = false;
+        //window update: the server stopped at the credit
+        if (config.credit && headerReceived && currentOffset < numberOfPackets && advertisedCredit < window && receiveCredit() > advertisedCredit)
+          queueAck();
+      }
+      if (otherFull)
+      {
+        flushing = true;
+        loopBusyUntil = now + flashWriteTime;
+      }
+      else if (ackPending)
+      {
+        ackPending = false;
+        uplink.push_back(buildAck());
+      }
+    }
+
+    //server: loop()
+    if (!started)
+      started = config.settle ? now >= config.settle : now >= connectTime;
+    if (!started || windowBase > numberOfPackets)
+    {
+      if (windowBase > numberOfPackets)
+      {
+        result.time = now;
+        return result;
+      }
+      continue;
+    }
+    if (config.pacing)
+    {
+      if (now % config.pacing)
+        continue;
+      int sequence = nextPacketToSend(now);
+      if (sequence < 0)
+        continue;
+      packetState[sequence % window] = PACKET_SENT;
+      packetSentMillis[sequence % window] = now;
+      result.notifications++;
+      if ((int) controller.size() < CONTROLLER_BUFFER)
+        controller.push_back(sequence);
+      else
+        result.dropped++;
+      continue;
+    }
+    for (int i = 0; i < TRANSMIT_BURST && (int) controller.size() < CONTROLLER_BUFFER; i++)
+    {
+      int sequence = nextPacketToSend(now);
+      if (sequence < 0)
+        break;
+      packetState[sequence % window] = PACKET_SENT;
+      packetSentMillis[sequence % window] = now;
+      result.notifications++;
+      controller.push_back(sequence);
+    }
+  }
+  result.time = TIME_LIMIT;
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  int moduleSize = argc > 1 ? atoi(argv[1]) : 16384;
+  lossProbability = argc > 2 ? atof(argv[2]) / 100 : 0;
+  flashWriteTime = argc > 3 ? atoi(argv[3]) : flashWriteTime;
+  const Config configs[] = {
+    {"fixed 50 ms, window 8", false, 8, 50, 1000, 10},
+    {"no credit, window 32", false, 32, 0, 0, 1},
+    {"credit, window 8", true, 8, 0, 0, 1},
+    {"credit, window 16", true, 16, 0, 0, 1},
+    {"credit, window 32", true, 32, 0, 0, 1},
+  };
+  const int intervals[] = {8, 15, 30, 50};
+
+  printf("module %d bytes, %d byte payload, loss %.1f%%, flash write %d ms\n", moduleSize, PAYLOAD_SIZE, lossProbability * 100, flashWriteTime);
+  printf("%-24s %8s %10s %12s %9s %8s\n", "", "interval", "time ms", "bytes/s", "notifies", "stalls");
+  for (const Config &config : configs)
+  {
+    for (int interval : intervals)
+    {
+      srand(1);
+      Result r = simulate(config, interval, moduleSize);
+      printf("%-24s %6d ms %10d %12.0f %9d %8d\n", config.name, interval, r.time, moduleSize * 1000.0 / r.time, r.notifications, r.stalls);
+    }
+  }
+  return 0;
+}
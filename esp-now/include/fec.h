@@ -0,0 +1,46 @@
+/**
+ * @file fec.h
+ * @brief Forward error correction for the wasm broadcast.
+ * Systematic Cauchy Reed-Solomon erasure code over GF(2^8): a block of k source packets is extended by repair packets,
+ * and any k packets of the block (source or repair) restore all source packets.
+ */
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+#define FEC_MAX_SOURCE_PACKETS 32 //max. source packets per block (received packets are tracked in a uint32_t)
+#define FEC_MAX_REPAIR_PACKETS 32 //max. repair packets per block
+
+/**
+ * @fn
+ * Build the GF(2^8) tables. Must be called once before fecEncode() or fecDecode().
+ */
+void fecInit();
+
+/**
+ * @fn
+ * Compute a repair packet of a block.
+ * @param sources const uint8_t * const *, source packets of the block (all of the same length, the last one zero padded)
+ * @param sourceCount uint8_t, number of source packets (1..FEC_MAX_SOURCE_PACKETS)
+ * @param repairIndex uint8_t, index of the repair packet (0..FEC_MAX_REPAIR_PACKETS-1)
+ * @param length uint16_t, packet length
+ * @param repair uint8_t *, output buffer of length bytes
+ */
+void fecEncode(const uint8_t * const * sources, uint8_t sourceCount, uint8_t repairIndex, uint16_t length, uint8_t * repair);
+
+/**
+ * @fn
+ * Restore the missing source packets of a block in place.
+ * @param sources uint8_t * const *, source packets of the block. Missing ones are overwritten.
+ * @param sourceCount uint8_t, number of source packets
+ * @param receivedMask uint32_t, bit i is set if source packet i is received
+ * @param repairs uint8_t * const *, received repair packets. Used as scratch memory, the content is destroyed.
+ * @param repairIndices const uint8_t *, repair index of each received repair packet
+ * @param repairCount uint8_t, number of received repair packets
+ * @param length uint16_t, packet length
+ * @return false if less than sourceCount packets are received
+ */
+bool fecDecode(uint8_t * const * sources, uint8_t sourceCount, uint32_t receivedMask, uint8_t * const * repairs, const uint8_t * repairIndices, uint8_t repairCount, uint16_t length);
+
+#endif
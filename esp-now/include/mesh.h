@@ -0,0 +1,189 @@
+/**
+ * @file mesh.h
+ * @brief Multi-hop forwarding for ESP-NOW. Nodes broadcast beacons with their cost to the gateway (the node with MESH_GATEWAY),
+ * every node chooses the neighbor with the lowest cost as parent, and packets are forwarded hop by hop in mesh frames.
+ * - Upward (to the gateway): along the parents.
+ * - Downward: along routes learned from the frames passing upward (reverse path). Every node sends an empty frame to the gateway
+ *   every MESH_ANNOUNCE_INTERVAL ms, so the routes to it exist before the gateway sends the first packet.
+ * The link cost grows with the beacon loss: MESH_LINK_COST * (8 / beacons received of the last 8 beacon intervals)^2,
+ * so a weak link is avoided even if the path gets longer by a hop.
+ * The neighbor table and the route table have a fixed size, so the routing state does not grow with the number of nodes.
+ *
+ * The layer does not access the radio. The caller passes received frames to meshReceive() and sends the frames of meshPoll(),
+ * so it runs on the host as well (see tools/mesh_sim.cpp). It is not thread safe.
+ *
+ * Message structure (uint8_t *):
+ * - Beacon (to every node)
+ * | message flag (0x07) | node ID (2 bytes) | cost to the gateway (2 bytes) | hops to the gateway | parent ID (2 bytes) |
+ * - Mesh frame (to the next hop)
+ * | message flag (0x06) | TTL | source ID (2 bytes) | destination ID (2 bytes) | payload |
+ */
+#ifndef MESH_H
+#define MESH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MESH_FRAME_FLAG 0x06
+#define MESH_BEACON_FLAG 0x07
+#define MESH_HEADER_SIZE 6
+#define MESH_BEACON_SIZE 8
+#define MESH_MAX_FRAME_SIZE 250 //ESP_NOW_MAX_DATA_LEN
+#define MESH_MAX_PAYLOAD_SIZE (MESH_MAX_FRAME_SIZE - MESH_HEADER_SIZE)
+#define MESH_MAX_NEIGHBORS 16 //below the ESP-NOW peer limit (20)
+#define MESH_MAX_ROUTES 64 //the gateway needs a route to every node
+#define MESH_FORWARD_QUEUE_SIZE 8 //frames waiting to be forwarded
+#define MESH_MAX_HOPS 8 //TTL of a new frame
+#define MESH_BEACON_INTERVAL 1000 //ms
+#define MESH_BEACON_JITTER 100 //ms, beacons of neighbors must not collide every time
+#define MESH_ANNOUNCE_INTERVAL 10000 //ms
+#define MESH_ROUTE_TIMEOUT 30000 //ms
+#define MESH_LINK_COST 16 //cost of a link without beacon loss
+#define MESH_MIN_LINK_QUALITY 3 //min. beacons of the last 8 intervals to use a neighbor as parent
+#define MESH_PARENT_HYSTERESIS 16 //a new parent must be cheaper by this cost
+#define MESH_NO_COST 0xffff
+#define MESH_GATEWAY_ID 0xffff //destination ID of the gateway, whatever its node ID is
+
+typedef struct {
+  bool used;
+  uint8_t mac[6];
+  uint16_t id;
+  uint16_t parent; //parent ID of the neighbor, a node must not choose its child as parent
+  uint16_t gatewayCost; //MESH_NO_COST: no way to the gateway
+  uint8_t gatewayHops;
+  uint8_t beaconHistory; //bit 0: beacon received in the current interval
+} MeshNeighbor;
+
+typedef struct {
+  bool used;
+  uint16_t destination;
+  uint8_t mac[6]; //next hop
+  uint8_t hops; //to the destination, from the TTL of its last frame
+  uint32_t updated;
+} MeshRoute;
+
+typedef struct {
+  uint8_t mac[6];
+  uint8_t frame[MESH_MAX_FRAME_SIZE];
+  uint8_t length;
+} MeshQueuedFrame;
+
+typedef struct {
+  uint8_t mac[6];
+  uint16_t id;
+  bool gateway;
+  MeshNeighbor neighbors[MESH_MAX_NEIGHBORS];
+  MeshRoute routes[MESH_MAX_ROUTES];
+  int parent; //index in neighbors, -1 if none
+  uint16_t gatewayCost;
+  uint8_t gatewayHops;
+  uint32_t nextTick;
+  uint32_t nextAnnounce;
+  bool beaconDue;
+  MeshQueuedFrame forwardQueue[MESH_FORWARD_QUEUE_SIZE];
+  uint8_t forwardHead;
+  uint8_t forwardCount;
+  //counters
+  uint32_t beaconsSent;
+  uint32_t framesSent; //frames of this node, including announces
+  uint32_t framesForwarded;
+  uint32_t framesDelivered;
+  uint32_t framesDropped; //no route, TTL expired or queue full
+} Mesh;
+
+/**
+ * @fn
+ * Node ID of a MAC address (last two bytes). MESH_GATEWAY_ID is mapped to 0xfffe.
+ * @param mac const uint8_t *
+ * @return uint16_t
+ */
+uint16_t meshNodeId(const uint8_t *mac);
+
+/**
+ * @fn
+ * Initialize the mesh state of a node
+ * @param mesh Mesh *
+ * @param mac const uint8_t *, MAC address of the node
+ * @param gateway bool, true for the gateway (root of the parents)
+ * @param now uint32_t, ms
+ */
+void meshInit(Mesh *mesh, const uint8_t *mac, bool gateway, uint32_t now);
+
+/**
+ * @fn
+ * Handle a received beacon or mesh frame. A frame to another node is queued for forwarding (see meshPoll()).
+ * @param mesh Mesh *
+ * @param mac const uint8_t *, MAC address of the sender (previous hop)
+ * @param data const uint8_t *
+ * @param len size_t
+ * @param now uint32_t, ms
+ * @param source uint16_t *, output: source ID of a delivered payload
+ * @param payload const uint8_t **, output: delivered payload (points into data)
+ * @return length of the payload for this node, 0 if there is nothing to deliver
+ */
+size_t meshReceive(Mesh *mesh, const uint8_t *mac, const uint8_t *data, size_t len, uint32_t now, uint16_t *source, const uint8_t **payload);
+
+/**
+ * @fn
+ * Build the mesh frame of a payload from this node.
+ * @param mesh Mesh *
+ * @param destination uint16_t, node ID or MESH_GATEWAY_ID
+ * @param data const uint8_t *
+ * @param len size_t, at most MESH_MAX_PAYLOAD_SIZE
+ * @param frame uint8_t *, output: buffer of at least len + MESH_HEADER_SIZE bytes
+ * @param mac uint8_t *, output: MAC address of the next hop
+ * @return frame length, 0 if there is no route
+ */
+size_t meshBuildFrame(Mesh *mesh, uint16_t destination, const uint8_t *data, size_t len, uint8_t *frame, uint8_t *mac);
+
+/**
+ * @fn
+ * Link quality of a neighbor: beacons received of the last 8 beacon intervals
+ * @param mesh const Mesh *
+ * @param mac const uint8_t *
+ * @return 0..8, 0 if the node is no neighbor
+ */
+uint8_t meshLinkQuality(const Mesh *mesh, const uint8_t *mac);
+
+/**
+ * @fn
+ * Get the children of this node: neighbors which have chosen it as parent. A rollout is relayed along them.
+ * @param mesh const Mesh *
+ * @param ids uint16_t *, output: node IDs
+ * @param max int, size of ids
+ * @return number of children
+ */
+int meshChildren(const Mesh *mesh, uint16_t *ids, int max);
+
+/**
+ * @fn
+ * Get the nodes below this node: routes through its children, learned from their announces. A rollout from this node reaches them.
+ * @param mesh const Mesh *
+ * @param depth uint8_t *, output: max. hops from this node to them, 0 without children
+ * @return number of nodes
+ */
+int meshDescendants(const Mesh *mesh, uint8_t *depth);
+
+/**
+ * @fn
+ * Get the next frame to send: beacons, announces and forwarded frames. Also ages the neighbor and route tables.
+ * Call it until it returns false.
+ * @param mesh Mesh *
+ * @param now uint32_t, ms
+ * @param mac uint8_t *, output: MAC address of the next hop (FF:FF:FF:FF:FF:FF for a beacon)
+ * @param frame uint8_t *, output: buffer of MESH_MAX_FRAME_SIZE bytes
+ * @param len size_t *, output: frame length
+ * @return false if there is nothing to send
+ */
+bool meshPoll(Mesh *mesh, uint32_t now, uint8_t *mac, uint8_t *frame, size_t *len);
+
+/**
+ * @fn
+ * Time until meshPoll() has the next frame, unless a received frame is queued for forwarding meanwhile
+ * @param mesh const Mesh *
+ * @param now uint32_t, ms
+ * @return ms, 0 if a frame is due now
+ */
+uint32_t meshNextDue(const Mesh *mesh, uint32_t now);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @file trickle.h
+ * @brief Trickle timer (RFC 6206) for the version summary of the running module. A node advertises its summary once per interval
+ * at a random time in the second half of the interval, unless it has heard TRICKLE_REDUNDANCY consistent summaries before.
+ * The interval doubles up to intervalMin * 2^maxDoublings while the neighbors agree, and falls back to intervalMin
+ * as soon as a summary differs, so a new module spreads fast and a consistent network sends almost nothing.
+ *
+ * Like mesh.h, the timer does not access the radio or the clock, so it runs on the host as well. It is not thread safe.
+ */
+#ifndef TRICKLE_H
+#define TRICKLE_H
+
+#include <stdint.h>
+
+#define TRICKLE_REDUNDANCY 1 //k: consistent summaries heard in an interval which suppress the own one
+
+typedef struct {
+  uint32_t intervalMin; //ms
+  uint8_t maxDoublings;
+  uint32_t interval; //ms, current interval
+  uint32_t intervalStart;
+  uint32_t transmitTime; //t in [interval / 2, interval)
+  uint8_t counter; //consistent summaries heard in the current interval
+  bool transmitted; //the summary of the current interval is sent or suppressed
+  uint32_t random;
+} Trickle;
+
+/**
+ * @fn
+ * Start the timer with the shortest interval
+ * @param trickle Trickle *
+ * @param intervalMin uint32_t, ms
+ * @param maxDoublings uint8_t
+ * @param seed uint32_t, differs per node, so neighbors do not send at the same time
+ * @param now uint32_t, ms
+ */
+void trickleInit(Trickle *trickle, uint32_t intervalMin, uint8_t maxDoublings, uint32_t seed, uint32_t now);
+
+/**
+ * @fn
+ * A summary equal to the own one is heard
+ * @param trickle Trickle *
+ */
+void trickleConsistent(Trickle *trickle);
+
+/**
+ * @fn
+ * A different summary is heard or the own one has changed: go back to the shortest interval
+ * @param trickle Trickle *
+ * @param now uint32_t, ms
+ */
+void trickleInconsistent(Trickle *trickle, uint32_t now);
+
+/**
+ * @fn
+ * Check the timer. Call it periodically.
+ * @param trickle Trickle *
+ * @param now uint32_t, ms
+ * @return true if the summary must be sent now
+ */
+bool tricklePoll(Trickle *trickle, uint32_t now);
+
+/**
+ * @fn
+ * Time until tricklePoll() has something to do: the transmit time or the end of the interval
+ * @param trickle const Trickle *
+ * @param now uint32_t, ms
+ * @return ms, 0 if it is due now
+ */
+uint32_t trickleNextDue(const Trickle *trickle, uint32_t now);
+
+#endif
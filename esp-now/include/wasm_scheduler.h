@@ -0,0 +1,108 @@
+/**
+ * @file wasm_scheduler.h
+ * @brief Periodic tasks running the wasm modules, so several modules run at once and next to loop().
+ * On the ESP32 a task is a FreeRTOS task pinned to a core: compute-heavy modules run on the application core (1)
+ * while the WiFi and ESP-NOW stack keeps the protocol core (0). On the host a task is a std::thread (core and priority are ignored),
+ * so the same scheduling runs in host tools (see tools/scheduler_sim.cpp).
+ *
+ * A task runs its function once per period (fixed rate, the releases do not drift with the run time).
+ * A run which ends after the next release is an overrun: the missed releases are skipped and counted, so a slow module
+ * does not run back to back and starve the tasks of a lower priority.
+ * A task can also be woken for a run at once, e.g. when data for its module has arrived (wasmTaskWake()). Such a run does not
+ * move the periodic releases.
+ * The function runs under the lock of the task, so loop() can switch the module of a task between two runs (wasmTaskLock()).
+ */
+#ifndef WASM_SCHEDULER_H
+#define WASM_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WASM_TASK_ANY_CORE -1
+
+/**
+ * One run of a task
+ * @param context void *, context of wasmTaskStart()
+ */
+typedef void (*WasmTaskFunction)(void *context);
+
+typedef struct {
+  const char *name;
+  uint32_t period; //ms between two releases, 0: run again at once (after one tick on the ESP32, so the idle task of the core runs)
+  uint8_t priority; //FreeRTOS priority, loop() runs at 1
+  int8_t core; //0, 1 or WASM_TASK_ANY_CORE
+  uint32_t stackSize; //bytes of the native stack, the interpreter of wasm3 runs on it
+} WasmTaskConfig;
+
+struct WasmTaskPlatform;
+
+typedef struct {
+  WasmTaskConfig config;
+  WasmTaskFunction function;
+  void *context;
+  //statistics, written by the task
+  volatile uint32_t runs;
+  volatile uint32_t overruns; //releases skipped because a run ended after the next release
+  volatile uint32_t lastRunTime; //us
+  volatile uint32_t maxRunTime; //us
+  //state of the task
+  volatile bool stopRequested;
+  uint64_t release; //us, clock of wasmTaskClock()
+  WasmTaskPlatform *platform; //NULL if the task is not running
+} WasmTask;
+
+/**
+ * @fn
+ * Start a task. The first run is released at once.
+ * @param task WasmTask *, must stay valid until wasmTaskStop()
+ * @param config const WasmTaskConfig *, copied
+ * @param function WasmTaskFunction
+ * @param context void *
+ * @return false if the task cannot be created (memory)
+ */
+bool wasmTaskStart(WasmTask *task, const WasmTaskConfig *config, WasmTaskFunction function, void *context);
+
+/**
+ * @fn
+ * Stop a task and wait until its current run has ended. A sleeping task is woken. Not to be called by the task itself.
+ * @param task WasmTask *
+ */
+void wasmTaskStop(WasmTask *task);
+
+/**
+ * @fn
+ * Release a run of a task at once, or right after its current run. Wakes in a row before the run lead to one run.
+ * @param task WasmTask *
+ */
+void wasmTaskWake(WasmTask *task);
+
+/**
+ * @fn
+ * Wait until the current run of a task has ended and hold off the next one, e.g. to exchange the module of the task.
+ * @param task WasmTask *
+ */
+void wasmTaskLock(WasmTask *task);
+
+/**
+ * @fn
+ * Release a task locked by wasmTaskLock(). A release missed meanwhile runs at once.
+ * @param task WasmTask *
+ */
+void wasmTaskUnlock(WasmTask *task);
+
+/**
+ * @fn
+ * Stack high-water mark of a task, e.g. to size WasmTaskConfig.stackSize
+ * @param task WasmTask *
+ * @return minimum free stack (bytes) since the task started, 0 on the host or if the task is not running
+ */
+uint32_t wasmTaskStackFree(WasmTask *task);
+
+/**
+ * @fn
+ * Monotonic clock of the scheduler
+ * @return us
+ */
+uint64_t wasmTaskClock();
+
+#endif
@@ -0,0 +1,151 @@
+/**
+ * @file fec.cpp
+ * @brief Cauchy Reed-Solomon erasure code over GF(2^8) (see fec.h).
+ * The repair packet j of a block is r_j = sum_i C[j][i] * s_i with the Cauchy matrix C[j][i] = 1 / (x_j + y_i),
+ * x_j = 128 + j and y_i = i. Every square submatrix of a Cauchy matrix is invertible, so any k packets restore the block.
+ */
+#include "fec.h"
+#include <string.h>
+
+#define FEC_POLYNOMIAL 0x11d //x^8 + x^4 + x^3 + x^2 + 1, 2 is a generator
+#define FEC_REPAIR_X_OFFSET 128 //x_j and y_i must be disjoint
+
+static uint8_t gfExp[512]; //doubled, so gfExp[log a + log b] needs no modulo
+static uint8_t gfLog[256];
+
+void fecInit()
+{
+  uint16_t value = 1;
+  for (int i = 0; i < 255; i++)
+  {
+    gfExp[i] = value;
+    gfExp[i + 255] = value;
+    gfLog[value] = i;
+    value <<= 1;
+    if (value & 0x100)
+      value ^= FEC_POLYNOMIAL;
+  }
+  gfExp[510] = gfExp[0];
+  gfExp[511] = gfExp[1];
+  gfLog[0] = 0; //undefined, never used
+}
+
+static inline uint8_t gfMul(uint8_t a, uint8_t b)
+{
+  if (!a || !b)
+    return 0;
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static inline uint8_t gfInv(uint8_t a)
+{
+  return gfExp[255 - gfLog[a]];
+}
+
+static inline uint8_t cauchyCoefficient(uint8_t repairIndex, uint8_t sourceIndex)
+{
+  return gfInv((FEC_REPAIR_X_OFFSET + repairIndex) ^ sourceIndex);
+}
+
+/**
+ * @fn
+ * dst += coefficient * src
+ */
+static void gfMulAddRegion(uint8_t * dst, const uint8_t * src, uint8_t coefficient, uint16_t length)
+{
+  if (!coefficient)
+    return;
+  uint8_t logCoefficient = gfLog[coefficient];
+  for (uint16_t i = 0; i < length; i++)
+  {
+    if (src[i])
+      dst[i] ^= gfExp[gfLog[src[i]] + logCoefficient];
+  }
+}
+
+void fecEncode(const uint8_t * const * sources, uint8_t sourceCount, uint8_t repairIndex, uint16_t length, uint8_t * repair)
+{
+  memset(repair, 0, length);
+  for (uint8_t i = 0; i < sourceCount; i++)
+    gfMulAddRegion(repair, sources[i], cauchyCoefficient(repairIndex, i), length);
+}
+
+bool fecDecode(uint8_t * const * sources, uint8_t sourceCount, uint32_t receivedMask, uint8_t * const * repairs, const uint8_t * repairIndices, uint8_t repairCount, uint16_t length)
+{
+  uint8_t missing[FEC_MAX_SOURCE_PACKETS];
+  uint8_t missingCount = 0;
+  for (uint8_t i = 0; i < sourceCount; i++)
+  {
+    if (!(receivedMask & (1UL << i)))
+      missing[missingCount++] = i;
+  }
+  if (!missingCount)
+    return true;
+  if (missingCount > repairCount)
+    return false;
+
+  //remove the received source packets from the repair packets: r_j - sum_{i received} C[j][i] * s_i = sum_{i missing} C[j][i] * s_i
+  for (uint8_t r = 0; r < missingCount; r++)
+  {
+    for (uint8_t i = 0; i < sourceCount; i++)
+    {
+      if (receivedMask & (1UL << i))
+        gfMulAddRegion(repairs[r], sources[i], cauchyCoefficient(repairIndices[r], i), length);
+    }
+  }
+
+  //invert the missingCount x missingCount Cauchy submatrix (Gauss-Jordan)
+  uint8_t matrix[FEC_MAX_SOURCE_PACKETS][FEC_MAX_SOURCE_PACKETS];
+  uint8_t inverse[FEC_MAX_SOURCE_PACKETS][FEC_MAX_SOURCE_PACKETS];
+  for (uint8_t r = 0; r < missingCount; r++)
+  {
+    for (uint8_t c = 0; c < missingCount; c++)
+    {
+      matrix[r][c] = cauchyCoefficient(repairIndices[r], missing[c]);
+      inverse[r][c] = r == c;
+    }
+  }
+  for (uint8_t c = 0; c < missingCount; c++)
+  {
+    uint8_t pivot = c;
+    while (pivot < missingCount && !matrix[pivot][c])
+      pivot++;
+    if (pivot == missingCount)
+      return false; //duplicate repair index
+    if (pivot != c)
+    {
+      for (uint8_t k = 0; k < missingCount; k++)
+      {
+        uint8_t tmp = matrix[c][k]; matrix[c][k] = matrix[pivot][k]; matrix[pivot][k] = tmp;
+        tmp = inverse[c][k]; inverse[c][k] = inverse[pivot][k]; inverse[pivot][k] = tmp;
+      }
+    }
+    uint8_t scale = gfInv(matrix[c][c]);
+    for (uint8_t k = 0; k < missingCount; k++)
+    {
+      matrix[c][k] = gfMul(matrix[c][k], scale);
+      inverse[c][k] = gfMul(inverse[c][k], scale);
+    }
+    for (uint8_t r = 0; r < missingCount; r++)
+    {
+      uint8_t factor = matrix[r][c];
+      if (r == c || !factor)
+        continue;
+      for (uint8_t k = 0; k < missingCount; k++)
+      {
+        matrix[r][k] ^= gfMul(factor, matrix[c][k]);
+        inverse[r][k] ^= gfMul(factor, inverse[c][k]);
+      }
+    }
+  }
+
+  //s_missing = inverse * reduced repairs
+  for (uint8_t c = 0; c < missingCount; c++)
+  {
+    uint8_t * source = sources[missing[c]];
+    memset(source, 0, length);
+    for (uint8_t r = 0; r < missingCount; r++)
+      gfMulAddRegion(source, repairs[r], inverse[c][r], length);
+  }
+  return true;
+}
@@ -13,11 +13,30 @@ Default_MAC_adress_esp32_2: 10:52:1C:5D:84:18
 #include <esp_wifi.h>
 #include "WiFi.h"
 #include <SPI.h>
+#include <EEPROM.h>
 
 #include "wasm3.h"
 #include "m3_env.h"
 #include "wasm3_defs.h"
 
+#include "chunk_source.h"
+#include "dlog.h"
+#include "event_loop.h"
+#include "fec.h"
+#include "integrity.h"
+#include "lzss.h"
+#include "mesh.h"
+#include "metrics.h"
+#include "staging.h"
+#include "transfer.h"
+#include "trickle.h"
+#include "wasm_budget.h"
+#include "wasm_call.h"
+#include "wasm_imports.h"
+#include "wasm_partition.h"
+#include "wasm_scheduler.h"
+#include "wasm_validate.h"
+
 //Web Server
 #include <ESPAsyncWebServer.h>
 #include <ESPmDNS.h>
@@ -25,19 +44,123 @@ Default_MAC_adress_esp32_2: 10:52:1C:5D:84:18
 
 #define WASM_STACK_SLOTS    4000
 #define CALC_INPUT  2
+#define CALC_RESULT_SIZE 4 //i32 result of calcWasm() in a batch output block
+#define CALC_BATCH_BUFFER_SIZE 1024 //bytes of the batch region of a module (see wasm_call.h)
 #define FATAL(func, msg) { Serial.print("Fatal: " func " "); Serial.println(msg); return; }
 #define CHANNEL 0
 #define MAX_PAYLOAD_SIZE 240 //ESP_NOW_MAX_DATA_LEN (250byte) is not usable due to packet's structure. (it also sends packets flag, total packet size, offset, etc.) 
-
-IM3Environment env;
-IM3Runtime runtime;
-IM3Module module;
-IM3Function calcWasm;
-int wasmResult = 0;
-
-//Set MAC addresses of ESP32 receivers
+#ifndef TRANSMIT_WINDOW_SIZE
+#define TRANSMIT_WINDOW_SIZE 8 //Max. number of unacknowledged packets (sender) and of buffered out-of-order packets (receiver). Can be overwritten with build_flags (-DTRANSMIT_WINDOW_SIZE=n)
+#endif
+#define RETRANSMIT_TIMEOUT 200 //ms without ACK until an unacknowledged packet is sent again
+#define TRANSMIT_MAX_TIMEOUTS 50 //retransmissions after RETRANSMIT_TIMEOUT without any ACK until a receiver is given up
+#define TRANSMIT_MAX_SESSIONS 4 //receivers of one transmission: the node of an upload, or the children of a rollout (see startRelay())
+#define FEC_BLOCK_SIZE 8 //source packets per FEC block of a broadcast (max. FEC_MAX_SOURCE_PACKETS)
+#define FEC_REPAIR_COUNT 3 //repair packets per FEC block of a broadcast (max. FEC_MAX_REPAIR_PACKETS). Up to this number of lost packets per block is restored.
+#define TRANSMIT_HEADER_SIZE 7 //header of a transmission without the digest (see startTransmit())
+#define ROLLOUT_STORE_AND_FORWARD 1 //rollout mode in the header: a node relays the module once it has received and verified all of it
+#define ROLLOUT_CUT_THROUGH 2 //a node relays every packet as soon as it is received in order (see startRelay())
+#define ROLLOUT_BY_DEPTH 3 //not sent: the rollout mode is chosen from the depth of the mesh below the node (see selectRolloutMode())
+#ifndef ROLLOUT_MODE
+#define ROLLOUT_MODE ROLLOUT_BY_DEPTH //rollout mode of an upload without "rollout=cut|store". Can be overwritten with build_flags (-DROLLOUT_MODE=1)
+#endif
+#define ROLLOUT_CUT_THROUGH_CHAIN_DEPTH 7 //min. depth for cut-through if every node has one child, the break-even of tools/relay_sim.cpp is at 6 hops
+#define ROLLOUT_CUT_THROUGH_TREE_DEPTH 5 //min. depth for cut-through if the nodes branch, the break-even of tools/relay_sim.cpp (binary tree) is at 4 hops
+#define BROADCAST_HEADER_SIZE (12 + INTEGRITY_DIGEST_SIZE) //a header of at least this size starts a broadcast reception, a transmission header is shorter
+#ifdef WASM_MEMORY_LIMIT
+#define MODULE_MEMORY_LIMIT WASM_MEMORY_LIMIT
+#else
+#define MODULE_MEMORY_LIMIT 0 //the runtime allocates the whole initial memory of a module
+#endif
+#define STAGED_MODULE_PATH "/main.new" //a received module until it is verified and loaded (see commitReception())
+#define UPLOADED_MODULE_PATH "/main.up" //an uploaded module until it is validated (see handleUpload())
+#define BROADCAST_HEADER_REPEAT 3 //broadcast packets are not acknowledged, so the header is sent several times
+#ifndef TRANSFER_COMPRESSION
+#define TRANSFER_COMPRESSION 1 //1: send the module LZSS compressed if it gets smaller (see lzss.h)
+#endif
+#define WASM_TASK_INTERVAL 5000 //ms between two calls of wasm_task()
+#define WASM_MAX_MODULES 2 //modules running at once, each needs two wasm partitions (A/B slots, see partitions.csv)
+#define WASM_TASK_STACK_SIZE 8192 //bytes of the native stack of a module task, as the one of loop()
+#define WASM_TASK_PRIORITY 1 //as loop()
+#define WASM_TASK_CORE 1 //application core, WiFi and ESP-NOW run on core 0
+#define WASM_CALL_FUEL 2000000 //instructions per call of a module, a runaway module traps (see wasm_budget.h)
+#define WASM_CALL_TIME 200000 //us per call of a module
+#define MESH_MESSAGE_QUEUE_SIZE 4 //messages of the modules waiting to be sent in loop() (see meshSendHook())
+#define LOOP_RETRY_DELAY 1 //ms until loop() tries again a step which could not go on, e.g. ESP-NOW took no packet
+#ifndef DLOG_BINARY
+#define DLOG_BINARY 0 //1: the log is written as binary frames, expanded on the host by tools/dlog_decode.cpp (see dlog.h)
+#endif
+#ifndef METRICS_SERIAL_INTERVAL
+#define METRICS_SERIAL_INTERVAL 0 //ms between two binary dumps of the metrics over serial, 0: off (build_flags = -DMETRICS_SERIAL_INTERVAL=n, see tools/metrics_decode.cpp)
+#endif
+#define SEND_TIME_QUEUE_SIZE 16 //packets ESP-NOW took and has not reported yet, for the send time (see OnDataSent())
+//events which wake loop() (see event_loop.h)
+#define EVENT_RECEIVE 0x01 //a packet was received (OnDataRecv())
+#define EVENT_SENT 0x02 //a send report (OnDataSent())
+#define EVENT_UPLOAD 0x04 //an upload is complete (handleUpload())
+#define EVENT_MODULE 0x08 //a module task has a result or a message (wasm_task(), meshSendHook())
+#define SUMMARY_INTERVAL_MIN 500 //ms, Trickle interval after a change of a module version (see trickle.h)
+#define SUMMARY_MAX_DOUBLINGS 8 //longest Trickle interval: SUMMARY_INTERVAL_MIN * 2^8 = 128 s
+#define SUMMARY_SIZE 6
+#define PULL_DELAY 200 //ms to collect the summaries of the neighbors before pulling from the one with the best link
+#define PULL_RETRY_INTERVAL 30000 //ms between two pulls, e.g. if the pulled module cannot be loaded
+#define EEPROM_SIZE 1 //save static status in the flash
+#define MODULE_VERSION_OFFSET 0x00
+#ifndef MESH_GATEWAY
+#define MESH_GATEWAY 0 //1: root of the mesh, set on the node where the modules are uploaded (build_flags = -DMESH_GATEWAY=1)
+#endif
+
+typedef struct {
+  const char *path; //module file in SPIFFS
+  uint32_t stackSize; //bytes of the wasm stack of the module runtime
+  WasmTaskConfig task;
+  WasmBudgetConfig budget; //of each call
+} WasmModuleConfig;
+
+//A running module. Each module has its own runtime and runs in its own task (see wasm_scheduler.h).
+typedef struct {
+  IM3Environment env;
+  IM3Runtime runtime;
+  IM3Module module;
+  IM3Function calcWasm;
+  WasmBatch batch; //batch entry point, function is NULL if the module has none
+  int slot; //wasm partition slot, -1 if no module is loaded
+  uint32_t hash; //FNV-1a of the module file (see integrity.h)
+  WasmTask task;
+  WasmBudget budget; //of the calls and their statistics, under the lock of the task
+  volatile int32_t result;
+  volatile bool resultReady; //set by the task, the result is sent in loop()
+  uint8_t input[MESH_MAX_PAYLOAD_SIZE]; //samples of received messages, CALC_INPUT bytes each (see queueModuleInput())
+  size_t inputLength; //under wasmInputMux
+} WasmModule;
+
+//Module 0 is the module distributed over the mesh. The other modules are files of the file system image (data/) and run if they exist.
+const WasmModuleConfig wasmModuleConfigs[WASM_MAX_MODULES] = {
+  {"/main.wasm", WASM_STACK_SLOTS, {"wasm0", WASM_TASK_INTERVAL, WASM_TASK_PRIORITY, WASM_TASK_CORE, WASM_TASK_STACK_SIZE},
+   {WASM_CALL_FUEL, WASM_CALL_TIME}},
+  {"/module1.wasm", WASM_STACK_SLOTS, {"wasm1", WASM_TASK_INTERVAL, WASM_TASK_PRIORITY, WASM_TASK_CORE, WASM_TASK_STACK_SIZE},
+   {WASM_CALL_FUEL, WASM_CALL_TIME}},
+};
+WasmModule wasmModules[WASM_MAX_MODULES];
+portMUX_TYPE wasmInputMux = portMUX_INITIALIZER_UNLOCKED;
+bool wasmSwapPending = false; //a received module is loaded in loop()
+
+//Messages of the modules (see meshSendHook()). The module tasks queue them and loop() sends them, so only loop() uses the mesh.
+typedef struct {
+  uint16_t node;
+  uint8_t len;
+  uint8_t data[MESH_MAX_PAYLOAD_SIZE];
+} MeshMessage;
+MeshMessage meshMessages[MESH_MESSAGE_QUEUE_SIZE];
+uint8_t meshMessageHead = 0;
+uint8_t meshMessageCount = 0;
+portMUX_TYPE meshMessageMux = portMUX_INITIALIZER_UNLOCKED;
+
+//Set MAC addresses of ESP32 receivers. A module is sent to this node unless the upload names another node (see handleUpload()).
 uint8_t broadcastAddress[] = {0x10, 0x52, 0x1C, 0x5D, 0x84, 0x18};
 //uint8_t broadcastAddress[] = {0xAC, 0x67, 0xB2, 0x20, 0x40, 0x2C};
+//ESP-NOW broadcast to every listening node (see startBroadcast())
+uint8_t everyNodeAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 typedef struct struct_message {
     float temp;
@@ -56,10 +179,142 @@ String success;
 int wl_status = WL_IDLE_STATUS;
 AsyncWebServer server(80);
 
-//For wasm binary transmission
-int currentTransmitOffset = 0;
+//Metrics of the hot paths (see metrics.h), read at /metrics or as binary frames over serial (see dumpMetrics())
+Metric wasmInstallTime = {"wasm_install_us", NULL, "Time to instrument and write a module into a wasm partition", METRIC_HISTOGRAM};
+Metric wasmLoadTime = {"wasm_load_us", NULL, "Time to parse, load and link a module", METRIC_HISTOGRAM};
+Metric wasmCallTime[WASM_MAX_MODULES] = {
+  {"wasm_call_us", "module=\"0\"", "Latency of a call of a module", METRIC_HISTOGRAM},
+  {"wasm_call_us", "module=\"1\"", "Latency of a call of a module", METRIC_HISTOGRAM},
+};
+Metric wasmBudgetTraps[WASM_MAX_MODULES] = {
+  {"wasm_budget_exceeded_total", "module=\"0\"", "Calls which trapped on their fuel or time budget", METRIC_COUNTER},
+  {"wasm_budget_exceeded_total", "module=\"1\"", "Calls which trapped on their fuel or time budget", METRIC_COUNTER},
+};
+Metric espnowSendTime = {"espnow_send_us", NULL, "Time from esp_now_send() to the send report", METRIC_HISTOGRAM};
+Metric espnowReportSuccess = {"espnow_reports_total", "status=\"success\"", "Send reports of ESP-NOW", METRIC_COUNTER};
+Metric espnowReportFail = {"espnow_reports_total", "status=\"fail\"", "Send reports of ESP-NOW", METRIC_COUNTER};
+Metric espnowRefused = {"espnow_refused_total", NULL, "Packets esp_now_send() did not take", METRIC_COUNTER};
+Metric transferAckTime = {"transfer_ack_ms", NULL, "Time from the last send of a transfer packet to its ACK", METRIC_HISTOGRAM};
+Metric transferPackets = {"transfer_packets_total", NULL, "New packets of the finished transfer sessions", METRIC_COUNTER};
+Metric transferRetransmissions = {"transfer_retransmissions_total", NULL, "Packets sent again after a NACK or a timeout", METRIC_COUNTER};
+Metric transferRejected = {"transfer_rejected_total", NULL, "Received modules which failed the integrity check or the validation", METRIC_COUNTER};
+Metric heapFree = {"heap_free_bytes", NULL, "Free heap", METRIC_GAUGE};
+Metric heapMinFree = {"heap_min_free_bytes", NULL, "Lowest free heap since the start", METRIC_GAUGE};
+Metric stackFree[1 + WASM_MAX_MODULES] = {
+  {"stack_min_free_bytes", "task=\"loop\"", "Lowest free stack of a task since its start", METRIC_GAUGE},
+  {"stack_min_free_bytes", "task=\"wasm0\"", "Lowest free stack of a task since its start", METRIC_GAUGE},
+  {"stack_min_free_bytes", "task=\"wasm1\"", "Lowest free stack of a task since its start", METRIC_GAUGE},
+};
+TaskHandle_t mainTaskHandle = NULL; //the task of setup() and loop()
+unsigned long lastMetricsDump = 0;
+//send times of the packets ESP-NOW took, in the order of their send reports
+uint32_t sendTimes[SEND_TIME_QUEUE_SIZE];
+uint8_t sendTimeHead = 0;
+uint8_t sendTimeCount = 0;
+portMUX_TYPE sendTimeMux = portMUX_INITIALIZER_UNLOCKED;
+
+//For wasm binary reception. Out-of-order packets wait in receiveBuffer until the gap is filled (see transfer.h).
+TransferReceiver receiver;
 int numberOfPackets = 0;
-byte sendNextPacketFlag = 0;
+bool receiveActive = false;
+uint8_t receiveTransferId = 0;
+uint8_t receiveCodec = CODEC_NONE; //codec of the running reception, advertised in the header
+LzssDecoder lzssDecoder;
+IntegrityCheck moduleCheck; //digest of the running reception, unicast or broadcast (see integrity.h)
+uint32_t stagedModuleHash = 0; //module hash of the verified module in STAGED_MODULE_PATH
+//validation of the running reception and of an upload, a module which cannot run is rejected while it streams in (see wasm_validate.h)
+const WasmValidateConfig moduleValidation = {"calcWasm", CALC_INPUT, 1, MODULE_MEMORY_LIMIT, WASM_STACK_SLOTS};
+WasmValidator moduleValidator;
+WasmFuelInfo stagedFuelInfo; //scan of the module in STAGED_MODULE_PATH, its install does not scan it again
+bool stagedFuelInfoValid = false;
+uint8_t receiveBuffer[TRANSMIT_WINDOW_SIZE * MAX_PAYLOAD_SIZE];
+bool ackPending = false;
+uint8_t ackMessage[TRANSFER_ACK_SIZE(TRANSMIT_WINDOW_SIZE)]; //built in OnDataRecv, sent in loop()
+uint8_t ackMessageLength = 0;
+uint16_t ackNode = 0; //mesh node ID of the sender
+portMUX_TYPE ackMux = portMUX_INITIALIZER_UNLOCKED;
+
+//For wasm binary transmission (selective repeat). Sequence number 0 is the header packet, 1..numberOfTransmitPackets are payload packets.
+//Every receiver has its own session (window, see transfer.h), the packets are shared.
+typedef struct {
+  TransferSender sender;
+  TransferLink link; //mesh frames to the destination
+  uint16_t destination; //mesh node ID of the receiver
+} TransmitSession;
+TransmitSession transmitSessions[TRANSMIT_MAX_SESSIONS];
+uint16_t numberOfTransmitPackets = 0;
+uint16_t availableTransmitPackets = 0; //payload packets which can be sent: all packets of a file, the packets received so far when relaying
+uint8_t transmitTransferId = 0;
+ChunkSource transmitSource; //"/main.wasm", or "/main.lz" for a compressed transfer
+uint8_t transmitCodec = CODEC_NONE;
+IntegrityDigest transmitDigest; //advertised in the header
+bool transmitDigestValid = false; //false: a relayed header had no digest
+uint8_t transmitRollout = 0; //rollout mode, the receivers relay the module to their children. 0: no rollout
+bool transmitActive = false;
+uint16_t transmitDestination = 0; //mesh node ID of the receiver
+bool transmitRequested = false; //set by handleUpload(), the transmission is started in loop()
+uint8_t rolloutRequested = 0; //rollout mode set by handleUpload(), the rollout is started in loop()
+
+//For relaying a rollout. The payload packets are kept as they arrive in order and sent on from relayBuffer, while the module is still received
+//(cut-through) or once it is complete and verified (store-and-forward).
+uint8_t *relayBuffer = NULL; //NULL if the packets come from transmitSource
+uint32_t relayLength = 0; //bytes of in-order packets in relayBuffer
+bool relayFilling = false; //the running reception is relayed
+bool relayRequested = false; //set in the WiFi task, the relay is started in loop()
+bool relayPending = false; //store-and-forward: the relay is requested at the end of the reception (see commitReception())
+portMUX_TYPE transmitMux = portMUX_INITIALIZER_UNLOCKED; //ACKs are handled in the WiFi task, the window is filled in loop()
+
+//For wasm binary broadcast reception. Packets of the current FEC block are collected until the block can be restored.
+bool fecReceiveActive = false;
+uint8_t fecSourceCount = 0; //source packets per block of the running broadcast
+uint8_t fecRepairCount = 0; //repair packets per block of the running broadcast
+uint32_t receiveFileSize = 0;
+uint16_t currentBlock = 0;
+uint16_t numberOfBlocks = 0;
+uint32_t blockReceivedMask = 0; //bit i: source packet i of the current block is received
+uint8_t blockRepairCount = 0;
+uint8_t blockRepairIndex[FEC_REPAIR_COUNT];
+uint8_t fecSourceBuffer[FEC_BLOCK_SIZE][MAX_PAYLOAD_SIZE];
+uint8_t fecRepairBuffer[FEC_REPAIR_COUNT][MAX_PAYLOAD_SIZE];
+
+//For wasm binary broadcast transmission. Emission order: header (BROADCAST_HEADER_REPEAT times), then per block the source packets and the repair packets.
+bool broadcastActive = false;
+uint8_t broadcastTransferId = 0;
+uint16_t numberOfBroadcastPackets = 0;
+ChunkSource broadcastSource;
+uint8_t broadcastCodec = CODEC_NONE;
+uint32_t broadcastFileSize = 0;
+IntegrityDigest broadcastDigest;
+uint32_t broadcastEmission = 0; //index of the next packet in emission order
+int loadedBroadcastBlock = -1; //block in broadcastBlock
+const uint8_t *broadcastBlock[FEC_BLOCK_SIZE]; //source packets of the loaded block, views of broadcastSource
+uint8_t broadcastLastPacket[MAX_PAYLOAD_SIZE]; //zero padded last packet of the module
+bool broadcastRequested = false; //set by handleUpload(), the broadcast is started in loop()
+uint8_t broadcastPacketsInFlight = 0; //sent broadcast packets without OnDataSent report
+
+//Mesh forwarding (see mesh.h). Transfer packets, ACKs and results are sent in mesh frames, FEC broadcasts are not forwarded.
+Mesh mesh;
+portMUX_TYPE meshMux = portMUX_INITIALIZER_UNLOCKED; //frames are received in the WiFi task and sent in loop()
+uint8_t meshPeers[MESH_MAX_NEIGHBORS][ESP_NOW_ETH_ALEN]; //ESP-NOW peers added for the mesh, the oldest one is removed first
+uint8_t numberOfMeshPeers = 0;
+
+//Version dissemination. Every node advertises the summary (module version, module hash) of its module with a Trickle timer
+//and pulls the module from a neighbor which advertises a newer one.
+Trickle trickle;
+portMUX_TYPE trickleMux = portMUX_INITIALIZER_UNLOCKED; //summaries are received in the WiFi task and sent in loop()
+uint8_t moduleVersion = 0; //incremented at every upload, saved in the EEPROM
+uint32_t moduleHash = 0; //FNV-1a of the module, 0 if no module is loaded
+uint8_t receiveVersion = 0; //version of the running reception, advertised in the header
+uint8_t transmitVersion = 0; //version of the running transmission
+uint32_t uploadHash = INTEGRITY_HASH_SEED; //computed while the upload is written
+WasmValidator uploadValidator; //an invalid upload is not sent
+bool moduleUploaded = false; //set by handleUpload(), the summary is updated in loop()
+bool pullPending = false; //a neighbor advertises a newer module
+uint8_t pullAddress[ESP_NOW_ETH_ALEN]; //the neighbor with the best link which advertises the newest module
+uint8_t pullQuality = 0;
+uint8_t pullVersion = 0;
+unsigned long pullHeardMillis = 0;
+unsigned long nextPullMillis = 0;
 
 /**
  * @fn 
@@ -127,214 +382,1292 @@ void setupWifi() {
 
 
 /**
- * @fn 
- * ESP-Now: Callback when data is sent
- * @param mac_addr const uint8_t*
- * @param status esp_now_send_status_t
+ * @fn
+ * ESP-Now: Register a peer
+ * @param peerAddress const uint8_t *, MAC address of the peer
+ * @return true if the peer is registered
+ */
+bool addPeer(const uint8_t * peerAddress) {
+  esp_now_peer_info_t peerInfo = {};
+  memcpy(peerInfo.peer_addr, peerAddress, ESP_NOW_ETH_ALEN);
+  peerInfo.channel = 0;  
+  peerInfo.encrypt = false;
+  return esp_now_add_peer(&peerInfo) == ESP_OK;
+}
+
+
+/**
+ * @fn 
+ * ESP-Now: Callback when data is sent
+ * Delivery is confirmed by the ACK packets of the receiver, so this report is only informative.
+ * @param mac_addr const uint8_t*
+ * @param status esp_now_send_status_t
+ */
+void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
+  uint32_t now = micros();
+  portENTER_CRITICAL(&sendTimeMux);
+  bool timed = sendTimeCount > 0;
+  uint32_t sendTime = sendTimes[sendTimeHead];
+  if (timed)
+  {
+    sendTimeHead = (sendTimeHead + 1) % SEND_TIME_QUEUE_SIZE;
+    sendTimeCount--;
+  }
+  portEXIT_CRITICAL(&sendTimeMux);
+  if (timed)
+    metricRecord(&espnowSendTime, now - sendTime);
+  metricCount(status == ESP_NOW_SEND_SUCCESS ? &espnowReportSuccess : &espnowReportFail);
+
+  //broadcast packets are paced by the reports, since there are no ACKs
+  if (!memcmp(mac_addr, everyNodeAddress, ESP_NOW_ETH_ALEN))
+  {
+    portENTER_CRITICAL(&transmitMux);
+    if (broadcastPacketsInFlight)
+      broadcastPacketsInFlight--;
+    portEXIT_CRITICAL(&transmitMux);
+    eventPost(EVENT_SENT);
+  }
+  DLOG_DEBUG("Send report: %s", status == ESP_NOW_SEND_SUCCESS ? "Delivery Success" : "Delivery Fail");
+}
+
+/**
+ * @fn
+ * FNV-1a hash of a module file. The module is hashed as it was received, the wasm partition holds it metered (see wasm_partition.h).
+ * @param path const char *
+ * @return uint32_t, INTEGRITY_HASH_SEED if the file cannot be read
+ */
+uint32_t hashModuleFile(const char *path)
+{
+  uint32_t hash = INTEGRITY_HASH_SEED;
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return hash;
+  uint8_t buffer[256];
+  size_t n;
+  while ((n = file.read(buffer, sizeof(buffer))) > 0)
+    hash = integrityHash(hash, buffer, n);
+  file.close();
+  return hash;
+}
+
+/**
+ * @fn
+ * Compare a summary of a neighbor with the own one. The version is compared in serial number arithmetic,
+ * two different modules with the same version are ordered by their hash, so every node agrees on one of them.
+ * @param version uint8_t
+ * @param hash uint32_t
+ * @return > 0 if the neighbor has a newer module, < 0 if it has an older one, 0 if it has the same
+ */
+int compareSummary(uint8_t version, uint32_t hash)
+{
+  if (version != moduleVersion)
+    return (int8_t) (version - moduleVersion);
+  return hash == moduleHash ? 0 : (hash > moduleHash ? 1 : -1);
+}
+
+/**
+ * @fn
+ * Set the summary of the own module. A changed summary restarts the Trickle timer, so the neighbors learn it soon.
+ * @param version uint8_t
+ * @param hash uint32_t
+ */
+void setModuleSummary(uint8_t version, uint32_t hash)
+{
+  if (version != moduleVersion)
+  {
+    EEPROM.write(MODULE_VERSION_OFFSET, version);
+    EEPROM.commit();
+  }
+  portENTER_CRITICAL(&trickleMux);
+  bool changed = version != moduleVersion || hash != moduleHash;
+  moduleVersion = version;
+  moduleHash = hash;
+  if (changed)
+    trickleInconsistent(&trickle, millis());
+  portEXIT_CRITICAL(&trickleMux);
+  DLOG_INFO("Module version %u, hash %x", version, hash);
+}
+
+/**
+ * @fn
+ * Handle the summary of a neighbor (see sendSummary()). A newer module is pulled from the neighbor with the best link
+ * of those heard within PULL_DELAY (see disseminateVersion()).
+ * @param mac const uint8_t *, MAC address of the neighbor
+ * @param data const uint8_t *
+ * @param len int
+ */
+void handleSummary(const uint8_t *mac, const uint8_t *data, int len)
+{
+  if (len < SUMMARY_SIZE)
+    return;
+  uint8_t version = data[1];
+  uint32_t hash = (uint32_t) data[2] << 24 | (uint32_t) data[3] << 16 | data[4] << 8 | data[5];
+  portENTER_CRITICAL(&meshMux);
+  uint8_t quality = meshLinkQuality(&mesh, mac);
+  portEXIT_CRITICAL(&meshMux);
+
+  portENTER_CRITICAL(&trickleMux);
+  int order = compareSummary(version, hash);
+  if (order == 0)
+    trickleConsistent(&trickle);
+  else
+    trickleInconsistent(&trickle, millis());
+  if (order > 0 && (!pullPending || (int8_t) (version - pullVersion) > 0 || (version == pullVersion && quality > pullQuality)))
+  {
+    if (!pullPending)
+      pullHeardMillis = millis();
+    memcpy(pullAddress, mac, ESP_NOW_ETH_ALEN);
+    pullQuality = quality;
+    pullVersion = version;
+    pullPending = true;
+  }
+  portEXIT_CRITICAL(&trickleMux);
+}
+
+/**
+ * @fn
+ * Receiver: LzssWriter (see lzss.h) of the decoded module, which is validated, hashed and staged (see staging.h).
+ * Nothing is staged after the module is invalid.
+ * @param data const uint8_t *
+ * @param len size_t
+ * @param context void *, unused
+ */
+void writeDecodedData(const uint8_t *data, size_t len, void *context)
+{
+  if (!wasmValidateFeed(&moduleValidator, data, len))
+    return;
+  integrityModule(&moduleCheck, data, len);
+  stagingWrite(data, len);
+}
+
+/**
+ * @fn
+ * Receiver: append received data in order to the staged module file, decompressed if the header advertised a codec.
+ * The digest of the reception is updated on the way (see integrity.h).
+ * An invalid module is rejected at once: the rest is dropped, a broadcast reception ends and a relay of it stalls
+ * (see transmitWindow()). A unicast reception is acknowledged as a whole in handlePacket(), so the sender stops.
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+void writeModuleData(const uint8_t *data, size_t len)
+{
+  if (moduleValidator.error)
+    return;
+  integrityTransfer(&moduleCheck, data, len);
+  if (receiveCodec == CODEC_NONE)
+    writeDecodedData(data, len, NULL);
+  else if (lzssDecoder.valid && !lzssDecode(&lzssDecoder, data, len, writeDecodedData, NULL))
+    DLOG_WARN("Invalid compressed data");
+  if (moduleValidator.error)
+  {
+    DLOG_WARN("Received module rejected: %s", moduleValidator.error);
+    metricCount(&transferRejected);
+    relayFilling = false;
+    fecReceiveActive = false;
+  }
+}
+
+/**
+ * @fn
+ * Receiver: free the packets of a store-and-forward relay which is not started, its reception failed or was replaced by another one
+ */
+void dropRelay()
+{
+  if (!relayPending)
+    return;
+  relayPending = false;
+  portENTER_CRITICAL(&transmitMux);
+  uint8_t *unusedBuffer = transmitActive ? NULL : relayBuffer;
+  if (unusedBuffer)
+    relayBuffer = NULL;
+  portEXIT_CRITICAL(&transmitMux);
+  free(unusedBuffer);
+}
+
+/**
+ * @fn
+ * Receiver: end of a reception. The staged module is loaded in loop() only if it matches the digest of the header and is valid,
+ * otherwise the running module stays and the newer version is pulled again (see disseminateVersion()).
+ */
+void commitReception()
+{
+  if (moduleValidator.error)
+  {
+    dropRelay();
+    return; //rejected during the reception (see writeModuleData())
+  }
+  //the digest first: a corrupted module is also invalid
+  const char *error = integrityVerify(&moduleCheck);
+  if (!error)
+    error = wasmValidateFinish(&moduleValidator);
+  if (error)
+  {
+    DLOG_WARN("Received module rejected: %s", error);
+    metricCount(&transferRejected);
+    dropRelay();
+    return;
+  }
+  if (relayPending)
+  {
+    relayPending = false;
+    portENTER_CRITICAL(&transmitMux);
+    relayRequested = relayBuffer != NULL;
+    portEXIT_CRITICAL(&transmitMux);
+  }
+  stagedModuleHash = moduleCheck.received.moduleHash;
+  const WasmFuelInfo *fuelInfo = wasmValidateFuelInfo(&moduleValidator);
+  stagedFuelInfoValid = fuelInfo != NULL;
+  if (fuelInfo)
+    stagedFuelInfo = *fuelInfo;
+  wasmSwapPending = true;
+}
+
+/**
+ * @fn
+ * Receiver: TransferWriter of the unicast reception, the packets arrive in order (see transfer.h).
+ * @param context void *, unused
+ * @param offset uint16_t, 1..numberOfPackets
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+void writeReceivedPacket(void *context, uint16_t offset, const uint8_t *data, size_t len)
+{
+  if (relayFilling)
+  {
+    //the packet can be relayed before it is written here
+    portENTER_CRITICAL(&transmitMux);
+    if (relayBuffer)
+    {
+      memcpy(relayBuffer + (offset - 1) * MAX_PAYLOAD_SIZE, data, len);
+      relayLength = (offset - 1) * MAX_PAYLOAD_SIZE + len;
+      availableTransmitPackets = offset;
+    }
+    portEXIT_CRITICAL(&transmitMux);
+  }
+  writeModuleData(data, len);
+}
+
+/**
+ * @fn
+ * Receiver: take a snapshot of the reception state as ACK packet (see transferBuildAck()). It is sent by sendAck() in loop().
+ * The receive buffer is in RAM, so the credit is always the whole window.
+ */
+void queueAck()
+{
+  portENTER_CRITICAL(&ackMux);
+  ackMessageLength = transferBuildAck(&receiver, TRANSMIT_WINDOW_SIZE, ackMessage);
+  ackPending = true;
+  portEXIT_CRITICAL(&ackMux);
+}
+
+/**
+ * @fn
+ * Receiver: keep the packets of a rollout for the children of this node (see startRelay()). With cut-through they are relayed
+ * while they are received, with store-and-forward once the module is complete and verified, so a rejected module is not relayed.
+ * Nothing is relayed if this node is transmitting itself or the packets do not fit into the RAM.
+ * @param mode uint8_t, rollout mode of the header
+ */
+void prepareRelay(uint8_t mode)
+{
+  portENTER_CRITICAL(&transmitMux);
+  bool busy = transmitActive || relayBuffer || relayRequested;
+  portEXIT_CRITICAL(&transmitMux);
+  if (busy)
+    return;
+
+  uint8_t *buffer = (uint8_t *) malloc((size_t) numberOfPackets * MAX_PAYLOAD_SIZE);
+  if (!buffer)
+  {
+    DLOG_WARN("Not enough memory to relay");
+    return;
+  }
+  portENTER_CRITICAL(&transmitMux);
+  relayBuffer = buffer;
+  relayLength = 0;
+  numberOfTransmitPackets = numberOfPackets;
+  availableTransmitPackets = 0;
+  transmitTransferId = receiveTransferId;
+  transmitCodec = receiveCodec;
+  transmitVersion = receiveVersion;
+  transmitDigest = moduleCheck.expected;
+  transmitDigestValid = moduleCheck.advertised;
+  transmitRollout = mode == ROLLOUT_CUT_THROUGH ? ROLLOUT_CUT_THROUGH : ROLLOUT_STORE_AND_FORWARD;
+  relayRequested = transmitRollout == ROLLOUT_CUT_THROUGH;
+  portEXIT_CRITICAL(&transmitMux);
+  relayPending = !relayRequested;
+  relayFilling = true;
+}
+
+/**
+ * @fn
+ * Sender: update the window of a receiver with an ACK packet (see transferSenderAck()).
+ * @param source uint16_t, mesh node ID of the receiver
+ * @param data const uint8_t *, ACK packet with message flag
+ * @param len int
+ */
+void handleAck(uint16_t source, const uint8_t *data, int len)
+{
+  uint32_t now = millis();
+  portENTER_CRITICAL(&transmitMux);
+  for (int s = 0; s < TRANSMIT_MAX_SESSIONS; s++)
+  {
+    TransmitSession *session = &transmitSessions[s];
+    if (!transmitActive || session->destination != source)
+      continue;
+    TransferSender *sender = &session->sender;
+    uint16_t base = sender->windowBase;
+    uint8_t packetState[TRANSFER_MAX_WINDOW];
+    memcpy(packetState, sender->packetState, sizeof(packetState));
+    if (!transferSenderAck(sender, data, len))
+      continue;
+    //packets acknowledged by this ACK, cumulatively or selectively
+    for (uint16_t sequence = base; sequence < sender->nextSequence; sequence++)
+    {
+      uint8_t slot = sequence % sender->window;
+      if (packetState[slot] == TRANSFER_SENT && (sequence < sender->windowBase || sender->packetState[slot] == TRANSFER_ACKED))
+        metricRecord(&transferAckTime, now - sender->packetSentMillis[slot]);
+    }
+  }
+  portEXIT_CRITICAL(&transmitMux);
+}
+
+/**
+ * @fn
+ * Broadcast receiver: start the reception with a broadcast header (see startBroadcast()).
+ * @param data const uint8_t *, header without message flag
+ * @param len int
+ */
+void startBroadcastReception(const uint8_t *data, int len)
+{
+  //the header is repeated
+  if ((fecReceiveActive || numberOfBlocks) && data[2] == receiveTransferId)
+    return;
+  if (data[3] == 0 || data[3] > FEC_BLOCK_SIZE || data[4] > FEC_REPAIR_COUNT)
+  {
+    DLOG_WARN("Broadcast FEC parameters are not supported");
+    return;
+  }
+
+  DLOG_INFO("Start of new file broadcast");
+  numberOfPackets = data[0] << 8 | data[1];
+  receiveTransferId = data[2];
+  fecSourceCount = data[3];
+  fecRepairCount = data[4];
+  receiveFileSize = (uint32_t) data[5] << 24 | (uint32_t) data[6] << 16 | data[7] << 8 | data[8];
+  receiveCodec = data[9];
+  receiveVersion = data[10];
+  integrityBegin(&moduleCheck, data + 11);
+  wasmValidateBegin(&moduleValidator, &moduleValidation);
+  lzssDecoderInit(&lzssDecoder);
+  numberOfBlocks = (numberOfPackets + fecSourceCount - 1) / fecSourceCount;
+  currentBlock = 0;
+  blockReceivedMask = 0;
+  blockRepairCount = 0;
+  receiveActive = false; //no ACKs in broadcast mode
+  relayFilling = false;
+  dropRelay();
+  fecReceiveActive = true;
+  if (!stagingBegin(STAGED_MODULE_PATH))
+    DLOG_ERROR("Error opening file ...");
+}
+
+/**
+ * @fn
+ * Broadcast receiver: handle a source or repair packet. As soon as the current block has fecSourceCount packets,
+ * the missing source packets are restored and the block is appended to the file.
+ * A packet of a later block means that the current block cannot be restored anymore, so the reception fails.
+ * @param block uint16_t, FEC block of the packet
+ * @param sourceIndex int, index of the source packet in the block, -1 for a repair packet
+ * @param repairIndex uint8_t, index of the repair packet
+ * @param payload const uint8_t *
+ * @param payloadLength int
+ */
+void handleBroadcastPacket(uint16_t block, int sourceIndex, uint8_t repairIndex, const uint8_t *payload, int payloadLength)
+{
+  if (!fecReceiveActive || block < currentBlock || payloadLength > MAX_PAYLOAD_SIZE)
+    return;
+  if (block > currentBlock)
+  {
+    fecReceiveActive = false;
+    DLOG_WARN("Broadcast block lost, too many packets are missing");
+    return;
+  }
+
+  uint8_t blockSourceCount = min((int) fecSourceCount, numberOfPackets - block * fecSourceCount);
+  if (sourceIndex >= 0)
+  {
+    if (sourceIndex >= blockSourceCount || (blockReceivedMask & (1UL << sourceIndex)))
+      return;
+    memcpy(fecSourceBuffer[sourceIndex], payload, payloadLength);
+    memset(fecSourceBuffer[sourceIndex] + payloadLength, 0, MAX_PAYLOAD_SIZE - payloadLength); //the last packet is zero padded
+    blockReceivedMask |= 1UL << sourceIndex;
+  }
+  else
+  {
+    if (blockRepairCount == fecRepairCount)
+      return;
+    for (int i = 0; i < blockRepairCount; i++)
+    {
+      if (blockRepairIndex[i] == repairIndex)
+        return;
+    }
+    memcpy(fecRepairBuffer[blockRepairCount], payload, payloadLength);
+    memset(fecRepairBuffer[blockRepairCount] + payloadLength, 0, MAX_PAYLOAD_SIZE - payloadLength);
+    blockRepairIndex[blockRepairCount++] = repairIndex;
+  }
+
+  if (__builtin_popcount(blockReceivedMask) + blockRepairCount < blockSourceCount)
+    return;
+
+  uint8_t *sources[FEC_BLOCK_SIZE];
+  uint8_t *repairs[FEC_REPAIR_COUNT];
+  for (int i = 0; i < FEC_BLOCK_SIZE; i++)
+    sources[i] = fecSourceBuffer[i];
+  for (int i = 0; i < FEC_REPAIR_COUNT; i++)
+    repairs[i] = fecRepairBuffer[i];
+  if (!fecDecode(sources, blockSourceCount, blockReceivedMask, repairs, blockRepairIndex, blockRepairCount, MAX_PAYLOAD_SIZE))
+  {
+    fecReceiveActive = false;
+    DLOG_WARN("Broadcast block cannot be restored");
+    return;
+  }
+
+  uint32_t blockOffset = (uint32_t) block * fecSourceCount * MAX_PAYLOAD_SIZE;
+  uint32_t blockLength = min((uint32_t) blockSourceCount * MAX_PAYLOAD_SIZE, receiveFileSize - blockOffset);
+  for (int i = 0; blockLength; i++)
+  {
+    uint32_t length = min(blockLength, (uint32_t) MAX_PAYLOAD_SIZE);
+    writeModuleData(fecSourceBuffer[i], length);
+    blockLength -= length;
+  }
+
+  currentBlock++;
+  blockReceivedMask = 0;
+  blockRepairCount = 0;
+  if (currentBlock == numberOfBlocks)
+  {
+    fecReceiveActive = false;
+    size_t size = stagingFinish();
+    DLOG_INFO("done wasm file broadcast: %u bytes", (uint32_t) size);
+    commitReception();
+  }
+}
+
+/**
+ * @fn
+ * Pass samples to a module and wake its task, so they are processed at once instead of at the next period.
+ * Samples which do not fit until the next run are dropped.
+ * @param wasm WasmModule *
+ * @param data const uint8_t *, CALC_INPUT bytes per sample
+ * @param len size_t
+ */
+void queueModuleInput(WasmModule *wasm, const uint8_t *data, size_t len){
+  portENTER_CRITICAL(&wasmInputMux);
+  size_t n = min(len, sizeof(wasm->input) - wasm->inputLength);
+  memcpy(wasm->input + wasm->inputLength, data, n);
+  wasm->inputLength += n;
+  portEXIT_CRITICAL(&wasmInputMux);
+  wasmTaskWake(&wasm->task);
+}
+
+/**
+ * @fn
+ * Handle a received packet, either directly received or the payload of a mesh frame
+ * @param source uint16_t, mesh node ID of the sender
+ * @param data const uint8_t *
+ * @param len int
+ */
+void handlePacket(uint16_t source, const uint8_t *data, int len) {
+  switch (*data++)
+  {
+    case 0x01:
+      if (len >= BROADCAST_HEADER_SIZE)
+      {
+        startBroadcastReception(data, len - 1);
+        break;
+      }
+      //a repeated header of the running transfer must not restart the reception
+      if (len >= 4 && data[2] == receiveTransferId && receiver.numberOfPackets && !numberOfBlocks)
+      {
+        queueAck();
+        break;
+      }
+      DLOG_INFO("Start of new file transmit");
+      numberOfPackets = data[0] << 8 | data[1];
+      receiveTransferId = len >= 4 ? data[2] : 0;
+      receiveCodec = len >= 5 ? data[3] : CODEC_NONE;
+      receiveVersion = len >= 7 ? data[5] : moduleVersion + 1;
+      integrityBegin(&moduleCheck, len >= TRANSMIT_HEADER_SIZE + INTEGRITY_DIGEST_SIZE ? data + 6 : NULL);
+      wasmValidateBegin(&moduleValidator, &moduleValidation);
+      relayFilling = false;
+      dropRelay();
+      if (len >= 6 && data[4])
+        prepareRelay(data[4]);
+      lzssDecoderInit(&lzssDecoder);
+      receiveActive = true;
+      fecReceiveActive = false;
+      numberOfBlocks = 0;
+      transferReceiverStart(&receiver, receiveTransferId, numberOfPackets);
+      ackNode = source;
+      queueAck();
+      DLOG_INFO("currentNumberOfPackets = %d", numberOfPackets);
+      if (!stagingBegin(STAGED_MODULE_PATH))
+        DLOG_ERROR("Error opening file ...");
+      break;
+    case 0x02:
+    {
+      if (numberOfBlocks)
+      {
+        int offset = data[0] << 8 | data[1];
+        if (len > 3 && len - 3 <= MAX_PAYLOAD_SIZE && offset >= 1)
+          handleBroadcastPacket((offset - 1) / fecSourceCount, (offset - 1) % fecSourceCount, 0, data + 2, len - 3);
+        break;
+      }
+      //a duplicate, a gap and the last packet need an ACK at once
+      if (transferReceive(&receiver, data - 1, len, writeReceivedPacket, NULL))
+        queueAck();
+      //the rest of an invalid module is not needed (see writeModuleData())
+      if (receiveActive && moduleValidator.error && !transferReceiverDone(&receiver))
+      {
+        transferReceiverSkip(&receiver);
+        queueAck();
+      }
+
+      if (receiveActive && transferReceiverDone(&receiver))
+      {
+        receiveActive = false;
+        size_t size = stagingFinish();
+        DLOG_INFO("done wasm file transfer: %u bytes", (uint32_t) size);
+        commitReception();
+      }
+      break;
+    }
+    case 0x03:
+      handleAck(source, data - 1, len);
+      break;
+    case 0x04:
+      if (numberOfBlocks && len > 4)
+        handleBroadcastPacket(data[0] << 8 | data[1], -1, data[2], data + 3, len - 4);
+      break;
+    case 0x05:
+      if (len >= 5)
+        DLOG_INFO("Wasm result of node %x module %u: %d", source, len >= 6 ? data[4] : 0,
+                  (int32_t) (data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]));
+      break;
+    case 0x09:
+      //a neighbor pulls the module (see disseminateVersion())
+      if (len >= 2 && data[0] == moduleVersion && moduleHash && !transmitActive && !transmitRequested)
+      {
+        DLOG_INFO("Module pulled by node %x", source);
+        transmitDestination = source;
+        transmitRequested = true;
+      }
+      break;
+    case 0x0A:
+      //message of a wasm module (see meshSendHook()): samples for the module distributed over the mesh, which runs on them at once
+      DLOG_DEBUG("Message of node %x: %d bytes", source, len - 1);
+      queueModuleInput(&wasmModules[0], data, len - 1);
+      break;
+  } 
+} 
+
+/**
+ * @fn 
+ * ESP-Now: Callback when data is alived
+ * Beacons and mesh frames go to the mesh layer, which returns the payload of a frame to this node.
+ * @param mac const uint8_t *
+ * @param data const uint8_t *
+ * @param len int
+ */
+void OnDataRecv(const uint8_t * mac, const uint8_t *data, int len) {
+  /*memcpy(&incomingReadings, data, sizeof(incomingReadings));
+  Serial.print("Bytes received: ");
+  Serial.println(len);
+  Serial.println("Temp:");
+  Serial.println(incomingReadings.temp);*/
+
+  if (len < 1)
+    return;
+  //loop() sends what the packet asks for (ACKs, forwarded frames, transmissions) at once
+  if (data[0] == 0x08)
+    handleSummary(mac, data, len);
+  else if (data[0] == MESH_FRAME_FLAG || data[0] == MESH_BEACON_FLAG)
+  {
+    uint16_t source;
+    const uint8_t *payload;
+    portENTER_CRITICAL(&meshMux);
+    size_t payloadLength = meshReceive(&mesh, mac, data, len, millis(), &source, &payload);
+    portEXIT_CRITICAL(&meshMux);
+    if (payloadLength)
+      handlePacket(source, payload, payloadLength);
+  }
+  else
+    handlePacket(meshNodeId(mac), data, len);
+  eventPost(EVENT_RECEIVE);
+}
+
+
+/**
+ * @fn
+ * send and check the sending statement
+ * @param dataArray uint8_t *, payload
+ * @param dataArrayLength uint8_t, payload length 
+ * @param peerAddress const uint8_t *, MAC address of the receiver
+*/
+
+esp_err_t sendData(uint8_t * dataArray, uint8_t dataArrayLength, const uint8_t * peerAddress = broadcastAddress) {
+  //Serial.print("Sending: "); Serial.println(data);
+  //Serial.print("length: "); Serial.println(dataArrayLength);
+
+  //queued before the send, the report may come at once from the WiFi task
+  portENTER_CRITICAL(&sendTimeMux);
+  bool timed = sendTimeCount < SEND_TIME_QUEUE_SIZE;
+  if (timed)
+    sendTimes[(sendTimeHead + sendTimeCount++) % SEND_TIME_QUEUE_SIZE] = micros();
+  portEXIT_CRITICAL(&sendTimeMux);
+  esp_err_t result = esp_now_send(peerAddress, dataArray, dataArrayLength);
+  if (result != ESP_OK) {
+    //no report follows, the send time is the last one of the queue
+    portENTER_CRITICAL(&sendTimeMux);
+    if (timed && sendTimeCount)
+      sendTimeCount--;
+    portEXIT_CRITICAL(&sendTimeMux);
+    metricCount(&espnowRefused);
+  }
+  if (result != ESP_OK)
+    DLOG_WARN("esp_now_send: %s", esp_err_to_name(result));
+  return result;
+}
+
+
+/**
+ * @fn
+ * Register a mesh neighbor as ESP-NOW peer. The oldest peer of the mesh is removed if MESH_MAX_NEIGHBORS peers are registered.
+ * @param mac const uint8_t *
+ * @return true if the peer is registered
+ */
+bool addMeshPeer(const uint8_t *mac)
+{
+  if (esp_now_is_peer_exist(mac))
+    return true;
+  if (numberOfMeshPeers == MESH_MAX_NEIGHBORS)
+  {
+    esp_now_del_peer(meshPeers[0]);
+    memmove(meshPeers[0], meshPeers[1], (MESH_MAX_NEIGHBORS - 1) * ESP_NOW_ETH_ALEN);
+    numberOfMeshPeers--;
+  }
+  if (!addPeer(mac))
+    return false;
+  memcpy(meshPeers[numberOfMeshPeers++], mac, ESP_NOW_ETH_ALEN);
+  return true;
+}
+
+/**
+ * @fn
+ * Send a packet to a node in a mesh frame (see mesh.h)
+ * @param node uint16_t, mesh node ID or MESH_GATEWAY_ID
+ * @param data const uint8_t *
+ * @param len uint8_t, at most MESH_MAX_PAYLOAD_SIZE
+ * @return ESP_ERR_ESPNOW_NOT_FOUND if there is no route to the node
+ */
+esp_err_t sendMesh(uint16_t node, const uint8_t *data, uint8_t len)
+{
+  uint8_t frame[MESH_MAX_FRAME_SIZE];
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  portENTER_CRITICAL(&meshMux);
+  size_t frameLength = meshBuildFrame(&mesh, node, data, len, frame, mac);
+  portEXIT_CRITICAL(&meshMux);
+  if (!frameLength)
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+  if (!addMeshPeer(mac))
+    return ESP_ERR_ESPNOW_NO_MEM;
+  return sendData(frame, frameLength, mac);
+}
+
+/**
+ * @fn
+ * Send the beacons, announces and forwarded frames of the mesh. Called in loop().
+ */
+void meshFlush()
+{
+  uint8_t frame[MESH_MAX_FRAME_SIZE];
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  size_t frameLength;
+  while (true)
+  {
+    portENTER_CRITICAL(&meshMux);
+    bool pending = meshPoll(&mesh, millis(), mac, frame, &frameLength);
+    portEXIT_CRITICAL(&meshMux);
+    if (!pending)
+      return;
+
+    if (!memcmp(mac, everyNodeAddress, ESP_NOW_ETH_ALEN))
+    {
+      //the send report of a beacon is counted like a broadcast packet (see OnDataSent())
+      portENTER_CRITICAL(&transmitMux);
+      broadcastPacketsInFlight++;
+      portEXIT_CRITICAL(&transmitMux);
+      if (sendData(frame, frameLength, everyNodeAddress) != ESP_OK)
+      {
+        portENTER_CRITICAL(&transmitMux);
+        broadcastPacketsInFlight--;
+        portEXIT_CRITICAL(&transmitMux);
+      }
+    }
+    else if (addMeshPeer(mac))
+      sendData(frame, frameLength, mac);
+  }
+}
+
+/**
+ * @fn
+ * Receiver: send the pending ACK. Called in loop(), since esp_now_send() should not be called in the receive callback.
+ */
+void sendAck()
+{
+  if (!ackPending)
+    return;
+
+  uint8_t messageArray[TRANSFER_ACK_SIZE(TRANSMIT_WINDOW_SIZE)];
+  portENTER_CRITICAL(&ackMux);
+  uint8_t messageLength = ackMessageLength;
+  memcpy(messageArray, ackMessage, messageLength);
+  ackPending = false;
+  portEXIT_CRITICAL(&ackMux);
+
+  if (sendMesh(ackNode, messageArray, messageLength) != ESP_OK)
+    ackPending = true;
+}
+
+
+/**
+ * @fn
+ * Send the summary of the own module to every neighbor (one hop, not forwarded).
+ * Message structure (uint8_t *):
+ * | message flag (0x08) | module version | module hash (4 bytes, big endian) |
+ */
+void sendSummary()
+{
+  uint8_t messageArray[SUMMARY_SIZE] = {0x08, moduleVersion, (uint8_t) (moduleHash >> 24), (uint8_t) (moduleHash >> 16),
+                                        (uint8_t) (moduleHash >> 8), (uint8_t) moduleHash};
+  //the send report is counted like a broadcast packet (see OnDataSent())
+  portENTER_CRITICAL(&transmitMux);
+  broadcastPacketsInFlight++;
+  portEXIT_CRITICAL(&transmitMux);
+  if (sendData(messageArray, SUMMARY_SIZE, everyNodeAddress) != ESP_OK)
+  {
+    portENTER_CRITICAL(&transmitMux);
+    broadcastPacketsInFlight--;
+    portEXIT_CRITICAL(&transmitMux);
+  }
+}
+
+/**
+ * @fn
+ * Trickle dissemination of the module version. Called in loop().
+ * The summary is sent when the Trickle timer fires. A node with an older module pulls the newer one from a neighbor:
+ * Message structure (uint8_t *):
+ * | message flag (0x09) | module version |
+ * The neighbor answers with a transmission of its module (see startTransmit()).
+ */
+void disseminateVersion()
+{
+  unsigned long now = millis();
+  uint8_t messageArray[2] = {0x09, 0};
+  uint8_t address[ESP_NOW_ETH_ALEN];
+  portENTER_CRITICAL(&trickleMux);
+  bool summaryDue = tricklePoll(&trickle, now);
+  bool pull = pullPending && now - pullHeardMillis >= PULL_DELAY && (int32_t) (now - nextPullMillis) >= 0;
+  if (pull)
+  {
+    pullPending = false;
+    nextPullMillis = now + PULL_RETRY_INTERVAL;
+    messageArray[1] = pullVersion;
+    memcpy(address, pullAddress, ESP_NOW_ETH_ALEN);
+  }
+  portEXIT_CRITICAL(&trickleMux);
+
+  if (summaryDue)
+    sendSummary();
+  if (pull && !receiveActive && !fecReceiveActive && addMeshPeer(address))
+  {
+    DLOG_INFO("Pulling module version %u", messageArray[1]);
+    sendData(messageArray, sizeof(messageArray), address);
+  }
+}
+
+/**
+ * @fn
+ * Choose the file to send: the LZSS compressed module ("/main.lz") if TRANSFER_COMPRESSION is set and it is smaller, otherwise the module.
+ * @param codec uint8_t *, output: codec of the file
+ * @param moduleSize uint32_t *, output: size of the module, for the digest of the header (see integrity.h)
+ * @return path of the file
+*/
+const char *selectTransmitFile(uint8_t *codec, uint32_t *moduleSize)
+{
+  *codec = CODEC_NONE;
+  File file = SPIFFS.open("/main.wasm", "r");
+  *moduleSize = file ? file.size() : 0;
+  file.close();
+#if TRANSFER_COMPRESSION
+  size_t compressedSize = lzssCompressFile("/main.wasm", "/main.lz");
+  if (compressedSize && compressedSize < *moduleSize)
+  {
+    Serial.print("Compressed: ");
+    Serial.println(compressedSize);
+    *codec = CODEC_LZSS;
+    return "/main.lz";
+  }
+#endif
+  return "/main.wasm";
+}
+
+/**
+ * @fn
+ * Choose the rollout mode from the nodes below this node (see meshDescendants()). Cut-through only pays off in deep meshes (see startRelay()):
+ * in tools/relay_sim.cpp it takes up to 30% longer in a chain of 2 to 5 hops, and is faster from 7 hops in a chain and 4 hops in a binary tree.
+ * A mesh with more nodes than hops branches, it gets cut-through from ROLLOUT_CUT_THROUGH_TREE_DEPTH, a chain from ROLLOUT_CUT_THROUGH_CHAIN_DEPTH.
+ * @return ROLLOUT_STORE_AND_FORWARD or ROLLOUT_CUT_THROUGH
+*/
+uint8_t selectRolloutMode()
+{
+  uint8_t depth;
+  portENTER_CRITICAL(&meshMux);
+  int nodes = meshDescendants(&mesh, &depth);
+  portEXIT_CRITICAL(&meshMux);
+  uint8_t minDepth = nodes > depth ? ROLLOUT_CUT_THROUGH_TREE_DEPTH : ROLLOUT_CUT_THROUGH_CHAIN_DEPTH;
+  uint8_t mode = depth >= minDepth ? ROLLOUT_CUT_THROUGH : ROLLOUT_STORE_AND_FORWARD;
+  DLOG_INFO("Rollout to %d nodes, %u hops deep: %s", nodes, depth, mode == ROLLOUT_CUT_THROUGH ? "cut-through" : "store-and-forward");
+  return mode;
+}
+
+
+/**
+ * @fn
+ * Sender: send a packet of a session to its receiver (TransferLink.send)
+ * @param context void *, TransmitSession *
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return false if ESP-NOW does not take the packet now
+ */
+bool sendToSession(void *context, const uint8_t *data, size_t len)
+{
+  TransmitSession *session = (TransmitSession *) context;
+  return sendMesh(session->destination, data, len) == ESP_OK;
+}
+
+void lockTransmit(void *context)
+{
+  portENTER_CRITICAL(&transmitMux);
+}
+
+void unlockTransmit(void *context)
+{
+  portEXIT_CRITICAL(&transmitMux);
+}
+
+/**
+ * @fn
+ * Sender: start a session for every receiver. The receivers take the whole window from the start. Must be called within transmitMux.
+ * @param destinations const uint16_t *, mesh node IDs
+ * @param count int, at most TRANSMIT_MAX_SESSIONS
  */
-void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
-  
-if (numberOfPackets)
+void startSessions(const uint16_t *destinations, int count)
+{
+  memset(transmitSessions, 0, sizeof(transmitSessions));
+  for (int i = 0; i < count; i++)
   {
-    sendNextPacketFlag = 1;
-    // if nto suecess 0 resent the last one
-    if (status != ESP_NOW_SEND_SUCCESS)
-      currentTransmitOffset--;
-  } //end if
+    TransmitSession *session = &transmitSessions[i];
+    session->destination = destinations[i];
+    session->link = {sendToSession, lockTransmit, unlockTransmit, session};
+    transferSenderStart(&session->sender, numberOfTransmitPackets, transmitTransferId, TRANSMIT_WINDOW_SIZE, RETRANSMIT_TIMEOUT, false);
+  }
+  transmitActive = count > 0;
+}
 
-  Serial.println("sendFlag:");
-  Serial.println(sendNextPacketFlag);
-  Serial.println("numberOfPackets:");
-  Serial.println(numberOfPackets);
-  Serial.print("\r\nLast Packet Send Status:\t");
-  Serial.println(status == ESP_NOW_SEND_SUCCESS ? "Delivery Success" : "Delivery Fail");
+/**
+ * @fn
+ * Starting transmission. The first message just imforms the number of packets. (without main data)
+ * Packets are sent by transmitWindow() with a sliding window of TRANSMIT_WINDOW_SIZE packets (selective repeat, see transfer.h).
+ * In a rollout the module goes to the children of this node in the mesh, which relay it to their children (see startRelay()).
+ * Message structure (uint8_t *):
+ * - First message (sequence number 0)
+ * | message flag | second byte of the number of packets | first byte of the number of packets | transfer ID | codec | rollout mode | module version | digest |
+ * The rollout mode is 0 without rollout, ROLLOUT_STORE_AND_FORWARD or ROLLOUT_CUT_THROUGH.
+ * The digest (INTEGRITY_DIGEST_SIZE bytes) lets the receiver verify the module before loading it (see integrity.h).
+ * - Other messages (sequence number = offset, 1..number of packets)
+ * | message flag | second byte of the number of offset | first byte of the offset | payload |
+ * Flag for the first message: 0x01
+ * Otherwise: 0x02
+ * The receiver answers with ACK packets (flag 0x03, see transfer.h).
+ * The payload is the LZSS compressed module if the codec is CODEC_LZSS (see selectTransmitFile()).
+ * @param rollout uint8_t, rollout mode or ROLLOUT_BY_DEPTH, 0: the module goes to transmitDestination only
+*/
+void startTransmit(uint8_t rollout)
+{
+  Serial.println(rollout ? "Starting rollout" : "Starting transmit");
+  uint16_t destinations[TRANSMIT_MAX_SESSIONS] = {transmitDestination};
+  int numberOfDestinations = 1;
+  if (rollout)
+  {
+    portENTER_CRITICAL(&meshMux);
+    numberOfDestinations = meshChildren(&mesh, destinations, TRANSMIT_MAX_SESSIONS);
+    portEXIT_CRITICAL(&meshMux);
+    if (!numberOfDestinations) {
+      Serial.println("No children in the mesh");
+      return;
+    }
+    if (rollout == ROLLOUT_BY_DEPTH)
+      rollout = selectRolloutMode();
+  }
+  uint8_t codec;
+  IntegrityDigest digest;
+  const char *path = selectTransmitFile(&codec, &digest.moduleSize);
+  if (!chunkSourceOpen(&transmitSource, path, MAX_PAYLOAD_SIZE) || !chunkSourceCrc(&transmitSource, &digest.transferCrc)) {
+    Serial.println("Failed to open file in reading mode");
+    return;
+  }
+  Serial.println(transmitSource.size);
+
+  portENTER_CRITICAL(&transmitMux);
+  uint8_t *previousRelayBuffer = relayBuffer;
+  relayBuffer = NULL;
+  relayRequested = false;
+  transmitCodec = codec;
+  numberOfTransmitPackets = transferPacketCount(transmitSource.size, MAX_PAYLOAD_SIZE); //split binary data into the esp-now-max-length (250 Bytes)
+  availableTransmitPackets = numberOfTransmitPackets;
+  transmitTransferId = (transmitTransferId + random(1, 256)) % 256; //a restarted sender must not repeat the ID of the last transfer
+  transmitRollout = rollout;
+  transmitVersion = moduleVersion;
+  digest.moduleHash = moduleHash;
+  transmitDigest = digest;
+  transmitDigestValid = true;
+  startSessions(destinations, numberOfDestinations);
+  portEXIT_CRITICAL(&transmitMux);
+  free(previousRelayBuffer);
+  Serial.println(numberOfTransmitPackets);
 }
 
 /**
- * @fn 
- * ESP-Now: Callback when data is alived
- * @param mac const uint8_t *
- * @param data const uint8_t *
- * @param len int
+ * @fn
+ * Relay a rollout to the children of this node (see prepareRelay()). With cut-through every packet is sent on as soon as it is received
+ * in order, so the hops of a rollout overlap instead of waiting for the whole module at every hop. This pays off in deep meshes only:
+ * the radio of a relay is half duplex and its parent and children may not hear each other, so cut-through is slower in a chain of
+ * 2 to 5 hops and a binary tree of 2 or 3 hops (see tools/relay_sim.cpp and selectRolloutMode()).
+ * The header and the transfer ID are the ones of the received transfer, so a node which got the module from another parent
+ * only acknowledges it.
  */
-void OnDataRecv(const uint8_t * mac, const uint8_t *data, int len) {
-  /*memcpy(&incomingReadings, data, sizeof(incomingReadings));
-  Serial.print("Bytes received: ");
-  Serial.println(len);
-  Serial.println("Temp:");
-  Serial.println(incomingReadings.temp);*/
+void startRelay()
+{
+  uint16_t children[TRANSMIT_MAX_SESSIONS];
+  int numberOfChildren = 0;
+  portENTER_CRITICAL(&meshMux);
+  uint16_t candidates[TRANSMIT_MAX_SESSIONS];
+  int numberOfCandidates = meshChildren(&mesh, candidates, TRANSMIT_MAX_SESSIONS);
+  portEXIT_CRITICAL(&meshMux);
+  for (int i = 0; i < numberOfCandidates; i++)
+  {
+    if (candidates[i] != ackNode)
+      children[numberOfChildren++] = candidates[i];
+  }
 
-  switch (*data++)
+  uint8_t *unusedBuffer = NULL;
+  portENTER_CRITICAL(&transmitMux);
+  if (numberOfChildren)
+    startSessions(children, numberOfChildren);
+  else
   {
-    case 0x01:
-      Serial.println("Start of new file transmit");
-      currentTransmitOffset = 0;
-      numberOfPackets = (*data++) << 8 | *data;
-      Serial.println("currentNumberOfPackets = " + String(numberOfPackets));
-      SPIFFS.remove("/main.wasm");
-      break;
-    case 0x02:
-      currentTransmitOffset = (*data++) << 8 | *data++; 
-      File file = SPIFFS.open("/main.wasm",FILE_APPEND);
-      if (!file)
-        Serial.println("Error opening file ...");
-        
-      for (int i=0; i < (len-3); i++)
-      {
-        //byte dat = *data++;
-        //Serial.println(dat);
-        file.write(*data++);
-      }
-      file.close();
+    unusedBuffer = relayBuffer;
+    relayBuffer = NULL;
+  }
+  portEXIT_CRITICAL(&transmitMux);
+  free(unusedBuffer);
+  DLOG_INFO("Relaying to %d children", numberOfChildren);
+}
 
-      if (currentTransmitOffset == numberOfPackets)
-      {
-        Serial.println("done wasm file transfer");
-        File file = SPIFFS.open("/main.wasm");
-        Serial.println(file.size());
-        file.close();
-      }
-      
-      break;
-  } 
-} 
 
+/**
+ * @fn
+ * Build the packet of a sequence number. TransferBuilder of the sessions, the packets are the same for every receiver (see transfer.h).
+ * @param context void *, unused
+ * @param sequence uint16_t, 0: header packet, otherwise offset of the payload packet
+ * @param messageArray uint8_t *, buffer of at least MAX_PAYLOAD_SIZE + 3 bytes
+ * @return packet length, 0 if the file cannot be read
+*/
+uint16_t buildPacket(void *context, uint16_t sequence, uint8_t * messageArray)
+{
+  if (sequence == 0)
+  {
+    //integer value must be splitted into uint_8 because of esp_now_send(). the bit shift >>8 means that it takes second byte. 
+    transferBuildHeader(numberOfTransmitPackets, messageArray);
+    messageArray[3] = transmitTransferId;
+    messageArray[4] = transmitCodec;
+    messageArray[5] = transmitRollout;
+    messageArray[6] = transmitVersion;
+    if (!transmitDigestValid)
+      return TRANSMIT_HEADER_SIZE;
+    integrityPut(&transmitDigest, messageArray + TRANSMIT_HEADER_SIZE);
+    return TRANSMIT_HEADER_SIZE + INTEGRITY_DIGEST_SIZE;
+  }
+
+  // set array size.
+  int fileDataSize = MAX_PAYLOAD_SIZE; // if its the last package - we adjust the size !!!
+  if (sequence == numberOfTransmitPackets)
+  {
+    fileDataSize = (relayBuffer ? relayLength : transmitSource.size) - ((numberOfTransmitPackets - 1) * MAX_PAYLOAD_SIZE);
+  }
 
+  //a relayed packet is in relayBuffer, since it is sent only after it has been received (availableTransmitPackets)
+  const uint8_t *payload = relayBuffer ? relayBuffer + (sequence - 1) * MAX_PAYLOAD_SIZE
+    : chunkSourceView(&transmitSource, (sequence - 1) * MAX_PAYLOAD_SIZE, fileDataSize);
+  if (!payload) {
+    DLOG_ERROR("Packet %u cannot be read", sequence);
+    return 0;
+  }
+  return transferBuildData(sequence, payload, fileDataSize, messageArray);
+}
 
 
 /**
  * @fn
- * send and check the sending statement
- * @param dataArray uint8_t *, payload
- * @param dataArrayLength uint8_t, payload length 
+ * This function will be called in loop() after calling startTransimit() or startRelay().
+ * It sends all packets which are due (see transferSenderPoll()), the sessions take turns with one packet each.
+ * The windows move forward in handleAck(). New packets are sent only if they are available (see availableTransmitPackets).
+ * A session is done if all packets (header and payload) are acknowledged, or given up after TRANSMIT_MAX_TIMEOUTS retransmissions without ACK.
+ * The transmission is done if every session is done.
 */
+void transmitWindow()
+{
+  while (true)
+  {
+    bool done = true;
+    int sent = 0;
+    for (int s = 0; s < TRANSMIT_MAX_SESSIONS; s++)
+    {
+      TransmitSession *session = &transmitSessions[s];
+      portENTER_CRITICAL(&transmitMux);
+      //a relay cannot go on if the reception of the relayed transfer was replaced by another one
+      bool stalled = relayBuffer && !relayFilling && availableTransmitPackets < numberOfTransmitPackets;
+      bool active = session->sender.active;
+      bool acknowledged = transferSenderDone(&session->sender);
+      bool finished = active && (acknowledged || session->sender.timeouts >= TRANSMIT_MAX_TIMEOUTS || stalled);
+      if (finished)
+        session->sender.active = false;
+      uint16_t available = availableTransmitPackets;
+      portEXIT_CRITICAL(&transmitMux);
+
+      if (finished)
+      {
+        metricCount(&transferPackets, session->sender.packetsSent);
+        metricCount(&transferRetransmissions, session->sender.retransmissions);
+        DLOG_INFO("Node %x %s", session->destination, acknowledged ? "done" : "given up");
+        continue;
+      }
+      if (!active)
+        continue;
+      done = false;
+      //a packet which ESP-NOW does not take now is sent again in the next loop
+      sent += transferSenderPoll(&session->sender, &session->link, buildPacket, NULL, available, millis(), 1);
+    }
 
-void sendData(uint8_t * dataArray, uint8_t dataArrayLength) {
-  //Serial.print("Sending: "); Serial.println(data);
-  //Serial.print("length: "); Serial.println(dataArrayLength);
-
-  esp_err_t result = esp_now_send(broadcastAddress, dataArray, dataArrayLength);
-  //Serial.print("Send Status: ");
-  if (result == ESP_OK) {
-    //Serial.println("Success");
-  } else if (result == ESP_ERR_ESPNOW_NOT_INIT) {
-    // How did we get so far!!
-    Serial.println("ESPNOW not Init.");
-  } else if (result == ESP_ERR_ESPNOW_ARG) {
-    Serial.println("Invalid Argument");
-  } else if (result == ESP_ERR_ESPNOW_INTERNAL) {
-    Serial.println("Internal Error");
-  } else if (result == ESP_ERR_ESPNOW_NO_MEM) {
-    Serial.println("ESP_ERR_ESPNOW_NO_MEM");
-  } else if (result == ESP_ERR_ESPNOW_NOT_FOUND) {
-    Serial.println("Peer not found.");
-  } else {
-    Serial.println("Not sure what happened");
+    if (done)
+    {
+      portENTER_CRITICAL(&transmitMux);
+      transmitActive = false;
+      uint8_t *finishedRelayBuffer = relayBuffer;
+      relayBuffer = NULL;
+      portEXIT_CRITICAL(&transmitMux);
+      free(finishedRelayBuffer);
+      chunkSourceClose(&transmitSource);
+      DLOG_INFO("Done submiting files");
+      return;
+    }
+    if (!sent)
+      return;
   }
 }
 
-
 /**
  * @fn
- * Starting transmission. The first message just imforms the number of packets. (without main data)
+ * Starting broadcast. The module is sent once to every listening node (everyNodeAddress) without ACKs.
+ * The source packets are grouped into blocks of FEC_BLOCK_SIZE packets and each block is followed by FEC_REPAIR_COUNT repair packets (see fec.h),
+ * so a receiver restores a block from any FEC_BLOCK_SIZE of its packets.
  * Message structure (uint8_t *):
- * - First message
- * | message flag | second byte of the number of packets | first byte of the number of packets |
- * - Other messages 
- * | message flag | second byte of the number of offset | first byte of the offset | payload |
- * Flag for the first message: 0x01
- * Otherwise: 0x02
+ * - Header (sent BROADCAST_HEADER_REPEAT times)
+ * | message flag (0x01) | second byte of the number of packets | first byte of the number of packets | transfer ID | FEC block size | FEC repair count | file size (4 bytes, big endian) | codec | module version | digest (see integrity.h) |
+ * - Source packets: same as startTransmit() (flag 0x02)
+ * - Repair packets
+ * | message flag (0x04) | second byte of the block | first byte of the block | repair index | payload |
 */
-void startTransmit()
+void startBroadcast()
 {
-  Serial.println("Starting transmit");
-  File file = SPIFFS.open("/main.wasm", "r");
-  if (!file) {
+  Serial.println("Starting broadcast");
+  uint8_t codec;
+  IntegrityDigest digest;
+  const char *path = selectTransmitFile(&codec, &digest.moduleSize);
+  if (!chunkSourceOpen(&broadcastSource, path, FEC_BLOCK_SIZE * MAX_PAYLOAD_SIZE) || !chunkSourceCrc(&broadcastSource, &digest.transferCrc)) {
     Serial.println("Failed to open file in reading mode");
     return;
   }
-  Serial.println(file.size());
-  double fileSize = file.size();
-  file.close();
-  currentTransmitOffset = 0;
-  numberOfPackets = ceil(fileSize/MAX_PAYLOAD_SIZE); //split binary data into the esp-now-max-length (250 Bytes)
-  Serial.println(numberOfPackets);
-   //integer value must be splitted into uint_8 because of esp_now_send(). the bit shift >>8 means that it takes second byte. 
-  uint8_t message[] = {0x01, numberOfPackets >> 8, (byte) numberOfPackets};
-  sendData(message, sizeof(message));
+  uint32_t fileSize = broadcastSource.size;
+
+  portENTER_CRITICAL(&transmitMux);
+  broadcastCodec = codec;
+  broadcastFileSize = fileSize;
+  digest.moduleHash = moduleHash;
+  broadcastDigest = digest;
+  numberOfBroadcastPackets = (fileSize + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+  broadcastTransferId = (broadcastTransferId + random(1, 256)) % 256;
+  broadcastEmission = 0;
+  loadedBroadcastBlock = -1;
+  broadcastActive = true;
+  portEXIT_CRITICAL(&transmitMux);
+  Serial.println(numberOfBroadcastPackets);
 }
 
 
 /**
  * @fn
- * This function will be called in loop() after calling startTransimit() and start to send the payload.
- * It compares current offset of the sent packet and the total number of packets.
- * If offset < total, then continues transmission using the flag. (The flag will be set to 1 in OnDataSent, i.e., after calling startTransimit())
+ * Point broadcastBlock to the source packets of a FEC block. The last packet of the module is copied zero padded to broadcastLastPacket.
+ * @param block int
+ * @return false if the file cannot be read
 */
-void sendNextPacket()
+bool loadBroadcastBlock(int block)
 {
-  // claer the flag
-  sendNextPacketFlag = 0;
-
-  // if got to AFTER the last package
-  if (currentTransmitOffset == numberOfPackets)
+  if (loadedBroadcastBlock == block)
+    return true;
+
+  uint32_t blockOffset = (uint32_t) block * FEC_BLOCK_SIZE * MAX_PAYLOAD_SIZE;
+  uint32_t blockLength = min((uint32_t) (FEC_BLOCK_SIZE * MAX_PAYLOAD_SIZE), broadcastFileSize - blockOffset);
+  const uint8_t *data = chunkSourceView(&broadcastSource, blockOffset, blockLength);
+  if (!data) {
+    DLOG_ERROR("Failed to read file");
+    return false;
+  }
+  for (int i = 0; i < FEC_BLOCK_SIZE; i++)
+    broadcastBlock[i] = data + i * MAX_PAYLOAD_SIZE;
+  if (blockLength % MAX_PAYLOAD_SIZE)
   {
-    currentTransmitOffset = 0;
-    numberOfPackets = 0;
-    Serial.println("Done submiting files");
-    //takeNextPhotoFlag = 1;
-    return;
-  } //end if
+    int last = blockLength / MAX_PAYLOAD_SIZE;
+    memset(broadcastLastPacket, 0, MAX_PAYLOAD_SIZE);
+    memcpy(broadcastLastPacket, broadcastBlock[last], blockLength % MAX_PAYLOAD_SIZE);
+    broadcastBlock[last] = broadcastLastPacket;
+  }
+  loadedBroadcastBlock = block;
+  return true;
+}
 
-  //first read the data.
-  File file = SPIFFS.open("/main.wasm", "r");
-  if (!file) {
-    Serial.println("Failed to open file in writing mode");
-    return;
+
+/**
+ * @fn
+ * Build the broadcast packet of an emission index (see startBroadcast()).
+ * @param emission uint32_t
+ * @param messageArray uint8_t *, buffer of at least MAX_PAYLOAD_SIZE + 4 bytes
+ * @return packet length, 0 if there is no packet at this index (unused source positions of the last block)
+*/
+uint8_t buildBroadcastPacket(uint32_t emission, uint8_t * messageArray)
+{
+  if (emission < BROADCAST_HEADER_REPEAT)
+  {
+    messageArray[0] = 0x01;
+    messageArray[1] = numberOfBroadcastPackets >> 8;
+    messageArray[2] = (byte) numberOfBroadcastPackets;
+    messageArray[3] = broadcastTransferId;
+    messageArray[4] = FEC_BLOCK_SIZE;
+    messageArray[5] = FEC_REPAIR_COUNT;
+    messageArray[6] = broadcastFileSize >> 24;
+    messageArray[7] = broadcastFileSize >> 16;
+    messageArray[8] = broadcastFileSize >> 8;
+    messageArray[9] = (byte) broadcastFileSize;
+    messageArray[10] = broadcastCodec;
+    messageArray[11] = moduleVersion;
+    integrityPut(&broadcastDigest, messageArray + 12);
+    return BROADCAST_HEADER_SIZE;
   }
 
-  // set array size.
-  int fileDataSize = MAX_PAYLOAD_SIZE; // if its the last package - we adjust the size !!!
-  if (currentTransmitOffset == numberOfPackets - 1)
+  uint32_t packet = emission - BROADCAST_HEADER_REPEAT;
+  int block = packet / (FEC_BLOCK_SIZE + FEC_REPAIR_COUNT);
+  int index = packet % (FEC_BLOCK_SIZE + FEC_REPAIR_COUNT);
+  int blockSourceCount = min(FEC_BLOCK_SIZE, numberOfBroadcastPackets - block * FEC_BLOCK_SIZE);
+  if (!loadBroadcastBlock(block))
+    return 0;
+
+  if (index < FEC_BLOCK_SIZE)
   {
-    Serial.println("*************************");
-    Serial.println(file.size());
-    Serial.println(numberOfPackets - 1);
-    Serial.println((numberOfPackets - 1)*MAX_PAYLOAD_SIZE);
-    fileDataSize = file.size() - ((numberOfPackets - 1) * MAX_PAYLOAD_SIZE);
+    if (index >= blockSourceCount)
+      return 0;
+    uint16_t sequence = block * FEC_BLOCK_SIZE + index + 1;
+    uint32_t fileDataSize = min((uint32_t) MAX_PAYLOAD_SIZE, broadcastFileSize - (sequence - 1) * MAX_PAYLOAD_SIZE);
+    messageArray[0] = 0x02;
+    messageArray[1] = sequence >> 8;
+    messageArray[2] = (byte) sequence;
+    memcpy(messageArray + 3, broadcastBlock[index], fileDataSize);
+    return fileDataSize + 3;
   }
 
-  // define message array
-  uint8_t messageArray[fileDataSize + 3];
-  messageArray[0] = 0x02;
+  messageArray[0] = 0x04;
+  messageArray[1] = block >> 8;
+  messageArray[2] = (byte) block;
+  messageArray[3] = index - FEC_BLOCK_SIZE;
+  fecEncode(broadcastBlock, blockSourceCount, index - FEC_BLOCK_SIZE, MAX_PAYLOAD_SIZE, messageArray + 4);
+  return MAX_PAYLOAD_SIZE + 4;
+}
+
 
-  //offset
-  file.seek(currentTransmitOffset * MAX_PAYLOAD_SIZE);
-  currentTransmitOffset++;
+/**
+ * @fn
+ * This function will be called in loop() after calling startBroadcast().
+ * It sends packets in emission order as long as less than TRANSMIT_WINDOW_SIZE packets wait for their OnDataSent report.
+*/
+void broadcastWindow()
+{
+  uint8_t messageArray[MAX_PAYLOAD_SIZE + 4];
+  uint32_t numberOfEmissions = BROADCAST_HEADER_REPEAT
+    + (uint32_t) ((numberOfBroadcastPackets + FEC_BLOCK_SIZE - 1) / FEC_BLOCK_SIZE) * (FEC_BLOCK_SIZE + FEC_REPAIR_COUNT);
 
-  messageArray[1] = currentTransmitOffset >> 8;
-  messageArray[2] = (byte) currentTransmitOffset;
-  for (int i = 0; i < fileDataSize; i++)
+  while (broadcastPacketsInFlight < TRANSMIT_WINDOW_SIZE)
   {
-    if (file.available())
-    {
-      messageArray[3 + i] = file.read();
-    } //end if available
-    else
+    if (broadcastEmission >= numberOfEmissions)
     {
-      Serial.println("END !!!");
-      break;
+      broadcastActive = false;
+      chunkSourceClose(&broadcastSource);
+      DLOG_INFO("Done broadcasting files");
+      return;
     }
-  } //end for
 
-  sendData(messageArray, sizeof(messageArray));
-  file.close();
+    uint8_t messageLength = buildBroadcastPacket(broadcastEmission, messageArray);
+    if (!messageLength)
+    {
+      broadcastEmission++;
+      continue;
+    }
 
+    portENTER_CRITICAL(&transmitMux);
+    broadcastPacketsInFlight++;
+    portEXIT_CRITICAL(&transmitMux);
+    if (sendData(messageArray, messageLength, everyNodeAddress) != ESP_OK)
+    {
+      //try again in the next loop
+      portENTER_CRITICAL(&transmitMux);
+      broadcastPacketsInFlight--;
+      portEXIT_CRITICAL(&transmitMux);
+      return;
+    }
+    broadcastEmission++;
+  }
 }
 
 /**
  * @fn 
  * Browser Editer: Handle uploaded data
+ * The module is sent to the peer (startTransmit()), or to every node if the upload URL has the parameter "broadcast" (startBroadcast()).
+ * The parameter "node" (hex mesh node ID, the last two bytes of the MAC address) chooses another receiver, which may be several hops away.
+ * With the parameter "rollout" the module goes to every node of the mesh: each node relays it to its children. "rollout=cut" relays
+ * while receiving (cut-through), "rollout=store" after receiving (store-and-forward), without value ROLLOUT_MODE applies
+ * (by default chosen from the depth of the mesh, see selectRolloutMode()).
+ * The transmission is started in loop(), which also reads the file during the transmission.
+ * An uploaded main.wasm is validated while it is written to UPLOADED_MODULE_PATH and replaces "/main.wasm" only if it is valid,
+ * an invalid module (see wasm_validate.h) is answered with 400 and not sent. Other files are stored as they are.
  * @param request AsyncWebServerRequest *
  * @param filename String
  * @param index size_t
@@ -343,123 +1676,507 @@ void sendNextPacket()
  * @param final bool
  */
 void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+    bool module = filename == "main.wasm";
     if (!index) {
         Serial.println((String)"UploadStart: " + filename);
+        if (module) {
+          uploadHash = INTEGRITY_HASH_SEED;
+          wasmValidateBegin(&uploadValidator, &moduleValidation);
+        }
         // open the file on first call and store the file handle in the request object
-        request->_tempFile = SPIFFS.open("/" + filename, "w");
+        request->_tempFile = SPIFFS.open(module ? UPLOADED_MODULE_PATH : "/" + filename, "w");
     }
     if (len) {
         // stream the incoming chunk to the opened file
         request->_tempFile.write(data, len);
+        if (module) {
+          uploadHash = integrityHash(uploadHash, data, len);
+          wasmValidateFeed(&uploadValidator, data, len);
+        }
     }
     if (final) {
         Serial.println((String)"UploadEnd: " + filename + "," + index+len);
         // close the file handle as the upload is now done
         request->_tempFile.close();
+        if (!module) {
+          request->send(200, "text/plain", "File Uploaded !");
+          return;
+        }
+        const char *error = wasmValidateFinish(&uploadValidator);
+        if (error) {
+          DLOG_WARN("Invalid module: %s", error);
+          SPIFFS.remove(UPLOADED_MODULE_PATH);
+          request->send(400, "text/plain", (String)"Invalid module: " + error);
+          return;
+        }
+        SPIFFS.remove("/main.wasm");
+        SPIFFS.rename(UPLOADED_MODULE_PATH, "/main.wasm");
         request->send(200, "text/plain", "File Uploaded !");
+        moduleUploaded = true;
         Serial.println((String)"Start broadcast via ESP-NOW");
-        startTransmit();
+        if (request->hasParam("broadcast"))
+          broadcastRequested = true;
+        else if (request->hasParam("rollout"))
+        {
+          String mode = request->getParam("rollout")->value();
+          rolloutRequested = mode == "cut" ? ROLLOUT_CUT_THROUGH : mode == "store" ? ROLLOUT_STORE_AND_FORWARD : ROLLOUT_MODE;
+        }
+        else
+        {
+          transmitDestination = request->hasParam("node") ? strtol(request->getParam("node")->value().c_str(), NULL, 16) : meshNodeId(broadcastAddress);
+          transmitRequested = true;
+        }
+        eventPost(EVENT_UPLOAD);
+    }
+}
+
+/**
+ * @fn
+ * Print the call statistics of a module (see wasm_budget.h)
+ * @param budget const WasmBudget *
+ */
+void printBudget(const WasmBudget *budget){
+  if (!budget->calls)
+    return;
+  DLOG_INFO("Calls: %u, last %u us, mean %u us, max. %u us, budget exceeded %u (fuel) %u (time)", budget->calls, budget->lastTime,
+            (uint32_t) (budget->totalTime / budget->calls), budget->maxTime, budget->fuelTraps, budget->timeTraps);
+}
+
+/**
+ * @fn
+ * End a call of a module (see wasmBudgetEnd()) and record its latency
+ * @param wasm WasmModule *
+ * @param result M3Result, of the call
+ * @return result
+ */
+static M3Result endCall(WasmModule *wasm, M3Result result)
+{
+  int index = wasm - wasmModules;
+  wasmBudgetEnd(&wasm->budget, result);
+  metricRecord(&wasmCallTime[index], wasm->budget.lastTime);
+  if (wasmBudgetExceeded(result))
+    metricCount(&wasmBudgetTraps[index]);
+  return result;
+}
+
+/**
+ * @fn
+ * Run calcWasm() of a module on a block of samples. A module with calcBatch() is entered once per CALC_BATCH_BUFFER_SIZE bytes of samples,
+ * otherwise once per sample (see wasm_call.h). Each call has the budget of the module, a call which exceeds it traps (see wasm_budget.h).
+ * @param wasm WasmModule *
+ * @param inputs const uint8_t [][CALC_INPUT]
+ * @param results int32_t *, output
+ * @param count int
+ * @return number of processed samples, less than count if a call failed
+ */
+static int calcSamples(WasmModule *wasm, const uint8_t inputs[][CALC_INPUT], int32_t *results, int count)
+{
+  int done = 0;
+  while (done < count)
+  {
+    M3Result result;
+    if (wasm->batch.function)
+    {
+      uint32_t blockCount = min((uint32_t) (count - done), wasmBatchCapacity(&wasm->batch, CALC_INPUT, CALC_RESULT_SIZE));
+      uint32_t processed = 0;
+      wasmBudgetBegin(&wasm->budget);
+      result = endCall(wasm, wasmBatchCall(&wasm->batch, inputs[done], CALC_INPUT, results + done, CALC_RESULT_SIZE, blockCount, &processed));
+      done += processed;
+      if (!result && processed == blockCount)
+        continue;
+    }
+    else
+    {
+      WasmArgs args;
+      wasmArgsInit(&args);
+      for (int i = 0; i < CALC_INPUT; i++)
+        wasmArgsAdd(&args, (uint32_t) inputs[done][i]);
+      wasmBudgetBegin(&wasm->budget);
+      result = endCall(wasm, wasmCallArgs(wasm->calcWasm, &args));
+      if (!result)
+        result = m3_GetResultsV(wasm->calcWasm, &results[done]);
+      if (!result)
+      {
+        done++;
+        continue;
+      }
     }
+    DLOG_ERROR("Fatal: calcWasm %s", result ? result : "incomplete batch");
+    if (wasmBudgetExceeded(result))
+      printBudget(&wasm->budget);
+    break;
+  }
+  return done;
 }
 
 /**
  * @fn 
- * WASM setup using wasm3
+ * Call WASM task. One run of the task of a module (WasmTaskFunction, see wasm_scheduler.h), every WASM_TASK_INTERVAL ms
+ * and at once when samples have arrived (see queueModuleInput()). Without samples, the module runs on a test sample.
+ * @param context void *, WasmModule *
  */
+void wasm_task(void *context){
+  WasmModule *wasm = (WasmModule *) context;
+  uint8_t inputs[MESH_MAX_PAYLOAD_SIZE / CALC_INPUT][CALC_INPUT] = {{0x01, 0x02}};
+  int32_t results[MESH_MAX_PAYLOAD_SIZE / CALC_INPUT];
+  portENTER_CRITICAL(&wasmInputMux);
+  int count = wasm->inputLength / CALC_INPUT;
+  memcpy(inputs, wasm->input, count * CALC_INPUT);
+  wasm->inputLength = 0;
+  portEXIT_CRITICAL(&wasmInputMux);
+  if (!count)
+    count = 1;
+
+  if (calcSamples(wasm, inputs, results, count) == count)
+  {
+    wasm->result = results[count - 1];
+    wasm->resultReady = true;
+    eventPost(EVENT_MODULE);
+  }
+}
 
-static void run_wasm(void*)
+/**
+ * @fn 
+ * WASM setup using wasm3: load the file of a module into a new runtime next to the running one, then switch to it (A/B slots, see wasm_partition.h).
+ * The switch waits for the running call of wasm_task() to end. The running module stays active if the new one fails.
+ * The task of the module is started with its first load.
+ * @param index int, module (see wasmModuleConfigs)
+ * @param path const char *, file of the module, NULL: the file of its config (a received module is loaded from STAGED_MODULE_PATH)
+ * @param hash uint32_t, FNV-1a of the module file if it is known (a verified reception, see integrity.h), 0: the file is hashed here
+ * @param fuelInfo const WasmFuelInfo *, scan of the module file if it is known (a validated reception, see wasm_validate.h), NULL: the file is scanned at its install
+ * @return false if the new module cannot be loaded
+ */
+static bool load_wasm(int index, const char *path, uint32_t hash, const WasmFuelInfo *fuelInfo)
 {
-  // load wasm from SPIFFS
-  /* If default CONFIG_ARDUINO_LOOP_STACK_SIZE 8192 < wasmFile,
-  a new size must be given in  \Users\<user>\.platformio\packages\framework-arduinoespressif32\tools\sdk\include\config\sdkconfig.h
-  https://community.platformio.org/t/esp32-stack-configuration-reloaded/20994/2
-  */
-  File wasmFile = SPIFFS.open("/main.wasm", "r");
-  unsigned int build_main_wasm_len = wasmFile.size();
+  WasmModule *wasm = &wasmModules[index];
+  const WasmModuleConfig *config = &wasmModuleConfigs[index];
+  if (!path)
+    path = config->path;
+  uint32_t busySlots = 0;
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    busySlots |= WASM_PARTITION_SLOT_MASK(wasmModules[i].slot);
+
+  // the module is executed from the memory-mapped flash, so it is not copied into RAM
+  unsigned long start = micros();
+  int slot = wasmPartitionInstall(path, busySlots, fuelInfo);
+  if (slot >= 0)
+    metricRecord(&wasmInstallTime, micros() - start);
+  size_t build_main_wasm_len = 0;
+  const uint8_t *build_main_wasm = slot < 0 ? NULL : wasmPartitionMap(slot, &build_main_wasm_len);
+  if (!build_main_wasm) {
+    Serial.println("Fatal: wasmPartitionMap failed");
+    return false;
+  }
   Serial.println("wasm_length:");
   Serial.println(build_main_wasm_len);
-  // read file
-  unsigned char build_main_wasm[build_main_wasm_len];
-  wasmFile.readBytes((char *) build_main_wasm, build_main_wasm_len);
-
-  Serial.println("Loading WebAssembly was successful");
+  if (!hash)
+    hash = hashModuleFile(path);
+
+  start = micros();
+  IM3Environment newEnv = m3_NewEnvironment ();
+  IM3Runtime newRuntime = newEnv ? m3_NewRuntime (newEnv, config->stackSize, NULL) : NULL;
+  if (!newRuntime) {
+    Serial.println("Fatal: m3_NewRuntime failed");
+    if (newEnv) m3_FreeEnvironment(newEnv);
+    wasmPartitionUnmap(slot);
+    return false;
+  }
 
-  M3Result result = m3Err_none;
+  #ifdef WASM_MEMORY_LIMIT
+    newRuntime->memoryLimit = WASM_MEMORY_LIMIT;
+  #endif
 
-  //it warks also without using variable
-  //uint8_t* wasm = (uint8_t*)build_app_wasm;
+  IM3Module newModule;
+  IM3Function newCalcWasm;
+  const char *step = "m3_ParseModule";
+  M3Result result = m3_ParseModule (newEnv, &newModule, build_main_wasm, build_main_wasm_len);
+  if (!result) {
+    step = "m3_LoadModule";
+    result = m3_LoadModule (newRuntime, newModule);
+    if (result) m3_FreeModule(newModule);
+  }
 
-  env = m3_NewEnvironment ();
-  if (!env) FATAL("NewEnvironment", "failed");
+  // link the host functions the module imports (see wasm_imports.h)
+  if (!result) {
+    step = "wasmLinkImports";
+    result = wasmLinkImports(newModule);
+  }
 
-  runtime = m3_NewRuntime (env, WASM_STACK_SLOTS, NULL);
-  if (!runtime) FATAL("m3_NewRuntime", "failed");
+  // the budget of the calls, the module is metered (see wasm_fuel.h)
+  if (!result) {
+    step = "wasmBudgetLink";
+    result = wasmBudgetLink(newModule, &wasm->budget);
+  }
 
-  #ifdef WASM_MEMORY_LIMIT
-    runtime->memoryLimit = WASM_MEMORY_LIMIT;
-  #endif
+  if (!result) {
+    step = "m3_FindFunction(calcWasm)";
+    result = m3_FindFunction (&newCalcWasm, newRuntime, "calcWasm");
+  }
+  if (result) {
+    Serial.print("Fatal: ");
+    Serial.print(step);
+    Serial.print(" ");
+    Serial.println(result);
+    m3_FreeRuntime(newRuntime);
+    m3_FreeEnvironment(newEnv);
+    wasmPartitionUnmap(slot);
+    return false;
+  }
+  metricRecord(&wasmLoadTime, micros() - start);
+
+  // switch to the new module between two runs of the task, then release the previous one.
+  // Both modules charge the same budget, so the new one is called first under the lock.
+  bool taskRunning = wasm->task.platform != NULL;
+  if (taskRunning) wasmTaskLock(&wasm->task);
+  wasmBudgetInit(&wasm->budget, &config->budget);
+  // modules without calcBatch() are called once per sample
+  WasmBatch newBatch;
+  wasmBudgetBegin(&wasm->budget);
+  M3Result batchResult = wasmBudgetEnd(&wasm->budget, wasmBatchInit(&newBatch, newRuntime, CALC_BATCH_BUFFER_SIZE));
+  IM3Environment previousEnv = wasm->env;
+  IM3Runtime previousRuntime = wasm->runtime;
+  int previousSlot = wasm->slot;
+  wasm->env = newEnv;
+  wasm->runtime = newRuntime;
+  wasm->module = newModule;
+  wasm->calcWasm = newCalcWasm;
+  wasm->batch = newBatch;
+  wasm->slot = slot;
+  wasm->hash = hash;
+  if (taskRunning) wasmTaskUnlock(&wasm->task);
+  if (previousRuntime) m3_FreeRuntime(previousRuntime);
+  if (previousEnv) m3_FreeEnvironment(previousEnv);
+  wasmPartitionUnmap(previousSlot);
+  Serial.print("Batch calls: ");
+  Serial.println(batchResult ? batchResult : "yes");
+
+  if (!taskRunning && !wasmTaskStart(&wasm->task, &config->task, wasm_task, wasm))
+    Serial.println("Fatal: wasmTaskStart failed");
+  DLOG_INFO("Running WebAssembly %s on core %d...", config->path, (int) config->task.core);
+  return true;
+}
 
-   result = m3_ParseModule (env, &module, build_main_wasm, build_main_wasm_len);
-   if (result) FATAL("m3_ParseModule", result);
+/**
+ * @fn
+ * Send the result of wasm_task() to the gateway of the mesh.
+ * Message structure (uint8_t *):
+ * | message flag (0x05) | result (4 bytes, big endian) | module |
+ * @param index int, module (see wasmModuleConfigs)
+ */
+void sendResult(int index){
+  if (MESH_GATEWAY)
+    return;
+  int32_t wasmResult = wasmModules[index].result;
+  uint8_t messageArray[] = {0x05, (uint8_t) (wasmResult >> 24), (uint8_t) (wasmResult >> 16), (uint8_t) (wasmResult >> 8), (uint8_t) wasmResult, (uint8_t) index};
+  sendMesh(MESH_GATEWAY_ID, messageArray, sizeof(messageArray));
+}
 
-   result = m3_LoadModule (runtime, module);
-   if (result) FATAL("m3_LoadModule", result);
+/**
+ * @fn
+ * Queue a message of a wasm module for a node of the mesh (import meshSend, see wasm_imports.h). Called by the module tasks,
+ * the message is sent in loop() (see sendMeshMessages()).
+ * Message structure (uint8_t *):
+ * | message flag (0x0A) | data (at most MESH_MAX_PAYLOAD_SIZE - 1 bytes) |
+ * @return false if the message is too long or the queue is full
+ */
+bool meshSendHook(uint16_t node, const uint8_t *data, size_t len){
+  if (len > MESH_MAX_PAYLOAD_SIZE - 1)
+    return false;
+  bool queued = false;
+  portENTER_CRITICAL(&meshMessageMux);
+  if (meshMessageCount < MESH_MESSAGE_QUEUE_SIZE)
+  {
+    MeshMessage *message = &meshMessages[(meshMessageHead + meshMessageCount) % MESH_MESSAGE_QUEUE_SIZE];
+    message->node = node;
+    message->len = len + 1;
+    message->data[0] = 0x0A;
+    memcpy(message->data + 1, data, len);
+    meshMessageCount++;
+    queued = true;
+  }
+  portEXIT_CRITICAL(&meshMessageMux);
+  if (queued)
+    eventPost(EVENT_MODULE);
+  return queued;
+}
 
-   // link
-   //result = LinkArduino (runtime);
-   //if (result) FATAL("LinkArduino", result);
+/**
+ * @fn
+ * Send the messages queued by meshSendHook(). Called in loop().
+ */
+void sendMeshMessages(){
+  MeshMessage message;
+  while (true)
+  {
+    portENTER_CRITICAL(&meshMessageMux);
+    bool pending = meshMessageCount > 0;
+    if (pending)
+    {
+      message = meshMessages[meshMessageHead];
+      meshMessageHead = (meshMessageHead + 1) % MESH_MESSAGE_QUEUE_SIZE;
+      meshMessageCount--;
+    }
+    portEXIT_CRITICAL(&meshMessageMux);
+    if (!pending)
+      return;
+    if (sendMesh(message.node, message.data, message.len) != ESP_OK)
+      DLOG_WARN("No route for the message to node %x", message.node);
+  }
+}
 
+/**
+ * @fn
+ * Read an ADC pin for a wasm module (import sensorRead, see wasm_imports.h)
+ * @return -1 if the pin has no ADC channel
+ */
+int32_t sensorReadHook(int32_t channel){
+  if (channel < 0 || digitalPinToAnalogChannel(channel) < 0)
+    return -1;
+  return analogRead(channel);
+}
 
-   result = m3_FindFunction (&calcWasm, runtime, "calcWasm");
-   if (result) FATAL("m3_FindFunction(calcWasm)", result);
+/**
+ * @fn
+ * DlogWriter (see dlog.h) of the drain task
+ */
+void writeLog(void *context, const uint8_t *data, size_t len){
+  Serial.write(data, len);
+}
 
-   Serial.println("Running WebAssembly...");
+/**
+ * @fn
+ * Register the metrics (see metrics.h). Metrics of the same name one after the other.
+ */
+void setupMetrics(){
+  mainTaskHandle = xTaskGetCurrentTaskHandle();
+  metricsAdd(&wasmInstallTime);
+  metricsAdd(&wasmLoadTime);
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    metricsAdd(&wasmCallTime[i]);
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    metricsAdd(&wasmBudgetTraps[i]);
+  metricsAdd(&espnowSendTime);
+  metricsAdd(&espnowReportSuccess);
+  metricsAdd(&espnowReportFail);
+  metricsAdd(&espnowRefused);
+  metricsAdd(&transferAckTime);
+  metricsAdd(&transferPackets);
+  metricsAdd(&transferRetransmissions);
+  metricsAdd(&transferRejected);
+  metricsAdd(&stagingWriteTime);
+  metricsAdd(&heapFree);
+  metricsAdd(&heapMinFree);
+  for (int i = 0; i < 1 + WASM_MAX_MODULES; i++)
+    metricsAdd(&stackFree[i]);
+}
 
+/**
+ * @fn
+ * Update the gauges of the heap and of the stacks before the metrics are read
+ */
+void updateSystemMetrics(){
+  metricSet(&heapFree, ESP.getFreeHeap());
+  metricSet(&heapMinFree, ESP.getMinFreeHeap());
+  metricSet(&stackFree[0], uxTaskGetStackHighWaterMark(mainTaskHandle));
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    metricSet(&stackFree[1 + i], wasmTaskStackFree(&wasmModules[i].task));
 }
 
-  /**
- * @fn 
- * Call WASM task
+/**
+ * @fn
+ * MetricsWriter (see metrics.h) of the /metrics route
+ * @param context void *, AsyncResponseStream *
  */
+void writeMetricsResponse(void *context, const char *data, size_t len){
+  ((AsyncResponseStream *) context)->write((const uint8_t *) data, len);
+}
 
-  void wasm_task(){
-    const void *i_argptrs[CALC_INPUT];
-    byte inputBytes[CALC_INPUT] = {0x01, 0x02};
-    M3Result result = m3Err_none;
-    
-    for(int i=0; i<CALC_INPUT ;i++){
-      i_argptrs[i] = &inputBytes[i];
-    }
+/**
+ * @fn
+ * Write a binary frame of the metrics to serial every METRICS_SERIAL_INTERVAL ms. Called in loop().
+ * The frames are found between the text output by their sync bytes (see tools/metrics_decode.cpp).
+ */
+void dumpMetrics(){
+  if (!METRICS_SERIAL_INTERVAL || millis() - lastMetricsDump < METRICS_SERIAL_INTERVAL)
+    return;
+  lastMetricsDump = millis();
+  updateSystemMetrics();
+  size_t size = metricsFrameSize();
+  uint8_t *frame = (uint8_t *) malloc(size);
+  if (!frame)
+    return;
+  size_t len = metricsFrame(frame, size, lastMetricsDump);
+  Serial.write(frame, len);
+  free(frame);
+}
 
-    /*
-    m3_Call(function, number_of_arguments, arguments_array)
-    To get return, one have to call a function with m3_Call first, then call m3_GetResultsV(function, adress).
-    (Apparently) m3_Call stores the result in the liner memory, then m3_GetResultsV accesses the address.
-    */
-    result = m3_Call(calcWasm,CALC_INPUT,i_argptrs);                       
-    if(result){
-      FATAL("m3_Call(calcWasm):", result);
-    }
+/**
+ * @fn
+ * Time until the next timer of loop() is due: the mesh, the Trickle timer, a pull, the retransmissions of a transmission and the
+ * dump of the metrics.
+ * Everything else is started by an event (see event_loop.h). A step which could not go on is tried again after LOOP_RETRY_DELAY.
+ * @return ms
+ */
+uint32_t nextLoopTimeout(){
+  unsigned long now = millis();
+  portENTER_CRITICAL(&meshMux);
+  uint32_t timeout = meshNextDue(&mesh, now);
+  portEXIT_CRITICAL(&meshMux);
+
+  portENTER_CRITICAL(&trickleMux);
+  timeout = min(timeout, trickleNextDue(&trickle, now));
+  if (pullPending)
+  {
+    //both must have passed (see disseminateVersion())
+    int32_t heard = (int32_t) (pullHeardMillis + PULL_DELAY - now), retry = (int32_t) (nextPullMillis - now);
+    timeout = min(timeout, (uint32_t) max(max(heard, retry), (int32_t) 0));
+  }
+  portEXIT_CRITICAL(&trickleMux);
 
-    result = m3_GetResultsV(calcWasm, &wasmResult);
-      if(result){
-      FATAL("m3_GetResultsV(calcWasm):", result);
+  if (transmitActive)
+  {
+    for (int s = 0; s < TRANSMIT_MAX_SESSIONS; s++)
+    {
+      portENTER_CRITICAL(&transmitMux);
+      timeout = min(timeout, transferSenderNextTimeout(&transmitSessions[s].sender, availableTransmitPackets, now));
+      portEXIT_CRITICAL(&transmitMux);
     }
-
   }
+  //the send reports of the broadcast packets wake loop(), unless ESP-NOW took none
+  if (ackPending || (broadcastActive && !broadcastPacketsInFlight))
+    timeout = 0;
+  if (METRICS_SERIAL_INTERVAL)
+    timeout = min(timeout, (uint32_t) max((int32_t) (lastMetricsDump + METRICS_SERIAL_INTERVAL - now), (int32_t) 0));
+  return max(timeout, (uint32_t) LOOP_RETRY_DELAY);
+}
 
 void setup(){
 
+  dlogInit();
   Serial.begin(115200);
+  dlogStart(writeLog, NULL, DLOG_BINARY);
+  eventLoopInit();
   Serial.println(WiFi.macAddress());
+  fecInit();
 
   //WiFi.mode(WIFI_STA);
   setupWifi();
 
+  setupMetrics();
   SPIFFS.begin();
+  EEPROM.begin(EEPROM_SIZE);
+  transferReceiverInit(&receiver, TRANSMIT_WINDOW_SIZE, receiveBuffer, MAX_PAYLOAD_SIZE);
+  moduleVersion = EEPROM.read(MODULE_VERSION_OFFSET);
 
   //set up for wasm
-  run_wasm(NULL);
+  const WasmHostHooks hooks = {meshSendHook, sensorReadHook};
+  wasmImportsInit(&hooks);
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    wasmModules[i].slot = -1;
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+    if (i == 0 || SPIFFS.exists(wasmModuleConfigs[i].path))
+      load_wasm(i, NULL, 0, NULL);
+  moduleHash = wasmModules[0].hash;
 
   // Init ESP-NOW
   if (esp_now_init() != ESP_OK) {
@@ -472,16 +2189,17 @@ void setup(){
   esp_now_register_send_cb(OnDataSent);
   
   // Register peer
-  esp_now_peer_info_t peerInfo;
-  memcpy(peerInfo.peer_addr, broadcastAddress, 6);
-  peerInfo.channel = 0;  
-  peerInfo.encrypt = false;
-  
-  // Add peer        
-  if (esp_now_add_peer(&peerInfo) != ESP_OK){
+  if (!addPeer(broadcastAddress) || !addPeer(everyNodeAddress)){
     Serial.println("Failed to add peer");
     return;
   }
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  WiFi.macAddress(mac);
+  meshInit(&mesh, mac, MESH_GATEWAY, millis());
+  transmitDestination = meshNodeId(broadcastAddress);
+  DLOG_INFO("Mesh node ID: %x", mesh.id);
+  trickleInit(&trickle, SUMMARY_INTERVAL_MIN, SUMMARY_MAX_DOUBLINGS, mesh.id * 2654435761u ^ micros(), millis());
+
   // Register for a callback function that will be called when data is received
   esp_now_register_recv_cb(OnDataRecv);
 
@@ -506,6 +2224,13 @@ void setup(){
     request->send(SPIFFS, "/arduino.ts");
   });
 
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    updateSystemMetrics();
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    metricsText(writeMetricsResponse, response);
+    request->send(response);
+  });
+
   server.on("/upload", HTTP_POST, [](AsyncWebServerRequest *request) {
       request->send(200);
       }, handleUpload);
@@ -544,14 +2269,69 @@ void loop(){
     Serial.println("Error sending the data");
   }*/
 
-  // if the sendNextPackageFlag is set
-  if (sendNextPacketFlag)
-    sendNextPacket();
-  
-  wasm_task();
-    Serial.println("Wasm result:");
-    Serial.println(wasmResult);
+  // a new module is advertised before it is sent, so the transfer carries the new version
+  if (moduleUploaded)
+  {
+    moduleUploaded = false;
+    setModuleSummary(moduleVersion + 1, uploadHash);
+  }
+  if (transmitRequested || rolloutRequested)
+  {
+    startTransmit(rolloutRequested);
+    transmitRequested = false;
+    rolloutRequested = 0;
+  }
+  if (relayRequested)
+  {
+    relayRequested = false;
+    startRelay();
+  }
+  if (broadcastRequested)
+  {
+    broadcastRequested = false;
+    startBroadcast();
+  }
 
-  delay(5000);
-}
+  // fill the transmission window (no-op if no transmission is running)
+  if (transmitActive)
+    transmitWindow();
+  if (broadcastActive)
+    broadcastWindow();
+
+  sendAck();
+  meshFlush();
+  disseminateVersion();
+  stagingFlush();
+
+  // switch to a received module between two wasm_task() calls
+  if (wasmSwapPending)
+  {
+    wasmSwapPending = false;
+    //the verified module replaces the file of the running one only once it is loaded, so a failed module is not loaded at the next boot nor served
+    if (load_wasm(0, STAGED_MODULE_PATH, stagedModuleHash, stagedFuelInfoValid ? &stagedFuelInfo : NULL))
+    {
+      SPIFFS.remove("/main.wasm");
+      SPIFFS.rename(STAGED_MODULE_PATH, "/main.wasm");
+      setModuleSummary(receiveVersion, wasmModules[0].hash);
+      wasmTaskWake(&wasmModules[0].task); //the new module runs at once
+    }
+    else
+      SPIFFS.remove(STAGED_MODULE_PATH);
+  }
+
+  // the modules run in their tasks, their results and messages are sent from here
+  for (int i = 0; i < WASM_MAX_MODULES; i++)
+  {
+    if (!wasmModules[i].resultReady)
+      continue;
+    wasmModules[i].resultReady = false;
+    DLOG_INFO("Wasm result of module %d: %d", i, wasmModules[i].result);
+    printBudget(&wasmModules[i].budget);
+    sendResult(i);
+  }
+  sendMeshMessages();
+  dumpMetrics();
 
+  // sleep until a callback posts an event or the next timer is due
+  eventWait(nextLoopTimeout());
+}
\ No newline at end of file
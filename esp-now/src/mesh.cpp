@@ -0,0 +1,414 @@
+/**
+ * @file mesh.cpp
+ * @brief Neighbor table, parent choice and forwarding of the ESP-NOW mesh (see mesh.h).
+ */
+#include <string.h>
+#include "mesh.h"
+
+static const uint8_t everyNode[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static inline bool isDue(uint32_t now, uint32_t time)
+{
+  return (int32_t) (now - time) >= 0;
+}
+
+static uint8_t linkQuality(const MeshNeighbor *neighbor)
+{
+  uint8_t quality = 0;
+  for (uint8_t history = neighbor->beaconHistory; history; history >>= 1)
+    quality += history & 1;
+  return quality;
+}
+
+static uint16_t linkCost(const MeshNeighbor *neighbor)
+{
+  uint8_t quality = linkQuality(neighbor);
+  return quality ? MESH_LINK_COST * 64 / (quality * quality) : MESH_NO_COST;
+}
+
+/**
+ * @fn
+ * Cost to the gateway via a neighbor, MESH_NO_COST if the neighbor cannot be the parent
+ */
+static uint16_t costVia(const Mesh *mesh, const MeshNeighbor *neighbor)
+{
+  if (!neighbor->used || neighbor->gatewayCost == MESH_NO_COST || neighbor->gatewayHops >= MESH_MAX_HOPS
+      || neighbor->parent == mesh->id || linkQuality(neighbor) < MESH_MIN_LINK_QUALITY)
+    return MESH_NO_COST;
+  uint32_t cost = (uint32_t) neighbor->gatewayCost + linkCost(neighbor);
+  return cost < MESH_NO_COST ? cost : MESH_NO_COST - 1;
+}
+
+static MeshNeighbor *findNeighbor(Mesh *mesh, const uint8_t *mac)
+{
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (mesh->neighbors[i].used && !memcmp(mesh->neighbors[i].mac, mac, 6))
+      return &mesh->neighbors[i];
+  }
+  return NULL;
+}
+
+static MeshNeighbor *findNeighborById(Mesh *mesh, uint16_t id)
+{
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (mesh->neighbors[i].used && mesh->neighbors[i].id == id)
+      return &mesh->neighbors[i];
+  }
+  return NULL;
+}
+
+/**
+ * @fn
+ * Choose the neighbor with the lowest cost to the gateway as parent
+ */
+static void selectParent(Mesh *mesh, uint32_t now)
+{
+  if (mesh->gateway)
+    return;
+
+  int best = -1;
+  uint16_t bestCost = MESH_NO_COST;
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    uint16_t cost = costVia(mesh, &mesh->neighbors[i]);
+    if (cost < bestCost)
+    {
+      best = i;
+      bestCost = cost;
+    }
+  }
+
+  uint16_t parentCost = mesh->parent >= 0 ? costVia(mesh, &mesh->neighbors[mesh->parent]) : MESH_NO_COST;
+  if (best >= 0 && best != mesh->parent && (parentCost == MESH_NO_COST || bestCost + MESH_PARENT_HYSTERESIS < parentCost))
+  {
+    //announce the new path at once, so the routes of the gateway follow
+    mesh->parent = best;
+    mesh->nextAnnounce = now;
+  }
+  else if (parentCost == MESH_NO_COST)
+  {
+    mesh->parent = -1;
+  }
+
+  if (mesh->parent >= 0)
+  {
+    mesh->gatewayCost = costVia(mesh, &mesh->neighbors[mesh->parent]);
+    mesh->gatewayHops = mesh->neighbors[mesh->parent].gatewayHops + 1;
+  }
+  else
+  {
+    mesh->gatewayCost = MESH_NO_COST;
+    mesh->gatewayHops = 0;
+  }
+}
+
+/**
+ * @fn
+ * Start a beacon interval: age the link quality and the routes, choose the parent
+ */
+static void tick(Mesh *mesh, uint32_t now)
+{
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    MeshNeighbor *neighbor = &mesh->neighbors[i];
+    if (!neighbor->used)
+      continue;
+    neighbor->beaconHistory <<= 1;
+    if (!neighbor->beaconHistory)
+    {
+      //no beacon during the last 8 intervals
+      neighbor->used = false;
+      if (mesh->parent == i)
+        mesh->parent = -1;
+    }
+  }
+  for (int i = 0; i < MESH_MAX_ROUTES; i++)
+  {
+    if (mesh->routes[i].used && isDue(now, mesh->routes[i].updated + MESH_ROUTE_TIMEOUT))
+      mesh->routes[i].used = false;
+  }
+  selectParent(mesh, now);
+
+  mesh->beaconDue = true;
+  mesh->nextTick = now + MESH_BEACON_INTERVAL + (mesh->id * 31 + mesh->beaconsSent * 17) % MESH_BEACON_JITTER;
+}
+
+static void handleBeacon(Mesh *mesh, const uint8_t *mac, const uint8_t *data)
+{
+  MeshNeighbor *neighbor = findNeighbor(mesh, mac);
+  if (!neighbor)
+  {
+    //a free entry, otherwise the worst link which is not the parent
+    int worst = -1;
+    for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+    {
+      if (!mesh->neighbors[i].used)
+      {
+        worst = i;
+        break;
+      }
+      if (i != mesh->parent && (worst < 0 || linkQuality(&mesh->neighbors[i]) < linkQuality(&mesh->neighbors[worst])))
+        worst = i;
+    }
+    if (worst < 0)
+      return;
+    neighbor = &mesh->neighbors[worst];
+    memset(neighbor, 0, sizeof(MeshNeighbor));
+    neighbor->used = true;
+    memcpy(neighbor->mac, mac, 6);
+  }
+  neighbor->id = data[1] << 8 | data[2];
+  neighbor->gatewayCost = data[3] << 8 | data[4];
+  neighbor->gatewayHops = data[5];
+  neighbor->parent = data[6] << 8 | data[7];
+  neighbor->beaconHistory |= 1;
+}
+
+/**
+ * @fn
+ * Remember the previous hop of a frame as next hop to its source
+ */
+static void learnRoute(Mesh *mesh, uint16_t destination, const uint8_t *mac, uint8_t hops, uint32_t now)
+{
+  MeshRoute *route = NULL;
+  for (int i = 0; i < MESH_MAX_ROUTES && !route; i++)
+  {
+    if (mesh->routes[i].used && mesh->routes[i].destination == destination)
+      route = &mesh->routes[i];
+  }
+  //a free entry, otherwise the oldest one
+  for (int i = 0; i < MESH_MAX_ROUTES && !route; i++)
+  {
+    if (!mesh->routes[i].used)
+      route = &mesh->routes[i];
+  }
+  if (!route)
+  {
+    route = &mesh->routes[0];
+    for (int i = 1; i < MESH_MAX_ROUTES; i++)
+    {
+      if (isDue(route->updated, mesh->routes[i].updated + 1))
+        route = &mesh->routes[i];
+    }
+  }
+  route->used = true;
+  route->destination = destination;
+  memcpy(route->mac, mac, 6);
+  route->hops = hops;
+  route->updated = now;
+}
+
+/**
+ * @fn
+ * Find the next hop to a destination: a neighbor, a learned route, otherwise the parent
+ */
+static bool nextHop(Mesh *mesh, uint16_t destination, uint8_t *mac)
+{
+  if (destination != MESH_GATEWAY_ID)
+  {
+    MeshNeighbor *neighbor = findNeighborById(mesh, destination);
+    if (neighbor)
+    {
+      memcpy(mac, neighbor->mac, 6);
+      return true;
+    }
+    for (int i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+      if (mesh->routes[i].used && mesh->routes[i].destination == destination)
+      {
+        memcpy(mac, mesh->routes[i].mac, 6);
+        return true;
+      }
+    }
+  }
+  //the gateway knows the routes to every node, so unknown destinations go upward
+  if (mesh->parent < 0)
+    return false;
+  memcpy(mac, mesh->neighbors[mesh->parent].mac, 6);
+  return true;
+}
+
+uint16_t meshNodeId(const uint8_t *mac)
+{
+  uint16_t id = mac[4] << 8 | mac[5];
+  return id == MESH_GATEWAY_ID ? MESH_GATEWAY_ID - 1 : id;
+}
+
+void meshInit(Mesh *mesh, const uint8_t *mac, bool gateway, uint32_t now)
+{
+  memset(mesh, 0, sizeof(Mesh));
+  memcpy(mesh->mac, mac, 6);
+  mesh->id = meshNodeId(mac);
+  mesh->gateway = gateway;
+  mesh->parent = -1;
+  mesh->gatewayCost = gateway ? 0 : MESH_NO_COST;
+  mesh->nextTick = now + mesh->id % MESH_BEACON_JITTER;
+  mesh->nextAnnounce = now + MESH_ANNOUNCE_INTERVAL;
+}
+
+size_t meshReceive(Mesh *mesh, const uint8_t *mac, const uint8_t *data, size_t len, uint32_t now, uint16_t *source, const uint8_t **payload)
+{
+  if (data[0] == MESH_BEACON_FLAG)
+  {
+    if (len >= MESH_BEACON_SIZE)
+      handleBeacon(mesh, mac, data);
+    return 0;
+  }
+  if (data[0] != MESH_FRAME_FLAG || len < MESH_HEADER_SIZE || len > MESH_MAX_FRAME_SIZE)
+    return 0;
+
+  uint8_t ttl = data[1];
+  uint16_t frameSource = data[2] << 8 | data[3];
+  uint16_t destination = data[4] << 8 | data[5];
+  if (frameSource == mesh->id)
+  {
+    mesh->framesDropped++; //loop
+    return 0;
+  }
+  learnRoute(mesh, frameSource, mac, ttl <= MESH_MAX_HOPS ? MESH_MAX_HOPS - ttl + 1 : 1, now);
+
+  if (destination == mesh->id || (destination == MESH_GATEWAY_ID && mesh->gateway))
+  {
+    mesh->framesDelivered++;
+    *source = frameSource;
+    *payload = data + MESH_HEADER_SIZE;
+    return len - MESH_HEADER_SIZE; //0 for an announce
+  }
+
+  uint8_t next[6];
+  if (ttl <= 1 || mesh->forwardCount == MESH_FORWARD_QUEUE_SIZE || !nextHop(mesh, destination, next) || !memcmp(next, mac, 6))
+  {
+    mesh->framesDropped++;
+    return 0;
+  }
+  MeshQueuedFrame *queued = &mesh->forwardQueue[(mesh->forwardHead + mesh->forwardCount) % MESH_FORWARD_QUEUE_SIZE];
+  memcpy(queued->mac, next, 6);
+  memcpy(queued->frame, data, len);
+  queued->frame[1] = ttl - 1;
+  queued->length = len;
+  mesh->forwardCount++;
+  mesh->framesForwarded++;
+  return 0;
+}
+
+size_t meshBuildFrame(Mesh *mesh, uint16_t destination, const uint8_t *data, size_t len, uint8_t *frame, uint8_t *mac)
+{
+  if (len > MESH_MAX_PAYLOAD_SIZE || !nextHop(mesh, destination, mac))
+    return 0;
+  frame[0] = MESH_FRAME_FLAG;
+  frame[1] = MESH_MAX_HOPS;
+  frame[2] = mesh->id >> 8;
+  frame[3] = (uint8_t) mesh->id;
+  frame[4] = destination >> 8;
+  frame[5] = (uint8_t) destination;
+  if (len)
+    memcpy(frame + MESH_HEADER_SIZE, data, len);
+  mesh->framesSent++;
+  return len + MESH_HEADER_SIZE;
+}
+
+uint8_t meshLinkQuality(const Mesh *mesh, const uint8_t *mac)
+{
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (mesh->neighbors[i].used && !memcmp(mesh->neighbors[i].mac, mac, 6))
+      return linkQuality(&mesh->neighbors[i]);
+  }
+  return 0;
+}
+
+int meshChildren(const Mesh *mesh, uint16_t *ids, int max)
+{
+  int count = 0;
+  for (int i = 0; i < MESH_MAX_NEIGHBORS && count < max; i++)
+  {
+    const MeshNeighbor *neighbor = &mesh->neighbors[i];
+    if (neighbor->used && neighbor->parent == mesh->id && linkQuality(neighbor))
+      ids[count++] = neighbor->id;
+  }
+  return count;
+}
+
+int meshDescendants(const Mesh *mesh, uint8_t *depth)
+{
+  int count = 0;
+  *depth = 0;
+  for (int i = 0; i < MESH_MAX_ROUTES; i++)
+  {
+    const MeshRoute *route = &mesh->routes[i];
+    if (!route->used)
+      continue;
+    for (int j = 0; j < MESH_MAX_NEIGHBORS; j++)
+    {
+      const MeshNeighbor *neighbor = &mesh->neighbors[j];
+      if (neighbor->used && neighbor->parent == mesh->id && linkQuality(neighbor) && !memcmp(neighbor->mac, route->mac, 6))
+      {
+        count++;
+        if (route->hops > *depth)
+          *depth = route->hops;
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+bool meshPoll(Mesh *mesh, uint32_t now, uint8_t *mac, uint8_t *frame, size_t *len)
+{
+  if (isDue(now, mesh->nextTick))
+    tick(mesh, now);
+
+  if (mesh->beaconDue)
+  {
+    uint16_t parentId = mesh->parent >= 0 ? mesh->neighbors[mesh->parent].id : mesh->id;
+    frame[0] = MESH_BEACON_FLAG;
+    frame[1] = mesh->id >> 8;
+    frame[2] = (uint8_t) mesh->id;
+    frame[3] = mesh->gatewayCost >> 8;
+    frame[4] = (uint8_t) mesh->gatewayCost;
+    frame[5] = mesh->gatewayHops;
+    frame[6] = parentId >> 8;
+    frame[7] = (uint8_t) parentId;
+    memcpy(mac, everyNode, 6);
+    *len = MESH_BEACON_SIZE;
+    mesh->beaconDue = false;
+    mesh->beaconsSent++;
+    return true;
+  }
+
+  if (!mesh->gateway && mesh->parent >= 0 && isDue(now, mesh->nextAnnounce))
+  {
+    mesh->nextAnnounce = now + MESH_ANNOUNCE_INTERVAL;
+    *len = meshBuildFrame(mesh, MESH_GATEWAY_ID, NULL, 0, frame, mac);
+    return true;
+  }
+
+  if (mesh->forwardCount)
+  {
+    MeshQueuedFrame *queued = &mesh->forwardQueue[mesh->forwardHead];
+    memcpy(mac, queued->mac, 6);
+    memcpy(frame, queued->frame, queued->length);
+    *len = queued->length;
+    mesh->forwardHead = (mesh->forwardHead + 1) % MESH_FORWARD_QUEUE_SIZE;
+    mesh->forwardCount--;
+    return true;
+  }
+  return false;
+}
+
+uint32_t meshNextDue(const Mesh *mesh, uint32_t now)
+{
+  if (mesh->beaconDue || mesh->forwardCount || isDue(now, mesh->nextTick))
+    return 0;
+  uint32_t due = mesh->nextTick - now;
+  if (!mesh->gateway && mesh->parent >= 0)
+  {
+    if (isDue(now, mesh->nextAnnounce))
+      return 0;
+    if (mesh->nextAnnounce - now < due)
+      due = mesh->nextAnnounce - now;
+  }
+  return due;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file trickle.cpp
+ * @brief Trickle timer (see trickle.h).
+ */
+#include "trickle.h"
+
+static inline bool isDue(uint32_t now, uint32_t time)
+{
+  return (int32_t) (now - time) >= 0;
+}
+
+/**
+ * @fn
+ * xorshift32, the timer must not depend on the random() of the platform
+ */
+static uint32_t nextRandom(Trickle *trickle)
+{
+  uint32_t x = trickle->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  trickle->random = x;
+  return x;
+}
+
+static void startInterval(Trickle *trickle, uint32_t now)
+{
+  trickle->intervalStart = now;
+  trickle->transmitTime = now + trickle->interval / 2 + nextRandom(trickle) % (trickle->interval / 2);
+  trickle->counter = 0;
+  trickle->transmitted = false;
+}
+
+void trickleInit(Trickle *trickle, uint32_t intervalMin, uint8_t maxDoublings, uint32_t seed, uint32_t now)
+{
+  trickle->intervalMin = intervalMin;
+  trickle->maxDoublings = maxDoublings;
+  trickle->interval = intervalMin;
+  trickle->random = seed ? seed : 1;
+  startInterval(trickle, now);
+}
+
+void trickleConsistent(Trickle *trickle)
+{
+  if (trickle->counter < 0xff)
+    trickle->counter++;
+}
+
+void trickleInconsistent(Trickle *trickle, uint32_t now)
+{
+  if (trickle->interval == trickle->intervalMin)
+    return;
+  trickle->interval = trickle->intervalMin;
+  startInterval(trickle, now);
+}
+
+bool tricklePoll(Trickle *trickle, uint32_t now)
+{
+  if (isDue(now, trickle->intervalStart + trickle->interval))
+  {
+    if (trickle->interval < trickle->intervalMin << trickle->maxDoublings)
+      trickle->interval *= 2;
+    startInterval(trickle, now);
+  }
+  if (trickle->transmitted || !isDue(now, trickle->transmitTime))
+    return false;
+  trickle->transmitted = true;
+  return trickle->counter < TRICKLE_REDUNDANCY;
+}
+
+uint32_t trickleNextDue(const Trickle *trickle, uint32_t now)
+{
+  uint32_t intervalEnd = trickle->intervalStart + trickle->interval;
+  if (isDue(now, intervalEnd) || (!trickle->transmitted && isDue(now, trickle->transmitTime)))
+    return 0;
+  uint32_t due = intervalEnd - now;
+  if (!trickle->transmitted && trickle->transmitTime - now < due)
+    due = trickle->transmitTime - now;
+  return due;
+}
@@ -0,0 +1,236 @@
+/**
+ * @file wasm_scheduler.cpp
+ * @brief Periodic tasks of the wasm modules (see wasm_scheduler.h). The scheduling is shared, the threads, locks and clock
+ * are the ones of FreeRTOS on the ESP32 and of the C++ standard library on the host.
+ */
+#include <new>
+#include "wasm_scheduler.h"
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+struct WasmTaskPlatform {
+  TaskHandle_t handle;
+  SemaphoreHandle_t lock;
+  SemaphoreHandle_t done; //given by the task when it ends
+};
+
+uint64_t wasmTaskClock()
+{
+  return esp_timer_get_time();
+}
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct WasmTaskPlatform {
+  std::thread thread;
+  std::mutex lock;
+  std::mutex wakeLock;
+  std::condition_variable wake;
+  bool wakeRequested; //by wasmTaskWake() or wasmTaskStop(), under wakeLock
+};
+
+uint64_t wasmTaskClock()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+/**
+ * @fn
+ * Release after a run which ended at now. Missed releases are skipped and counted as overruns.
+ */
+static uint64_t nextRelease(WasmTask *task, uint64_t now)
+{
+  uint64_t period = (uint64_t) task->config.period * 1000;
+  if (!period)
+    return now;
+  uint64_t release = task->release + period;
+  if (now > release)
+  {
+    uint64_t missed = (now - release + period - 1) / period;
+    task->overruns += missed;
+    release += missed * period;
+  }
+  return release;
+}
+
+/**
+ * @fn
+ * Sleep until the release of the task, or until it is woken or stopped
+ */
+static void sleepUntilRelease(WasmTask *task)
+{
+  uint64_t now = wasmTaskClock();
+#ifdef ESP_PLATFORM
+  //at least one tick, so the idle task of the core runs (task watchdog)
+  uint64_t tick = (uint64_t) portTICK_PERIOD_MS * 1000;
+  TickType_t ticks = task->release > now ? (task->release - now + tick - 1) / tick : 1;
+  ulTaskNotifyTake(pdTRUE, ticks);
+#else
+  std::unique_lock<std::mutex> wakeLock(task->platform->wakeLock);
+  if (task->release > now)
+    task->platform->wake.wait_for(wakeLock, std::chrono::microseconds(task->release - now), [task] { return task->platform->wakeRequested; });
+  task->platform->wakeRequested = false;
+#endif
+}
+
+/**
+ * @fn
+ * Body of a task: run the function at every release until the task is stopped
+ */
+static void runTask(WasmTask *task)
+{
+  task->release = wasmTaskClock();
+  while (!task->stopRequested)
+  {
+    wasmTaskLock(task);
+    uint64_t start = wasmTaskClock();
+    if (!task->stopRequested && task->function)
+      task->function(task->context);
+    uint64_t end = wasmTaskClock();
+    wasmTaskUnlock(task);
+
+    uint32_t runTime = end - start;
+    task->lastRunTime = runTime;
+    if (runTime > task->maxRunTime)
+      task->maxRunTime = runTime;
+    task->runs++;
+    //a woken run before the release leaves the release as it is
+    if (end >= task->release)
+      task->release = nextRelease(task, end);
+    sleepUntilRelease(task);
+  }
+}
+
+#ifdef ESP_PLATFORM
+static void taskEntry(void *parameter)
+{
+  WasmTask *task = (WasmTask *) parameter;
+  runTask(task);
+  xSemaphoreGive(task->platform->done);
+  vTaskDelete(NULL);
+}
+
+bool wasmTaskStart(WasmTask *task, const WasmTaskConfig *config, WasmTaskFunction function, void *context)
+{
+  WasmTaskPlatform *platform = new (std::nothrow) WasmTaskPlatform();
+  if (!platform)
+    return false;
+  platform->lock = xSemaphoreCreateMutex();
+  platform->done = xSemaphoreCreateBinary();
+  task->config = *config;
+  task->function = function;
+  task->context = context;
+  task->runs = task->overruns = task->lastRunTime = task->maxRunTime = 0;
+  task->stopRequested = false;
+  task->platform = platform;
+  if (platform->lock && platform->done
+      && xTaskCreatePinnedToCore(taskEntry, config->name, config->stackSize, task, config->priority, &platform->handle,
+                                 config->core == WASM_TASK_ANY_CORE ? tskNO_AFFINITY : config->core) == pdPASS)
+    return true;
+
+  if (platform->lock) vSemaphoreDelete(platform->lock);
+  if (platform->done) vSemaphoreDelete(platform->done);
+  delete platform;
+  task->platform = NULL;
+  return false;
+}
+
+void wasmTaskStop(WasmTask *task)
+{
+  if (!task->platform)
+    return;
+  task->stopRequested = true;
+  xTaskNotifyGive(task->platform->handle);
+  xSemaphoreTake(task->platform->done, portMAX_DELAY);
+  vSemaphoreDelete(task->platform->lock);
+  vSemaphoreDelete(task->platform->done);
+  delete task->platform;
+  task->platform = NULL;
+}
+
+void wasmTaskWake(WasmTask *task)
+{
+  if (task->platform)
+    xTaskNotifyGive(task->platform->handle);
+}
+
+void wasmTaskLock(WasmTask *task)
+{
+  xSemaphoreTake(task->platform->lock, portMAX_DELAY);
+}
+
+void wasmTaskUnlock(WasmTask *task)
+{
+  xSemaphoreGive(task->platform->lock);
+}
+
+uint32_t wasmTaskStackFree(WasmTask *task)
+{
+  return task->platform ? uxTaskGetStackHighWaterMark(task->platform->handle) : 0;
+}
+#else
+bool wasmTaskStart(WasmTask *task, const WasmTaskConfig *config, WasmTaskFunction function, void *context)
+{
+  WasmTaskPlatform *platform = new (std::nothrow) WasmTaskPlatform();
+  if (!platform)
+    return false;
+  task->config = *config;
+  task->function = function;
+  task->context = context;
+  task->runs = task->overruns = task->lastRunTime = task->maxRunTime = 0;
+  task->stopRequested = false;
+  task->platform = platform;
+  platform->thread = std::thread(runTask, task);
+  return true;
+}
+
+void wasmTaskStop(WasmTask *task)
+{
+  if (!task->platform)
+    return;
+  {
+    std::lock_guard<std::mutex> wakeLock(task->platform->wakeLock);
+    task->stopRequested = true;
+    task->platform->wakeRequested = true;
+  }
+  task->platform->wake.notify_all();
+  task->platform->thread.join();
+  delete task->platform;
+  task->platform = NULL;
+}
+
+void wasmTaskWake(WasmTask *task)
+{
+  if (!task->platform)
+    return;
+  {
+    std::lock_guard<std::mutex> wakeLock(task->platform->wakeLock);
+    task->platform->wakeRequested = true;
+  }
+  task->platform->wake.notify_all();
+}
+
+void wasmTaskLock(WasmTask *task)
+{
+  task->platform->lock.lock();
+}
+
+void wasmTaskUnlock(WasmTask *task)
+{
+  task->platform->lock.unlock();
+}
+
+uint32_t wasmTaskStackFree(WasmTask *task)
+{
+  (void) task;
+  return 0;
+}
+#endif
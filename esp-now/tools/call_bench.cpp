@@ -0,0 +1,141 @@
+/**
+ * @file call_bench.cpp
+ * @brief Host benchmark of the calls of calcWasm() (see lib/shared/src/wasm_call.cpp). Compares the cost per sample of
+ * - m3_Call per sample: the former wasm_task(), an argument pointer array and m3_Call() / m3_GetResultsV() for every sample
+ * - wasmCall per sample: the typed arguments of wasm_call.h, still one interpreter entry per sample
+ * - calcBatch: the samples are copied into the linear memory and processed with one call per block (wasmBatchCall()), for blocks
+ *   of 1, 8 and 32 samples and the capacity of the region, so the fixed cost of a call and the cost per sample are both visible
+ *
+ * Needs the wasm3 sources (v0.5.0, wasm3/Wasm3 of platformio.ini), e.g. the copy PlatformIO downloads for the sketch.
+ * Build and run (from esp-now/):
+ *   W=.pio/libdeps/esp32dev/Wasm3/src
+ *   gcc -O2 -c $W/m3_*.c && g++ -O2 -I../lib/shared/src -I$W tools/call_bench.cpp ../lib/shared/src/wasm_call.cpp *.o -lm -o call_bench && ./call_bench [samples]
+ *
+ * The module is built in: calcWasm(x: u8, y: u8): u8, batchBuffer() and calcBatch() as in the example of wasm_call.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "wasm3.h"
+#include "wasm_call.h"
+
+#define CALC_INPUT 2
+#define CALC_RESULT_SIZE 4
+#define BATCH_BUFFER_SIZE 1024
+#define STACK_SLOTS 4000
+
+static const uint8_t benchModule[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x13, 0x03, 0x60, 0x02, 0x7f, 0x7f, 0x01,
+  0x7f, 0x60, 0x01, 0x7f, 0x01, 0x7f, 0x60, 0x03, 0x7f, 0x7f, 0x7f, 0x01, 0x7f, 0x03, 0x04, 0x03,
+  0x00, 0x01, 0x02, 0x05, 0x03, 0x01, 0x00, 0x01, 0x07, 0x2f, 0x04, 0x06, 0x6d, 0x65, 0x6d, 0x6f,
+  0x72, 0x79, 0x02, 0x00, 0x08, 0x63, 0x61, 0x6c, 0x63, 0x57, 0x61, 0x73, 0x6d, 0x00, 0x00, 0x0b,
+  0x62, 0x61, 0x74, 0x63, 0x68, 0x42, 0x75, 0x66, 0x66, 0x65, 0x72, 0x00, 0x01, 0x09, 0x63, 0x61,
+  0x6c, 0x63, 0x42, 0x61, 0x74, 0x63, 0x68, 0x00, 0x02, 0x0a, 0x5f, 0x03, 0x0b, 0x00, 0x20, 0x00,
+  0x20, 0x01, 0x6a, 0x41, 0xff, 0x01, 0x71, 0x0b, 0x11, 0x00, 0x20, 0x00, 0x41, 0x80, 0x08, 0x4c,
+  0x04, 0x7f, 0x41, 0x80, 0x08, 0x05, 0x41, 0x00, 0x0b, 0x0b, 0x3f, 0x01, 0x01, 0x7f, 0x02, 0x40,
+  0x03, 0x40, 0x20, 0x03, 0x20, 0x02, 0x4e, 0x0d, 0x01, 0x20, 0x01, 0x20, 0x03, 0x41, 0x02, 0x74,
+  0x6a, 0x20, 0x00, 0x20, 0x03, 0x41, 0x01, 0x74, 0x6a, 0x2d, 0x00, 0x00, 0x20, 0x00, 0x20, 0x03,
+  0x41, 0x01, 0x74, 0x6a, 0x2d, 0x00, 0x01, 0x10, 0x00, 0x36, 0x02, 0x00, 0x20, 0x03, 0x41, 0x01,
+  0x6a, 0x21, 0x03, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x02, 0x0b,
+};
+
+static double nanos()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void check(M3Result result, const char *step)
+{
+  if (result)
+  {
+    fprintf(stderr, "%s: %s\n", step, result);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int samples = argc > 1 ? atoi(argv[1]) : 100000;
+  std::vector<uint8_t> inputs((size_t) samples * CALC_INPUT);
+  srand(1);
+  for (size_t i = 0; i < inputs.size(); i++)
+    inputs[i] = rand();
+
+  IM3Environment env = m3_NewEnvironment();
+  IM3Runtime runtime = m3_NewRuntime(env, STACK_SLOTS, NULL);
+  IM3Module module;
+  IM3Function calcWasm;
+  check(m3_ParseModule(env, &module, benchModule, sizeof(benchModule)), "m3_ParseModule");
+  check(m3_LoadModule(runtime, module), "m3_LoadModule");
+  check(m3_FindFunction(&calcWasm, runtime, "calcWasm"), "m3_FindFunction");
+  WasmBatch batch;
+  check(wasmBatchInit(&batch, runtime, BATCH_BUFFER_SIZE), "wasmBatchInit");
+
+  std::vector<int32_t> expected(samples), results(samples);
+  for (int i = 0; i < samples; i++)
+    expected[i] = (inputs[i * CALC_INPUT] + inputs[i * CALC_INPUT + 1]) & 0xff;
+
+  //m3_Call per sample, the arguments in the width of i32 (m3_Call reads 4 bytes per i32 argument)
+  double start = nanos();
+  for (int i = 0; i < samples; i++)
+  {
+    int32_t values[CALC_INPUT];
+    const void *argptrs[CALC_INPUT];
+    for (int k = 0; k < CALC_INPUT; k++)
+    {
+      values[k] = inputs[i * CALC_INPUT + k];
+      argptrs[k] = &values[k];
+    }
+    check(m3_Call(calcWasm, CALC_INPUT, argptrs), "m3_Call");
+    check(m3_GetResultsV(calcWasm, &results[i]), "m3_GetResultsV");
+  }
+  double perSample = (nanos() - start) / samples;
+  bool correct = results == expected;
+  printf("%-22s %10.1f ns/sample %10.1f ns/call %s\n", "m3_Call per sample", perSample, perSample, correct ? "ok" : "WRONG");
+
+  //typed arguments
+  results.assign(samples, 0);
+  start = nanos();
+  for (int i = 0; i < samples; i++)
+  {
+    check(wasmCall(calcWasm, inputs[i * CALC_INPUT], inputs[i * CALC_INPUT + 1]), "wasmCall");
+    check(m3_GetResultsV(calcWasm, &results[i]), "m3_GetResultsV");
+  }
+  double typed = (nanos() - start) / samples;
+  correct = results == expected;
+  printf("%-22s %10.1f ns/sample %10.1f ns/call %s\n", "wasmCall per sample", typed, typed, correct ? "ok" : "WRONG");
+
+  //batch calls, blocks of 1 sample up to the capacity of the region
+  uint32_t capacity = wasmBatchCapacity(&batch, CALC_INPUT, CALC_RESULT_SIZE);
+  const uint32_t blockSizes[] = {1, 8, 32, capacity};
+  for (uint32_t blockSize : blockSizes)
+  {
+    if (blockSize > capacity)
+      continue;
+    results.assign(samples, 0);
+    int calls = 0;
+    start = nanos();
+    for (int done = 0; done < samples; calls++)
+    {
+      uint32_t count = samples - done < (int) blockSize ? samples - done : blockSize;
+      uint32_t processed;
+      check(wasmBatchCall(&batch, &inputs[(size_t) done * CALC_INPUT], CALC_INPUT, &results[done], CALC_RESULT_SIZE, count, &processed), "wasmBatchCall");
+      done += processed;
+    }
+    double elapsed = nanos() - start;
+    double batched = elapsed / samples;
+    correct = results == expected;
+    char name[32];
+    snprintf(name, sizeof(name), "calcBatch, %u per call", blockSize);
+    printf("%-22s %10.1f ns/sample %10.1f ns/call %s, %.1fx faster than m3_Call per sample\n", name, batched, elapsed / calls,
+           correct ? "ok" : "WRONG", perSample / batched);
+  }
+
+  m3_FreeRuntime(runtime);
+  m3_FreeEnvironment(env);
+  return 0;
+}
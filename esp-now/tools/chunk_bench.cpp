@@ -0,0 +1,140 @@
+/**
+ * @file chunk_bench.cpp
+ * @brief Host benchmark of the sender side chunk source (lib/shared/src/chunk_source.cpp) over the file-backed SPIFFS stand-in of
+ * tools/host. The chunks of a module are read as sendNextPacket() and sendNextBlock() read them, in both modes of the source:
+ * preloaded into RAM (chunkSourceOpen()) and read from the file into the scratch buffer (chunkSourceOpenFile(), the fallback when
+ * the file does not fit into the heap). For comparison, the chunks are also read as before the chunk source: the file is opened
+ * per packet, seeked and read byte by byte. Every chunk has to match the file, and chunkSourceCrc() the CRC-32 of the file.
+ * Reports the time per chunk of each mode for the view lengths of the sketches.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -Itools/host -I../lib/shared/src tools/chunk_bench.cpp ../lib/shared/src/chunk_source.cpp ../lib/shared/src/dsp.cpp -o chunk_bench && ./chunk_bench [module.wasm] [rounds]
+ *
+ * The host file system caches the module, as the flash cache does on the board, so the file-backed times are a lower bound of SPIFFS.
+ */
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <SPIFFS.h>
+#include "chunk_source.h"
+#include "dsp.h"
+
+struct ViewLength {
+  const char *name;
+  size_t length;
+};
+
+static const ViewLength viewLengths[] = {
+  {"ESP-NOW packet", 240}, //MAX_PAYLOAD_SIZE
+  {"BLE packet, MTU 23", 17},
+  {"BLE packet, MTU 247", 241},
+  {"broadcast block", 8 * 240}, //FEC_BLOCK_SIZE * MAX_PAYLOAD_SIZE
+};
+
+enum Mode { MODE_REOPEN, MODE_FILE, MODE_PRELOADED };
+
+static const char *modeNames[] = {"reopen per chunk", "file + scratch", "preloaded"};
+
+static volatile uint32_t sink;
+
+static double nanos()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/**
+ * @fn
+ * Read a chunk as sendNextPacket() did before the chunk source: open, seek and a read() per byte
+ */
+static const uint8_t *reopenView(const char *path, size_t offset, size_t length, uint8_t *buffer)
+{
+  File file = SPIFFS.open(path, "r");
+  if (!file || !file.seek(offset))
+    return NULL;
+  for (size_t i = 0; i < length; i++)
+  {
+    int value = file.read();
+    if (value < 0)
+      return NULL;
+    buffer[i] = value;
+  }
+  file.close();
+  return buffer;
+}
+
+int main(int argc, char **argv)
+{
+  const char *modulePath = argc > 1 ? argv[1] : "data/main.wasm";
+  int rounds = argc > 2 ? atoi(argv[2]) : 200;
+  FILE *file = fopen(modulePath, "rb");
+  if (!file || rounds < 1)
+  {
+    printf("Usage: %s [module.wasm] [rounds]\n", argv[0]);
+    return 1;
+  }
+  std::vector<uint8_t> module;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    module.insert(module.end(), buffer, buffer + n);
+  fclose(file);
+
+  //the module is /<file name> in SPIFFS_DIR, as /main.wasm on the board
+  std::string directory(modulePath), name(modulePath);
+  setenv("SPIFFS_DIR", dirname(&directory[0]), 1);
+  std::string path = std::string("/") + basename(&name[0]);
+  uint32_t fileCrc = dspCrc32(0, module.data(), module.size());
+
+  printf("module %s, %zu bytes, %d rounds\n", modulePath, module.size(), rounds);
+  printf("%-20s %7s %-17s %10s %10s %s\n", "", "chunks", "mode", "ns/chunk", "MB/s", "");
+  int failures = 0;
+  for (const ViewLength &view : viewLengths)
+  {
+    size_t chunkCount = (module.size() + view.length - 1) / view.length;
+    std::vector<uint8_t> scratch(view.length);
+    for (int mode = MODE_REOPEN; mode <= MODE_PRELOADED; mode++)
+    {
+      ChunkSource source = {};
+      bool ok = true;
+      if (mode == MODE_FILE)
+        ok = chunkSourceOpenFile(&source, path.c_str(), view.length);
+      else if (mode == MODE_PRELOADED)
+        ok = chunkSourceOpen(&source, path.c_str(), view.length) && source.data;
+      if (mode != MODE_REOPEN)
+      {
+        uint32_t crc;
+        ok = ok && chunkSourceCrc(&source, &crc) && crc == fileCrc;
+      }
+
+      uint32_t sum = 0; //uses every chunk, so no read is left out
+      double start = nanos();
+      for (int round = 0; round < rounds && ok; round++)
+      {
+        for (size_t offset = 0; offset < module.size() && ok; offset += view.length)
+        {
+          size_t length = module.size() - offset < view.length ? module.size() - offset : view.length;
+          const uint8_t *data = mode == MODE_REOPEN ? reopenView(path.c_str(), offset, length, scratch.data())
+                                                    : chunkSourceView(&source, offset, length);
+          ok = data != NULL;
+          if (ok && !round)
+            ok = !memcmp(data, module.data() + offset, length);
+          if (ok)
+            sum += data[0] + data[length - 1];
+        }
+      }
+      double time = nanos() - start;
+      chunkSourceClose(&source);
+      sink = sum;
+      failures += !ok;
+      printf("%-20s %7zu %-17s %10.0f %10.1f %s\n", mode == MODE_REOPEN ? view.name : "", chunkCount, modeNames[mode],
+             time / rounds / chunkCount, module.size() * rounds * 1e3 / time, ok ? "ok" : "FAILED");
+    }
+  }
+  return failures ? 1 : 0;
+}
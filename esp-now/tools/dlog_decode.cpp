@@ -0,0 +1,220 @@
+/**
+ * @file dlog_decode.cpp
+ * @brief Host decoder of the binary log frames (see dlog.h) a node writes to serial with -DDLOG_BINARY=1. The format strings are
+ * not in the frames, so they are collected from the DLOG_ calls of the source files of the firmware and found by their hash.
+ * The text between the frames (e.g. Serial.println() of setup()) is passed through.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/dlog_decode.cpp ../lib/shared/src/dlog.cpp -o dlog_decode -pthread && ./dlog_decode src/main.cpp < serial.log
+ * The arguments are the source files with DLOG_ calls, e.g. ../BLE-communication/client/src/main.cpp for a BLE client.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "dlog.h"
+
+static std::map<uint32_t, std::string> formats;
+
+static uint32_t get32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * @fn
+ * Value of the string literals at p (adjacent literals are joined), as the compiler stores it
+ * @return false if there is no string literal at p
+ */
+static bool parseLiteral(const char *p, std::string *value)
+{
+  bool found = false;
+  while (true)
+  {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+      p++;
+    if (*p != '"')
+      return found;
+    found = true;
+    for (p++; *p && *p != '"'; p++)
+    {
+      if (*p != '\\')
+      {
+        *value += *p;
+        continue;
+      }
+      p++;
+      switch (*p)
+      {
+        case 'n': *value += '\n'; break;
+        case 't': *value += '\t'; break;
+        case 'r': *value += '\r'; break;
+        case 'x':
+          *value += (char) strtol(p + 1, (char **) &p, 16);
+          p--;
+          break;
+        default:
+          if (*p >= '0' && *p <= '7')
+          {
+            int code = 0;
+            for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++)
+              code = code * 8 + *p++ - '0';
+            *value += (char) code;
+            p--;
+          }
+          else
+            *value += *p; //\\ \" \'
+          break;
+      }
+    }
+    if (*p)
+      p++;
+  }
+}
+
+/**
+ * @fn
+ * Collect the format strings of the DLOG_ calls of a source file
+ */
+static int collectFormats(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return -1;
+  std::string source;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    source.append(buffer, n);
+  fclose(file);
+
+  static const char *macros[] = {"DLOG_ERROR(", "DLOG_WARN(", "DLOG_INFO(", "DLOG_DEBUG("};
+  int count = 0;
+  for (const char *macro : macros)
+  {
+    for (size_t at = source.find(macro); at != std::string::npos; at = source.find(macro, at + 1))
+    {
+      std::string format;
+      if (parseLiteral(source.c_str() + at + strlen(macro), &format))
+      {
+        formats[dlogFormatHash(format.c_str())] = format;
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * @fn
+ * Print a record
+ * @return false if the record is malformed
+ */
+static bool printRecord(const uint8_t *record, size_t len)
+{
+  static const char levelNames[] = "-EWID";
+  if (len < 10 || len < 10 + (size_t) 4 * record[9] || record[9] > DLOG_MAX_ARGS)
+    return false;
+  uint32_t hash = get32(record), time = get32(record + 4);
+  uint8_t level = record[8], argc = record[9];
+  uint32_t args[DLOG_MAX_ARGS];
+  for (uint8_t i = 0; i < argc; i++)
+    args[i] = get32(record + 10 + 4 * i);
+
+  const char *format = hash ? NULL : "%u log records dropped";
+  std::map<uint32_t, std::string>::const_iterator known = formats.find(hash);
+  if (known != formats.end())
+    format = known->second.c_str();
+  char text[512];
+  if (format)
+  {
+    //the strings follow the arguments
+    std::vector<std::string> values(argc);
+    const char *strings[DLOG_MAX_ARGS] = {NULL};
+    uint32_t mask = dlogStringMask(format);
+    const uint8_t *p = record + 10 + 4 * argc, *end = record + len;
+    for (uint8_t i = 0; i < argc; i++)
+    {
+      if (!(mask & (1u << i)))
+        continue;
+      if (p >= end || end - p - 1 < *p)
+        return false;
+      values[i].assign((const char *) p + 1, *p);
+      strings[i] = values[i].c_str();
+      p += 1 + *p;
+    }
+    dlogFormat(text, sizeof(text), format, args, argc, strings);
+  }
+  else
+  {
+    int n = snprintf(text, sizeof(text), "unknown format %08x:", hash);
+    for (uint8_t i = 0; i < argc; i++)
+      n += snprintf(text + n, sizeof(text) - n, " %u", args[i]);
+  }
+  printf("[%6u.%03u] %c %s\n", time / 1000, time % 1000, levelNames[level <= DLOG_LEVEL_DEBUG ? level : 0], text);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s source.cpp ... < serial.log\n", argv[0]);
+    return 1;
+  }
+  for (int i = 1; i < argc; i++)
+  {
+    if (collectFormats(argv[i]) < 0)
+      fprintf(stderr, "Cannot read %s\n", argv[i]);
+  }
+  fprintf(stderr, "%zu format strings\n", formats.size());
+
+  std::vector<uint8_t> input;
+  uint8_t buffer[4096];
+  size_t n;
+  int records = 0, invalid = 0;
+  bool end = false;
+  while (!end)
+  {
+    n = fread(buffer, 1, sizeof(buffer), stdin);
+    end = n == 0;
+    input.insert(input.end(), buffer, buffer + n);
+    size_t i = 0, text = 0;
+    while (i < input.size())
+    {
+      if (input[i] != (DLOG_SYNC & 0xff) || (i + 1 < input.size() && input[i + 1] != DLOG_SYNC >> 8))
+      {
+        i++;
+        continue;
+      }
+      if (i + 3 > input.size() || i + 3 + input[i + 2] + 2 > input.size())
+      {
+        if (!end)
+          break; //the frame is not complete yet
+        i++;
+        continue;
+      }
+      size_t len = input[i + 2];
+      const uint8_t *record = input.data() + i + 3;
+      uint16_t checksum = record[len] | record[len + 1] << 8;
+      fwrite(input.data() + text, 1, i - text, stdout);
+      text = i;
+      if (checksum != dlogChecksum(record, len) || !printRecord(record, len))
+      {
+        invalid++;
+        i++; //sync bytes in the text
+        continue;
+      }
+      records++;
+      i += 3 + len + 2;
+      text = i;
+    }
+    fwrite(input.data() + text, 1, i - text, stdout);
+    fflush(stdout);
+    input.erase(input.begin(), input.begin() + i);
+  }
+  fprintf(stderr, "%d records, %d invalid\n", records, invalid);
+  return 0;
+}
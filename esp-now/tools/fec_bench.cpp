@@ -0,0 +1,134 @@
+/**
+ * @file fec_bench.cpp
+ * @brief Host benchmark of the FEC of the wasm broadcast (src/fec.cpp, see fec.h). A random module is split into payload packets and
+ * blocks of k source packets as startBroadcast() does, and m repair packets are encoded per block. Every block then loses a random number
+ * of its k + m packets, from 0 up to m, at random positions, and is decoded as handleBroadcastPacket() does. The restored module has to
+ * match the sent one. Encode and decode throughput are reported in MB/s of module data for several (k, m) settings, among them the
+ * FEC_BLOCK_SIZE and FEC_REPAIR_COUNT of the sketch (8, 3).
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -Iinclude tools/fec_bench.cpp src/fec.cpp -o fec_bench && ./fec_bench [module size] [rounds] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "fec.h"
+
+#define PAYLOAD_SIZE 240 //MAX_PAYLOAD_SIZE of esp-now
+
+struct Setting {
+  uint8_t sourceCount; //k
+  uint8_t repairCount; //m
+};
+
+static const Setting settings[] = {{4, 1}, {4, 2}, {8, 2}, {8, 3}, {8, 4}, {16, 4}, {16, 8}, {32, 4}, {32, 8}, {32, 16}};
+
+static double micros()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+  size_t moduleSize = argc > 1 ? atoi(argv[1]) : 65536;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20;
+  unsigned seed = argc > 3 ? atoi(argv[3]) : 1;
+  if (!moduleSize || rounds < 1)
+  {
+    printf("Usage: %s [module size] [rounds] [seed]\n", argv[0]);
+    return 1;
+  }
+  srand(seed);
+  fecInit();
+
+  size_t packetCount = (moduleSize + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+  std::vector<uint8_t> module(packetCount * PAYLOAD_SIZE, 0); //the last packet is zero padded
+  for (size_t i = 0; i < moduleSize; i++)
+    module[i] = rand();
+  std::vector<uint8_t> restored(module.size());
+
+  printf("module %zu bytes, %zu packets of %d bytes, %d rounds, seed %u\n", moduleSize, packetCount, PAYLOAD_SIZE, rounds, seed);
+  printf("%4s %4s %9s %12s %12s %10s %s\n", "k", "m", "overhead", "encode MB/s", "decode MB/s", "restored", "");
+  int failures = 0;
+  for (const Setting &setting : settings)
+  {
+    uint8_t k = setting.sourceCount;
+    uint8_t m = setting.repairCount;
+    size_t blockCount = (packetCount + k - 1) / k;
+    std::vector<uint8_t> repairData(blockCount * m * PAYLOAD_SIZE);
+    double encodeTime = 0, decodeTime = 0;
+    size_t restoredPackets = 0;
+    bool intact = true;
+    for (int round = 0; round < rounds; round++)
+    {
+      double start = micros();
+      for (size_t block = 0; block < blockCount; block++)
+      {
+        uint8_t blockSourceCount = packetCount - block * k < k ? packetCount - block * k : k;
+        const uint8_t *sources[FEC_MAX_SOURCE_PACKETS];
+        for (uint8_t i = 0; i < blockSourceCount; i++)
+          sources[i] = &module[(block * k + i) * PAYLOAD_SIZE];
+        for (uint8_t j = 0; j < m; j++)
+          fecEncode(sources, blockSourceCount, j, PAYLOAD_SIZE, &repairData[(block * m + j) * PAYLOAD_SIZE]);
+      }
+      encodeTime += micros() - start;
+
+      memset(restored.data(), 0, restored.size());
+      for (size_t block = 0; block < blockCount; block++)
+      {
+        uint8_t blockSourceCount = packetCount - block * k < k ? packetCount - block * k : k;
+        //lose 0..m of the k + m packets of the block
+        bool lost[FEC_MAX_SOURCE_PACKETS + FEC_MAX_REPAIR_PACKETS] = {false};
+        int lossCount = rand() % (m + 1);
+        for (int n = 0; n < lossCount; )
+        {
+          int packet = rand() % (blockSourceCount + m);
+          if (!lost[packet])
+          {
+            lost[packet] = true;
+            n++;
+          }
+        }
+        uint8_t *sources[FEC_MAX_SOURCE_PACKETS];
+        uint32_t receivedMask = 0;
+        for (uint8_t i = 0; i < blockSourceCount; i++)
+        {
+          sources[i] = &restored[(block * k + i) * PAYLOAD_SIZE];
+          if (!lost[i])
+          {
+            memcpy(sources[i], &module[(block * k + i) * PAYLOAD_SIZE], PAYLOAD_SIZE);
+            receivedMask |= 1UL << i;
+          }
+          else
+            restoredPackets++;
+        }
+        //received repair packets, copied as the receiver does (fecDecode() destroys them)
+        uint8_t repairBuffer[FEC_MAX_REPAIR_PACKETS][PAYLOAD_SIZE];
+        uint8_t *repairs[FEC_MAX_REPAIR_PACKETS];
+        uint8_t repairIndices[FEC_MAX_REPAIR_PACKETS];
+        uint8_t repairCount = 0;
+        for (uint8_t j = 0; j < m; j++)
+        {
+          if (lost[blockSourceCount + j])
+            continue;
+          memcpy(repairBuffer[repairCount], &repairData[(block * m + j) * PAYLOAD_SIZE], PAYLOAD_SIZE);
+          repairs[repairCount] = repairBuffer[repairCount];
+          repairIndices[repairCount++] = j;
+        }
+        double start = micros();
+        bool decoded = fecDecode(sources, blockSourceCount, receivedMask, repairs, repairIndices, repairCount, PAYLOAD_SIZE);
+        decodeTime += micros() - start;
+        intact = intact && decoded;
+      }
+      intact = intact && restored == module;
+    }
+    failures += !intact;
+    printf("%4d %4d %8.1f%% %12.1f %12.1f %10zu %s\n", k, m, 100.0 * m / k, moduleSize * rounds / encodeTime,
+           moduleSize * rounds / decodeTime, restoredPackets, intact ? "ok" : "CORRUPT");
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file fuel_check.cpp
+ * @brief Host check of the fuel metering instrumentation (lib/shared/src/wasm_fuel.cpp). Instruments a module as wasmPartitionInstall() does,
+ * reports the size overhead and the time per KB, and writes the instrumented module, e.g. to validate or run it with another engine.
+ * The module is also instrumented from the file in blocks (wasmFuelInstrumentSource()), which has to give the same module; the bytes
+ * read from the file are reported.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/fuel_check.cpp ../lib/shared/src/wasm_fuel.cpp -o fuel_check && ./fuel_check data/main.wasm [instrumented.wasm]
+ *
+ * The instrumented module imports "fuel"."refuel" (i32) -> i32, which has to return the new fuel (e.g. 10000 - deficit, see wasm_fuel.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "wasm_fuel.h"
+
+#define RUNS 100 //instrumentations for the time measurement
+
+static bool appendOutput(void *context, const uint8_t *data, size_t len)
+{
+  std::vector<uint8_t> *output = (std::vector<uint8_t> *) context;
+  output->insert(output->end(), data, data + len);
+  return true;
+}
+
+typedef struct {
+  FILE *file;
+  size_t bytesRead;
+} FileSource;
+
+static bool readFile(void *context, size_t offset, uint8_t *data, size_t len)
+{
+  FileSource *source = (FileSource *) context;
+  source->bytesRead += len;
+  return !fseek(source->file, offset, SEEK_SET) && fread(data, 1, len, source->file) == len;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s module.wasm [instrumented.wasm]\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (!file)
+  {
+    printf("Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> module;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    module.insert(module.end(), buffer, buffer + n);
+
+  size_t length = wasmFuelInstrument(module.data(), module.size(), NULL, NULL, NULL);
+  if (!length)
+  {
+    printf("%s cannot be instrumented (malformed or unsupported instructions)\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> instrumented;
+  clock_t start = clock();
+  for (int i = 0; i < RUNS; i++)
+  {
+    instrumented.clear();
+    if (wasmFuelInstrument(module.data(), module.size(), NULL, appendOutput, &instrumented) != length || instrumented.size() != length)
+    {
+      printf("Measured and written length differ\n");
+      return 1;
+    }
+  }
+  double us = (double) (clock() - start) / CLOCKS_PER_SEC * 1e6 / RUNS;
+
+  printf("module %zu bytes, instrumented %zu bytes (+%.1f %%), %.1f us per KB (host)\n", module.size(), length,
+         100.0 * (length - module.size()) / module.size(), us * 1024 / module.size());
+  //as wasmPartitionInstall(): measured, then written from the file
+  std::vector<uint8_t> streamed;
+  FileSource source = {file, 0};
+  bool same = wasmFuelInstrumentSource(readFile, &source, module.size(), NULL, NULL, NULL) == length
+              && wasmFuelInstrumentSource(readFile, &source, module.size(), NULL, appendOutput, &streamed) == length && streamed == instrumented;
+  fclose(file);
+  printf("instrumented from the file in blocks of %d bytes: %s, %zu bytes read (%.1f x the module)\n", WASM_FUEL_READ_SIZE,
+         same ? "same module" : "DIFFERS", source.bytesRead, (double) source.bytesRead / module.size());
+  if (!same)
+    return 1;
+
+  if (argc > 2)
+  {
+    file = fopen(argv[2], "wb");
+    if (!file || fwrite(instrumented.data(), 1, instrumented.size(), file) != instrumented.size())
+    {
+      printf("Cannot write %s\n", argv[2]);
+      return 1;
+    }
+    fclose(file);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * @file Arduino.h
+ * @brief Host stand-in of the parts of the Arduino core used by the shared modules built by the host tools (see FS.h).
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file FS.h
+ * @brief Host stand-in of the Arduino file system API over stdio. A path "/name" is the file name in the directory of the
+ * environment variable SPIFFS_DIR (default: the working directory), so a module of the sketches is read on the host as
+ * SPIFFS.open("/main.wasm") reads it on the board (see tools/chunk_bench.cpp and BLE-communication/tools/delta_check.cpp).
+ * Copies of a File share the open file, as on the board.
+ */
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <string>
+#include "Arduino.h"
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+class File {
+public:
+  File() {}
+  explicit File(FILE *file) : handle(std::make_shared<Handle>(file)) {}
+  operator bool() const { return handle && handle->file; }
+  size_t size()
+  {
+    long position = ftell(handle->file);
+    fseek(handle->file, 0, SEEK_END);
+    long size = ftell(handle->file);
+    fseek(handle->file, position, SEEK_SET);
+    return size;
+  }
+  bool seek(uint32_t position, SeekMode mode = SeekSet)
+  {
+    return *this && !fseek(handle->file, position, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END);
+  }
+  size_t position() { return ftell(handle->file); }
+  size_t read(uint8_t *buffer, size_t len) { return *this ? fread(buffer, 1, len, handle->file) : 0; }
+  int read() { return *this ? fgetc(handle->file) : -1; } //one byte, -1 at the end
+  size_t write(const uint8_t *buffer, size_t len) { return *this ? fwrite(buffer, 1, len, handle->file) : 0; }
+  size_t write(uint8_t value) { return write(&value, 1); }
+  void close()
+  {
+    if (*this)
+      fclose(handle->file);
+    if (handle)
+      handle->file = NULL;
+  }
+
+private:
+  struct Handle {
+    FILE *file;
+    explicit Handle(FILE *file) : file(file) {}
+    ~Handle() { if (file) fclose(file); }
+  };
+  std::shared_ptr<Handle> handle;
+};
+
+class FS {
+public:
+  File open(const char *path, const char *mode = "r")
+  {
+    std::string mapped = hostPath(path);
+    std::string hostMode = std::string(mode) + "b";
+    return File(fopen(mapped.c_str(), hostMode.c_str()));
+  }
+  bool exists(const char *path)
+  {
+    FILE *file = fopen(hostPath(path).c_str(), "rb");
+    if (file)
+      fclose(file);
+    return file != NULL;
+  }
+  bool remove(const char *path) { return !::remove(hostPath(path).c_str()); }
+  bool rename(const char *from, const char *to) { return !::rename(hostPath(from).c_str(), hostPath(to).c_str()); }
+
+private:
+  static std::string hostPath(const char *path)
+  {
+    const char *directory = getenv("SPIFFS_DIR");
+    return std::string(directory ? directory : ".") + (*path == '/' ? "" : "/") + path;
+  }
+};
+
+#endif
@@ -0,0 +1,12 @@
+/**
+ * @file SPIFFS.h
+ * @brief Host stand-in of the SPIFFS file system (see FS.h).
+ */
+#ifndef HOST_SPIFFS_H
+#define HOST_SPIFFS_H
+
+#include "FS.h"
+
+inline FS SPIFFS; //one instance in all translation units (C++17)
+
+#endif
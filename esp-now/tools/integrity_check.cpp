@@ -0,0 +1,114 @@
+/**
+ * @file integrity_check.cpp
+ * @brief Host check of the integrity check of a received module (lib/shared/src/integrity.cpp). A module is split into payload packets as
+ * startTransmit() does, the digest of the header is computed as on the sender, and the packets are fed to the receiver side
+ * intact and damaged: a flipped bit, a missing last packet, a truncated packet, two swapped packets, a decoder which stages a wrong byte,
+ * and a header without digest. Every damaged reception has to be rejected, the others accepted. Each damage is also checked with the
+ * digest in a trailing digest packet after the payload (integrityExpect()), as the BLE server sends it to a client with the default MTU.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/integrity_check.cpp ../lib/shared/src/integrity.cpp ../lib/shared/src/dsp.cpp -o integrity_check && ./integrity_check data/main.wasm
+ */
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include "dsp.h"
+#include "integrity.h"
+
+#define PAYLOAD_SIZE 240 //MAX_PAYLOAD_SIZE of esp-now
+
+typedef std::vector<std::vector<uint8_t> > Packets;
+
+enum Damage { DAMAGE_NONE, DAMAGE_BIT, DAMAGE_LAST_PACKET, DAMAGE_TRUNCATED_PACKET, DAMAGE_SWAP, DAMAGE_DECODER, DAMAGE_NO_DIGEST };
+
+static const char *damageNames[] = {"intact", "flipped bit", "missing last packet", "truncated packet", "swapped packets",
+                                    "decoder error", "no digest"};
+
+/**
+ * @fn
+ * Receive the packets as writeModuleData() does (codec none: the payload is the module)
+ * @param trailing bool, the digest follows the payload instead of being in the header
+ * @return result of integrityVerify()
+ */
+static const char *receive(const uint8_t *header, const Packets &packets, bool decoderError, bool trailing)
+{
+  IntegrityCheck check;
+  integrityBegin(&check, trailing ? NULL : header);
+  for (size_t i = 0; i < packets.size(); i++)
+  {
+    const std::vector<uint8_t> &packet = packets[i];
+    integrityTransfer(&check, packet.data(), packet.size());
+    std::vector<uint8_t> decoded(packet);
+    if (decoderError && i == packets.size() / 2)
+      decoded[0] ^= 0x20;
+    integrityModule(&check, decoded.data(), decoded.size());
+  }
+  if (trailing && header)
+    integrityExpect(&check, header);
+  return integrityVerify(&check);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s module.wasm\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (!file)
+  {
+    printf("Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> module;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    module.insert(module.end(), buffer, buffer + n);
+  fclose(file);
+
+  Packets packets;
+  for (size_t offset = 0; offset < module.size(); offset += PAYLOAD_SIZE)
+    packets.push_back(std::vector<uint8_t>(module.begin() + offset, module.begin() + std::min(offset + PAYLOAD_SIZE, module.size())));
+  if (packets.size() < 3)
+  {
+    printf("%s is too small, at least 3 packets are needed\n", argv[1]);
+    return 1;
+  }
+
+  //the sender: transfer CRC of the payload (chunkSourceCrc()), hash of the module (hashModuleFile())
+  IntegrityDigest digest;
+  digest.moduleSize = module.size();
+  digest.moduleHash = integrityHash(INTEGRITY_HASH_SEED, module.data(), module.size());
+  digest.transferCrc = dspCrc32(0, module.data(), module.size());
+  uint8_t header[INTEGRITY_DIGEST_SIZE];
+  integrityPut(&digest, header);
+  printf("module %zu bytes, %zu packets, hash %08x, transfer CRC %08x\n", module.size(), packets.size(), digest.moduleHash, digest.transferCrc);
+
+  int failures = 0;
+  for (int trailing = 0; trailing < 2; trailing++)
+  {
+    printf(trailing ? "digest in a trailing packet\n" : "digest in the header\n");
+    //without a trailing digest packet the client rejects the module itself
+    for (int damage = DAMAGE_NONE; damage <= (trailing ? DAMAGE_DECODER : DAMAGE_NO_DIGEST); damage++)
+    {
+      Packets received(packets);
+      switch (damage)
+      {
+        case DAMAGE_BIT: received[received.size() / 2][7] ^= 0x01; break;
+        case DAMAGE_LAST_PACKET: received.pop_back(); break;
+        case DAMAGE_TRUNCATED_PACKET: received[1].resize(received[1].size() - 1); break;
+        case DAMAGE_SWAP: std::swap(received[0], received[1]); break;
+        default: break;
+      }
+      const char *error = receive(damage == DAMAGE_NO_DIGEST ? NULL : header, received, damage == DAMAGE_DECODER, trailing);
+      bool expected = damage == DAMAGE_NONE || damage == DAMAGE_NO_DIGEST;
+      bool ok = expected == (error == NULL);
+      failures += !ok;
+      printf("  %-22s %-24s %s\n", damageNames[damage], error ? error : "accepted", ok ? "ok" : "FAILED");
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file lzss_bench.cpp
+ * @brief Host benchmark of the LZSS codec of compressed transfers (lib/shared/src/lzss.cpp). Every module is compressed as
+ * lzssCompressFile() does and decompressed in chunks of the payload sizes of the links (240 bytes ESP-NOW, 17 bytes BLE with
+ * the default MTU, 1 byte: every item split), as OnDataRecv() and wasmNotifyCallback() feed lzssDecode(). The output has to
+ * match the module. Reports the compression ratio and the compress and decode throughput.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/lzss_bench.cpp ../lib/shared/src/lzss.cpp -o lzss_bench && ./lzss_bench [module.wasm ...]
+ *
+ * Without arguments, the sample modules of the sketches are used (data/main.wasm and the ones of BLE-communication).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "lzss.h"
+
+#define MIN_BENCH_BYTES (16 << 20) //module bytes per measurement, so a small module is timed over many rounds
+
+static const char *sampleModules[] = {"data/main.wasm", "../BLE-communication/client/data/main.wasm",
+                                      "../BLE-communication/server/data/main.wasm"};
+static const size_t chunkSizes[] = {240, 17, 1};
+
+static void appendOutput(const uint8_t *data, size_t len, void *context)
+{
+  std::vector<uint8_t> *output = (std::vector<uint8_t> *) context;
+  output->insert(output->end(), data, data + len);
+}
+
+static void discardOutput(const uint8_t *data, size_t len, void *context)
+{
+  (void) data;
+  *(size_t *) context += len;
+}
+
+static double micros()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+/**
+ * @fn
+ * Decompress a stream in chunks
+ * @return false if the stream is invalid
+ */
+static bool decode(LzssDecoder *decoder, const std::vector<uint8_t> &compressed, size_t chunkSize, LzssWriter writer, void *context)
+{
+  lzssDecoderInit(decoder);
+  for (size_t offset = 0; offset < compressed.size(); offset += chunkSize)
+  {
+    size_t len = compressed.size() - offset < chunkSize ? compressed.size() - offset : chunkSize;
+    if (!lzssDecode(decoder, compressed.data() + offset, len, writer, context))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char **paths = (const char **) argv + 1;
+  int pathCount = argc - 1;
+  if (!pathCount)
+  {
+    paths = sampleModules;
+    pathCount = sizeof(sampleModules) / sizeof(sampleModules[0]);
+  }
+
+  static LzssDecoder decoder;
+  int failures = 0;
+  printf("%-44s %7s %7s %6s %6s %13s %7s %13s %s\n", "", "bytes", "lzss", "ratio", "saved", "compress MB/s", "chunks",
+         "decode MB/s", "");
+  for (int p = 0; p < pathCount; p++)
+  {
+    const char *path = paths[p];
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+      printf("Cannot open %s\n", path);
+      failures++;
+      continue;
+    }
+    std::vector<uint8_t> module;
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      module.insert(module.end(), buffer, buffer + n);
+    fclose(file);
+    if (module.empty())
+    {
+      printf("%s is empty\n", path);
+      failures++;
+      continue;
+    }
+    int rounds = MIN_BENCH_BYTES / module.size() + 1;
+
+    std::vector<uint8_t> compressed;
+    double start = micros();
+    for (int round = 0; round < rounds; round++)
+    {
+      compressed.clear();
+      lzssCompress(module.data(), module.size(), appendOutput, &compressed);
+    }
+    double compressTime = micros() - start;
+
+    for (size_t c = 0; c < sizeof(chunkSizes) / sizeof(chunkSizes[0]); c++)
+    {
+      std::vector<uint8_t> decoded;
+      bool ok = decode(&decoder, compressed, chunkSizes[c], appendOutput, &decoded) && decoded == module;
+      size_t produced = 0;
+      start = micros();
+      for (int round = 0; round < rounds; round++)
+        decode(&decoder, compressed, chunkSizes[c], discardOutput, &produced);
+      double decodeTime = micros() - start;
+      ok = ok && produced == module.size() * rounds;
+      failures += !ok;
+      if (!c)
+        printf("%-44s %7zu %7zu %6.3f %5.1f%% %13.1f", path, module.size(), compressed.size(), (double) compressed.size() / module.size(),
+               100.0 - 100.0 * compressed.size() / module.size(), module.size() * rounds / compressTime);
+      else
+        printf("%-44s %7s %7s %6s %6s %13s", "", "", "", "", "", "");
+      printf(" %7zu %13.1f %s\n", chunkSizes[c], module.size() * rounds / decodeTime, ok ? "ok" : "CORRUPT");
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+/**
+ * @file mesh_sim.cpp
+ * @brief Host simulation of the ESP-NOW mesh (src/mesh.cpp) with many nodes. Measures delivery ratio, latency and forwarding overhead.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -Iinclude tools/mesh_sim.cpp src/mesh.cpp -o mesh_sim && ./mesh_sim [nodes] [seed]
+ *
+ * Nodes are placed at random in a square of 100 x 100 m, node 0 (the gateway) in a corner, with a radio range of RANGE m.
+ * A frame is received with a probability decreasing with the distance, unicast frames get MAC_RETRIES attempts like ESP-NOW.
+ * After WARMUP ms every node sends a packet to the gateway and the gateway sends a packet to every node every TRAFFIC_INTERVAL ms (spread over the interval).
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "mesh.h"
+
+#define AREA 100.0 //m
+#define RANGE 30.0 //m
+#define AIRTIME 1 //ms per frame
+#define MAC_RETRIES 3
+#define WARMUP 30000 //ms
+#define DURATION 90000 //ms
+#define TRAFFIC_INTERVAL 5000 //ms
+#define PAYLOAD_SIZE 200
+
+struct Node {
+  Mesh mesh;
+  double x, y;
+};
+
+struct Transmission {
+  uint32_t arrival;
+  int sender;
+  int receiver; //-1: every node in range
+  uint8_t frame[MESH_MAX_FRAME_SIZE];
+  size_t length;
+};
+
+struct Packet {
+  uint32_t sent;
+  bool upward;
+  bool delivered;
+  uint32_t latency;
+  int hops;
+};
+
+static std::vector<Node> nodes;
+static std::vector<Transmission> inFlight;
+static std::vector<Packet> packets;
+static uint64_t transmissions = 0; //data frames on the air
+static uint64_t announces = 0; //announce frames on the air
+static uint64_t beaconBytes = 0;
+
+static double uniform()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+static double receptionProbability(int a, int b)
+{
+  double d = hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y);
+  if (d >= RANGE)
+    return 0;
+  double r = d / RANGE;
+  return 0.98 - 0.6 * r * r * r;
+}
+
+static int nodeOfMac(const uint8_t *mac)
+{
+  return mac[4] << 8 | mac[5];
+}
+
+static void transmit(int sender, const uint8_t *mac, const uint8_t *frame, size_t length, uint32_t now)
+{
+  Transmission t;
+  t.arrival = now + AIRTIME + rand() % 2;
+  t.sender = sender;
+  t.receiver = mac[0] == 0xFF ? -1 : nodeOfMac(mac);
+  memcpy(t.frame, frame, length);
+  t.length = length;
+  inFlight.push_back(t);
+  if (frame[0] == MESH_BEACON_FLAG)
+    beaconBytes += length;
+  else if (length == MESH_HEADER_SIZE)
+    announces++;
+  else
+    transmissions++;
+}
+
+static void deliver(int receiver, const Transmission &t, uint32_t now)
+{
+  uint16_t source;
+  const uint8_t *payload;
+  size_t length = meshReceive(&nodes[receiver].mesh, nodes[t.sender].mesh.mac, t.frame, t.length, now, &source, &payload);
+  if (length < 4)
+    return;
+  uint32_t index = payload[0] << 24 | payload[1] << 16 | payload[2] << 8 | payload[3];
+  Packet &packet = packets[index];
+  if (packet.delivered)
+    return;
+  packet.delivered = true;
+  packet.latency = now - packet.sent;
+  packet.hops = MESH_MAX_HOPS - t.frame[1] + 1;
+}
+
+static void send(int sender, uint16_t destination, bool upward, uint32_t now)
+{
+  uint8_t payload[PAYLOAD_SIZE] = {0};
+  uint32_t index = packets.size();
+  payload[0] = index >> 24;
+  payload[1] = index >> 16;
+  payload[2] = index >> 8;
+  payload[3] = index;
+  packets.push_back({now, upward, false, 0, 0});
+
+  uint8_t frame[MESH_MAX_FRAME_SIZE];
+  uint8_t mac[6];
+  size_t length = meshBuildFrame(&nodes[sender].mesh, destination, payload, sizeof(payload), frame, mac);
+  if (length)
+    transmit(sender, mac, frame, length, now);
+}
+
+static void report(const char *name, bool upward)
+{
+  std::vector<uint32_t> latencies;
+  int count = 0;
+  double hops = 0;
+  for (const Packet &packet : packets)
+  {
+    if (packet.upward != upward)
+      continue;
+    count++;
+    if (packet.delivered)
+    {
+      latencies.push_back(packet.latency);
+      hops += packet.hops;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  double mean = 0;
+  for (uint32_t l : latencies)
+    mean += l;
+  size_t n = latencies.size();
+  printf("%-9s delivered %5.1f%% (%zu/%d)  hops %.2f  latency mean %.1f ms  p95 %u ms\n", name,
+         count ? 100.0 * n / count : 0, n, count, n ? hops / n : 0, n ? mean / n : 0, n ? latencies[n * 95 / 100] : 0);
+}
+
+int main(int argc, char **argv)
+{
+  int numberOfNodes = argc > 1 ? atoi(argv[1]) : 40;
+  srand(argc > 2 ? atoi(argv[2]) : 1);
+
+  nodes.resize(numberOfNodes);
+  for (int i = 0; i < numberOfNodes; i++)
+  {
+    uint8_t mac[6] = {0x24, 0x6F, 0x28, 0x00, (uint8_t) (i >> 8), (uint8_t) i};
+    nodes[i].x = i ? uniform() * AREA : 0;
+    nodes[i].y = i ? uniform() * AREA : 0;
+    meshInit(&nodes[i].mesh, mac, i == 0, 0);
+  }
+
+  for (uint32_t now = 0; now < DURATION; now++)
+  {
+    //radio
+    std::vector<Transmission> arrived;
+    for (size_t i = 0; i < inFlight.size();)
+    {
+      if (inFlight[i].arrival <= now)
+      {
+        arrived.push_back(inFlight[i]);
+        inFlight[i] = inFlight.back();
+        inFlight.pop_back();
+      }
+      else
+        i++;
+    }
+    for (const Transmission &t : arrived)
+    {
+      if (t.receiver < 0)
+      {
+        for (int r = 0; r < numberOfNodes; r++)
+        {
+          if (r != t.sender && uniform() < receptionProbability(t.sender, r))
+            deliver(r, t, now);
+        }
+      }
+      else
+      {
+        double p = receptionProbability(t.sender, t.receiver);
+        if (uniform() < 1 - pow(1 - p, MAC_RETRIES))
+          deliver(t.receiver, t, now);
+      }
+    }
+
+    //loop() of every node
+    for (int i = 0; i < numberOfNodes; i++)
+    {
+      uint8_t frame[MESH_MAX_FRAME_SIZE];
+      uint8_t mac[6];
+      size_t length;
+      while (meshPoll(&nodes[i].mesh, now, mac, frame, &length))
+        transmit(i, mac, frame, length, now);
+    }
+
+    //traffic
+    for (int i = 1; i < numberOfNodes && now >= WARMUP; i++)
+    {
+      //spread over the interval
+      if ((now - WARMUP) % TRAFFIC_INTERVAL == (uint32_t) i * TRAFFIC_INTERVAL / numberOfNodes)
+      {
+        send(i, MESH_GATEWAY_ID, true, now);
+        send(0, nodes[i].mesh.id, false, now);
+      }
+    }
+  }
+
+  int connected = 0;
+  int maxNeighbors = 0;
+  int maxRoutes = 0;
+  int maxHops = 0;
+  uint64_t forwarded = 0;
+  uint64_t dropped = 0;
+  for (Node &node : nodes)
+  {
+    int neighbors = 0;
+    int routes = 0;
+    for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+      neighbors += node.mesh.neighbors[i].used;
+    for (int i = 0; i < MESH_MAX_ROUTES; i++)
+      routes += node.mesh.routes[i].used;
+    maxNeighbors = std::max(maxNeighbors, neighbors);
+    maxRoutes = std::max(maxRoutes, routes);
+    maxHops = std::max(maxHops, (int) node.mesh.gatewayHops);
+    connected += node.mesh.parent >= 0;
+    forwarded += node.mesh.framesForwarded;
+    dropped += node.mesh.framesDropped;
+  }
+
+  size_t delivered = 0;
+  for (const Packet &packet : packets)
+    delivered += packet.delivered;
+  uint8_t depth;
+  int descendants = meshDescendants(&nodes[0].mesh, &depth);
+  printf("%d nodes (%d with a parent), max. %d hops to the gateway, max. %d neighbors and %d routes per node\n",
+         numberOfNodes, connected, maxHops, maxNeighbors, maxRoutes);
+  printf("the gateway sees %d nodes below it, %d hops deep (rollout depth, see meshDescendants())\n", descendants, depth);
+  report("upward", true);
+  report("downward", false);
+  printf("forwarding: %.2f data frames on the air per delivered packet, %llu forwarded, %llu dropped\n",
+         delivered ? (double) transmissions / delivered : 0, (unsigned long long) forwarded, (unsigned long long) dropped);
+  printf("control: beacons %.1f bytes/s, announces %.2f frames/s per node\n",
+         beaconBytes / (DURATION / 1000.0) / numberOfNodes, announces / (DURATION / 1000.0) / numberOfNodes);
+  return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * @file metrics_decode.cpp
+ * @brief Host decoder of the binary metrics frames (see metrics.h) a node writes to serial with -DMETRICS_SERIAL_INTERVAL=n.
+ * Reads the serial output, skips the text between the frames and prints every valid frame: the counters and gauges with their
+ * value, the histograms with their count, mean, median and 99th percentile (upper bounds of the buckets) and maximum.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/metrics_decode.cpp ../lib/shared/src/metrics.cpp -o metrics_decode && ./metrics_decode < serial.log
+ *   e.g. stty -F /dev/ttyUSB0 115200 raw && ./metrics_decode < /dev/ttyUSB0
+ */
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+static uint32_t get32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * @fn
+ * Upper bound of the bucket which holds the quantile q of a histogram
+ */
+static std::string quantile(const uint32_t *buckets, uint32_t count, double q)
+{
+  uint32_t cumulative = 0;
+  for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+  {
+    cumulative += buckets[bucket];
+    if (cumulative >= q * count && cumulative)
+      return bucket < METRIC_BUCKETS - 1 ? "<= " + std::to_string(1u << bucket) : "> " + std::to_string(1u << (METRIC_BUCKETS - 2));
+  }
+  return "-";
+}
+
+/**
+ * @fn
+ * Print the payload of a frame
+ * @return false if the payload is malformed
+ */
+static bool printPayload(const uint8_t *payload, size_t len)
+{
+  const uint8_t *p = payload, *end = payload + len;
+  if (len < 5 || p[0] != METRICS_VERSION)
+    return false;
+  printf("uptime %.3f s\n", get32(p + 1) / 1000.0);
+  p += 5;
+  while (p < end)
+  {
+    uint8_t type = *p++;
+    std::string name;
+    for (int part = 0; part < 2; part++)
+    {
+      if (p >= end || end - p - 1 < *p)
+        return false;
+      std::string s((const char *) p + 1, *p);
+      p += 1 + *p;
+      name += part ? (s.empty() ? "" : "{" + s + "}") : s;
+    }
+    if (end - p < 4)
+      return false;
+    uint32_t value = get32(p);
+    p += 4;
+    if (type != METRIC_HISTOGRAM)
+    {
+      printf("  %-48s %u\n", name.c_str(), value);
+      continue;
+    }
+
+    if (end - p < 16)
+      return false;
+    uint64_t sum = get32(p) | (uint64_t) get32(p + 4) << 32;
+    uint32_t max = get32(p + 8), mask = get32(p + 12);
+    p += 16;
+    uint32_t buckets[METRIC_BUCKETS] = {0};
+    for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+      if (!(mask & (1u << bucket)))
+        continue;
+      if (end - p < 4)
+        return false;
+      buckets[bucket] = get32(p);
+      p += 4;
+    }
+    if (!value)
+    {
+      printf("  %-48s count 0\n", name.c_str());
+      continue;
+    }
+    printf("  %-48s count %u, mean %.1f, p50 %s, p99 %s, max %u\n", name.c_str(), value, (double) sum / value,
+           quantile(buckets, value, 0.5).c_str(), quantile(buckets, value, 0.99).c_str(), max);
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * Print the frames of the input and remove the scanned input. The rest is the text output of the node.
+ * @param input std::vector<uint8_t> &
+ * @param end bool, end of the input: an incomplete frame is sync bytes in the text
+ */
+static void scan(std::vector<uint8_t> &input, bool end, int *frames, int *invalid)
+{
+  size_t i = 0;
+  while (i + 4 <= input.size())
+  {
+    if (input[i] != (METRICS_SYNC & 0xff) || input[i + 1] != METRICS_SYNC >> 8)
+    {
+      i++;
+      continue;
+    }
+    size_t len = input[i + 2] | input[i + 3] << 8;
+    if (i + 4 + len + 2 > input.size())
+    {
+      if (!end)
+        break; //the frame is not complete yet
+      i++;
+      continue;
+    }
+    const uint8_t *payload = input.data() + i + 4;
+    uint16_t checksum = payload[len] | payload[len + 1] << 8;
+    if (checksum != metricsChecksum(payload, len) || !printPayload(payload, len))
+    {
+      (*invalid)++;
+      i++; //sync bytes in the text
+      continue;
+    }
+    (*frames)++;
+    fflush(stdout);
+    i += 4 + len + 2;
+  }
+  input.erase(input.begin(), end ? input.end() : input.begin() + i);
+}
+
+int main()
+{
+  std::vector<uint8_t> input;
+  uint8_t buffer[4096];
+  size_t n;
+  int frames = 0, invalid = 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+  {
+    input.insert(input.end(), buffer, buffer + n);
+    scan(input, false, &frames, &invalid);
+  }
+  scan(input, true, &frames, &invalid);
+  fprintf(stderr, "%d frames, %d invalid\n", frames, invalid);
+  return 0;
+}
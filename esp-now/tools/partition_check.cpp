@@ -0,0 +1,199 @@
+/**
+ * @file partition_check.cpp
+ * @brief Host check of the module partitions (see wasm_partition.h) with the mmap() stand-in of tools/wasm_partition_host.cpp.
+ * Installs a module, maps it and compares the mapping with the instrumented module, then checks that
+ * - an installed module is used again without writing its partition
+ * - a module is installed next to a busy slot (A/B) and both mappings are valid at once
+ * - a slot with an interrupted copy (no header) is not mapped and is written again
+ * - a module larger than the stack of the loop task (a padded copy of the module) is installed and mapped
+ * - a file which is no module is not installed
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/partition_check.cpp tools/wasm_partition_host.cpp ../lib/shared/src/wasm_fuel.cpp -o partition_check && ./partition_check data/main.wasm
+ *
+ * The partition files are written to a new directory in /tmp, unless WASM_PARTITION_DIR is set.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "wasm_fuel.h"
+#include "wasm_partition.h"
+
+#define LOOP_STACK_SIZE 8192 //stack of the Arduino loop task
+#define PADDING_SIZE (8 * LOOP_STACK_SIZE) //custom section of the large module
+
+static std::string directory;
+static int failures = 0;
+
+static bool appendOutput(void *context, const uint8_t *data, size_t len)
+{
+  std::vector<uint8_t> *output = (std::vector<uint8_t> *) context;
+  output->insert(output->end(), data, data + len);
+  return true;
+}
+
+static double micros()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static void check(const char *name, bool ok)
+{
+  failures += !ok;
+  printf("  %-58s %s\n", name, ok ? "ok" : "FAILED");
+}
+
+static bool writeFile(const std::string &path, const std::vector<uint8_t> &data)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  bool ok = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+  if (file)
+    fclose(file);
+  return ok;
+}
+
+static std::string partitionPath(int slot)
+{
+  return directory + "/wasm" + std::to_string(slot);
+}
+
+/**
+ * @fn
+ * Modification time of the file of a slot, to see whether an install wrote it
+ */
+static long long modified(int slot)
+{
+  struct stat status;
+  if (stat(partitionPath(slot).c_str(), &status))
+    return -1;
+  return (long long) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+}
+
+/**
+ * @fn
+ * Map a slot and compare it with the instrumented module
+ */
+static bool mapsModule(int slot, const std::vector<uint8_t> &instrumented)
+{
+  size_t length = 0;
+  const uint8_t *mapped = slot < 0 ? NULL : wasmPartitionMap(slot, &length);
+  return mapped && length == instrumented.size() && !memcmp(mapped, instrumented.data(), length);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s module.wasm\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (!file)
+  {
+    printf("Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> module;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    module.insert(module.end(), buffer, buffer + n);
+  fclose(file);
+  std::vector<uint8_t> instrumented;
+  if (!wasmFuelInstrument(module.data(), module.size(), NULL, appendOutput, &instrumented))
+  {
+    printf("%s cannot be instrumented\n", argv[1]);
+    return 1;
+  }
+
+  if (getenv("WASM_PARTITION_DIR"))
+    directory = getenv("WASM_PARTITION_DIR");
+  else
+  {
+    char temporary[] = "/tmp/wasm_partitions_XXXXXX";
+    if (!mkdtemp(temporary))
+    {
+      printf("Cannot create a directory in /tmp\n");
+      return 1;
+    }
+    directory = temporary;
+    setenv("WASM_PARTITION_DIR", temporary, 1);
+  }
+  printf("partitions in %s\n", directory.c_str());
+  std::string modulePath = directory + "/main.wasm";
+  writeFile(modulePath, module);
+
+  double start = micros();
+  int slotA = wasmPartitionInstall(modulePath.c_str(), 0, NULL);
+  double installTime = micros() - start;
+  start = micros();
+  check("installed and mapped as instrumented", mapsModule(slotA, instrumented));
+  double mapTime = micros() - start;
+
+  long long written = modified(slotA);
+  usleep(10000);
+  start = micros();
+  int again = wasmPartitionInstall(modulePath.c_str(), 0, NULL);
+  double compareTime = micros() - start;
+  check("installed module used again without writing", again == slotA && modified(slotA) == written);
+
+  uint32_t busy = WASM_PARTITION_SLOT_MASK(slotA);
+  int slotB = wasmPartitionInstall(modulePath.c_str(), busy, NULL);
+  size_t lengthA = 0, lengthB = 0;
+  const uint8_t *mappedA = wasmPartitionMap(slotA, &lengthA);
+  const uint8_t *mappedB = slotB < 0 ? NULL : wasmPartitionMap(slotB, &lengthB);
+  check("installed next to the busy slot, both mapped at once", slotB >= 0 && slotB != slotA && mappedA && mappedB && mappedA != mappedB
+        && lengthA == lengthB && !memcmp(mappedA, mappedB, lengthA));
+
+  //an interrupted copy: the header is written last, so it is still erased
+  wasmPartitionUnmap(slotB);
+  int fd = open(partitionPath(slotB).c_str(), O_WRONLY);
+  const uint8_t erased[WASM_PARTITION_HEADER_SIZE] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  bool interrupted = fd >= 0 && pwrite(fd, erased, sizeof(erased), 0) == (ssize_t) sizeof(erased);
+  if (fd >= 0)
+    close(fd);
+  n = 0;
+  check("interrupted copy not mapped", interrupted && !wasmPartitionMap(slotB, &n));
+  check("interrupted copy written again", wasmPartitionInstall(modulePath.c_str(), busy, NULL) == slotB && mapsModule(slotB, instrumented));
+
+  //a custom section after the module: copied by the instrumentation, so the instrumented module grows by it as well
+  std::vector<uint8_t> large(module);
+  const char name[] = "padding";
+  std::vector<uint8_t> content(PADDING_SIZE, 0x5a);
+  content[0] = sizeof(name) - 1;
+  memcpy(&content[1], name, sizeof(name) - 1);
+  large.push_back(0);
+  for (uint32_t size = content.size(); ; size >>= 7)
+  {
+    large.push_back((size & 0x7f) | (size >> 7 ? 0x80 : 0));
+    if (!(size >> 7))
+      break;
+  }
+  large.insert(large.end(), content.begin(), content.end());
+  std::vector<uint8_t> largeInstrumented;
+  wasmFuelInstrument(large.data(), large.size(), NULL, appendOutput, &largeInstrumented);
+  std::string largePath = directory + "/large.wasm";
+  writeFile(largePath, large);
+  int slotLarge = wasmPartitionInstall(largePath.c_str(), busy, NULL);
+  char largeName[80];
+  snprintf(largeName, sizeof(largeName), "module of %zu bytes (%zu x the loop stack) mapped", large.size(), large.size() / LOOP_STACK_SIZE);
+  check(largeName, slotLarge >= 0 && mapsModule(slotLarge, largeInstrumented));
+
+  std::string textPath = directory + "/text.wasm";
+  writeFile(textPath, std::vector<uint8_t>(name, name + sizeof(name)));
+  check("file which is no module not installed", wasmPartitionInstall(textPath.c_str(), 0, NULL) < 0);
+
+  for (int slot = 0; slot < WASM_PARTITION_SLOTS; slot++)
+    wasmPartitionUnmap(slot);
+  printf("module %zu bytes: install %.0f us, install of an installed module %.0f us, map %.0f us (host)\n", module.size(), installTime,
+         compareTime, mapTime);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,413 @@
+/**
+ * @file relay_sim.cpp
+ * @brief Host simulation of a rollout relayed hop by hop (see startRelay() in src/main.cpp). Compares the end-to-end latency
+ * of store-and-forward (a node relays the module after receiving all of it) and cut-through (a node relays each packet as soon as
+ * it is received in order) versus the depth of a chain and of a binary tree.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 tools/relay_sim.cpp -o relay_sim && ./relay_sim [packets] [loss] [runs]
+ *
+ * Every link runs the selective repeat of the sketch: a window of TRANSMIT_WINDOW_SIZE packets, an ACK after ACK_INTERVAL in-order packets
+ * or at a gap, and a retransmission after RETRANSMIT_TIMEOUT. A relay with several children serves them in turns, one packet each.
+ * The radio is slotted, one frame (data or ACK) per slot: a node defers while a neighbor sends (carrier sense),
+ * it cannot receive while it sends, a frame collides with another frame sent in range of the receiver (hidden node),
+ * and an attempt is lost with the probability loss. Like ESP-NOW, a failed unicast frame is repeated by the MAC
+ * (MAC_ATTEMPTS attempts, random backoff) before the selective repeat has to recover it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#define TRANSMIT_WINDOW_SIZE 8
+#define ACK_INTERVAL (TRANSMIT_WINDOW_SIZE / 2)
+#define RETRANSMIT_TIMEOUT 200 //ms
+#define TRANSMIT_MAX_SESSIONS 4
+#define MAC_ATTEMPTS 4
+#define SLOT_MS 2 //airtime of a frame of 250 bytes at 1 Mbit/s with the MAC overhead
+#define MAX_DEPTH 8
+#define MAX_SLOTS 1000000
+
+enum PacketState { PACKET_PENDING, PACKET_SENT, PACKET_ACKED };
+
+struct Session {
+  int destination;
+  int windowBase;
+  int nextSequence;
+  PacketState packetState[TRANSMIT_WINDOW_SIZE];
+  long packetSentSlot[TRANSMIT_WINDOW_SIZE];
+};
+
+struct Frame {
+  int sender;
+  int receiver;
+  bool ack;
+  int sequence; //data: sequence number, ACK: next expected
+  unsigned bitmap;
+};
+struct Node {
+  int parent;
+  std::vector<int> children;
+  std::vector<int> inRange; //nodes which hear this node
+  //reception
+  bool headerReceived;
+  int inOrder; //received in order, sequence numbers 1..inOrder
+  std::vector<bool> buffered;
+  int packetsSinceAck;
+  bool ackPending;
+  long completedSlot;
+  //transmission
+  std::vector<Session> sessions;
+  size_t nextSession;
+  //MAC
+  bool macPending;
+  int macAttempts;
+  Frame macFrame;
+};
+
+
+static std::vector<Node> nodes;
+static int numberOfPackets;
+static double loss;
+static bool cutThrough;
+
+static double uniform()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+static void link(int a, int b)
+{
+  nodes[a].inRange.push_back(b);
+  nodes[b].inRange.push_back(a);
+}
+
+static void addNode(int parent)
+{
+  Node node = {};
+  node.parent = parent;
+  node.buffered.assign(numberOfPackets + 2, false);
+  node.completedSlot = -1;
+  nodes.push_back(node);
+  int id = nodes.size() - 1;
+  if (parent < 0)
+    return;
+  //siblings are in range of each other, since all of them are in range of the parent
+  for (int sibling : nodes[parent].children)
+    link(sibling, id);
+  nodes[parent].children.push_back(id);
+  link(parent, id);
+}
+
+static void buildChain(int depth)
+{
+  nodes.clear();
+  addNode(-1);
+  for (int i = 1; i <= depth; i++)
+    addNode(i - 1);
+}
+
+static void buildTree(int depth)
+{
+  nodes.clear();
+  addNode(-1);
+  size_t first = 0;
+  for (int level = 1; level <= depth; level++)
+  {
+    size_t last = nodes.size();
+    for (size_t parent = first; parent < last; parent++)
+    {
+      addNode(parent);
+      addNode(parent);
+    }
+    first = last;
+  }
+}
+
+/**
+ * @fn
+ * Payload packets which a node can send: all for the root, otherwise the received ones (cut-through) or none until the module is complete
+ */
+static int availablePackets(const Node &node)
+{
+  if (node.parent < 0 || node.inOrder == numberOfPackets)
+    return numberOfPackets;
+  return cutThrough ? node.inOrder : 0;
+}
+
+static void startSessions(Node &node)
+{
+  for (int child : node.children)
+  {
+    Session session = {};
+    session.destination = child;
+    node.sessions.push_back(session);
+  }
+}
+
+static int nextPacketToSend(Session &session, int available, long slot)
+{
+  for (int sequence = session.windowBase; sequence < session.nextSequence; sequence++)
+  {
+    int s = sequence % TRANSMIT_WINDOW_SIZE;
+    if (session.packetState[s] == PACKET_PENDING
+        || (session.packetState[s] == PACKET_SENT && (slot - session.packetSentSlot[s]) * SLOT_MS >= RETRANSMIT_TIMEOUT))
+      return sequence;
+  }
+  if (session.nextSequence <= available && session.nextSequence < session.windowBase + TRANSMIT_WINDOW_SIZE)
+  {
+    session.packetState[session.nextSequence % TRANSMIT_WINDOW_SIZE] = PACKET_PENDING;
+    return session.nextSequence++;
+  }
+  return -1;
+}
+
+/**
+ * @fn
+ * Frame which a node wants to send in this slot: a pending ACK, otherwise a packet of the next session which has one
+ */
+static bool nextFrame(int id, long slot, Frame *frame)
+{
+  Node &node = nodes[id];
+  frame->sender = id;
+  if (node.ackPending)
+  {
+    frame->receiver = node.parent;
+    frame->ack = true;
+    frame->sequence = node.inOrder + 1;
+    frame->bitmap = 0;
+    for (int i = 0; i < TRANSMIT_WINDOW_SIZE - 1; i++)
+    {
+      int sequence = node.inOrder + 2 + i;
+      if (sequence <= numberOfPackets && node.buffered[sequence])
+        frame->bitmap |= 1u << i;
+    }
+    return true;
+  }
+  int available = availablePackets(node);
+  for (size_t i = 0; i < node.sessions.size(); i++)
+  {
+    size_t index = (node.nextSession + i) % node.sessions.size();
+    Session &session = node.sessions[index];
+    if (session.windowBase > numberOfPackets)
+      continue;
+    int sequence = nextPacketToSend(session, available, slot);
+    if (sequence < 0)
+      continue;
+    node.nextSession = index + 1;
+    frame->receiver = session.destination;
+    frame->ack = false;
+    frame->sequence = sequence;
+    return true;
+  }
+  return false;
+}
+
+static void sent(const Frame &frame, long slot)
+{
+  Node &node = nodes[frame.sender];
+  if (frame.ack)
+  {
+    node.ackPending = false;
+    node.packetsSinceAck = 0;
+    return;
+  }
+  for (Session &session : node.sessions)
+  {
+    if (session.destination == frame.receiver)
+    {
+      session.packetState[frame.sequence % TRANSMIT_WINDOW_SIZE] = PACKET_SENT;
+      session.packetSentSlot[frame.sequence % TRANSMIT_WINDOW_SIZE] = slot;
+    }
+  }
+}
+
+static void receiveAck(const Frame &frame)
+{
+  for (Session &session : nodes[frame.receiver].sessions)
+  {
+    if (session.destination != frame.sender || frame.sequence < session.windowBase || frame.sequence > session.nextSequence)
+      continue;
+    session.windowBase = frame.sequence;
+    int highestBuffered = -1;
+    for (int i = 0; i < TRANSMIT_WINDOW_SIZE - 1; i++)
+    {
+      int sequence = session.windowBase + 1 + i;
+      if (sequence >= session.nextSequence)
+        break;
+      if (frame.bitmap & (1u << i))
+      {
+        session.packetState[sequence % TRANSMIT_WINDOW_SIZE] = PACKET_ACKED;
+        highestBuffered = i;
+      }
+    }
+    for (int i = -1; i < highestBuffered; i++)
+    {
+      int s = (session.windowBase + 1 + i) % TRANSMIT_WINDOW_SIZE;
+      if (session.packetState[s] == PACKET_SENT)
+        session.packetState[s] = PACKET_PENDING;
+    }
+  }
+}
+
+static void receiveData(const Frame &frame, long slot)
+{
+  Node &node = nodes[frame.receiver];
+  if (frame.sequence == 0)
+  {
+    if (!node.headerReceived)
+    {
+      node.headerReceived = true;
+      startSessions(node);
+    }
+    node.ackPending = true;
+    return;
+  }
+  if (!node.headerReceived)
+    return;
+  if (frame.sequence <= node.inOrder)
+  {
+    node.ackPending = true; //duplicate, the last ACK was lost
+    return;
+  }
+  if (frame.sequence > node.inOrder + TRANSMIT_WINDOW_SIZE)
+    return;
+  node.buffered[frame.sequence] = true;
+  if (frame.sequence != node.inOrder + 1)
+  {
+    node.ackPending = true; //gap
+    return;
+  }
+  while (node.inOrder < numberOfPackets && node.buffered[node.inOrder + 1])
+  {
+    node.inOrder++;
+    node.packetsSinceAck++;
+  }
+  if (node.packetsSinceAck >= ACK_INTERVAL || node.inOrder == numberOfPackets)
+    node.ackPending = true;
+  if (node.inOrder == numberOfPackets && node.completedSlot < 0)
+    node.completedSlot = slot;
+}
+
+/**
+ * @fn
+ * Run one rollout from node 0
+ * @return ms until every node has the module, -1 if it did not finish
+ */
+static long run()
+{
+  nodes[0].headerReceived = true;
+  nodes[0].inOrder = numberOfPackets;
+  nodes[0].completedSlot = 0;
+  startSessions(nodes[0]);
+
+  std::vector<int> order(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++)
+    order[i] = i;
+
+  for (long slot = 0; slot < MAX_SLOTS; slot++)
+  {
+    bool complete = true;
+    for (const Node &node : nodes)
+      complete = complete && node.completedSlot >= 0;
+    if (complete)
+    {
+      long last = 0;
+      for (const Node &node : nodes)
+        last = std::max(last, node.completedSlot);
+      return (last + 1) * SLOT_MS;
+    }
+
+    //carrier sense: a node sends if no node in range has taken the slot
+    for (size_t i = order.size() - 1; i > 0; i--)
+      std::swap(order[i], order[rand() % (i + 1)]);
+    std::vector<bool> sending(nodes.size(), false);
+    std::vector<Frame> frames;
+    for (int id : order)
+    {
+      Node &node = nodes[id];
+      bool busy = false;
+      for (int other : node.inRange)
+        busy = busy || sending[other];
+      if (busy)
+        continue;
+      if (!node.macPending)
+      {
+        if (!nextFrame(id, slot, &node.macFrame))
+          continue;
+        node.macPending = true;
+        node.macAttempts = 0;
+        sent(node.macFrame, slot);
+      }
+      else if (uniform() < 0.5)
+        continue; //backoff of a repeated frame
+      sending[id] = true;
+      node.macAttempts++;
+      frames.push_back(node.macFrame);
+    }
+
+    for (const Frame &frame : frames)
+    {
+      Node &sender = nodes[frame.sender];
+      bool collision = false;
+      for (int other : nodes[frame.receiver].inRange)
+        collision = collision || (other != frame.sender && sending[other]);
+      if (sending[frame.receiver] || collision || uniform() < loss)
+      {
+        if (sender.macAttempts == MAC_ATTEMPTS)
+          sender.macPending = false; //lost, the selective repeat recovers it
+        continue;
+      }
+      sender.macPending = false;
+      if (frame.ack)
+        receiveAck(frame);
+      else
+        receiveData(frame, slot);
+    }
+  }
+  return -1;
+}
+
+static double meanLatency(bool tree, int depth, bool relayCutThrough, int runs)
+{
+  cutThrough = relayCutThrough;
+  double sum = 0;
+  int finished = 0;
+  for (int i = 0; i < runs; i++)
+  {
+    if (tree)
+      buildTree(depth);
+    else
+      buildChain(depth);
+    long latency = run();
+    if (latency >= 0)
+    {
+      sum += latency;
+      finished++;
+    }
+  }
+  return finished ? sum / finished : -1;
+}
+
+int main(int argc, char **argv)
+{
+  numberOfPackets = argc > 1 ? atoi(argv[1]) : 40;
+  loss = argc > 2 ? atof(argv[2]) : 0.05;
+  int runs = argc > 3 ? atoi(argv[3]) : 20;
+  srand(1);
+
+  printf("%d packets, loss %.2f, mean of %d runs, ms until the last node has the module\n", numberOfPackets, loss, runs);
+  printf("depth | chain: store-and-forward  cut-through  speedup | binary tree: store-and-forward  cut-through  speedup\n");
+  for (int depth = 1; depth <= MAX_DEPTH; depth++)
+  {
+    double chainStore = meanLatency(false, depth, false, runs);
+    double chainCut = meanLatency(false, depth, true, runs);
+    double treeStore = meanLatency(true, depth, false, runs);
+    double treeCut = meanLatency(true, depth, true, runs);
+    printf("%5d | %24.0f %12.0f %8.2f | %30.0f %12.0f %8.2f\n", depth,
+           chainStore, chainCut, chainCut > 0 ? chainStore / chainCut : 0,
+           treeStore, treeCut, treeCut > 0 ? treeStore / treeCut : 0);
+  }
+  return 0;
+}
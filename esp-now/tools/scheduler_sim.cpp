@@ -0,0 +1,138 @@
+/**
+ * @file scheduler_sim.cpp
+ * @brief Host simulation of the module tasks (src/wasm_scheduler.cpp on std::thread). Runs modules with a busy-wait work
+ * per run instead of wasm and reports the runs, overruns, run times and release jitter of every task, while the main
+ * thread switches the module of a task the way loop() does (wasmTaskLock()) and wakes a task with a long period the way
+ * a received message does (wasmTaskWake()), reporting the latency from the wake to the start of the run.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -pthread -Iinclude tools/scheduler_sim.cpp src/wasm_scheduler.cpp -o scheduler_sim && ./scheduler_sim [duration ms]
+ *
+ * A run checks that the module it sees was switched completely (version and data belong together), and counts a torn switch as error.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "wasm_scheduler.h"
+
+#define SWITCH_INTERVAL 50 //ms between two module switches of the first task
+
+struct SimModule {
+  uint32_t version;
+  uint32_t data; //version * 7, as a module and its runtime which are switched together
+};
+
+struct SimTaskSetup {
+  WasmTaskConfig config;
+  uint32_t work; //us of busy-waiting per run
+};
+
+struct SimTask {
+  WasmTaskConfig config;
+  uint32_t work; //us of busy-waiting per run
+  WasmTask task;
+  SimModule *module;
+  uint64_t lastStart;
+  uint64_t maxJitter; //us, start of a run after its release
+  uint32_t tornSwitches;
+  volatile uint64_t wokenAt; //us, 0 if not woken
+  uint64_t maxWakeLatency; //us
+  uint32_t wokenRuns;
+};
+
+static void busyWait(uint32_t us)
+{
+  uint64_t end = wasmTaskClock() + us;
+  while (wasmTaskClock() < end)
+    ;
+}
+
+static void runModule(void *context)
+{
+  SimTask *sim = (SimTask *) context;
+  uint64_t start = wasmTaskClock();
+  uint64_t wokenAt = sim->wokenAt;
+  if (wokenAt)
+  {
+    sim->wokenAt = 0;
+    sim->wokenRuns++;
+    if (start - wokenAt > sim->maxWakeLatency)
+      sim->maxWakeLatency = start - wokenAt;
+  }
+  else
+  {
+    uint64_t jitter = start > sim->task.release ? start - sim->task.release : 0;
+    if (sim->task.runs && jitter > sim->maxJitter)
+      sim->maxJitter = jitter;
+  }
+  sim->lastStart = start;
+
+  SimModule *module = sim->module;
+  if (module->data != module->version * 7)
+    sim->tornSwitches++;
+  busyWait(sim->work);
+  if (sim->module != module)
+    sim->tornSwitches++;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t duration = argc > 1 ? atoi(argv[1]) : 2000;
+
+  SimModule modules[2] = {{0, 0}, {1, 7}};
+  static const SimTaskSetup setups[] = {
+    {{"sensor", 10, 2, 1, 8192}, 1000},
+    {{"fft", 50, 1, 1, 8192}, 20000},
+    {{"slow", 20, 1, 1, 8192}, 30000}, //longer than its period: overruns
+    {{"busy", 0, 1, 1, 8192}, 500}, //runs again at once
+    {{"event", 1000, 2, 1, 8192}, 200}, //woken by the main thread
+  };
+  const size_t count = sizeof(setups) / sizeof(setups[0]);
+  SimTask tasks[count] = {};
+
+  for (size_t i = 0; i < count; i++)
+  {
+    tasks[i].config = setups[i].config;
+    tasks[i].work = setups[i].work;
+    tasks[i].module = &modules[0];
+    if (!wasmTaskStart(&tasks[i].task, &tasks[i].config, runModule, &tasks[i]))
+    {
+      printf("Cannot start %s\n", tasks[i].config.name);
+      return 1;
+    }
+  }
+
+  //switch the module of the first task as loop() does after a reception
+  uint32_t switches = 0;
+  uint64_t end = wasmTaskClock() + (uint64_t) duration * 1000;
+  while (wasmTaskClock() < end)
+  {
+    busyWait(SWITCH_INTERVAL * 1000);
+    SimModule *next = tasks[0].module == &modules[0] ? &modules[1] : &modules[0];
+    next->version += 2;
+    next->data = next->version * 7;
+    wasmTaskLock(&tasks[0].task);
+    tasks[0].module = next;
+    wasmTaskUnlock(&tasks[0].task);
+    switches++;
+
+    //data for the last task has arrived
+    tasks[count - 1].wokenAt = wasmTaskClock();
+    wasmTaskWake(&tasks[count - 1].task);
+  }
+
+  printf("%u ms, %u module switches of %s\n", duration, switches, tasks[0].config.name);
+  printf("%-8s %8s %8s %8s %10s %10s %12s %6s\n", "task", "period", "work", "runs", "expected", "overruns", "max jitter", "torn");
+  int errors = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    wasmTaskStop(&tasks[i].task);
+    const WasmTask &task = tasks[i].task;
+    uint32_t expected = task.config.period ? duration / task.config.period : 0;
+    printf("%-8s %6u ms %5u us %8u %10u %10u %9lu us %6u\n", task.config.name, task.config.period, tasks[i].work,
+           task.runs, expected, task.overruns, (unsigned long) tasks[i].maxJitter, tasks[i].tornSwitches);
+    errors += tasks[i].tornSwitches;
+  }
+  printf("%s: %u woken runs, max. latency from the wake to the run %lu us\n", tasks[count - 1].config.name, tasks[count - 1].wokenRuns,
+         (unsigned long) tasks[count - 1].maxWakeLatency);
+  return errors ? 1 : 0;
+}
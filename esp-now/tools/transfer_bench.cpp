@@ -0,0 +1,273 @@
+/**
+ * @file transfer_bench.cpp
+ * @brief Host benchmark of the transfer engine (lib/shared/src/transfer.cpp) over a loopback TransferLink. Measures the goodput, the retransmissions
+ * and the CPU time of the engine per byte for the link profiles of the sketches, so a change of the engine can be compared without radios.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/transfer_bench.cpp ../lib/shared/src/transfer.cpp -o transfer_bench && ./transfer_bench [--window[=1,2,...]] [module size] [loss %] [seed]
+ *
+ * Link model: a packet occupies the channel for its length / bandwidth and arrives after the latency. The link queues up to
+ * LINK_QUEUE_SIZE packets, a packet beyond that is refused (the sender sends it again later). A packet is lost with the given
+ * probability, in both directions. The receiver answers at once when an ACK is due, the credit is always the whole window.
+ * Without the loss argument, the losses 0, 1, 5 and 10 % are run.
+ * With --window every profile is run with the windows of a sweep (default 1, 2, 4, 8, 16 and 32 packets, TRANSMIT_WINDOW_SIZE of the
+ * sketches) instead of its own window, so the throughput versus the window size is measured.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+#include "transfer.h"
+
+#define LINK_QUEUE_SIZE 8 //packets waiting for the channel
+#define TIME_STEP 100 //us
+#define TIME_LIMIT 600000000ULL //us
+
+struct Profile {
+  const char *name;
+  uint16_t payloadSize;
+  uint8_t window;
+  uint32_t retransmitTimeout; //ms
+  bool waitForCredit;
+  uint32_t latency; //us
+  double bandwidth; //bytes per us
+};
+
+struct Packet {
+  uint64_t arrival; //us
+  std::vector<uint8_t> data;
+};
+
+struct Link {
+  std::deque<Packet> queue;
+  uint64_t channelFree; //us
+  uint64_t now; //us
+};
+
+struct Result {
+  uint64_t time; //us
+  uint32_t packetsSent;
+  uint32_t retransmissions;
+  uint32_t duplicates;
+  int refused;
+  double engineNanos; //CPU time in the engine
+  bool intact;
+};
+
+static double lossProbability = 0;
+static const uint8_t *module = NULL;
+static size_t moduleSize = 0;
+static uint16_t payloadSize = 0;
+static std::vector<uint8_t> received;
+
+static double uniform()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+static double nanos()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static bool linkSend(Link *link, const Profile &profile, const uint8_t *data, size_t len)
+{
+  if (link->queue.size() >= LINK_QUEUE_SIZE)
+    return false;
+  uint64_t start = link->channelFree > link->now ? link->channelFree : link->now;
+  link->channelFree = start + (uint64_t) (len / profile.bandwidth);
+  if (uniform() < lossProbability)
+    return true; //lost on the air, the sender does not notice
+  link->queue.push_back({link->channelFree + profile.latency, std::vector<uint8_t>(data, data + len)});
+  return true;
+}
+
+//sender side of the loopback
+static Link downlink;
+static const Profile *currentProfile = NULL;
+
+static bool sendDown(void *context, const uint8_t *data, size_t len)
+{
+  (void) context;
+  return linkSend(&downlink, *currentProfile, data, len);
+}
+
+static uint16_t buildPacket(void *context, uint16_t sequence, uint8_t *packet)
+{
+  TransferSender *sender = (TransferSender *) context;
+  if (sequence == 0)
+  {
+    transferBuildHeader(sender->numberOfPackets, packet);
+    packet[3] = sender->transferId;
+    return 4;
+  }
+  size_t offset = (size_t) (sequence - 1) * payloadSize;
+  size_t len = moduleSize - offset < payloadSize ? moduleSize - offset : payloadSize;
+  return transferBuildData(sequence, module + offset, len, packet);
+}
+
+static void writePacket(void *context, uint16_t offset, const uint8_t *data, size_t len)
+{
+  (void) context;
+  memcpy(received.data() + (size_t) (offset - 1) * payloadSize, data, len);
+}
+
+static Result run(const Profile &profile)
+{
+  Result result = {0, 0, 0, 0, 0, 0, false};
+  currentProfile = &profile;
+  payloadSize = profile.payloadSize;
+  received.assign(moduleSize, 0);
+  downlink = Link();
+  Link uplink = Link();
+
+  TransferSender sender;
+  TransferLink link = {sendDown, NULL, NULL, NULL};
+  std::vector<uint8_t> buffer((size_t) profile.window * profile.payloadSize);
+  TransferReceiver receiver;
+  transferReceiverInit(&receiver, profile.window, buffer.data(), profile.payloadSize);
+  transferSenderStart(&sender, transferPacketCount(moduleSize, profile.payloadSize), 1, profile.window, profile.retransmitTimeout, profile.waitForCredit);
+
+  for (uint64_t now = 0; now < TIME_LIMIT; now += TIME_STEP)
+  {
+    downlink.now = now;
+    uplink.now = now;
+    uint32_t millis = now / 1000;
+
+    //receiver
+    bool ackDue = false;
+    while (!downlink.queue.empty() && downlink.queue.front().arrival <= now)
+    {
+      Packet packet = downlink.queue.front();
+      downlink.queue.pop_front();
+      double start = nanos();
+      if (packet.data[0] == TRANSFER_HEADER_FLAG)
+      {
+        if (!receiver.numberOfPackets)
+          transferReceiverStart(&receiver, packet.data[3], packet.data[1] << 8 | packet.data[2]);
+        ackDue = true;
+      }
+      else if (packet.data[0] == TRANSFER_DATA_FLAG)
+        ackDue |= transferReceive(&receiver, packet.data.data(), packet.data.size(), writePacket, NULL);
+      result.engineNanos += nanos() - start;
+    }
+    if (ackDue)
+    {
+      uint8_t ack[TRANSFER_MAX_ACK_SIZE];
+      double start = nanos();
+      uint8_t len = transferBuildAck(&receiver, profile.window, ack);
+      result.engineNanos += nanos() - start;
+      linkSend(&uplink, profile, ack, len);
+    }
+
+    //sender
+    double start = nanos();
+    while (!uplink.queue.empty() && uplink.queue.front().arrival <= now)
+    {
+      transferSenderAck(&sender, uplink.queue.front().data.data(), uplink.queue.front().data.size());
+      uplink.queue.pop_front();
+    }
+    if (transferSenderDone(&sender))
+    {
+      result.engineNanos += nanos() - start;
+      result.time = now;
+      break;
+    }
+    transferSenderPoll(&sender, &link, buildPacket, &sender, sender.numberOfPackets, millis, LINK_QUEUE_SIZE);
+    result.engineNanos += nanos() - start;
+  }
+  if (!result.time)
+    result.time = TIME_LIMIT;
+  result.packetsSent = sender.packetsSent;
+  result.retransmissions = sender.retransmissions;
+  result.duplicates = receiver.duplicates;
+  result.refused = sender.refused;
+  result.intact = transferReceiverDone(&receiver) && !memcmp(received.data(), module, moduleSize);
+  return result;
+}
+
+/**
+ * @fn
+ * Parse the windows of --window=1,2,...
+ * @return false if a window is not within 1..TRANSFER_MAX_WINDOW
+ */
+static bool parseWindows(const char *list, std::vector<int> *windows)
+{
+  windows->clear();
+  while (*list)
+  {
+    char *end;
+    long window = strtol(list, &end, 10);
+    if (end == list || window < 1 || window > TRANSFER_MAX_WINDOW)
+      return false;
+    windows->push_back(window);
+    list = *end == ',' ? end + 1 : end;
+  }
+  return !windows->empty();
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<int> windows; //empty: the window of each profile
+  const char *args[3] = {NULL, NULL, NULL};
+  int numberOfArgs = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--window"))
+      windows = {1, 2, 4, 8, 16, 32};
+    else if (!strncmp(argv[i], "--window=", 9))
+    {
+      if (!parseWindows(argv[i] + 9, &windows))
+      {
+        printf("Windows must be within 1..%d\n", TRANSFER_MAX_WINDOW);
+        return 1;
+      }
+    }
+    else if (numberOfArgs < 3)
+      args[numberOfArgs++] = argv[i];
+  }
+  moduleSize = args[0] ? atoi(args[0]) : 65536;
+  unsigned seed = args[2] ? atoi(args[2]) : 1;
+  std::vector<double> losses = {0, 0.01, 0.05, 0.1};
+  if (args[1])
+    losses = {atof(args[1]) / 100};
+
+  std::vector<uint8_t> data(moduleSize);
+  srand(seed);
+  for (size_t i = 0; i < moduleSize; i++)
+    data[i] = rand();
+  module = data.data();
+
+  const Profile profiles[] = {
+    {"ESP-NOW 1 Mbit/s", 240, 8, 200, false, 1000, 0.125},
+    {"BLE 1M, MTU 247", 241, 32, 1000, true, 7500, 0.09},
+    {"BLE 1M, MTU 23", 17, 32, 1000, true, 7500, 0.03},
+  };
+
+  printf("module %zu bytes, seed %u\n", moduleSize, seed);
+  printf("%-18s %6s %6s %10s %10s %8s %8s %8s %8s %9s %s\n", "", "window", "loss", "time ms", "bytes/s", "packets", "retrans", "dupl",
+         "refused", "ns/byte", "");
+  for (const Profile &base : profiles)
+  {
+    std::vector<int> profileWindows = windows.empty() ? std::vector<int>(1, base.window) : windows;
+    for (int window : profileWindows)
+    {
+      Profile profile = base;
+      profile.window = window;
+      for (double loss : losses)
+      {
+        lossProbability = loss;
+        srand(seed);
+        Result r = run(profile);
+        printf("%-18s %6d %5.1f%% %10.1f %10.0f %8u %8u %8u %8d %9.1f %s\n", profile.name, window, loss * 100, r.time / 1000.0,
+               moduleSize * 1e6 / r.time, r.packetsSent, r.retransmissions, r.duplicates, r.refused, r.engineNanos / moduleSize,
+               r.intact ? "ok" : "CORRUPT");
+      }
+    }
+  }
+  return 0;
+}
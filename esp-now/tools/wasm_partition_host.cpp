@@ -0,0 +1,216 @@
+/**
+ * @file wasm_partition_host.cpp
+ * @brief Host stand-in of the module partitions (lib/shared/src/wasm_partition.cpp, see wasm_partition.h). Every partition is a file of
+ * WASM_PARTITION_HOST_SIZE bytes and a slot is mapped with mmap() instead of esp_partition_mmap(), so the install, the A/B slots and
+ * the execution from the mapping run without a board (see tools/partition_check.cpp). The module file is read with stdio instead of SPIFFS.
+ *
+ * The partition files wasm0 to wasm3 are in the directory of the environment variable WASM_PARTITION_DIR (default: the working
+ * directory). A missing file is created erased (0xff), as a partition without module.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "wasm_fuel.h"
+#include "wasm_partition.h"
+
+#define WASM_PARTITION_HOST_SIZE 0x20000 //size of the partitions in partitions.csv
+#define WASM_PARTITION_COPY_SIZE 256 //bytes per flash write or compare
+#define SPI_FLASH_SEC_SIZE 4096
+
+static const char *wasmPartitionLabels[WASM_PARTITION_SLOTS] = {"wasm0", "wasm1", "wasm2", "wasm3"};
+static void *wasmMapAddress[WASM_PARTITION_SLOTS];
+static size_t wasmMapLength[WASM_PARTITION_SLOTS];
+
+/**
+ * @fn
+ * Open the file of a slot, created erased if it does not exist
+ * @return file descriptor, -1 if it cannot be opened
+ */
+static int openPartition(int slot)
+{
+  const char *directory = getenv("WASM_PARTITION_DIR");
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", directory ? directory : ".", wasmPartitionLabels[slot]);
+  int fd = open(path, O_RDWR);
+  if (fd >= 0 || (fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+    return fd;
+  uint8_t erased[SPI_FLASH_SEC_SIZE];
+  memset(erased, 0xff, sizeof(erased));
+  for (size_t offset = 0; offset < WASM_PARTITION_HOST_SIZE; offset += sizeof(erased))
+  {
+    if (pwrite(fd, erased, sizeof(erased), offset) != (ssize_t) sizeof(erased))
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+//consumer of the instrumented module (WasmFuelWriter): writes it into a partition, or compares it with the partition
+typedef struct {
+  int fd;
+  bool compare; //compare instead of write
+  size_t offset; //of the buffer in the module
+  size_t used;
+  uint8_t buffer[WASM_PARTITION_COPY_SIZE];
+} PartitionSink;
+
+static bool flushSink(PartitionSink *sink)
+{
+  bool ok;
+  if (sink->compare)
+  {
+    uint8_t flashData[WASM_PARTITION_COPY_SIZE];
+    ok = pread(sink->fd, flashData, sink->used, WASM_PARTITION_HEADER_SIZE + sink->offset) == (ssize_t) sink->used
+         && !memcmp(sink->buffer, flashData, sink->used);
+  }
+  else
+    ok = pwrite(sink->fd, sink->buffer, sink->used, WASM_PARTITION_HEADER_SIZE + sink->offset) == (ssize_t) sink->used;
+  sink->offset += sink->used;
+  sink->used = 0;
+  return ok;
+}
+
+static bool writeSink(void *context, const uint8_t *data, size_t len)
+{
+  PartitionSink *sink = (PartitionSink *) context;
+  while (len)
+  {
+    size_t n = len < sizeof(sink->buffer) - sink->used ? len : sizeof(sink->buffer) - sink->used;
+    memcpy(sink->buffer + sink->used, data, n);
+    sink->used += n;
+    data += n;
+    len -= n;
+    if (sink->used == sizeof(sink->buffer) && !flushSink(sink))
+      return false;
+  }
+  return true;
+}
+
+static bool readFile(void *context, size_t offset, uint8_t *data, size_t len)
+{
+  FILE *file = (FILE *) context;
+  return !fseek(file, offset, SEEK_SET) && fread(data, 1, len, file) == len;
+}
+
+static bool instrumentInto(int fd, bool compare, FILE *module, size_t length, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  PartitionSink sink;
+  sink.fd = fd;
+  sink.compare = compare;
+  sink.offset = 0;
+  sink.used = 0;
+  return wasmFuelInstrumentSource(readFile, module, length, info, writeSink, &sink) == instrumentedLength
+         && (!sink.used || flushSink(&sink));
+}
+
+static bool isInstalled(int fd, FILE *module, size_t length, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  uint32_t header[2];
+  if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) || header[0] != WASM_PARTITION_MAGIC || header[1] != instrumentedLength)
+    return false;
+  return instrumentInto(fd, true, module, length, info, instrumentedLength);
+}
+
+static bool writeModule(int fd, FILE *module, size_t length, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  //erase whole sectors (4 KB), the header first, so an interrupted copy leaves no valid module behind
+  size_t eraseSize = (instrumentedLength + WASM_PARTITION_HEADER_SIZE + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+  uint8_t erased[SPI_FLASH_SEC_SIZE];
+  memset(erased, 0xff, sizeof(erased));
+  for (size_t offset = 0; offset < eraseSize; offset += sizeof(erased))
+  {
+    if (pwrite(fd, erased, sizeof(erased), offset) != (ssize_t) sizeof(erased))
+      return false;
+  }
+  if (!instrumentInto(fd, false, module, length, info, instrumentedLength))
+    return false;
+
+  uint32_t header[2] = {WASM_PARTITION_MAGIC, (uint32_t) instrumentedLength};
+  return pwrite(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header);
+}
+
+int wasmPartitionInstall(const char *path, uint32_t busySlots, const WasmFuelInfo *info)
+{
+  FILE *module = fopen(path, "rb");
+  if (!module)
+  {
+    printf("Cannot read the wasm file\n");
+    return -1;
+  }
+  fseek(module, 0, SEEK_END);
+  size_t length = ftell(module);
+  size_t instrumentedLength = wasmFuelInstrumentSource(readFile, module, length, info, NULL, NULL);
+  if (!instrumentedLength)
+  {
+    printf("Wasm module cannot be metered (see wasm_fuel.h)\n");
+    fclose(module);
+    return -1;
+  }
+
+  int slot = -1;
+  int freeSlot = -1;
+  for (int i = 0; i < WASM_PARTITION_SLOTS && slot < 0; i++)
+  {
+    if (busySlots & WASM_PARTITION_SLOT_MASK(i))
+      continue;
+    int fd = openPartition(i);
+    if (fd < 0)
+      continue;
+    if (isInstalled(fd, module, length, info, instrumentedLength))
+      slot = i;
+    else if (freeSlot < 0)
+      freeSlot = i;
+    close(fd);
+  }
+  if (slot < 0 && freeSlot < 0)
+    printf("No wasm partition\n");
+  else if (slot < 0 && instrumentedLength + WASM_PARTITION_HEADER_SIZE > WASM_PARTITION_HOST_SIZE)
+    printf("Wasm file does not fit into the partition\n");
+  else if (slot < 0)
+  {
+    wasmPartitionUnmap(freeSlot);
+    int fd = openPartition(freeSlot);
+    if (fd >= 0 && writeModule(fd, module, length, info, instrumentedLength))
+      slot = freeSlot;
+    if (fd >= 0)
+      close(fd);
+  }
+  fclose(module);
+  return slot;
+}
+
+const uint8_t *wasmPartitionMap(int slot, size_t *length)
+{
+  int fd = openPartition(slot);
+  if (fd < 0)
+    return NULL;
+
+  uint32_t header[2];
+  void *data = MAP_FAILED;
+  if (pread(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header) && header[0] == WASM_PARTITION_MAGIC
+      && header[1] + WASM_PARTITION_HEADER_SIZE <= WASM_PARTITION_HOST_SIZE)
+  {
+    wasmPartitionUnmap(slot);
+    data = mmap(NULL, header[1] + WASM_PARTITION_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd); //the mapping stays
+  if (data == MAP_FAILED)
+    return NULL;
+  wasmMapAddress[slot] = data;
+  wasmMapLength[slot] = header[1] + WASM_PARTITION_HEADER_SIZE;
+  *length = header[1];
+  return (const uint8_t *) data + WASM_PARTITION_HEADER_SIZE;
+}
+
+void wasmPartitionUnmap(int slot)
+{
+  if (slot < 0 || !wasmMapAddress[slot])
+    return;
+  munmap(wasmMapAddress[slot], wasmMapLength[slot]);
+  wasmMapAddress[slot] = NULL;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file wasm_validate_check.cpp
+ * @brief Host check of the streaming validation of a received module (lib/shared/src/wasm_validate.cpp). The module is fed in chunks of
+ * several sizes, as packets of a transfer or pieces of the decompression, intact and damaged: a bad header, an unknown section,
+ * sections out of order, a truncated module, a renamed entry, an entry with another signature, a data segment beyond the memory limit
+ * and locals beyond the stack. Every damaged module has to be rejected, the others accepted; a damage in a section in front of the
+ * last chunk has to be rejected before the whole module is fed. The scan of the validation has to instrument the module as the scan of the install.
+ *
+ * Build and run (from esp-now/):
+ *   g++ -O2 -I../lib/shared/src tools/wasm_validate_check.cpp ../lib/shared/src/wasm_validate.cpp ../lib/shared/src/wasm_fuel.cpp -o wasm_validate_check && ./wasm_validate_check data/main.wasm
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "wasm_fuel.h"
+#include "wasm_validate.h"
+
+#define CALC_INPUT 2
+#define WASM_STACK_SLOTS 4000 //stack of the runtime in esp-now/src/main.cpp
+
+static const WasmValidateConfig config = {"calcWasm", CALC_INPUT, 1, 0, WASM_STACK_SLOTS};
+static const WasmValidateConfig wrongSignature = {"calcWasm", CALC_INPUT + 1, 1, 0, WASM_STACK_SLOTS};
+static const WasmValidateConfig smallMemory = {"calcWasm", CALC_INPUT, 1, 1024, WASM_STACK_SLOTS};
+static const WasmValidateConfig smallStack = {"calcWasm", CALC_INPUT, 1, 0, 4};
+
+static const size_t chunkSizes[] = {1, 7, 240, 0x10000};
+
+enum Damage { DAMAGE_NONE, DAMAGE_HEADER, DAMAGE_SECTION_ID, DAMAGE_ORDER, DAMAGE_TRUNCATED, DAMAGE_ENTRY_NAME, DAMAGE_SIGNATURE,
+              DAMAGE_MEMORY, DAMAGE_STACK };
+
+static const char *damageNames[] = {"intact", "bad header", "unknown section", "sections out of order", "truncated", "renamed entry",
+                                    "wrong signature", "memory limit", "stack"};
+
+static bool appendOutput(void *context, const uint8_t *data, size_t len)
+{
+  std::vector<uint8_t> *output = (std::vector<uint8_t> *) context;
+  output->insert(output->end(), data, data + len);
+  return true;
+}
+
+/**
+ * @fn
+ * Offset of the first section with an id
+ * @return 0 if the module has none
+ */
+static size_t findSection(const std::vector<uint8_t> &module, uint8_t id)
+{
+  size_t offset = 8;
+  while (offset < module.size())
+  {
+    if (module[offset] == id)
+      return offset;
+    uint32_t size = 0;
+    int shift = 0;
+    size_t position = offset + 1;
+    while (position < module.size())
+    {
+      uint8_t byte = module[position++];
+      size |= (uint32_t) (byte & 0x7f) << shift;
+      shift += 7;
+      if (!(byte & 0x80))
+        break;
+    }
+    offset = position + size;
+  }
+  return 0;
+}
+
+/**
+ * @fn
+ * Feed a module in chunks as writeDecodedData() does
+ * @param rejectedAt size_t *, output: bytes fed until the module was rejected, the module size if it was rejected at the end
+ * @return result of wasmValidateFinish()
+ */
+static const char *validate(WasmValidator *validator, const WasmValidateConfig *config, const std::vector<uint8_t> &module, size_t chunkSize,
+                            size_t *rejectedAt)
+{
+  wasmValidateBegin(validator, config);
+  *rejectedAt = module.size();
+  for (size_t offset = 0; offset < module.size(); offset += chunkSize)
+  {
+    size_t len = module.size() - offset < chunkSize ? module.size() - offset : chunkSize;
+    if (!wasmValidateFeed(validator, module.data() + offset, len))
+    {
+      *rejectedAt = offset + len;
+      break;
+    }
+  }
+  return wasmValidateFinish(validator);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s module.wasm\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (!file)
+  {
+    printf("Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> module;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    module.insert(module.end(), buffer, buffer + n);
+  fclose(file);
+
+  size_t exportSection = findSection(module, 7);
+  size_t entryName = 0;
+  for (size_t i = exportSection; exportSection && i + 8 <= module.size() && !entryName; i++)
+  {
+    if (!memcmp(&module[i], "calcWasm", 8))
+      entryName = i;
+  }
+  if (!entryName || !findSection(module, 1))
+  {
+    printf("%s has no type section or no calcWasm export\n", argv[1]);
+    return 1;
+  }
+
+  static WasmValidator validator;
+  int failures = 0;
+  for (int damage = DAMAGE_NONE; damage <= DAMAGE_STACK; damage++)
+  {
+    std::vector<uint8_t> damaged(module);
+    const WasmValidateConfig *damageConfig = &config;
+    size_t damagedSection = damaged.size(); //offset of the section which is rejected, the size: at the end
+    switch (damage)
+    {
+      case DAMAGE_HEADER: damaged[4] = 2; damagedSection = 0; break;
+      case DAMAGE_SECTION_ID: damagedSection = findSection(module, 1); damaged[damagedSection] = 14; break;
+      case DAMAGE_ORDER: damaged[findSection(module, 1)] = 4; damagedSection = findSection(module, 3); break; //table, in front of the function section
+      case DAMAGE_TRUNCATED: damaged.resize(damaged.size() - 10); damagedSection = damaged.size(); break;
+      case DAMAGE_ENTRY_NAME: damaged[entryName + 7] = 'X'; break;
+      case DAMAGE_SIGNATURE: damageConfig = &wrongSignature; damagedSection = exportSection; break;
+      case DAMAGE_MEMORY: damageConfig = &smallMemory; damagedSection = findSection(module, 11); break;
+      case DAMAGE_STACK: damageConfig = &smallStack; damagedSection = findSection(module, 10); break;
+      default: break;
+    }
+    for (size_t c = 0; c < sizeof(chunkSizes) / sizeof(chunkSizes[0]); c++)
+    {
+      size_t rejectedAt;
+      const char *error = validate(&validator, damageConfig, damaged, chunkSizes[c], &rejectedAt);
+      bool ok = (damage == DAMAGE_NONE) == (error == NULL);
+      size_t lastChunk = (damaged.size() - 1) / chunkSizes[c] * chunkSizes[c];
+      if (error && damagedSection < lastChunk)
+        ok = ok && rejectedAt < damaged.size();
+      failures += !ok;
+      printf("  %-22s chunks %5zu  %-38s at %5zu of %5zu  %s\n", damageNames[damage], chunkSizes[c], error ? error : "accepted",
+             rejectedAt, damaged.size(), ok ? "ok" : "FAILED");
+    }
+  }
+
+  //the scan of the validation instruments the module as the scan of the install
+  validate(&validator, &config, module, 240, &n);
+  const WasmFuelInfo *info = wasmValidateFuelInfo(&validator);
+  std::vector<uint8_t> scanned, validated;
+  size_t length = wasmFuelInstrument(module.data(), module.size(), NULL, appendOutput, &scanned);
+  bool same = info && length && wasmFuelInstrument(module.data(), module.size(), info, appendOutput, &validated) == length && scanned == validated;
+  failures += !same;
+  printf("  instrumented with the scan of the validation: %s\n", same ? "ok" : "FAILED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file chunk_source.cpp
+ * @brief RAM or file backed source of packet payloads (see chunk_source.h).
+ */
+#include <SPIFFS.h>
+#include "chunk_source.h"
+#include "dsp.h"
+
+/**
+ * @fn
+ * Use an open file as file-backed source: each view is read into the scratch buffer
+ */
+static bool useFile(ChunkSource *source, File file)
+{
+  source->scratch = (uint8_t *) malloc(source->maxViewLength);
+  if (!source->scratch)
+  {
+    file.close();
+    return false;
+  }
+  source->file = file;
+  return true;
+}
+
+bool chunkSourceOpen(ChunkSource *source, const char *path, size_t maxViewLength)
+{
+  chunkSourceClose(source);
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return false;
+  source->size = file.size();
+  source->maxViewLength = maxViewLength;
+
+  //preload the file with one read, the module is small compared to the heap
+  source->data = (uint8_t *) malloc(source->size ? source->size : 1);
+  if (source->data)
+  {
+    size_t readSize = file.read(source->data, source->size);
+    file.close();
+    if (readSize == source->size)
+      return true;
+    chunkSourceClose(source);
+    return false;
+  }
+  return useFile(source, file);
+}
+
+bool chunkSourceOpenFile(ChunkSource *source, const char *path, size_t maxViewLength)
+{
+  chunkSourceClose(source);
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return false;
+  source->size = file.size();
+  source->maxViewLength = maxViewLength;
+  return useFile(source, file);
+}
+
+const uint8_t *chunkSourceView(ChunkSource *source, size_t offset, size_t length)
+{
+  if (offset + length > source->size || length > source->maxViewLength)
+    return NULL;
+  if (source->data)
+    return source->data + offset;
+  if (!source->file || !source->file.seek(offset) || source->file.read(source->scratch, length) != length)
+    return NULL;
+  return source->scratch;
+}
+
+bool chunkSourceCrc(ChunkSource *source, uint32_t *crc)
+{
+  *crc = 0;
+  for (size_t offset = 0; offset < source->size; offset += source->maxViewLength)
+  {
+    size_t length = min(source->maxViewLength, source->size - offset);
+    const uint8_t *data = chunkSourceView(source, offset, length);
+    if (!data)
+      return false;
+    *crc = dspCrc32(*crc, data, length);
+  }
+  return true;
+}
+
+void chunkSourceClose(ChunkSource *source)
+{
+  if (source->file)
+    source->file.close();
+  free(source->data);
+  free(source->scratch);
+  source->data = NULL;
+  source->scratch = NULL;
+  source->size = 0;
+}
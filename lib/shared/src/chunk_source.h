@@ -0,0 +1,68 @@
+/**
+ * @file chunk_source.h
+ * @brief Sender side source of packet payloads. The file to send is opened once per transfer and read into RAM,
+ * so a packet payload is a pointer into that buffer (no SPIFFS.open/seek/read per packet).
+ * If the file does not fit into the heap, the file stays open and each view is read into a scratch buffer instead.
+ */
+#ifndef CHUNK_SOURCE_H
+#define CHUNK_SOURCE_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+typedef struct {
+  uint8_t *data; //whole file, NULL if the source reads from the file
+  File file; //open during the transfer if data is NULL
+  uint8_t *scratch; //view of the file-backed source, maxViewLength bytes
+  size_t maxViewLength;
+  size_t size;
+} ChunkSource;
+
+/**
+ * @fn
+ * Open a file as chunk source. A source which is already open is closed first.
+ * @param source ChunkSource *, zero initialized or closed before
+ * @param path const char *
+ * @param maxViewLength size_t, max. length of a view (chunkSourceView())
+ * @return false if the file cannot be read
+ */
+bool chunkSourceOpen(ChunkSource *source, const char *path, size_t maxViewLength);
+
+/**
+ * @fn
+ * Open a file as file-backed chunk source without preloading it, as chunkSourceOpen() does when the file does not fit into the heap
+ * (see tools/chunk_bench.cpp). A source which is already open is closed first.
+ * @param source ChunkSource *, zero initialized or closed before
+ * @param path const char *
+ * @param maxViewLength size_t, max. length of a view (chunkSourceView())
+ * @return false if the file cannot be opened
+ */
+bool chunkSourceOpenFile(ChunkSource *source, const char *path, size_t maxViewLength);
+
+/**
+ * @fn
+ * Get a view of the file. The view is valid until the next call of chunkSourceView() or chunkSourceClose().
+ * @param source ChunkSource *
+ * @param offset size_t
+ * @param length size_t, at most maxViewLength of chunkSourceOpen(), must end within the file
+ * @return pointer to length bytes, NULL if the file cannot be read
+ */
+const uint8_t *chunkSourceView(ChunkSource *source, size_t offset, size_t length);
+
+/**
+ * @fn
+ * CRC-32 of the whole file, the transfer CRC of the header (see integrity.h)
+ * @param source ChunkSource *
+ * @param crc uint32_t *, output
+ * @return false if the file cannot be read
+ */
+bool chunkSourceCrc(ChunkSource *source, uint32_t *crc);
+
+/**
+ * @fn
+ * Release the buffers and close the file
+ * @param source ChunkSource *
+ */
+void chunkSourceClose(ChunkSource *source);
+
+#endif
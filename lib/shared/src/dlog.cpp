@@ -0,0 +1,389 @@
+/**
+ * @file dlog.cpp
+ * @brief Ring buffer, drain task and formats of the deferred log (see dlog.h). The buffer is a bounded multi-producer queue of
+ * fixed-size slots: a writer claims a slot with a compare-and-swap of the write position and publishes it with the sequence
+ * number of the slot, so writers never wait for each other or for the drain task.
+ */
+#include <atomic>
+#include <stdio.h>
+#include "dlog.h"
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+static uint32_t dlogClock()
+{
+  return esp_timer_get_time() / 1000;
+}
+
+static void dlogSleep(uint32_t ms)
+{
+  vTaskDelay((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+}
+#else
+#include <chrono>
+#include <thread>
+
+static uint32_t dlogClock()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void dlogSleep(uint32_t ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+#endif
+
+static_assert((DLOG_BUFFER_RECORDS & (DLOG_BUFFER_RECORDS - 1)) == 0, "DLOG_BUFFER_RECORDS must be a power of two");
+
+typedef struct {
+  std::atomic<uint32_t> sequence; //position + 1 when the record is written, position + DLOG_BUFFER_RECORDS when it is free again
+  const char *format;
+  uint32_t time; //ms
+  uint8_t level;
+  uint8_t argc;
+  uintptr_t args[DLOG_MAX_ARGS];
+} DlogSlot;
+
+static DlogSlot slots[DLOG_BUFFER_RECORDS];
+static std::atomic<uint32_t> writePosition(0);
+static std::atomic<uint32_t> readPosition(0); //written by the drain task only
+static std::atomic<uint32_t> dropped(0);
+static std::atomic<bool> ready(false);
+
+struct DlogOutput {
+  DlogWriter writer;
+  void *context;
+  bool binary;
+};
+static DlogOutput output;
+
+void dlogInit()
+{
+  ready = false;
+  for (uint32_t i = 0; i < DLOG_BUFFER_RECORDS; i++)
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  writePosition = 0;
+  readPosition = 0;
+  dropped = 0;
+  ready = true;
+}
+
+void dlogWrite(uint8_t level, const char *format, const uintptr_t *args, uint8_t argc)
+{
+  if (!ready.load(std::memory_order_acquire))
+    return;
+  uint32_t position = writePosition.load(std::memory_order_relaxed);
+  DlogSlot *slot;
+  while (true)
+  {
+    slot = &slots[position & (DLOG_BUFFER_RECORDS - 1)];
+    int32_t state = (int32_t) (slot->sequence.load(std::memory_order_acquire) - position);
+    if (state == 0)
+    {
+      //free: claim it, or retry with the position of the writer which was faster
+      if (writePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (state < 0)
+    {
+      //full: the drain task has not read the record of the previous round yet
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+      position = writePosition.load(std::memory_order_relaxed);
+  }
+  slot->format = format;
+  slot->time = dlogClock();
+  slot->level = level;
+  slot->argc = argc;
+  for (uint8_t i = 0; i < argc; i++)
+    slot->args[i] = args[i];
+  slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+/**
+ * @fn
+ * Parse a conversion specification after its '%'
+ * @param p const char *, after '%'
+ * @param spec char *, output: the specification without length modifiers, for snprintf()
+ * @param conversion char *, output: conversion character, 0 at the end of the format
+ * @return const char *, after the specification
+ */
+static const char *parseSpec(const char *p, char spec[16], char *conversion)
+{
+  size_t n = 0;
+  spec[n++] = '%';
+  while (*p && strchr("-+ #0", *p) && n < 6)
+    spec[n++] = *p++;
+  while (*p >= '0' && *p <= '9' && n < 9)
+    spec[n++] = *p++;
+  if (*p == '.')
+  {
+    spec[n++] = *p++;
+    while (*p >= '0' && *p <= '9' && n < 13)
+      spec[n++] = *p++;
+  }
+  //the arguments are 32 bits
+  while (*p && strchr("hlLqjzt", *p))
+    p++;
+  *conversion = *p;
+  if (*p)
+    spec[n++] = *p++;
+  spec[n] = 0;
+  return p;
+}
+
+size_t dlogFormat(char *out, size_t size, const char *format, const uint32_t *args, uint8_t argc, const char *const *strings)
+{
+  if (!size)
+    return 0;
+  size_t len = 0;
+  uint8_t arg = 0;
+  const char *p = format;
+  while (*p && len < size - 1)
+  {
+    if (*p != '%' || p[1] == '%')
+    {
+      out[len++] = *p;
+      p += *p == '%' ? 2 : 1;
+      continue;
+    }
+    char spec[16], conversion;
+    p = parseSpec(p + 1, spec, &conversion);
+    if (!conversion)
+      break;
+    if (arg >= argc)
+    {
+      out[len++] = '?';
+      continue;
+    }
+    uint32_t value = args[arg];
+    const char *string = strings ? strings[arg] : NULL;
+    arg++;
+    int n;
+    switch (conversion)
+    {
+      case 'd':
+      case 'i':
+        n = snprintf(out + len, size - len, spec, (int) (int32_t) value);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        n = snprintf(out + len, size - len, spec, (unsigned) value);
+        break;
+      case 'c':
+        n = snprintf(out + len, size - len, spec, (int) value);
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+      {
+        float f;
+        memcpy(&f, &value, sizeof(f));
+        n = snprintf(out + len, size - len, spec, (double) f);
+        break;
+      }
+      case 's':
+        n = snprintf(out + len, size - len, spec, string ? string : "(?)");
+        break;
+      case 'p':
+        n = snprintf(out + len, size - len, "0x%08x", (unsigned) value);
+        break;
+      default:
+        n = snprintf(out + len, size - len, "%s", spec);
+        break;
+    }
+    if (n > 0)
+      len = len + n < size - 1 ? len + n : size - 1;
+  }
+  out[len] = 0;
+  return len;
+}
+
+uint32_t dlogStringMask(const char *format)
+{
+  uint32_t mask = 0;
+  uint8_t arg = 0;
+  for (const char *p = format; *p;)
+  {
+    if (*p != '%' || p[1] == '%')
+    {
+      p += *p == '%' ? 2 : 1;
+      continue;
+    }
+    char spec[16], conversion;
+    p = parseSpec(p + 1, spec, &conversion);
+    if (!conversion)
+      break;
+    if (conversion == 's' && arg < 32)
+      mask |= 1u << arg;
+    arg++;
+  }
+  return mask;
+}
+
+uint32_t dlogFormatHash(const char *format)
+{
+  uint32_t hash = DLOG_FORMAT_SEED;
+  for (const char *p = format; *p; p++)
+    hash = (hash ^ (uint8_t) *p) * 16777619u;
+  return hash ? hash : 1;
+}
+
+uint16_t dlogChecksum(const uint8_t *data, size_t len)
+{
+  uint16_t sum1 = 0, sum2 = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value)
+{
+  for (uint8_t i = 0; i < 4; i++)
+    *p++ = value >> (8 * i);
+  return p;
+}
+
+/**
+ * @fn
+ * Write a record as a binary frame (see dlog.h)
+ */
+static void writeFrame(DlogWriter writer, void *context, uint32_t hash, uint32_t time, uint8_t level, const uintptr_t *args,
+                       uint8_t argc, uint32_t stringMask)
+{
+  uint8_t frame[3 + DLOG_MAX_RECORD_SIZE + 2];
+  uint8_t *record = frame + 3;
+  uint8_t *p = put32(record, hash);
+  p = put32(p, time);
+  *p++ = level;
+  *p++ = argc;
+  for (uint8_t i = 0; i < argc; i++)
+    p = put32(p, args[i]);
+  for (uint8_t i = 0; i < argc; i++)
+  {
+    if (!(stringMask & (1u << i)))
+      continue;
+    const char *string = (const char *) args[i];
+    size_t space = DLOG_MAX_RECORD_SIZE - (p - record) - 1;
+    size_t len = string ? strlen(string) : 0;
+    len = len < space ? len : space;
+    *p++ = len;
+    memcpy(p, string, len);
+    p += len;
+  }
+  size_t len = p - record;
+  frame[0] = DLOG_SYNC & 0xff;
+  frame[1] = DLOG_SYNC >> 8;
+  frame[2] = len;
+  uint16_t checksum = dlogChecksum(record, len);
+  *p++ = checksum & 0xff;
+  *p++ = checksum >> 8;
+  writer(context, frame, p - frame);
+}
+
+/**
+ * @fn
+ * Write a record as a line of text
+ */
+static void writeText(DlogWriter writer, void *context, const char *format, uint32_t time, uint8_t level, const uintptr_t *args,
+                      uint8_t argc)
+{
+  static const char levelNames[] = "-EWID";
+  uint32_t values[DLOG_MAX_ARGS];
+  const char *strings[DLOG_MAX_ARGS];
+  for (uint8_t i = 0; i < argc; i++)
+  {
+    values[i] = args[i];
+    strings[i] = (const char *) args[i];
+  }
+  char line[192];
+  int len = snprintf(line, sizeof(line), "[%6u.%03u] %c ", (unsigned) (time / 1000), (unsigned) (time % 1000),
+                     levelNames[level <= DLOG_LEVEL_DEBUG ? level : 0]);
+  len += dlogFormat(line + len, sizeof(line) - len - 2, format, values, argc, strings);
+  line[len++] = '\r';
+  line[len++] = '\n';
+  writer(context, (const uint8_t *) line, len);
+}
+
+size_t dlogDrain(DlogWriter writer, void *context, bool binary)
+{
+  size_t count = 0;
+  uint32_t lost = dropped.exchange(0, std::memory_order_relaxed);
+  if (lost)
+  {
+    uintptr_t arg = lost;
+    if (binary)
+      writeFrame(writer, context, 0, dlogClock(), DLOG_LEVEL_WARN, &arg, 1, 0);
+    else
+      writeText(writer, context, "%u log records dropped", dlogClock(), DLOG_LEVEL_WARN, &arg, 1);
+  }
+  while (true)
+  {
+    uint32_t position = readPosition.load(std::memory_order_relaxed);
+    DlogSlot *slot = &slots[position & (DLOG_BUFFER_RECORDS - 1)];
+    if (slot->sequence.load(std::memory_order_acquire) != position + 1)
+      return count;
+    if (binary)
+      writeFrame(writer, context, dlogFormatHash(slot->format), slot->time, slot->level, slot->args, slot->argc,
+                 dlogStringMask(slot->format));
+    else
+      writeText(writer, context, slot->format, slot->time, slot->level, slot->args, slot->argc);
+    slot->sequence.store(position + DLOG_BUFFER_RECORDS, std::memory_order_release);
+    readPosition.store(position + 1, std::memory_order_release);
+    count++;
+  }
+}
+
+void dlogFlush(uint32_t timeout)
+{
+  uint32_t start = dlogClock();
+  while (output.writer && readPosition.load(std::memory_order_acquire) != writePosition.load(std::memory_order_relaxed)
+         && dlogClock() - start < timeout)
+    dlogSleep(1);
+}
+
+#ifdef ESP_PLATFORM
+static void drainTask(void *parameter)
+{
+  while (true)
+  {
+    if (!dlogDrain(output.writer, output.context, output.binary))
+      dlogSleep(DLOG_DRAIN_INTERVAL);
+  }
+}
+
+bool dlogStart(DlogWriter writer, void *context, bool binary)
+{
+  output = {writer, context, binary};
+  return xTaskCreatePinnedToCore(drainTask, "dlog", DLOG_TASK_STACK_SIZE, NULL, DLOG_TASK_PRIORITY, NULL, DLOG_TASK_CORE) == pdPASS;
+}
+#else
+bool dlogStart(DlogWriter writer, void *context, bool binary)
+{
+  output = {writer, context, binary};
+  std::thread([] {
+    while (true)
+    {
+      if (!dlogDrain(output.writer, output.context, output.binary))
+        dlogSleep(DLOG_DRAIN_INTERVAL);
+    }
+  }).detach();
+  return true;
+}
+#endif
@@ -0,0 +1,174 @@
+/**
+ * @file dlog.h
+ * @brief Deferred logging. A log call in a radio callback or a module task only stores the address of its format string, the
+ * time and its raw arguments in a lock-free ring buffer. A low-priority task drains the buffer and expands the records
+ * (printf format) to serial, so the callers do not wait for the UART and build no String objects.
+ *
+ * The calls below DLOG_LEVEL are removed at compile time, arguments included. A record takes at most DLOG_MAX_ARGS arguments of
+ * up to 32 bits: integers, float and double (stored as float) and strings for %s. A string is read when the record is expanded,
+ * so only string literals and other static strings may be logged. A full buffer drops records and reports their number.
+ *
+ * The drain task writes text, or binary frames with -DDLOG_BINARY=1, which take a fraction of the serial time. A frame identifies
+ * the format string by its FNV-1a hash and is expanded on the host by tools/dlog_decode.cpp from the source files.
+ *   | DLOG_SYNC (2) | record length (1) | record | Fletcher-16 of the record (2) |
+ *   record: | format hash (4) | time ms (4) | level (1) | argument count (1) | argument (4) ... | string arguments, each | length (1) | bytes | |
+ * A record with format hash 0 reports dropped records, its argument is their number.
+ *
+ * Usage:
+ *   dlogInit(); //first in setup()
+ *   dlogStart(writer, NULL, false);
+ *   DLOG_INFO("Node %x: %u bytes", node, len);
+ */
+#ifndef DLOG_H
+#define DLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#define DLOG_LEVEL_NONE 0
+#define DLOG_LEVEL_ERROR 1
+#define DLOG_LEVEL_WARN 2
+#define DLOG_LEVEL_INFO 3
+#define DLOG_LEVEL_DEBUG 4
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL DLOG_LEVEL_INFO //calls above this level are compiled out (build_flags = -DDLOG_LEVEL=n)
+#endif
+#ifndef DLOG_BUFFER_RECORDS
+#define DLOG_BUFFER_RECORDS 64 //records waiting for the drain task, a power of two
+#endif
+#define DLOG_MAX_ARGS 6
+#define DLOG_MAX_RECORD_SIZE 255 //bytes of a binary record, longer strings are truncated
+#define DLOG_SYNC 0x4ca5 //'\xa5' 'L'
+#define DLOG_FORMAT_SEED 2166136261u //FNV-1a offset basis of the format hash
+#define DLOG_DRAIN_INTERVAL 20 //ms the drain task sleeps when the buffer is empty
+#define DLOG_TASK_STACK_SIZE 3072
+#define DLOG_TASK_PRIORITY 1 //below the radio tasks, as loop()
+#define DLOG_TASK_CORE 0
+
+#define DLOG_AT(level, format, ...) \
+  do { if ((level) <= DLOG_LEVEL) dlogRecord((level), format, ##__VA_ARGS__); } while (0)
+#define DLOG_ERROR(format, ...) DLOG_AT(DLOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define DLOG_WARN(format, ...) DLOG_AT(DLOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define DLOG_INFO(format, ...) DLOG_AT(DLOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define DLOG_DEBUG(format, ...) DLOG_AT(DLOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+/**
+ * Consumer of the expanded records
+ * @param context void *
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+typedef void (*DlogWriter)(void *context, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Reset the buffer. Records of calls before are dropped.
+ */
+void dlogInit();
+
+/**
+ * @fn
+ * Start the drain task
+ * @param writer DlogWriter, e.g. to serial
+ * @param context void *
+ * @param binary bool, binary frames instead of text
+ * @return false if the task cannot be created (memory)
+ */
+bool dlogStart(DlogWriter writer, void *context, bool binary);
+
+/**
+ * @fn
+ * Append a record to the buffer, use the DLOG_ macros
+ * @param level uint8_t
+ * @param format const char *, static
+ * @param args const uintptr_t *
+ * @param argc uint8_t
+ */
+void dlogWrite(uint8_t level, const char *format, const uintptr_t *args, uint8_t argc);
+
+/**
+ * @fn
+ * Wait until the drain task has written the records of the buffer, e.g. before a restart
+ * @param timeout uint32_t, ms
+ */
+void dlogFlush(uint32_t timeout);
+
+/**
+ * @fn
+ * Expand the records in the buffer. Called by the drain task only.
+ * @param writer DlogWriter, called once per record
+ * @param context void *
+ * @param binary bool
+ * @return number of records
+ */
+size_t dlogDrain(DlogWriter writer, void *context, bool binary);
+
+/**
+ * @fn
+ * Expand a printf format with 32 bit arguments. Length modifiers are ignored, %p is printed as hex.
+ * @param out char *
+ * @param size size_t, of out
+ * @param format const char *
+ * @param args const uint32_t *
+ * @param argc uint8_t
+ * @param strings const char * const *, the string of each %s argument, NULL to print the strings of no argument
+ * @return length of the text in out
+ */
+size_t dlogFormat(char *out, size_t size, const char *format, const uint32_t *args, uint8_t argc, const char *const *strings);
+
+/**
+ * @fn
+ * @param format const char *
+ * @return uint32_t, bit i is set if argument i is a %s argument
+ */
+uint32_t dlogStringMask(const char *format);
+
+/**
+ * @fn
+ * FNV-1a hash of a format string, the identifier of the format in a binary record
+ * @param format const char *
+ * @return uint32_t, never 0
+ */
+uint32_t dlogFormatHash(const char *format);
+
+/**
+ * @fn
+ * Fletcher-16 checksum of a binary record
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return uint16_t
+ */
+uint16_t dlogChecksum(const uint8_t *data, size_t len);
+
+template <typename T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uintptr_t>::type dlogArg(T value)
+{
+  static_assert(sizeof(T) <= 4, "dlog: arguments of up to 32 bits");
+  //the sign is restored by the conversion of the format
+  return (uint32_t) value;
+}
+
+static inline uintptr_t dlogArg(double value)
+{
+  float f = (float) value;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static inline uintptr_t dlogArg(const void *value)
+{
+  return (uintptr_t) value;
+}
+
+template <typename... Args>
+static inline void dlogRecord(uint8_t level, const char *format, Args... args)
+{
+  static_assert(sizeof...(Args) <= DLOG_MAX_ARGS, "dlog: too many arguments");
+  const uintptr_t values[sizeof...(Args) + 1] = {dlogArg(args)...};
+  dlogWrite(level, format, values, sizeof...(Args));
+}
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @file dsp.cpp
+ * @brief Signal processing kernels (see dsp.h).
+ */
+#include <math.h>
+#include "dsp.h"
+
+static inline int16_t saturate16(int32_t value)
+{
+  return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+}
+
+void dspFir(const float *input, float *output, size_t count, const float *coefficients, size_t taps)
+{
+  //from the last sample, so an output sample never overwrites an input sample which is still needed
+  for (size_t i = count; i-- > 0;)
+  {
+    float sum = 0;
+    size_t n = taps < i + 1 ? taps : i + 1;
+    for (size_t k = 0; k < n; k++)
+      sum += coefficients[k] * input[i - k];
+    output[i] = sum;
+  }
+}
+
+void dspBiquad(float *data, size_t count, const float *coefficients, float *state)
+{
+  float b0 = coefficients[0], b1 = coefficients[1], b2 = coefficients[2], a1 = coefficients[3], a2 = coefficients[4];
+  float s1 = state[0], s2 = state[1];
+  for (size_t i = 0; i < count; i++)
+  {
+    float x = data[i];
+    float y = b0 * x + s1;
+    s1 = b1 * x - a1 * y + s2;
+    s2 = b2 * x - a2 * y;
+    data[i] = y;
+  }
+  state[0] = s1;
+  state[1] = s2;
+}
+
+bool dspFft(float *data, size_t n, bool inverse)
+{
+  if (n < 2 || n > DSP_MAX_FFT_SIZE || (n & (n - 1)))
+    return false;
+
+  //bit reversal permutation
+  for (size_t i = 1, j = 0; i < n; i++)
+  {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j |= bit;
+    if (i < j)
+    {
+      float re = data[2 * i], im = data[2 * i + 1];
+      data[2 * i] = data[2 * j];
+      data[2 * i + 1] = data[2 * j + 1];
+      data[2 * j] = re;
+      data[2 * j + 1] = im;
+    }
+  }
+
+  //butterflies, the twiddle factors by recurrence (one sinf per stage)
+  for (size_t length = 2; length <= n; length <<= 1)
+  {
+    float angle = (inverse ? 2 : -2) * (float) M_PI / length;
+    float half = sinf(angle / 2);
+    float stepRe = -2 * half * half, stepIm = sinf(angle); //cos(angle) - 1, sin(angle)
+    float wRe = 1, wIm = 0;
+    for (size_t k = 0; k < length / 2; k++)
+    {
+      for (size_t i = k; i < n; i += length)
+      {
+        size_t j = i + length / 2;
+        float re = data[2 * j] * wRe - data[2 * j + 1] * wIm;
+        float im = data[2 * j] * wIm + data[2 * j + 1] * wRe;
+        data[2 * j] = data[2 * i] - re;
+        data[2 * j + 1] = data[2 * i + 1] - im;
+        data[2 * i] += re;
+        data[2 * i + 1] += im;
+      }
+      float t = wRe;
+      wRe += t * stepRe - wIm * stepIm;
+      wIm += wIm * stepRe + t * stepIm;
+    }
+  }
+
+  if (inverse)
+  {
+    float scale = 1.0f / n;
+    for (size_t i = 0; i < 2 * n; i++)
+      data[i] *= scale;
+  }
+  return true;
+}
+
+void dspStatistics(const float *data, size_t count, float *result)
+{
+  if (!count)
+  {
+    result[0] = result[1] = result[2] = result[3] = 0;
+    return;
+  }
+  //Welford, no cancellation for a large mean
+  double mean = 0, m2 = 0;
+  float minimum = data[0], maximum = data[0];
+  for (size_t i = 0; i < count; i++)
+  {
+    double delta = data[i] - mean;
+    mean += delta / (i + 1);
+    m2 += delta * (data[i] - mean);
+    if (data[i] < minimum)
+      minimum = data[i];
+    if (data[i] > maximum)
+      maximum = data[i];
+  }
+  result[0] = mean;
+  result[1] = m2 / count;
+  result[2] = minimum;
+  result[3] = maximum;
+}
+
+uint32_t dspCrc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+  //4 bit table: 64 bytes instead of 1 KB
+  static const uint32_t table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+  };
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = table[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+    crc = table[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+void dspQ15Add(const int16_t *a, const int16_t *b, int16_t *output, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    output[i] = saturate16((int32_t) a[i] + b[i]);
+}
+
+void dspQ15Mul(const int16_t *a, const int16_t *b, int16_t *output, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    output[i] = saturate16(((int32_t) a[i] * b[i] + (1 << 14)) >> 15);
+}
+
+void dspQ15Scale(const int16_t *a, int16_t scale, int16_t *output, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    output[i] = saturate16(((int32_t) a[i] * scale + (1 << 14)) >> 15);
+}
+
+int32_t dspQ15Dot(const int16_t *a, const int16_t *b, size_t count)
+{
+  int64_t sum = 0;
+  for (size_t i = 0; i < count; i++)
+    sum += (int32_t) a[i] * b[i];
+  sum = (sum + (1 << 14)) >> 15;
+  return sum > INT32_MAX ? INT32_MAX : sum < INT32_MIN ? INT32_MIN : sum;
+}
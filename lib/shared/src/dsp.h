@@ -0,0 +1,103 @@
+/**
+ * @file dsp.h
+ * @brief Signal processing kernels of the host, called by wasm modules through the imports of wasm_imports.h,
+ * so the per-sample math runs native instead of in the interpreter.
+ * - Filters: FIR and biquad (float)
+ * - FFT: radix-2, in place (complex float, interleaved real and imaginary parts)
+ * - Statistics: mean, variance, minimum and maximum (float)
+ * - CRC-32 (IEEE 802.3), incremental
+ * - Fixed-point vector math in Q15 (int16_t, 1.0 = 32768), saturating
+ *
+ * The kernels do not access the hardware, so they run on the host as well. They do not allocate memory.
+ */
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DSP_MAX_FFT_SIZE 4096 //complex points
+
+/**
+ * @fn
+ * FIR filter: output[i] = sum of coefficients[k] * input[i - k], samples before the buffer are 0.
+ * Output and input may be the same buffer.
+ * @param input const float *
+ * @param output float *
+ * @param count size_t, samples
+ * @param coefficients const float *
+ * @param taps size_t, number of coefficients
+ */
+void dspFir(const float *input, float *output, size_t count, const float *coefficients, size_t taps);
+
+/**
+ * @fn
+ * Biquad filter in place (transposed direct form II). The state carries over to the next block.
+ * @param data float *
+ * @param count size_t, samples
+ * @param coefficients const float *, b0, b1, b2, a1, a2 (a0 = 1)
+ * @param state float *, 2 values, 0 before the first block
+ */
+void dspBiquad(float *data, size_t count, const float *coefficients, float *state);
+
+/**
+ * @fn
+ * FFT in place. The inverse transform is scaled by 1 / n.
+ * @param data float *, n complex values: real, imaginary, real, ...
+ * @param n size_t, power of two, at most DSP_MAX_FFT_SIZE
+ * @param inverse bool
+ * @return false if n is not supported
+ */
+bool dspFft(float *data, size_t n, bool inverse);
+
+/**
+ * @fn
+ * Statistics of a block
+ * @param data const float *
+ * @param count size_t
+ * @param result float *, output: mean, variance (population), minimum, maximum. All 0 if count is 0.
+ */
+void dspStatistics(const float *data, size_t count, float *result);
+
+/**
+ * @fn
+ * CRC-32 (IEEE 802.3, as zlib). A block can be continued with the CRC of the previous blocks.
+ * @param crc uint32_t, 0 for the first block
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return uint32_t
+ */
+uint32_t dspCrc32(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Q15 vector math, saturating. Output may be one of the inputs.
+ * @param a const int16_t *
+ * @param b const int16_t *
+ * @param output int16_t *
+ * @param count size_t
+ */
+void dspQ15Add(const int16_t *a, const int16_t *b, int16_t *output, size_t count);
+void dspQ15Mul(const int16_t *a, const int16_t *b, int16_t *output, size_t count);
+
+/**
+ * @fn
+ * Q15 vector multiplied by a Q15 factor, saturating
+ * @param a const int16_t *
+ * @param scale int16_t
+ * @param output int16_t *
+ * @param count size_t
+ */
+void dspQ15Scale(const int16_t *a, int16_t scale, int16_t *output, size_t count);
+
+/**
+ * @fn
+ * Dot product of Q15 vectors
+ * @param a const int16_t *
+ * @param b const int16_t *
+ * @param count size_t
+ * @return Q15, saturated to int32_t
+ */
+int32_t dspQ15Dot(const int16_t *a, const int16_t *b, size_t count);
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * @file event_loop.cpp
+ * @brief Events which wake loop() (see event_loop.h).
+ */
+#include "event_loop.h"
+
+#define EVENT_BITS 0x00ffffff //the upper bits of an event group are reserved
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+static EventGroupHandle_t eventGroup = NULL;
+
+void eventLoopInit()
+{
+  if (!eventGroup)
+    eventGroup = xEventGroupCreate();
+}
+
+void eventPost(uint32_t events)
+{
+  if (eventGroup)
+    xEventGroupSetBits(eventGroup, events & EVENT_BITS);
+}
+
+uint32_t eventWait(uint32_t timeout)
+{
+  if (!eventGroup)
+    return 0;
+  TickType_t ticks = timeout == EVENT_WAIT_FOREVER ? portMAX_DELAY : (timeout + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+  return xEventGroupWaitBits(eventGroup, EVENT_BITS, pdTRUE, pdFALSE, ticks) & EVENT_BITS;
+}
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+static std::mutex eventLock;
+static std::condition_variable eventPosted;
+static uint32_t pendingEvents = 0;
+
+void eventLoopInit()
+{
+}
+
+void eventPost(uint32_t events)
+{
+  {
+    std::lock_guard<std::mutex> lock(eventLock);
+    pendingEvents |= events & EVENT_BITS;
+  }
+  eventPosted.notify_all();
+}
+
+uint32_t eventWait(uint32_t timeout)
+{
+  std::unique_lock<std::mutex> lock(eventLock);
+  if (timeout == EVENT_WAIT_FOREVER)
+    eventPosted.wait(lock, [] { return pendingEvents != 0; });
+  else
+    eventPosted.wait_for(lock, std::chrono::milliseconds(timeout), [] { return pendingEvents != 0; });
+  uint32_t events = pendingEvents;
+  pendingEvents = 0;
+  return events;
+}
+#endif
@@ -0,0 +1,36 @@
+/**
+ * @file event_loop.h
+ * @brief Events which wake loop(). The callbacks of the radio, the web server and the module tasks post an event after they
+ * changed the state loop() works on, and loop() sleeps until an event is posted or its next timer is due, instead of polling
+ * with a fixed delay. A received packet is handled at once, and an idle node does not run loop() between its timers.
+ * On the ESP32 the events are the bits of a FreeRTOS event group, on the host a std::condition_variable, as in wasm_scheduler.h.
+ */
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+#define EVENT_WAIT_FOREVER 0xffffffff
+
+/**
+ * @fn
+ * Create the event group. Call it in setup() before the callbacks are registered.
+ */
+void eventLoopInit();
+
+/**
+ * @fn
+ * Post events. Called by tasks and callbacks, not by interrupt handlers.
+ * @param events uint32_t, bits of the application (at most 24 bits)
+ */
+void eventPost(uint32_t events);
+
+/**
+ * @fn
+ * Sleep until an event is posted or the timeout has passed. Events posted meanwhile are returned at once.
+ * @param timeout uint32_t, ms (rounded up to a tick on the ESP32) or EVENT_WAIT_FOREVER
+ * @return uint32_t, the posted events, cleared. 0 after the timeout.
+ */
+uint32_t eventWait(uint32_t timeout);
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file integrity.cpp
+ * @brief Incremental digest of a received module (see integrity.h).
+ */
+#include "dsp.h"
+#include "integrity.h"
+
+static uint32_t get32(const uint8_t *p)
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+uint32_t integrityHash(uint32_t hash, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void integrityPut(const IntegrityDigest *digest, uint8_t *data)
+{
+  put32(data, digest->moduleSize);
+  put32(data + 4, digest->moduleHash);
+  put32(data + 8, digest->transferCrc);
+}
+
+void integrityBegin(IntegrityCheck *check, const uint8_t *data)
+{
+  check->advertised = false;
+  if (data)
+    integrityExpect(check, data);
+  check->received.moduleSize = 0;
+  check->received.moduleHash = INTEGRITY_HASH_SEED;
+  check->received.transferCrc = 0;
+}
+
+void integrityTransfer(IntegrityCheck *check, const uint8_t *data, size_t len)
+{
+  check->received.transferCrc = dspCrc32(check->received.transferCrc, data, len);
+}
+
+void integrityModule(IntegrityCheck *check, const uint8_t *data, size_t len)
+{
+  check->received.moduleSize += len;
+  check->received.moduleHash = integrityHash(check->received.moduleHash, data, len);
+}
+
+void integrityExpect(IntegrityCheck *check, const uint8_t *data)
+{
+  check->advertised = true;
+  check->expected.moduleSize = get32(data);
+  check->expected.moduleHash = get32(data + 4);
+  check->expected.transferCrc = get32(data + 8);
+}
+
+const char *integrityVerify(const IntegrityCheck *check)
+{
+  if (!check->advertised)
+    return NULL;
+  //the transfer first: a corrupted payload also breaks the decoded module
+  if (check->received.transferCrc != check->expected.transferCrc)
+    return "transfer CRC mismatch";
+  if (check->received.moduleSize != check->expected.moduleSize)
+    return "module size mismatch";
+  if (check->received.moduleHash != check->expected.moduleHash)
+    return "module hash mismatch";
+  return NULL;
+}
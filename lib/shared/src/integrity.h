@@ -0,0 +1,96 @@
+/**
+ * @file integrity.h
+ * @brief Integrity check of a received module while it streams in. The sender advertises a digest in the header (0x01) of a transfer,
+ * the receiver updates its own digest with every chunk and commits the staged module only if both match, so a corrupted,
+ * truncated or reordered module is rejected before it replaces the running one, without a second pass over the flash.
+ * A header too small for the digest (BLE with the default MTU) is followed by the payload and a trailing digest packet (see integrityExpect()).
+ * Digest (big endian, INTEGRITY_DIGEST_SIZE bytes):
+ * | module size (4 bytes) | module hash (4 bytes) | transfer CRC (4 bytes) |
+ * - Transfer CRC: CRC-32 (dspCrc32()) of the payload packets in order, as sent (LZSS compressed or delta).
+ * - Module size and hash: FNV-1a of the module as it is staged, after the decompression or the delta. The hash is also the module hash
+ *   of the version summary (esp-now), so the received module needs no hashing when it is loaded.
+ *
+ * The functions do not access the flash or the radio, so they run on the host as well (see esp-now/tools/integrity_check.cpp).
+ */
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INTEGRITY_DIGEST_SIZE 12
+#define INTEGRITY_HASH_SEED 2166136261u //FNV-1a offset basis
+
+typedef struct {
+  uint32_t moduleSize;
+  uint32_t moduleHash;
+  uint32_t transferCrc;
+} IntegrityDigest;
+
+typedef struct {
+  bool advertised; //the header had a digest, otherwise the module is not checked
+  IntegrityDigest expected;
+  IntegrityDigest received; //of the chunks so far
+} IntegrityCheck;
+
+/**
+ * @fn
+ * FNV-1a hash of module data, continued from a previous hash
+ * @param hash uint32_t, INTEGRITY_HASH_SEED for the first data
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return uint32_t
+ */
+uint32_t integrityHash(uint32_t hash, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Write a digest into a header
+ * @param digest const IntegrityDigest *
+ * @param data uint8_t *, INTEGRITY_DIGEST_SIZE bytes
+ */
+void integrityPut(const IntegrityDigest *digest, uint8_t *data);
+
+/**
+ * @fn
+ * Start the check of a reception
+ * @param check IntegrityCheck *
+ * @param data const uint8_t *, digest of the header, NULL if the header has none
+ */
+void integrityBegin(IntegrityCheck *check, const uint8_t *data);
+
+/**
+ * @fn
+ * Set the digest of a trailing digest packet, for a header without room for it. Keeps the digest of the chunks so far.
+ * @param check IntegrityCheck *
+ * @param data const uint8_t *, INTEGRITY_DIGEST_SIZE bytes
+ */
+void integrityExpect(IntegrityCheck *check, const uint8_t *data);
+
+/**
+ * @fn
+ * Add a payload packet as received, in order. Called in the radio callback.
+ * @param check IntegrityCheck *
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+void integrityTransfer(IntegrityCheck *check, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Add decoded module data as it is staged
+ * @param check IntegrityCheck *
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+void integrityModule(IntegrityCheck *check, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * Compare the digests at the end of a reception
+ * @param check const IntegrityCheck *
+ * @return NULL if the module is complete and intact (or the header had no digest), otherwise the reason
+ */
+const char *integrityVerify(const IntegrityCheck *check);
+
+#endif
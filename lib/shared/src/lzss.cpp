@@ -0,0 +1,206 @@
+/**
+ * @file lzss.cpp
+ * @brief LZSS encoder and streaming decoder (see lzss.h). The encoder holds the input in RAM and finds matches with hash chains.
+ * lzssCompressFile() needs SPIFFS and is built on the ESP32 only; the codec itself also builds on the host (tools/lzss_bench.cpp).
+ */
+#include <stdlib.h>
+#include "lzss.h"
+
+#ifdef ESP_PLATFORM
+#include <SPIFFS.h>
+#endif
+
+#define LZSS_HASH_SIZE 256
+#define LZSS_MAX_CHAIN 32 //candidates checked per position
+#define LZSS_DECODE_BUFFER_SIZE 64
+
+static inline uint8_t hash3(const uint8_t *p)
+{
+  return (p[0] * 33 + p[1]) * 33 + p[2];
+}
+
+size_t lzssCompress(const uint8_t *in, size_t inputSize, LzssWriter writer, void *context)
+{
+  int32_t *lastPosition = (int32_t *) malloc(LZSS_HASH_SIZE * sizeof(int32_t)); //last position of a hash
+  int32_t *previous = (int32_t *) malloc(LZSS_WINDOW_SIZE * sizeof(int32_t)); //previous position with the same hash, indexed by position % window
+  size_t outputSize = 0;
+  if (lastPosition && previous)
+  {
+    for (int i = 0; i < LZSS_HASH_SIZE; i++)
+      lastPosition[i] = -1;
+
+    uint8_t group[1 + 8 * 2];
+    uint8_t groupLength = 1;
+    uint8_t items = 0;
+    group[0] = 0;
+    size_t i = 0;
+    while (i < inputSize)
+    {
+      size_t bestLength = 0;
+      size_t bestDistance = 0;
+      if (i + LZSS_MIN_MATCH <= inputSize)
+      {
+        int32_t candidate = lastPosition[hash3(in + i)];
+        for (int chain = 0; candidate >= 0 && i - candidate <= LZSS_WINDOW_SIZE && chain < LZSS_MAX_CHAIN; chain++)
+        {
+          size_t length = 0;
+          while (length < LZSS_MAX_MATCH && i + length < inputSize && in[candidate + length] == in[i + length])
+            length++;
+          if (length > bestLength)
+          {
+            bestLength = length;
+            bestDistance = i - candidate;
+          }
+          candidate = previous[candidate % LZSS_WINDOW_SIZE];
+        }
+      }
+
+      size_t step = 1;
+      if (bestLength >= LZSS_MIN_MATCH)
+      {
+        uint16_t token = (bestDistance - 1) << 6 | (bestLength - LZSS_MIN_MATCH);
+        group[groupLength++] = token >> 8;
+        group[groupLength++] = (uint8_t) token;
+        step = bestLength;
+      }
+      else
+      {
+        group[0] |= 1 << items;
+        group[groupLength++] = in[i];
+      }
+      if (++items == 8)
+      {
+        writer(group, groupLength, context);
+        outputSize += groupLength;
+        group[0] = 0;
+        groupLength = 1;
+        items = 0;
+      }
+
+      //insert all covered positions into the hash chains
+      for (size_t end = i + step; i < end; i++)
+      {
+        if (i + LZSS_MIN_MATCH <= inputSize)
+        {
+          uint8_t h = hash3(in + i);
+          previous[i % LZSS_WINDOW_SIZE] = lastPosition[h];
+          lastPosition[h] = i;
+        }
+      }
+    }
+    if (items)
+    {
+      writer(group, groupLength, context);
+      outputSize += groupLength;
+    }
+  }
+  free(lastPosition);
+  free(previous);
+  return outputSize;
+}
+
+#ifdef ESP_PLATFORM
+static void writeFile(const uint8_t *data, size_t len, void *context)
+{
+  ((File *) context)->write(data, len);
+}
+
+size_t lzssCompressFile(const char *inputPath, const char *outputPath)
+{
+  File input = SPIFFS.open(inputPath, "r");
+  if (!input)
+    return 0;
+  size_t inputSize = input.size();
+  uint8_t *in = (uint8_t *) malloc(inputSize ? inputSize : 1);
+  bool ok = in && input.read(in, inputSize) == inputSize;
+  input.close();
+
+  File output;
+  if (ok)
+    output = SPIFFS.open(outputPath, "w");
+  size_t outputSize = 0;
+  if (ok && output)
+  {
+    outputSize = lzssCompress(in, inputSize, writeFile, &output);
+    output.close();
+  }
+  free(in);
+  return outputSize;
+}
+#endif
+
+void lzssDecoderInit(LzssDecoder *decoder)
+{
+  decoder->produced = 0;
+  decoder->flagCount = 0;
+  decoder->matchPending = false;
+  decoder->valid = true;
+}
+
+bool lzssDecode(LzssDecoder *decoder, const uint8_t *data, size_t len, LzssWriter writer, void *context)
+{
+  uint8_t out[LZSS_DECODE_BUFFER_SIZE];
+  size_t outLength = 0;
+
+  while (decoder->valid && len)
+  {
+    if (!decoder->flagCount)
+    {
+      decoder->flags = *data++;
+      len--;
+      decoder->flagCount = 8;
+      continue;
+    }
+
+    if (decoder->flags & 1)
+    {
+      uint8_t literal = *data++;
+      len--;
+      decoder->window[decoder->produced % LZSS_WINDOW_SIZE] = literal;
+      decoder->produced++;
+      out[outLength++] = literal;
+    }
+    else if (!decoder->matchPending)
+    {
+      decoder->matchByte = *data++;
+      len--;
+      decoder->matchPending = true;
+      continue; //the item is not complete yet
+    }
+    else
+    {
+      uint16_t token = decoder->matchByte << 8 | *data++;
+      len--;
+      decoder->matchPending = false;
+      uint16_t distance = (token >> 6) + 1;
+      uint8_t length = (token & 0x3F) + LZSS_MIN_MATCH;
+      if (distance > decoder->produced)
+      {
+        decoder->valid = false;
+        break;
+      }
+      for (uint8_t k = 0; k < length; k++)
+      {
+        uint8_t value = decoder->window[(decoder->produced - distance) % LZSS_WINDOW_SIZE];
+        decoder->window[decoder->produced % LZSS_WINDOW_SIZE] = value;
+        decoder->produced++;
+        out[outLength++] = value;
+        if (outLength == sizeof(out))
+        {
+          writer(out, outLength, context);
+          outLength = 0;
+        }
+      }
+    }
+    decoder->flags >>= 1;
+    decoder->flagCount--;
+    if (outLength >= sizeof(out) - 1)
+    {
+      writer(out, outLength, context);
+      outLength = 0;
+    }
+  }
+  if (outLength)
+    writer(out, outLength, context);
+  return decoder->valid;
+}
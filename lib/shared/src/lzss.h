@@ -0,0 +1,73 @@
+/**
+ * @file lzss.h
+ * @brief Streaming LZSS compression of wasm transfers. The receiver decompresses the chunks as they arrive with a fixed
+ * LZSS_WINDOW_SIZE byte window, so RAM use does not depend on the module size.
+ * Stream format: groups of a flag byte and up to 8 items (LSB first). Flag bit 1: literal byte.
+ * Flag bit 0: match of 2 bytes (big endian) = (distance - 1) << 6 | (length - LZSS_MIN_MATCH).
+ */
+#ifndef LZSS_H
+#define LZSS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZSS_WINDOW_SIZE 1024 //max. distance of a match (10 bit)
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH (LZSS_MIN_MATCH + 63) //6 bit
+
+//! Codec IDs advertised in the header packet
+#define CODEC_NONE 0
+#define CODEC_LZSS 1
+
+typedef void (*LzssWriter)(const uint8_t *data, size_t len, void *context);
+
+typedef struct LzssDecoder {
+  uint8_t window[LZSS_WINDOW_SIZE];
+  uint32_t produced; //decompressed bytes so far
+  uint8_t flags;
+  uint8_t flagCount; //items left in the current group
+  uint8_t matchByte; //first byte of a match split between two chunks
+  bool matchPending;
+  bool valid;
+} LzssDecoder;
+
+/**
+ * @fn
+ * Compress a buffer.
+ * @param in const uint8_t *
+ * @param inputSize size_t
+ * @param writer LzssWriter, receives the compressed data in groups
+ * @param context void *, passed to writer
+ * @return size of the compressed data, 0 if the input is empty or out of memory
+ */
+size_t lzssCompress(const uint8_t *in, size_t inputSize, LzssWriter writer, void *context);
+
+/**
+ * @fn
+ * Compress a file (SPIFFS, ESP32 only).
+ * @param inputPath const char *
+ * @param outputPath const char *
+ * @return size of the compressed file, 0 on error
+ */
+size_t lzssCompressFile(const char *inputPath, const char *outputPath);
+
+/**
+ * @fn
+ * Reset a decoder for a new stream.
+ * @param decoder LzssDecoder *
+ */
+void lzssDecoderInit(LzssDecoder *decoder);
+
+/**
+ * @fn
+ * Decompress the next part of a stream. Items may be split at any byte.
+ * @param decoder LzssDecoder *
+ * @param data const uint8_t *, compressed data
+ * @param len size_t
+ * @param writer LzssWriter, receives the decompressed data
+ * @param context void *, passed to writer
+ * @return false if the stream is invalid (match before the start of the stream)
+ */
+bool lzssDecode(LzssDecoder *decoder, const uint8_t *data, size_t len, LzssWriter writer, void *context);
+
+#endif
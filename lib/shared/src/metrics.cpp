@@ -0,0 +1,297 @@
+/**
+ * @file metrics.cpp
+ * @brief Registry and formats of the metrics (see metrics.h).
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+
+static portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED; //updates are short, e.g. from the radio callbacks
+
+static void metricsLock()
+{
+  portENTER_CRITICAL(&metricsMux);
+}
+
+static void metricsUnlock()
+{
+  portEXIT_CRITICAL(&metricsMux);
+}
+#else
+#include <mutex>
+
+static std::mutex metricsMutex;
+
+static void metricsLock()
+{
+  metricsMutex.lock();
+}
+
+static void metricsUnlock()
+{
+  metricsMutex.unlock();
+}
+#endif
+
+static Metric *firstMetric = NULL;
+static Metric *lastMetric = NULL;
+
+/**
+ * @fn
+ * Copy the state of a metric, so it is formatted outside of the lock
+ */
+static void snapshot(const Metric *metric, Metric *copy)
+{
+  metricsLock();
+  *copy = *metric;
+  metricsUnlock();
+}
+
+/**
+ * @fn
+ * Bucket of a histogram value: the smallest i with value <= 2^i, the last bucket for larger values
+ */
+static uint8_t bucketOf(uint32_t value)
+{
+  if (value <= 1)
+    return 0;
+  uint8_t bucket = 32 - __builtin_clz(value - 1);
+  return bucket < METRIC_BUCKETS - 1 ? bucket : METRIC_BUCKETS - 1;
+}
+
+void metricsAdd(Metric *metric)
+{
+  metricsLock();
+  if (!metric->registered)
+  {
+    metric->registered = true;
+    metric->next = NULL;
+    if (lastMetric)
+      lastMetric->next = metric;
+    else
+      firstMetric = metric;
+    lastMetric = metric;
+  }
+  metricsUnlock();
+}
+
+void metricCount(Metric *metric, uint32_t n)
+{
+  metricsLock();
+  metric->value += n;
+  metricsUnlock();
+}
+
+void metricSet(Metric *metric, uint32_t value)
+{
+  metricsLock();
+  metric->value = value;
+  metricsUnlock();
+}
+
+void metricRecord(Metric *metric, uint32_t value)
+{
+  uint8_t bucket = bucketOf(value);
+  metricsLock();
+  metric->value++;
+  metric->sum += value;
+  if (value > metric->max)
+    metric->max = value;
+  metric->buckets[bucket]++;
+  metricsUnlock();
+}
+
+/**
+ * @fn
+ * Write a line of the text format
+ */
+static void writeLine(MetricsWriter writer, void *context, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void writeLine(MetricsWriter writer, void *context, const char *format, ...)
+{
+  char line[192];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len > 0)
+    writer(context, line, (size_t) len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+void metricsText(MetricsWriter writer, void *context)
+{
+  static const char *typeNames[] = {"counter", "gauge", "histogram"};
+  const char *family = NULL;
+  for (Metric *metric = firstMetric; metric; metric = metric->next)
+  {
+    Metric copy;
+    snapshot(metric, &copy);
+    const char *labels = copy.labels ? copy.labels : "";
+    const char *separator = copy.labels ? "," : "";
+    if (!family || strcmp(family, copy.name))
+    {
+      family = copy.name;
+      if (copy.help)
+        writeLine(writer, context, "# HELP %s %s\n", copy.name, copy.help);
+      writeLine(writer, context, "# TYPE %s %s\n", copy.name, typeNames[copy.type]);
+    }
+    if (copy.type != METRIC_HISTOGRAM)
+    {
+      if (copy.labels)
+        writeLine(writer, context, "%s{%s} %u\n", copy.name, labels, (unsigned) copy.value);
+      else
+        writeLine(writer, context, "%s %u\n", copy.name, (unsigned) copy.value);
+      continue;
+    }
+
+    uint32_t cumulative = 0;
+    for (uint8_t bucket = 0; bucket < METRIC_BUCKETS - 1; bucket++)
+    {
+      cumulative += copy.buckets[bucket];
+      writeLine(writer, context, "%s_bucket{%s%sle=\"%u\"} %u\n", copy.name, labels, separator, 1u << bucket, (unsigned) cumulative);
+    }
+    writeLine(writer, context, "%s_bucket{%s%sle=\"+Inf\"} %u\n", copy.name, labels, separator, (unsigned) copy.value);
+    if (copy.labels)
+    {
+      writeLine(writer, context, "%s_sum{%s} %llu\n", copy.name, labels, (unsigned long long) copy.sum);
+      writeLine(writer, context, "%s_count{%s} %u\n", copy.name, labels, (unsigned) copy.value);
+    }
+    else
+    {
+      writeLine(writer, context, "%s_sum %llu\n", copy.name, (unsigned long long) copy.sum);
+      writeLine(writer, context, "%s_count %u\n", copy.name, (unsigned) copy.value);
+    }
+  }
+
+  //the maxima of the histograms as gauges, after the histogram families
+  family = NULL;
+  for (Metric *metric = firstMetric; metric; metric = metric->next)
+  {
+    if (metric->type != METRIC_HISTOGRAM)
+      continue;
+    Metric copy;
+    snapshot(metric, &copy);
+    if (!family || strcmp(family, copy.name))
+    {
+      family = copy.name;
+      writeLine(writer, context, "# TYPE %s_max gauge\n", copy.name);
+    }
+    if (copy.labels)
+      writeLine(writer, context, "%s_max{%s} %u\n", copy.name, copy.labels, (unsigned) copy.max);
+    else
+      writeLine(writer, context, "%s_max %u\n", copy.name, (unsigned) copy.max);
+  }
+}
+
+static size_t stringLength(const char *s)
+{
+  size_t len = s ? strlen(s) : 0;
+  return len < METRICS_NAME_SIZE ? len : METRICS_NAME_SIZE;
+}
+
+/**
+ * @fn
+ * Maximum frame size of the metrics up to last (the list is only appended to, so it is read without the lock)
+ */
+static size_t frameSize(const Metric *last)
+{
+  size_t size = 4 + 1 + 4 + 2;
+  for (const Metric *metric = last ? firstMetric : NULL; metric; metric = metric == last ? NULL : metric->next)
+  {
+    size += 3 + stringLength(metric->name) + stringLength(metric->labels);
+    size += metric->type == METRIC_HISTOGRAM ? 4 + 8 + 4 + 4 + 4 * METRIC_BUCKETS : 4;
+  }
+  return size;
+}
+
+static Metric *lastRegistered()
+{
+  metricsLock();
+  Metric *last = lastMetric;
+  metricsUnlock();
+  return last;
+}
+
+size_t metricsFrameSize()
+{
+  return frameSize(lastRegistered());
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value)
+{
+  for (uint8_t i = 0; i < 4; i++)
+    *p++ = value >> (8 * i);
+  return p;
+}
+
+static uint8_t *putString(uint8_t *p, const char *s)
+{
+  size_t len = stringLength(s);
+  *p++ = len;
+  if (len)
+    memcpy(p, s, len);
+  return p + len;
+}
+
+size_t metricsFrame(uint8_t *frame, size_t size, uint32_t uptime)
+{
+  //metrics registered meanwhile are not in the frame
+  Metric *last = lastRegistered();
+  if (size < frameSize(last) || frameSize(last) - 6 > 0xffff)
+    return 0;
+  uint8_t *payload = frame + 4;
+  uint8_t *p = payload;
+  *p++ = METRICS_VERSION;
+  p = put32(p, uptime);
+  for (Metric *metric = last ? firstMetric : NULL; metric; metric = metric == last ? NULL : metric->next)
+  {
+    Metric copy;
+    snapshot(metric, &copy);
+    *p++ = copy.type;
+    p = putString(p, copy.name);
+    p = putString(p, copy.labels);
+    p = put32(p, copy.value);
+    if (copy.type != METRIC_HISTOGRAM)
+      continue;
+    p = put32(p, copy.sum);
+    p = put32(p, copy.sum >> 32);
+    p = put32(p, copy.max);
+    uint32_t mask = 0;
+    for (uint8_t bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+      if (copy.buckets[bucket])
+        mask |= 1u << bucket;
+    }
+    p = put32(p, mask);
+    for (uint8_t bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+      if (copy.buckets[bucket])
+        p = put32(p, copy.buckets[bucket]);
+    }
+  }
+
+  size_t len = p - payload;
+  frame[0] = METRICS_SYNC & 0xff;
+  frame[1] = METRICS_SYNC >> 8;
+  frame[2] = len & 0xff;
+  frame[3] = len >> 8;
+  uint16_t checksum = metricsChecksum(payload, len);
+  *p++ = checksum & 0xff;
+  *p++ = checksum >> 8;
+  return p - frame;
+}
+
+uint16_t metricsChecksum(const uint8_t *data, size_t len)
+{
+  uint16_t sum1 = 0, sum2 = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
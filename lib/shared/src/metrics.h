@@ -0,0 +1,122 @@
+/**
+ * @file metrics.h
+ * @brief Counters, gauges and histograms of the hot paths (module load and calls, radio, transfer, flash). A metric is a static
+ * Metric, registered once with metricsAdd() and updated with a few instructions under a spinlock, so it can be updated from any
+ * task and from the radio callbacks. The registered metrics are read as Prometheus text (e.g. the /metrics route) or as a
+ * compact binary frame (e.g. over serial, decoded on the host by tools/metrics_decode.cpp).
+ *
+ * A histogram counts values in METRIC_BUCKETS power-of-two buckets: bucket i counts the values <= 2^i, the last one the larger
+ * values (+Inf). It also keeps the count, the sum and the maximum.
+ *
+ * Binary frame (little endian):
+ *   | METRICS_SYNC (2) | payload length (2) | payload | Fletcher-16 of the payload (2) |
+ *   payload: | METRICS_VERSION (1) | uptime ms (4) | metric | metric | ...
+ *   metric:  | type (1) | name length (1) | name | labels length (1) | labels |
+ *     counter, gauge: | value (4) |
+ *     histogram:      | count (4) | sum (8) | max (4) | mask of the non-empty buckets (4) | count (4) per non-empty bucket |
+ *
+ * Usage:
+ *   Metric callTime = {"wasm_call_us", "module=\"0\"", "Latency of a module call", METRIC_HISTOGRAM};
+ *   metricsAdd(&callTime); //setup()
+ *   metricRecord(&callTime, us);
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRIC_BUCKETS 24 //upper bounds 1, 2, 4, ..., 2^22, +Inf
+#define METRICS_SYNC 0x4da5 //'\xa5' 'M'
+#define METRICS_VERSION 1
+#define METRICS_NAME_SIZE 255 //maximum length of the name and of the labels in a binary frame
+
+enum MetricType : uint8_t { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+typedef struct Metric {
+  const char *name; //Prometheus name, metrics of the same name have to be registered one after the other
+  const char *labels; //e.g. "module=\"0\"", NULL without labels
+  const char *help;
+  MetricType type;
+  //state, under the lock of the metrics
+  uint32_t value; //counter, gauge; histogram: count
+  uint32_t max; //histogram
+  uint64_t sum; //histogram
+  uint32_t buckets[METRIC_BUCKETS]; //histogram
+  struct Metric *next; //registered metrics
+  bool registered;
+} Metric;
+
+/**
+ * Consumer of the text of the metrics
+ * @param context void *
+ * @param data const char *
+ * @param len size_t
+ */
+typedef void (*MetricsWriter)(void *context, const char *data, size_t len);
+
+/**
+ * @fn
+ * Register a metric. Registering a metric again has no effect.
+ * @param metric Metric *, must stay valid
+ */
+void metricsAdd(Metric *metric);
+
+/**
+ * @fn
+ * Add to a counter
+ * @param metric Metric *
+ * @param n uint32_t
+ */
+void metricCount(Metric *metric, uint32_t n = 1);
+
+/**
+ * @fn
+ * Set a gauge
+ * @param metric Metric *
+ * @param value uint32_t
+ */
+void metricSet(Metric *metric, uint32_t value);
+
+/**
+ * @fn
+ * Add a value to a histogram
+ * @param metric Metric *
+ * @param value uint32_t
+ */
+void metricRecord(Metric *metric, uint32_t value);
+
+/**
+ * @fn
+ * Write the registered metrics in the Prometheus text format
+ * @param writer MetricsWriter, called once per line
+ * @param context void *
+ */
+void metricsText(MetricsWriter writer, void *context);
+
+/**
+ * @fn
+ * @return size_t, maximum size of a binary frame of the registered metrics
+ */
+size_t metricsFrameSize();
+
+/**
+ * @fn
+ * Write a binary frame of the registered metrics
+ * @param frame uint8_t *
+ * @param size size_t, e.g. metricsFrameSize()
+ * @param uptime uint32_t, ms
+ * @return length of the frame, 0 if it does not fit
+ */
+size_t metricsFrame(uint8_t *frame, size_t size, uint32_t uptime);
+
+/**
+ * @fn
+ * Fletcher-16 checksum of a binary frame
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return uint16_t
+ */
+uint16_t metricsChecksum(const uint8_t *data, size_t len);
+
+#endif
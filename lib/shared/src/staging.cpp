@@ -0,0 +1,122 @@
+/**
+ * @file staging.cpp
+ * @brief Double-buffered staging of received module data (see staging.h).
+ */
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "staging.h"
+
+static uint8_t stagingBuffer[2][STAGING_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint16_t stagingLength[2];
+static volatile bool stagingFull[2]; //set by stagingWrite(), cleared after the flash write
+static uint8_t stagingFill = 0; //buffer being filled
+static File stagingFile;
+static SemaphoreHandle_t stagingMutex = NULL; //the file is written from the radio callback and from loop()
+
+Metric stagingWriteTime = {"flash_write_us", NULL, "Time of a staging buffer write to flash", METRIC_HISTOGRAM};
+
+/**
+ * @fn
+ * Write a full buffer to flash if it is still full
+ */
+static void writeStagingBuffer(uint8_t index)
+{
+  xSemaphoreTake(stagingMutex, portMAX_DELAY);
+  if (stagingFull[index])
+  {
+    unsigned long start = micros();
+    stagingFile.write(stagingBuffer[index], stagingLength[index]);
+    metricRecord(&stagingWriteTime, micros() - start);
+    stagingLength[index] = 0;
+    stagingFull[index] = false;
+  }
+  xSemaphoreGive(stagingMutex);
+}
+
+bool stagingBegin(const char *path)
+{
+  if (!stagingMutex)
+    stagingMutex = xSemaphoreCreateMutex();
+
+  xSemaphoreTake(stagingMutex, portMAX_DELAY);
+  if (stagingFile)
+    stagingFile.close();
+  stagingFile = SPIFFS.open(path, "w");
+  stagingLength[0] = stagingLength[1] = 0;
+  stagingFull[0] = stagingFull[1] = false;
+  stagingFill = 0;
+  bool ok = stagingFile;
+  xSemaphoreGive(stagingMutex);
+  return ok;
+}
+
+void stagingWrite(const uint8_t *data, size_t len)
+{
+  while (len)
+  {
+    uint8_t index = stagingFill;
+    size_t n = min(len, (size_t) (STAGING_BUFFER_SIZE - stagingLength[index]));
+    memcpy(stagingBuffer[index] + stagingLength[index], data, n);
+    stagingLength[index] += n;
+    data += n;
+    len -= n;
+
+    if (stagingLength[index] == STAGING_BUFFER_SIZE)
+    {
+      //loop() did not write the other buffer yet
+      if (stagingFull[1 - index])
+        writeStagingBuffer(1 - index);
+      stagingFull[index] = true;
+      stagingFill = 1 - index;
+    }
+  }
+}
+
+void stagingWriter(const uint8_t *data, size_t len, void *context)
+{
+  (void) context;
+  stagingWrite(data, len);
+}
+
+void stagingFlush()
+{
+  for (uint8_t index = 0; index < 2; index++)
+  {
+    if (stagingFull[index])
+      writeStagingBuffer(index);
+  }
+}
+
+size_t stagingSpace()
+{
+  uint8_t fill = stagingFill;
+  size_t space = STAGING_BUFFER_SIZE - stagingLength[fill];
+  if (!stagingFull[1 - fill])
+    space += STAGING_BUFFER_SIZE;
+  return space;
+}
+
+size_t stagingFinish()
+{
+  if (!stagingMutex)
+    return 0;
+
+  //the older full buffer first
+  uint8_t fill = stagingFill;
+  if (stagingFull[1 - fill])
+    writeStagingBuffer(1 - fill);
+  if (stagingFull[fill])
+    writeStagingBuffer(fill);
+
+  xSemaphoreTake(stagingMutex, portMAX_DELAY);
+  size_t size = 0;
+  if (stagingFile)
+  {
+    stagingFile.write(stagingBuffer[fill], stagingLength[fill]);
+    stagingLength[fill] = 0;
+    size = stagingFile.size();
+    stagingFile.close();
+  }
+  xSemaphoreGive(stagingMutex);
+  return size;
+}
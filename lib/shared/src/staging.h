@@ -0,0 +1,60 @@
+/**
+ * @file staging.h
+ * @brief RAM staging of a received module. The radio callback only copies the data into one of two aligned buffers;
+ * a full buffer is written to flash in one call from loop() (stagingFlush()) while the other one fills.
+ * The file stays open during the whole reception, so there is no open/close per packet.
+ */
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+#define STAGING_BUFFER_SIZE 1024 //bytes per flash write, a multiple of the SPIFFS page size (256 Byte)
+
+extern Metric stagingWriteTime; //histogram of the flash writes (us), to be registered with metricsAdd()
+
+/**
+ * @fn
+ * Create (truncate) the file and reset the buffers. A file of a previous reception is closed.
+ * @param path const char *
+ * @return false if the file cannot be opened
+ */
+bool stagingBegin(const char *path);
+
+/**
+ * @fn
+ * Append data. Called in the radio callback. Writes to flash only if loop() did not write the other buffer in time.
+ * @param data const uint8_t *
+ * @param len size_t
+ */
+void stagingWrite(const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * LzssWriter (see lzss.h) for stagingWrite()
+ */
+void stagingWriter(const uint8_t *data, size_t len, void *context);
+
+/**
+ * @fn
+ * Write full buffers to flash. Called in loop().
+ */
+void stagingFlush();
+
+/**
+ * @fn
+ * Bytes which can be appended before stagingWrite() has to write to flash itself
+ * @return size_t
+ */
+size_t stagingSpace();
+
+/**
+ * @fn
+ * Write the remaining data and close the file.
+ * @return file size
+ */
+size_t stagingFinish();
+
+#endif
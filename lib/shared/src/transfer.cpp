@@ -0,0 +1,262 @@
+/**
+ * @file transfer.cpp
+ * @brief Transport independent chunked transfer (see transfer.h).
+ */
+#include <string.h>
+#include "transfer.h"
+
+uint16_t transferPacketCount(size_t size, uint16_t payloadSize)
+{
+  return (size + payloadSize - 1) / payloadSize;
+}
+
+uint16_t transferBuildHeader(uint16_t numberOfPackets, uint8_t *packet)
+{
+  packet[0] = TRANSFER_HEADER_FLAG;
+  packet[1] = numberOfPackets >> 8;
+  packet[2] = (uint8_t) numberOfPackets;
+  return TRANSFER_HEADER_SIZE;
+}
+
+uint16_t transferBuildData(uint16_t sequence, const uint8_t *payload, uint16_t len, uint8_t *packet)
+{
+  packet[0] = TRANSFER_DATA_FLAG;
+  packet[1] = sequence >> 8;
+  packet[2] = (uint8_t) sequence;
+  memcpy(packet + TRANSFER_DATA_HEADER_SIZE, payload, len);
+  return len + TRANSFER_DATA_HEADER_SIZE;
+}
+
+void transferSenderStart(TransferSender *sender, uint16_t numberOfPackets, uint8_t transferId, uint8_t window, uint32_t retransmitTimeout, bool waitForCredit)
+{
+  memset(sender, 0, sizeof(TransferSender));
+  sender->window = window > TRANSFER_MAX_WINDOW ? TRANSFER_MAX_WINDOW : window;
+  sender->numberOfPackets = numberOfPackets;
+  sender->transferId = transferId;
+  sender->retransmitTimeout = retransmitTimeout;
+  sender->creditLimit = waitForCredit ? 1 : TRANSFER_NO_CREDIT;
+  sender->active = true;
+}
+
+int transferSenderNext(TransferSender *sender, uint16_t available, uint32_t now)
+{
+  if (!sender->active)
+    return -1;
+  for (uint16_t sequence = sender->windowBase; sequence < sender->nextSequence; sequence++)
+  {
+    uint8_t slot = sequence % sender->window;
+    uint8_t state = sender->packetState[slot];
+    bool timeout = state == TRANSFER_SENT && now - sender->packetSentMillis[slot] >= sender->retransmitTimeout;
+    if (state == TRANSFER_PENDING || state == TRANSFER_REFUSED || timeout)
+    {
+      if (timeout)
+        sender->timeouts++;
+      if (state != TRANSFER_REFUSED)
+        sender->retransmissions++;
+      sender->packetState[slot] = TRANSFER_SENT;
+      sender->packetSentMillis[slot] = now;
+      return sequence;
+    }
+  }
+  if (sender->nextSequence <= sender->numberOfPackets && sender->nextSequence <= available
+      && sender->nextSequence < sender->windowBase + sender->window && sender->nextSequence < sender->creditLimit)
+  {
+    uint8_t slot = sender->nextSequence % sender->window;
+    sender->packetState[slot] = TRANSFER_SENT;
+    sender->packetSentMillis[slot] = now;
+    sender->packetsSent++;
+    return sender->nextSequence++;
+  }
+  return -1;
+}
+
+void transferSenderRetry(TransferSender *sender, uint16_t sequence)
+{
+  uint8_t slot = sequence % sender->window;
+  if (sequence >= sender->windowBase && sequence < sender->nextSequence && sender->packetState[slot] == TRANSFER_SENT)
+  {
+    sender->packetState[slot] = TRANSFER_REFUSED;
+    sender->refused++;
+  }
+}
+
+bool transferSenderAck(TransferSender *sender, const uint8_t *data, size_t len)
+{
+  uint8_t bitmapSize = TRANSFER_BITMAP_SIZE(sender->window);
+  if (!sender->active || len < (size_t) bitmapSize + 4 || data[0] != TRANSFER_ACK_FLAG || data[1] != sender->transferId)
+    return false;
+  uint16_t nextExpected = data[2] << 8 | data[3];
+  //ACKs older than the window base are outdated
+  if (nextExpected < sender->windowBase || nextExpected > sender->nextSequence)
+    return false;
+
+  sender->windowBase = nextExpected;
+  sender->timeouts = 0;
+  uint8_t credit = len > (size_t) bitmapSize + 4 ? data[bitmapSize + 4] : sender->window;
+  sender->creditLimit = nextExpected + (credit < sender->window ? credit : sender->window);
+
+  //the highest buffered packet tells which packets before it are missing
+  int highestBuffered = -1;
+  for (int i = 0; i < sender->window - 1; i++)
+  {
+    uint16_t sequence = sender->windowBase + 1 + i;
+    if (sequence >= sender->nextSequence)
+      break;
+    if (data[4 + i / 8] & (1 << (i % 8)))
+    {
+      sender->packetState[sequence % sender->window] = TRANSFER_ACKED;
+      highestBuffered = i;
+    }
+  }
+  for (int i = -1; i < highestBuffered; i++)
+  {
+    uint8_t slot = (sender->windowBase + 1 + i) % sender->window;
+    if (sender->packetState[slot] == TRANSFER_SENT)
+      sender->packetState[slot] = TRANSFER_PENDING;
+  }
+  return true;
+}
+
+bool transferSenderDone(const TransferSender *sender)
+{
+  return sender->windowBase > sender->numberOfPackets;
+}
+
+uint32_t transferSenderNextTimeout(const TransferSender *sender, uint16_t available, uint32_t now)
+{
+  if (!sender->active)
+    return TRANSFER_NO_TIMEOUT;
+  uint32_t timeout = TRANSFER_NO_TIMEOUT;
+  for (uint16_t sequence = sender->windowBase; sequence < sender->nextSequence; sequence++)
+  {
+    uint8_t slot = sequence % sender->window;
+    if (sender->packetState[slot] == TRANSFER_PENDING || sender->packetState[slot] == TRANSFER_REFUSED)
+      return 0;
+    if (sender->packetState[slot] == TRANSFER_SENT)
+    {
+      uint32_t age = now - sender->packetSentMillis[slot];
+      if (age >= sender->retransmitTimeout)
+        return 0;
+      if (sender->retransmitTimeout - age < timeout)
+        timeout = sender->retransmitTimeout - age;
+    }
+  }
+  if (sender->nextSequence <= sender->numberOfPackets && sender->nextSequence <= available
+      && sender->nextSequence < sender->windowBase + sender->window && sender->nextSequence < sender->creditLimit)
+    return 0;
+  return timeout;
+}
+
+int transferSenderPoll(TransferSender *sender, const TransferLink *link, TransferBuilder builder, void *builderContext,
+                       uint16_t available, uint32_t now, int maxPackets)
+{
+  uint8_t packet[TRANSFER_MAX_PACKET_SIZE];
+  int sent = 0;
+  while (sent < maxPackets)
+  {
+    if (link->lock)
+      link->lock(link->context);
+    int sequence = transferSenderNext(sender, available, now);
+    if (link->unlock)
+      link->unlock(link->context);
+    if (sequence < 0)
+      break;
+
+    uint16_t length = builder(builderContext, sequence, packet);
+    if (!length || !link->send(link->context, packet, length))
+    {
+      if (link->lock)
+        link->lock(link->context);
+      transferSenderRetry(sender, sequence);
+      if (link->unlock)
+        link->unlock(link->context);
+      break;
+    }
+    sent++;
+  }
+  return sent;
+}
+
+void transferReceiverInit(TransferReceiver *receiver, uint8_t window, uint8_t *buffer, uint16_t payloadSize)
+{
+  memset(receiver, 0, sizeof(TransferReceiver));
+  receiver->window = window > TRANSFER_MAX_WINDOW ? TRANSFER_MAX_WINDOW : window;
+  receiver->buffer = buffer;
+  receiver->payloadSize = payloadSize;
+}
+
+void transferReceiverStart(TransferReceiver *receiver, uint8_t transferId, uint16_t numberOfPackets)
+{
+  receiver->transferId = transferId;
+  receiver->numberOfPackets = numberOfPackets;
+  receiver->currentOffset = 0;
+  receiver->packetsSinceAck = 0;
+  receiver->creditLimit = 0;
+  memset(receiver->bufferLength, 0, sizeof(receiver->bufferLength));
+}
+
+void transferReceiverSkip(TransferReceiver *receiver)
+{
+  receiver->currentOffset = receiver->numberOfPackets;
+  memset(receiver->bufferLength, 0, sizeof(receiver->bufferLength));
+}
+
+bool transferReceive(TransferReceiver *receiver, const uint8_t *data, size_t len, TransferWriter writer, void *writerContext)
+{
+  if (!receiver->numberOfPackets || len <= TRANSFER_DATA_HEADER_SIZE || len - TRANSFER_DATA_HEADER_SIZE > receiver->payloadSize)
+    return false;
+  uint16_t offset = data[1] << 8 | data[2];
+  if (offset <= receiver->currentOffset)
+  {
+    receiver->duplicates++;
+    return true; //the last ACK was lost
+  }
+  if (offset > receiver->currentOffset + receiver->window || offset > receiver->numberOfPackets)
+    return false;
+
+  uint8_t slot = offset % receiver->window;
+  memcpy(receiver->buffer + slot * receiver->payloadSize, data + TRANSFER_DATA_HEADER_SIZE, len - TRANSFER_DATA_HEADER_SIZE);
+  receiver->bufferLength[slot] = len - TRANSFER_DATA_HEADER_SIZE;
+  receiver->packetsReceived++;
+  if (offset != receiver->currentOffset + 1)
+    return true; //gap: report the missing packets at once
+
+  //pass the buffered packets on as long as they are in order
+  while (receiver->bufferLength[slot] && receiver->currentOffset < receiver->numberOfPackets)
+  {
+    writer(writerContext, receiver->currentOffset + 1, receiver->buffer + slot * receiver->payloadSize, receiver->bufferLength[slot]);
+    receiver->bufferLength[slot] = 0;
+    receiver->currentOffset++;
+    receiver->packetsSinceAck++;
+    slot = (receiver->currentOffset + 1) % receiver->window;
+  }
+  return receiver->packetsSinceAck >= receiver->window / 2 || receiver->currentOffset + 1 >= receiver->creditLimit
+    || transferReceiverDone(receiver);
+}
+
+bool transferReceiverDone(const TransferReceiver *receiver)
+{
+  return receiver->numberOfPackets && receiver->currentOffset == receiver->numberOfPackets;
+}
+
+uint8_t transferBuildAck(TransferReceiver *receiver, uint8_t credit, uint8_t *packet)
+{
+  uint8_t bitmapSize = TRANSFER_BITMAP_SIZE(receiver->window);
+  uint16_t nextExpected = receiver->currentOffset + 1;
+  packet[0] = TRANSFER_ACK_FLAG;
+  packet[1] = receiver->transferId;
+  packet[2] = nextExpected >> 8;
+  packet[3] = (uint8_t) nextExpected;
+  memset(packet + 4, 0, bitmapSize);
+  for (int i = 0; i < receiver->window - 1; i++)
+  {
+    if (receiver->bufferLength[(nextExpected + 1 + i) % receiver->window])
+      packet[4 + i / 8] |= 1 << (i % 8);
+  }
+  if (credit > receiver->window)
+    credit = receiver->window;
+  packet[4 + bitmapSize] = credit;
+  receiver->creditLimit = nextExpected + credit;
+  receiver->packetsSinceAck = 0;
+  return bitmapSize + 5;
+}
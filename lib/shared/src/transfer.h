@@ -0,0 +1,262 @@
+/**
+ * @file transfer.h
+ * @brief Transport independent chunked transfer of a module (selective repeat). The sender splits the module into payload packets
+ * and keeps up to a window of them unacknowledged, the receiver buffers out-of-order packets, passes them on in order and answers with ACKs.
+ * The engine builds and parses the payload packets and the ACKs. The application fills the header (sequence number 0) with its own fields
+ * and moves the packets over a TransferLink:
+ * - ESP-NOW: mesh frames to a node (esp-now/src/main.cpp)
+ * - BLE: notifications to a connection and ACK writes (BLE-communication/server, BLE-communication/client)
+ * - Loopback: an in-process link with loss, latency, MTU and bandwidth (esp-now/tools/transfer_bench.cpp)
+ *
+ * Like mesh.h, the engine does not access the radio or the clock, so it runs on the host as well. It is not thread safe;
+ * TransferLink.lock is held while the state of a sender is changed in transferSenderPoll().
+ *
+ * Message structure (uint8_t *):
+ * - Header (sequence number 0)
+ * | message flag (0x01) | second byte of the number of packets | first byte of the number of packets | fields of the application |
+ * - Payload packet (sequence number = offset, 1..number of packets)
+ * | message flag (0x02) | second byte of the offset | first byte of the offset | payload |
+ * - ACK
+ * | message flag (0x03) | transfer ID | second byte of the next expected offset | first byte of the next expected offset | bitmap | credit |
+ * All packets before the next expected offset are received. Bit i of the bitmap (TRANSFER_BITMAP_SIZE(window) bytes) is set if the packet
+ * (next expected offset + 1 + i) is buffered. A cleared bit before a set bit is a NACK, the sender sends this packet again immediately.
+ * Credit: packets from the next expected offset the receiver can take now. New packets are sent only within it.
+ * An ACK without credit byte allows the whole window.
+ */
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRANSFER_HEADER_FLAG 0x01
+#define TRANSFER_DATA_FLAG 0x02
+#define TRANSFER_ACK_FLAG 0x03
+#define TRANSFER_HEADER_SIZE 3 //flag and number of packets, the fields of the application follow
+#define TRANSFER_DATA_HEADER_SIZE 3 //flag and offset
+#define TRANSFER_MAX_WINDOW 32
+#define TRANSFER_MAX_PACKET_SIZE 514 //largest BLE notification (ATT MTU 517 - 3 byte notify header), ESP-NOW: 250 byte
+#define TRANSFER_BITMAP_SIZE(window) (((window) + 7) / 8)
+#define TRANSFER_ACK_SIZE(window) (TRANSFER_BITMAP_SIZE(window) + 5)
+#define TRANSFER_MAX_ACK_SIZE TRANSFER_ACK_SIZE(TRANSFER_MAX_WINDOW)
+#define TRANSFER_NO_CREDIT 0xffff //creditLimit of a sender which does not wait for the first credit
+#define TRANSFER_NO_TIMEOUT 0xffffffff //see transferSenderNextTimeout()
+
+//TRANSFER_PENDING: NACKed, TRANSFER_REFUSED: not taken by the link. Both are sent before new packets.
+enum TransferPacketState : uint8_t { TRANSFER_PENDING, TRANSFER_SENT, TRANSFER_ACKED, TRANSFER_REFUSED };
+
+/**
+ * Link of a transfer. One link per receiver, context identifies it (e.g. the mesh node or the BLE connection).
+ */
+typedef struct {
+  //send a packet, false if the link cannot take it now (the packet is sent again later)
+  bool (*send)(void *context, const uint8_t *data, size_t len);
+  //critical section of the sender state, NULL if the sender is not shared with another task
+  void (*lock)(void *context);
+  void (*unlock)(void *context);
+  void *context;
+} TransferLink;
+
+/**
+ * Builds the packet of a sequence number: the header (0) or a payload packet (see transferBuildData()).
+ * @return packet length, 0 if the packet cannot be built
+ */
+typedef uint16_t (*TransferBuilder)(void *context, uint16_t sequence, uint8_t *packet);
+
+/**
+ * Receives the payload packets in order.
+ */
+typedef void (*TransferWriter)(void *context, uint16_t offset, const uint8_t *data, size_t len);
+
+typedef struct {
+  bool active;
+  uint8_t window; //max. number of unacknowledged packets, at most the window of the receiver
+  uint16_t numberOfPackets; //payload packets, sequence numbers 1..numberOfPackets
+  uint8_t transferId;
+  uint32_t retransmitTimeout; //ms without ACK until an unacknowledged packet is sent again
+  uint16_t windowBase; //oldest sequence number without ACK
+  uint16_t nextSequence; //next sequence number which has never been sent
+  uint16_t creditLimit; //new packets must have a lower sequence number
+  uint8_t timeouts; //retransmissions after retransmitTimeout since the last ACK
+  uint8_t packetState[TRANSFER_MAX_WINDOW]; //TransferPacketState, indexed by sequence number % window
+  uint32_t packetSentMillis[TRANSFER_MAX_WINDOW];
+  //counters
+  uint32_t packetsSent; //new packets
+  uint32_t retransmissions; //packets sent again after a NACK or a timeout
+  uint32_t refused; //packets the link did not take (see transferSenderRetry())
+} TransferSender;
+
+typedef struct {
+  uint8_t window; //max. number of buffered out-of-order packets, at least the window of the sender
+  uint16_t payloadSize; //max. payload of a packet
+  uint8_t *buffer; //window * payloadSize bytes of the application
+  uint16_t bufferLength[TRANSFER_MAX_WINDOW]; //0: slot is empty
+  uint16_t numberOfPackets; //0: no reception started
+  uint16_t currentOffset; //last packet passed on in order
+  uint8_t transferId;
+  uint8_t packetsSinceAck;
+  uint16_t creditLimit; //the sender sends no new packet from this offset until the next ACK
+  //counters
+  uint32_t packetsReceived;
+  uint32_t duplicates;
+} TransferReceiver;
+
+/**
+ * @fn
+ * Number of payload packets of a module
+ * @param size size_t, bytes
+ * @param payloadSize uint16_t
+ * @return uint16_t
+ */
+uint16_t transferPacketCount(size_t size, uint16_t payloadSize);
+
+/**
+ * @fn
+ * Write the flag and the number of packets of a header. The application appends its fields.
+ * @param numberOfPackets uint16_t
+ * @param packet uint8_t *, buffer of at least TRANSFER_HEADER_SIZE bytes
+ * @return TRANSFER_HEADER_SIZE
+ */
+uint16_t transferBuildHeader(uint16_t numberOfPackets, uint8_t *packet);
+
+/**
+ * @fn
+ * Build a payload packet
+ * @param sequence uint16_t, offset 1..number of packets
+ * @param payload const uint8_t *
+ * @param len uint16_t
+ * @param packet uint8_t *, buffer of at least len + TRANSFER_DATA_HEADER_SIZE bytes
+ * @return packet length
+ */
+uint16_t transferBuildData(uint16_t sequence, const uint8_t *payload, uint16_t len, uint8_t *packet);
+
+/**
+ * @fn
+ * Start a transfer. The header is sent first.
+ * @param sender TransferSender *
+ * @param numberOfPackets uint16_t
+ * @param transferId uint8_t, differs from the last transfer, so a repeated header is recognized
+ * @param window uint8_t, at most TRANSFER_MAX_WINDOW
+ * @param retransmitTimeout uint32_t, ms
+ * @param waitForCredit bool, true: send only the header until the first ACK tells the credit
+ */
+void transferSenderStart(TransferSender *sender, uint16_t numberOfPackets, uint8_t transferId, uint8_t window, uint32_t retransmitTimeout, bool waitForCredit);
+
+/**
+ * @fn
+ * Choose the next packet and mark it as sent. NACKed packets and packets without ACK after retransmitTimeout come first,
+ * then new packets within the window and the credit.
+ * @param sender TransferSender *
+ * @param available uint16_t, payload packets which can be sent, e.g. the packets received so far when relaying
+ * @param now uint32_t, ms
+ * @return sequence number, -1 if nothing to send
+ */
+int transferSenderNext(TransferSender *sender, uint16_t available, uint32_t now);
+
+/**
+ * @fn
+ * A packet of transferSenderNext() was not sent, it is sent again next time
+ * @param sender TransferSender *
+ * @param sequence uint16_t
+ */
+void transferSenderRetry(TransferSender *sender, uint16_t sequence);
+
+/**
+ * @fn
+ * Update the window with an ACK of the receiver. Outdated ACKs and ACKs of another transfer are ignored.
+ * @param sender TransferSender *
+ * @param data const uint8_t *, ACK packet with message flag
+ * @param len size_t
+ * @return false if the ACK is ignored
+ */
+bool transferSenderAck(TransferSender *sender, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * @param sender const TransferSender *
+ * @return true if all packets (header and payload) are acknowledged
+ */
+bool transferSenderDone(const TransferSender *sender);
+
+/**
+ * @fn
+ * Time until transferSenderNext() has a packet without a new ACK, so the application can sleep until then (see event_loop.h)
+ * @param sender const TransferSender *
+ * @param available uint16_t, as for transferSenderNext()
+ * @param now uint32_t, ms
+ * @return ms, 0 if a packet is due now, TRANSFER_NO_TIMEOUT if only an ACK moves the sender on
+ */
+uint32_t transferSenderNextTimeout(const TransferSender *sender, uint16_t available, uint32_t now);
+
+/**
+ * @fn
+ * Send the due packets over a link (transferSenderNext(), the builder, link->send). Stops when nothing is due or the link refuses a packet.
+ * @param sender TransferSender *
+ * @param link const TransferLink *
+ * @param builder TransferBuilder
+ * @param builderContext void *
+ * @param available uint16_t, see transferSenderNext()
+ * @param now uint32_t, ms
+ * @param maxPackets int
+ * @return number of sent packets
+ */
+int transferSenderPoll(TransferSender *sender, const TransferLink *link, TransferBuilder builder, void *builderContext,
+                       uint16_t available, uint32_t now, int maxPackets);
+
+/**
+ * @fn
+ * Initialize a receiver with the buffer for out-of-order packets
+ * @param receiver TransferReceiver *
+ * @param window uint8_t, at most TRANSFER_MAX_WINDOW
+ * @param buffer uint8_t *, window * payloadSize bytes
+ * @param payloadSize uint16_t
+ */
+void transferReceiverInit(TransferReceiver *receiver, uint8_t window, uint8_t *buffer, uint16_t payloadSize);
+
+/**
+ * @fn
+ * Start the reception of a header. Buffered packets of the last transfer are dropped.
+ * @param receiver TransferReceiver *
+ * @param transferId uint8_t
+ * @param numberOfPackets uint16_t
+ */
+void transferReceiverStart(TransferReceiver *receiver, uint8_t transferId, uint16_t numberOfPackets);
+
+/**
+ * @fn
+ * Acknowledge the whole transfer without receiving it, e.g. if the receiver has the module already
+ * @param receiver TransferReceiver *
+ */
+void transferReceiverSkip(TransferReceiver *receiver);
+
+/**
+ * @fn
+ * Handle a payload packet. Packets in order are passed to the writer, out-of-order packets are buffered.
+ * @param receiver TransferReceiver *
+ * @param data const uint8_t *, payload packet with message flag
+ * @param len size_t
+ * @param writer TransferWriter
+ * @param writerContext void *
+ * @return true if an ACK is due: after window / 2 packets in order, at a gap, at a duplicate (the last ACK was lost),
+ * when the credit is used up and at the end of the transfer
+ */
+bool transferReceive(TransferReceiver *receiver, const uint8_t *data, size_t len, TransferWriter writer, void *writerContext);
+
+/**
+ * @fn
+ * @param receiver const TransferReceiver *
+ * @return true if all payload packets are passed to the writer
+ */
+bool transferReceiverDone(const TransferReceiver *receiver);
+
+/**
+ * @fn
+ * Build the ACK of the current reception state
+ * @param receiver TransferReceiver *
+ * @param credit uint8_t, packets the receiver can take now, at most the window
+ * @param packet uint8_t *, buffer of at least TRANSFER_ACK_SIZE(window) bytes
+ * @return packet length
+ */
+uint8_t transferBuildAck(TransferReceiver *receiver, uint8_t credit, uint8_t *packet);
+
+#endif
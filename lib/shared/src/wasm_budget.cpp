@@ -0,0 +1,93 @@
+/**
+ * @file wasm_budget.cpp
+ * @brief Execution budget of metered modules (see wasm_budget.h).
+ */
+#include "wasm_budget.h"
+#include "wasm_fuel.h"
+
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+
+static uint64_t budgetClock()
+{
+  return esp_timer_get_time();
+}
+#else
+#include <chrono>
+
+static uint64_t budgetClock()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+const M3Result wasmTrapFuelExhausted = "[trap] fuel exhausted";
+const M3Result wasmTrapTimeExhausted = "[trap] time budget exhausted";
+
+/**
+ * refuel(fuel: i32): i32 of a metered module (see wasm_fuel.h). fuel is below 0 by the instructions charged beyond the last slice.
+ */
+m3ApiRawFunction(importRefuel)
+{
+  m3ApiReturnType(int32_t)
+  m3ApiGetArg(int32_t, fuel)
+  WasmBudget *budget = (WasmBudget *) _ctx->userdata;
+  if (budget->deadline && budgetClock() > budget->deadline)
+    m3ApiTrap(wasmTrapTimeExhausted);
+  if (!budget->config.fuel)
+    m3ApiReturn(WASM_BUDGET_SLICE);
+
+  uint64_t deficit = fuel < 0 ? (uint64_t) -(int64_t) fuel : 0;
+  if (budget->remaining <= deficit)
+  {
+    budget->remaining = 0;
+    m3ApiTrap(wasmTrapFuelExhausted);
+  }
+  budget->remaining -= deficit;
+  uint32_t slice = budget->remaining < WASM_BUDGET_SLICE ? (uint32_t) budget->remaining : WASM_BUDGET_SLICE;
+  budget->remaining -= slice;
+  m3ApiReturn((int32_t) slice);
+}
+
+void wasmBudgetInit(WasmBudget *budget, const WasmBudgetConfig *config)
+{
+  budget->config = *config;
+  budget->remaining = config->fuel;
+  budget->start = 0;
+  budget->deadline = 0;
+  budget->calls = budget->fuelTraps = budget->timeTraps = 0;
+  budget->lastTime = budget->maxTime = 0;
+  budget->totalTime = 0;
+}
+
+M3Result wasmBudgetLink(IM3Module module, WasmBudget *budget)
+{
+  return m3_LinkRawFunctionEx(module, WASM_FUEL_IMPORT_MODULE, WASM_FUEL_IMPORT_NAME, "i(i)", importRefuel, budget);
+}
+
+void wasmBudgetBegin(WasmBudget *budget)
+{
+  budget->remaining = budget->config.fuel;
+  budget->start = budgetClock();
+  budget->deadline = budget->config.time ? budget->start + budget->config.time : 0;
+}
+
+M3Result wasmBudgetEnd(WasmBudget *budget, M3Result result)
+{
+  uint32_t time = budgetClock() - budget->start;
+  budget->lastTime = time;
+  if (time > budget->maxTime)
+    budget->maxTime = time;
+  budget->totalTime += time;
+  budget->calls++;
+  if (result == wasmTrapFuelExhausted)
+    budget->fuelTraps++;
+  else if (result == wasmTrapTimeExhausted)
+    budget->timeTraps++;
+  return result;
+}
+
+bool wasmBudgetExceeded(M3Result result)
+{
+  return result == wasmTrapFuelExhausted || result == wasmTrapTimeExhausted;
+}
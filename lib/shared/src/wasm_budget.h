@@ -0,0 +1,90 @@
+/**
+ * @file wasm_budget.h
+ * @brief Execution budget of the calls of a metered module (see wasm_fuel.h). A call gets an instruction budget (fuel) and a time
+ * budget. The interpreter charges the fuel of the module and calls refuel() when it has used a slice of WASM_BUDGET_SLICE
+ * instructions. refuel() grants the next slice from the budget and checks the clock, so a call which exceeds either budget traps
+ * with wasmTrapFuelExhausted or wasmTrapTimeExhausted, and the task calling the module gets control back.
+ *
+ * A call runs at most WASM_BUDGET_SLICE instructions beyond its fuel (the rest of the previous slice) and at most one slice
+ * beyond its time budget, plus the time of a host import called in between (see wasm_imports.h).
+ * The budget also keeps statistics of the calls, e.g. the worst-case latency of the module.
+ *
+ * Usage:
+ *   wasmBudgetInit(&budget, &config);
+ *   wasmBudgetLink(module, &budget); //after m3_LoadModule()
+ *   wasmBudgetBegin(&budget);
+ *   M3Result result = m3_Call(...);
+ *   wasmBudgetEnd(&budget, result);
+ */
+#ifndef WASM_BUDGET_H
+#define WASM_BUDGET_H
+
+#include <stdint.h>
+#include "wasm3.h"
+
+#define WASM_BUDGET_SLICE 10000 //instructions granted at once, the clock is read once per slice
+
+extern const M3Result wasmTrapFuelExhausted;
+extern const M3Result wasmTrapTimeExhausted;
+
+typedef struct {
+  uint32_t fuel; //instructions per call, 0: unlimited
+  uint32_t time; //us per call, 0: unlimited
+} WasmBudgetConfig;
+
+typedef struct {
+  WasmBudgetConfig config;
+  //current call
+  uint64_t remaining; //fuel not granted yet
+  uint64_t start; //us
+  uint64_t deadline; //us, 0 without time budget
+  //statistics, written by the calling task
+  volatile uint32_t calls;
+  volatile uint32_t fuelTraps;
+  volatile uint32_t timeTraps;
+  volatile uint32_t lastTime; //us
+  volatile uint32_t maxTime; //us, worst-case latency of a call
+  volatile uint64_t totalTime; //us
+} WasmBudget;
+
+/**
+ * @fn
+ * Set the budget of the calls and clear the statistics, e.g. for a new module
+ * @param budget WasmBudget *
+ * @param config const WasmBudgetConfig *, copied
+ */
+void wasmBudgetInit(WasmBudget *budget, const WasmBudgetConfig *config);
+
+/**
+ * @fn
+ * Link refuel() of a metered module to a budget. Call it after m3_LoadModule().
+ * @param module IM3Module
+ * @param budget WasmBudget *, must stay valid while the module is loaded
+ * @return m3Err_none, m3Err_functionLookupFailed if the module is not metered
+ */
+M3Result wasmBudgetLink(IM3Module module, WasmBudget *budget);
+
+/**
+ * @fn
+ * Start a call: reset the fuel and the deadline
+ * @param budget WasmBudget *
+ */
+void wasmBudgetBegin(WasmBudget *budget);
+
+/**
+ * @fn
+ * End a call: update the statistics
+ * @param budget WasmBudget *
+ * @param result M3Result, of the call
+ * @return result
+ */
+M3Result wasmBudgetEnd(WasmBudget *budget, M3Result result);
+
+/**
+ * @fn
+ * @param result M3Result
+ * @return true if a call trapped because it exceeded its budget
+ */
+bool wasmBudgetExceeded(M3Result result);
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * @file wasm_call.cpp
+ * @brief Typed and batch calls of wasm functions (see wasm_call.h).
+ */
+#include <string.h>
+#include "wasm_call.h"
+
+static void addValue(WasmArgs *args, M3ValueType type, const void *value, size_t size)
+{
+  if (args->count == WASM_MAX_ARGS)
+  {
+    args->overflow = true;
+    return;
+  }
+  args->values[args->count] = 0;
+  memcpy(&args->values[args->count], value, size);
+  args->pointers[args->count] = &args->values[args->count];
+  args->types[args->count] = type;
+  args->count++;
+}
+
+void wasmArgsInit(WasmArgs *args)
+{
+  args->count = 0;
+  args->overflow = false;
+}
+
+void wasmArgsAdd(WasmArgs *args, int32_t value)
+{
+  addValue(args, c_m3Type_i32, &value, sizeof(value));
+}
+
+void wasmArgsAdd(WasmArgs *args, uint32_t value)
+{
+  addValue(args, c_m3Type_i32, &value, sizeof(value));
+}
+
+void wasmArgsAdd(WasmArgs *args, int64_t value)
+{
+  addValue(args, c_m3Type_i64, &value, sizeof(value));
+}
+
+void wasmArgsAdd(WasmArgs *args, uint64_t value)
+{
+  addValue(args, c_m3Type_i64, &value, sizeof(value));
+}
+
+void wasmArgsAdd(WasmArgs *args, float value)
+{
+  addValue(args, c_m3Type_f32, &value, sizeof(value));
+}
+
+void wasmArgsAdd(WasmArgs *args, double value)
+{
+  addValue(args, c_m3Type_f64, &value, sizeof(value));
+}
+
+M3Result wasmCallArgs(IM3Function function, WasmArgs *args)
+{
+  if (args->overflow || m3_GetArgCount(function) != args->count)
+    return m3Err_argumentCountMismatch;
+  for (uint8_t i = 0; i < args->count; i++)
+  {
+    if (m3_GetArgType(function, i) != args->types[i])
+      return m3Err_argumentTypeMismatch;
+  }
+  return m3_Call(function, args->count, args->pointers);
+}
+
+M3Result wasmBatchInit(WasmBatch *batch, IM3Runtime runtime, uint32_t size)
+{
+  memset(batch, 0, sizeof(WasmBatch));
+  IM3Function function;
+  IM3Function bufferFunction;
+  M3Result result = m3_FindFunction(&function, runtime, WASM_BATCH_FUNCTION);
+  if (!result)
+    result = m3_FindFunction(&bufferFunction, runtime, WASM_BATCH_BUFFER_FUNCTION);
+  if (!result && (m3_GetRetCount(function) != 1 || m3_GetRetCount(bufferFunction) != 1))
+    result = m3Err_argumentCountMismatch;
+  if (!result)
+    result = wasmCall(bufferFunction, size);
+  int32_t offset = 0;
+  if (!result)
+    result = m3_GetResultsV(bufferFunction, &offset);
+  if (result)
+    return result;
+
+  uint32_t memorySize = 0;
+  uint8_t *memory = m3_GetMemory(runtime, &memorySize, 0);
+  if (!memory || !offset || (uint32_t) offset > memorySize || memorySize - (uint32_t) offset < size)
+    return m3Err_trapOutOfBoundsMemoryAccess;
+
+  batch->runtime = runtime;
+  batch->function = function;
+  batch->bufferOffset = offset;
+  batch->bufferSize = size;
+  return m3Err_none;
+}
+
+uint32_t wasmBatchCapacity(const WasmBatch *batch, size_t inputSize, size_t outputSize)
+{
+  return batch->function ? batch->bufferSize / (inputSize + outputSize) : 0;
+}
+
+M3Result wasmBatchCall(WasmBatch *batch, const void *input, size_t inputSize, void *output, size_t outputSize, uint32_t count, uint32_t *processed)
+{
+  *processed = 0;
+  if (!batch->function)
+    return m3Err_functionLookupFailed;
+  if (count > wasmBatchCapacity(batch, inputSize, outputSize))
+    return m3Err_trapOutOfBoundsMemoryAccess;
+
+  //the memory moves if the module grows it, so it is looked up for every call
+  uint32_t memorySize = 0;
+  uint8_t *memory = m3_GetMemory(batch->runtime, &memorySize, 0);
+  if (!memory || memorySize < batch->bufferOffset + batch->bufferSize)
+    return m3Err_trapOutOfBoundsMemoryAccess;
+  uint32_t inputOffset = batch->bufferOffset;
+  uint32_t outputOffset = inputOffset + count * inputSize;
+  memcpy(memory + inputOffset, input, count * inputSize);
+
+  M3Result result = wasmCall(batch->function, inputOffset, outputOffset, count);
+  int32_t done = 0;
+  if (!result)
+    result = m3_GetResultsV(batch->function, &done);
+  if (result)
+    return result;
+  if (done < 0 || (uint32_t) done > count)
+    return m3Err_trapOutOfBoundsMemoryAccess;
+
+  memory = m3_GetMemory(batch->runtime, &memorySize, 0);
+  if (!memory || memorySize < outputOffset + done * outputSize)
+    return m3Err_trapOutOfBoundsMemoryAccess;
+  memcpy(output, memory + outputOffset, done * outputSize);
+  *processed = done;
+  return m3Err_none;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file wasm_call.h
+ * @brief Calls of wasm functions without heap allocations, and a batch call over the linear memory.
+ *
+ * Typed arguments: m3_Call() reads every argument in the width of its wasm type (a u8 parameter of AssemblyScript is an i32),
+ * so a pointer to a byte reads three bytes of whatever follows it. WasmArgs keeps each argument in the width of its wasm type
+ * on the stack of the caller, and wasmCall() checks the number and the types against the signature of the function.
+ *
+ * Batch call: one interpreter entry for a block of samples instead of one per sample. A module offers it with two exports:
+ * - batchBuffer(size: i32): usize, offset of a static region of at least size bytes in the linear memory, 0 if it has no such region
+ * - calcBatch(input: usize, output: usize, count: i32): i32, processes count input records at input, writes count output records
+ *   at output and returns the number of processed records
+ * The host copies the input block into the region, calls calcBatch() once and copies the output block back.
+ * The size of a record is a convention between the module and the host, e.g. two u8 inputs and an i32 result for calcWasm().
+ *
+ * AssemblyScript (stub runtime):
+ *   const batchMemory = memory.data(1024)
+ *   export function batchBuffer(size: i32): usize { return size <= 1024 ? batchMemory : 0 }
+ *   export function calcBatch(input: usize, output: usize, count: i32): i32 {
+ *     for (let i = 0; i < count; i++) store<i32>(output + 4 * i, calcWasm(load<u8>(input + 2 * i), load<u8>(input + 2 * i + 1)))
+ *     return count
+ *   }
+ */
+#ifndef WASM_CALL_H
+#define WASM_CALL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wasm3.h"
+
+#define WASM_MAX_ARGS 8
+#define WASM_BATCH_FUNCTION "calcBatch"
+#define WASM_BATCH_BUFFER_FUNCTION "batchBuffer"
+
+typedef struct {
+  uint64_t values[WASM_MAX_ARGS]; //each argument in the width of its wasm type
+  const void *pointers[WASM_MAX_ARGS];
+  M3ValueType types[WASM_MAX_ARGS];
+  uint8_t count;
+  bool overflow; //more than WASM_MAX_ARGS arguments
+} WasmArgs;
+
+typedef struct {
+  IM3Runtime runtime;
+  IM3Function function; //calcBatch, NULL if the module has no batch entry point
+  uint32_t bufferOffset; //region of batchBuffer() in the linear memory
+  uint32_t bufferSize;
+} WasmBatch;
+
+/**
+ * @fn
+ * Start an empty argument list
+ * @param args WasmArgs *
+ */
+void wasmArgsInit(WasmArgs *args);
+
+/**
+ * @fn
+ * Append an argument. The overload selects the wasm type: i32 for 8 to 32 bit integers, i64, f32 or f64.
+ * @param args WasmArgs *
+ * @param value argument
+ */
+void wasmArgsAdd(WasmArgs *args, int32_t value);
+void wasmArgsAdd(WasmArgs *args, uint32_t value);
+void wasmArgsAdd(WasmArgs *args, int64_t value);
+void wasmArgsAdd(WasmArgs *args, uint64_t value);
+void wasmArgsAdd(WasmArgs *args, float value);
+void wasmArgsAdd(WasmArgs *args, double value);
+
+/**
+ * @fn
+ * Call a function with an argument list
+ * @param function IM3Function
+ * @param args WasmArgs *
+ * @return m3Err_none, m3Err_argumentCountMismatch or m3Err_argumentTypeMismatch if the arguments do not match the signature,
+ * otherwise the result of m3_Call()
+ */
+M3Result wasmCallArgs(IM3Function function, WasmArgs *args);
+
+/**
+ * @fn
+ * Call a function with typed arguments, e.g. wasmCall(calcWasm, inputBytes[0], inputBytes[1]).
+ * The result is read with m3_GetResultsV() as before.
+ * @param function IM3Function
+ * @param values arguments (see wasmArgsAdd())
+ * @return see wasmCallArgs()
+ */
+template <typename... Values>
+M3Result wasmCall(IM3Function function, Values... values)
+{
+  WasmArgs args;
+  wasmArgsInit(&args);
+  int expand[] = {0, (wasmArgsAdd(&args, values), 0)...};
+  (void) expand;
+  return wasmCallArgs(function, &args);
+}
+
+/**
+ * @fn
+ * Look up the batch entry point of a module and reserve its region for blocks of up to size bytes (input and output).
+ * @param batch WasmBatch *
+ * @param runtime IM3Runtime, the module is loaded
+ * @param size uint32_t, bytes of an input block and its output block
+ * @return m3Err_none, or the reason why the module cannot be called in batches (batch->function is NULL)
+ */
+M3Result wasmBatchInit(WasmBatch *batch, IM3Runtime runtime, uint32_t size);
+
+/**
+ * @fn
+ * Process a block of records with one call of calcBatch()
+ * @param batch WasmBatch *
+ * @param input const void *, count records of inputSize bytes
+ * @param inputSize size_t
+ * @param output void *, count records of outputSize bytes
+ * @param outputSize size_t
+ * @param count uint32_t, at most bufferSize / (inputSize + outputSize)
+ * @param processed uint32_t *, output: records processed by the module
+ * @return m3Err_none, otherwise the error of the call
+ */
+M3Result wasmBatchCall(WasmBatch *batch, const void *input, size_t inputSize, void *output, size_t outputSize, uint32_t count, uint32_t *processed);
+
+/**
+ * @fn
+ * @param batch const WasmBatch *
+ * @param inputSize size_t
+ * @param outputSize size_t
+ * @return max. number of records of a batch call
+ */
+uint32_t wasmBatchCapacity(const WasmBatch *batch, size_t inputSize, size_t outputSize);
+
+#endif
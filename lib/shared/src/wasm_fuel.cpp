@@ -0,0 +1,840 @@
+/**
+ * @file wasm_fuel.cpp
+ * @brief Fuel metering instrumentation of wasm modules (see wasm_fuel.h).
+ * The module is read from memory, or in blocks of WASM_FUEL_READ_SIZE bytes from a WasmFuelSource, and written in pieces.
+ * The size of a section or function body precedes it, so its instrumented content is measured first (a writer of NULL) and
+ * written afterwards: a part of the module is read several times, the source has to allow random access.
+ */
+#include <string.h>
+#include "wasm_fuel.h"
+
+#define WASM_HEADER_SIZE 8
+
+#define SECTION_CUSTOM 0
+#define SECTION_TYPE 1
+#define SECTION_IMPORT 2
+#define SECTION_GLOBAL 6
+#define SECTION_EXPORT 7
+#define SECTION_START 8
+#define SECTION_ELEMENT 9
+#define SECTION_CODE 10
+#define SECTION_COUNT 14 //ids 0 to 13
+
+#define OP_BLOCK 0x02
+#define OP_LOOP 0x03
+#define OP_IF 0x04
+#define OP_END 0x0b
+#define OP_CALL 0x10
+#define OP_RETURN_CALL 0x12
+#define OP_GLOBAL_GET 0x23
+#define OP_GLOBAL_SET 0x24
+#define OP_I32_CONST 0x41
+#define OP_I32_LT_S 0x48
+#define OP_I32_SUB 0x6b
+#define OP_REF_FUNC 0xd2
+#define OP_PREFIX_FC 0xfc
+#define BLOCK_TYPE_EMPTY 0x40
+#define TYPE_I32 0x7f
+#define TYPE_FUNCTION 0x60
+#define KIND_FUNCTION 0
+#define KIND_TABLE 1
+#define KIND_MEMORY 2
+#define KIND_GLOBAL 3
+#define KIND_TAG 4
+
+#define MAX_COST 0x3fffffff //keeps the fuel arithmetic of the module in the i32 range
+
+static const uint8_t wasmHeader[WASM_HEADER_SIZE] = {0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00};
+//position of a section in the module, 0 for custom and unknown sections. The data count section (12) precedes the code section,
+//the tag section (13) the global section.
+static const uint8_t sectionRank[SECTION_COUNT] = {0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 19, 11};
+
+//the module, or the block of it which was read last
+typedef struct {
+  WasmFuelSource read; //NULL: the whole module is in data
+  void *context;
+  size_t length; //of the module
+  const uint8_t *data;
+  size_t offset; //of data in the module
+  size_t used; //bytes of data
+  uint8_t buffer[WASM_FUEL_READ_SIZE];
+} Source;
+
+//positions are module offsets
+typedef struct {
+  Source *source;
+  size_t position;
+  size_t end;
+  bool error;
+} Reader;
+
+typedef struct {
+  WasmFuelWriter writer; //NULL: the length is only measured
+  void *context;
+  size_t length;
+  bool error;
+} Output;
+
+typedef struct {
+  uint8_t opcode;
+  size_t start;
+  size_t end;
+  bool hasFunction; //call, return_call or ref.func
+  uint32_t function;
+} Instruction;
+
+typedef bool (*SectionEmitter)(const WasmFuelInfo *info, Reader *content, Output *output);
+
+/**
+ * @fn
+ * Module data at an offset, read from the source if it is not in the last block
+ * @return data up to the end of the block, NULL if it cannot be read
+ */
+static const uint8_t *fetch(Source *source, size_t offset)
+{
+  if (offset - source->offset < source->used)
+    return source->data + (offset - source->offset);
+  if (!source->read || offset >= source->length)
+    return NULL;
+  size_t len = source->length - offset < sizeof(source->buffer) ? source->length - offset : sizeof(source->buffer);
+  source->used = 0;
+  if (!source->read(source->context, offset, source->buffer, len))
+    return NULL;
+  source->data = source->buffer;
+  source->offset = offset;
+  source->used = len;
+  return source->data;
+}
+
+static uint8_t readByte(Reader *reader)
+{
+  const uint8_t *data = reader->position < reader->end ? fetch(reader->source, reader->position) : NULL;
+  if (!data)
+  {
+    reader->error = true;
+    return 0;
+  }
+  reader->position++;
+  return *data;
+}
+
+static uint32_t readU32(Reader *reader)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    uint8_t byte = readByte(reader);
+    value |= (uint32_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  reader->error = true;
+  return 0;
+}
+
+/**
+ * @fn
+ * Skip a LEB128 number (signed or unsigned) of at most maxBytes bytes
+ */
+static void skipLeb(Reader *reader, int maxBytes)
+{
+  for (int i = 0; i < maxBytes; i++)
+  {
+    if (!(readByte(reader) & 0x80))
+      return;
+  }
+  reader->error = true;
+}
+
+static void skipBytes(Reader *reader, uint32_t len)
+{
+  if (len > (size_t) (reader->end - reader->position))
+  {
+    reader->error = true;
+    return;
+  }
+  reader->position += len;
+}
+
+static void skipName(Reader *reader)
+{
+  skipBytes(reader, readU32(reader));
+}
+
+static void skipLimits(Reader *reader)
+{
+  uint8_t flags = readByte(reader);
+  if (flags & ~0x03) //memory64
+    reader->error = true;
+  readU32(reader);
+  if (flags & 0x01)
+    readU32(reader);
+}
+
+static void put(Output *output, const void *data, size_t len)
+{
+  if (output->writer && !output->error && len && !output->writer(output->context, (const uint8_t *) data, len))
+    output->error = true;
+  output->length += len;
+}
+
+/**
+ * @fn
+ * Copy a part of the module, block by block. A measurement does not read it.
+ */
+static void putModule(Output *output, Source *source, size_t start, size_t end)
+{
+  if (!output->writer)
+  {
+    output->length += end - start;
+    return;
+  }
+  while (start < end && !output->error)
+  {
+    const uint8_t *data = fetch(source, start);
+    if (!data)
+    {
+      output->error = true;
+      return;
+    }
+    size_t available = source->offset + source->used - start;
+    size_t len = end - start < available ? end - start : available;
+    put(output, data, len);
+    start += len;
+  }
+}
+
+static void putByte(Output *output, uint8_t value)
+{
+  put(output, &value, 1);
+}
+
+static void putU32(Output *output, uint32_t value)
+{
+  uint8_t buffer[5];
+  size_t n = 0;
+  do
+  {
+    buffer[n] = value & 0x7f;
+    value >>= 7;
+    if (value)
+      buffer[n] |= 0x80;
+    n++;
+  } while (value);
+  put(output, buffer, n);
+}
+
+static void putS32(Output *output, int32_t value)
+{
+  uint8_t buffer[5];
+  size_t n = 0;
+  bool more = true;
+  while (more)
+  {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+    buffer[n++] = more ? byte | 0x80 : byte;
+  }
+  put(output, buffer, n);
+}
+
+/**
+ * @fn
+ * Copy the rest of a section
+ */
+static void putRest(Output *output, Reader *reader)
+{
+  putModule(output, reader->source, reader->position, reader->end);
+  reader->position = reader->end;
+}
+
+static uint32_t functionIndex(const WasmFuelInfo *info, uint32_t function)
+{
+  return function < info->functionImports ? function : function + 1;
+}
+
+/**
+ * @fn
+ * Read an instruction with its immediates
+ * @return false if it is malformed or not supported
+ */
+static bool readInstruction(Reader *reader, Instruction *instruction)
+{
+  instruction->start = reader->position;
+  instruction->hasFunction = false;
+  uint8_t opcode = readByte(reader);
+  instruction->opcode = opcode;
+  switch (opcode)
+  {
+    case 0x00: case 0x01: case 0x05: case OP_END: case 0x0f: case 0x1a: case 0x1b: case 0xd1:
+      break;
+    case OP_BLOCK: case OP_LOOP: case OP_IF:
+      skipLeb(reader, 5); //empty, value type or type index (s33)
+      break;
+    case 0x0c: case 0x0d: //br, br_if
+    case 0x20: case 0x21: case 0x22: case OP_GLOBAL_GET: case OP_GLOBAL_SET: case 0x25: case 0x26:
+      readU32(reader);
+      break;
+    case 0x0e: //br_table
+    {
+      uint32_t count = readU32(reader);
+      for (uint32_t i = 0; i <= count && !reader->error; i++)
+        readU32(reader);
+      break;
+    }
+    case OP_CALL: case OP_RETURN_CALL: case OP_REF_FUNC:
+      instruction->function = readU32(reader);
+      instruction->hasFunction = true;
+      break;
+    case 0x11: case 0x13: //call_indirect, return_call_indirect
+      readU32(reader);
+      readU32(reader);
+      break;
+    case 0x1c: //select with types
+      skipBytes(reader, readU32(reader));
+      break;
+    case 0x3f: case 0x40: //memory.size, memory.grow
+      readU32(reader);
+      break;
+    case OP_I32_CONST:
+      skipLeb(reader, 5);
+      break;
+    case 0x42: //i64.const
+      skipLeb(reader, 10);
+      break;
+    case 0x43: //f32.const
+      skipBytes(reader, 4);
+      break;
+    case 0x44: //f64.const
+      skipBytes(reader, 8);
+      break;
+    case 0xd0: //ref.null
+      readByte(reader);
+      break;
+    case OP_PREFIX_FC:
+    {
+      uint32_t operation = readU32(reader);
+      if (operation <= 7) //saturating conversions
+        break;
+      switch (operation)
+      {
+        case 8: case 10: case 12: case 14: //memory.init, memory.copy, table.init, table.copy
+          readU32(reader);
+          readU32(reader);
+          break;
+        case 9: case 11: case 13: case 15: case 16: case 17: //data.drop, memory.fill, elem.drop, table.grow, table.size, table.fill
+          readU32(reader);
+          break;
+        default:
+          return false;
+      }
+      break;
+    }
+    default:
+      if (opcode >= 0x28 && opcode <= 0x3e) //loads and stores
+      {
+        if (readU32(reader) & 0x40) //memory index
+          readU32(reader);
+        skipLeb(reader, 10);
+        break;
+      }
+      if (opcode >= 0x45 && opcode <= 0xc4) //numeric
+        break;
+      return false;
+  }
+  instruction->end = reader->position;
+  return !reader->error;
+}
+
+static void putInstruction(const WasmFuelInfo *info, Reader *reader, const Instruction *instruction, Output *output)
+{
+  if (!instruction->hasFunction)
+  {
+    putModule(output, reader->source, instruction->start, instruction->end);
+    return;
+  }
+  putByte(output, instruction->opcode);
+  putU32(output, functionIndex(info, instruction->function));
+}
+
+/**
+ * @fn
+ * Copy a constant expression up to its end (init of a global, offset or item of an element segment)
+ */
+static bool putConstantExpression(const WasmFuelInfo *info, Reader *reader, Output *output)
+{
+  Instruction instruction;
+  do
+  {
+    if (!readInstruction(reader, &instruction))
+      return false;
+    putInstruction(info, reader, &instruction, output);
+  } while (instruction.opcode != OP_END);
+  return true;
+}
+
+/**
+ * @fn
+ * Cost of a function or loop body: its instructions up to its end without the bodies of nested loops
+ * @param reader Reader, after the locals of the function or the block type of the loop
+ * @param cost uint32_t *, output
+ * @return false if the body is malformed
+ */
+static bool regionCost(Reader reader, uint32_t *cost)
+{
+  uint32_t count = 0;
+  uint32_t depth = 1; //blocks open in the region
+  uint32_t loopDepth = 0; //blocks open in a nested loop
+  Instruction instruction;
+  while (depth)
+  {
+    if (!readInstruction(&reader, &instruction))
+      return false;
+    if (loopDepth)
+    {
+      if (instruction.opcode == OP_BLOCK || instruction.opcode == OP_LOOP || instruction.opcode == OP_IF)
+        loopDepth++;
+      else if (instruction.opcode == OP_END)
+        loopDepth--;
+      continue;
+    }
+    if (count < MAX_COST)
+      count++;
+    if (instruction.opcode == OP_LOOP)
+      loopDepth = 1;
+    else if (instruction.opcode == OP_BLOCK || instruction.opcode == OP_IF)
+      depth++;
+    else if (instruction.opcode == OP_END)
+      depth--;
+  }
+  *cost = count;
+  return true;
+}
+
+/**
+ * @fn
+ * Charge the fuel and refuel below 0 (see wasm_fuel.h)
+ */
+static void putCharge(const WasmFuelInfo *info, uint32_t cost, Output *output)
+{
+  uint32_t fuel = info->globals;
+  putByte(output, OP_GLOBAL_GET);
+  putU32(output, fuel);
+  putByte(output, OP_I32_CONST);
+  putS32(output, cost);
+  putByte(output, OP_I32_SUB);
+  putByte(output, OP_GLOBAL_SET);
+  putU32(output, fuel);
+
+  putByte(output, OP_GLOBAL_GET);
+  putU32(output, fuel);
+  putByte(output, OP_I32_CONST);
+  putS32(output, 0);
+  putByte(output, OP_I32_LT_S);
+  putByte(output, OP_IF);
+  putByte(output, BLOCK_TYPE_EMPTY);
+  putByte(output, OP_GLOBAL_GET);
+  putU32(output, fuel);
+  putByte(output, OP_CALL);
+  putU32(output, info->functionImports);
+  putByte(output, OP_GLOBAL_SET);
+  putU32(output, fuel);
+  putByte(output, OP_END);
+}
+
+/**
+ * @fn
+ * Instrument a function body (locals and code)
+ */
+static bool putBody(const WasmFuelInfo *info, Reader *body, Output *output)
+{
+  size_t locals = body->position;
+  uint32_t groups = readU32(body);
+  for (uint32_t i = 0; i < groups && !body->error; i++)
+  {
+    readU32(body);
+    readByte(body);
+  }
+  if (body->error)
+    return false;
+  putModule(output, body->source, locals, body->position);
+
+  uint32_t cost;
+  if (!regionCost(*body, &cost))
+    return false;
+  putCharge(info, cost, output);
+  uint32_t depth = 1;
+  Instruction instruction;
+  while (depth)
+  {
+    if (!readInstruction(body, &instruction))
+      return false;
+    putInstruction(info, body, &instruction, output);
+    if (instruction.opcode == OP_LOOP)
+    {
+      if (!regionCost(*body, &cost))
+        return false;
+      putCharge(info, cost, output);
+    }
+    if (instruction.opcode == OP_BLOCK || instruction.opcode == OP_LOOP || instruction.opcode == OP_IF)
+      depth++;
+    else if (instruction.opcode == OP_END)
+      depth--;
+  }
+  return body->position == body->end;
+}
+
+/**
+ * @fn
+ * Number of entries of a section, 0 for a section the instrumentation adds
+ */
+static uint32_t readCount(Reader *content)
+{
+  return content->position < content->end ? readU32(content) : 0;
+}
+
+static bool putTypes(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  (void) info;
+  putU32(output, readCount(content) + 1);
+  putRest(output, content);
+  //refuel: (i32) -> i32
+  const uint8_t type[] = {TYPE_FUNCTION, 1, TYPE_I32, 1, TYPE_I32};
+  put(output, type, sizeof(type));
+  return true;
+}
+
+static bool putImports(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  putU32(output, readCount(content) + 1);
+  putRest(output, content);
+  putU32(output, strlen(WASM_FUEL_IMPORT_MODULE));
+  put(output, WASM_FUEL_IMPORT_MODULE, strlen(WASM_FUEL_IMPORT_MODULE));
+  putU32(output, strlen(WASM_FUEL_IMPORT_NAME));
+  put(output, WASM_FUEL_IMPORT_NAME, strlen(WASM_FUEL_IMPORT_NAME));
+  putByte(output, KIND_FUNCTION);
+  putU32(output, info->types);
+  return true;
+}
+
+static bool putGlobals(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  uint32_t count = readCount(content);
+  putU32(output, count + 1);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    size_t type = content->position;
+    readByte(content);
+    readByte(content);
+    if (content->error)
+      return false;
+    putModule(output, content->source, type, content->position);
+    if (!putConstantExpression(info, content, output))
+      return false;
+  }
+  //the fuel: mutable i32, 0 until the first refuel
+  const uint8_t fuel[] = {TYPE_I32, 1, OP_I32_CONST, 0, OP_END};
+  put(output, fuel, sizeof(fuel));
+  return true;
+}
+
+static bool putExports(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  uint32_t count = readU32(content);
+  putU32(output, count);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    size_t name = content->position;
+    skipName(content);
+    if (content->error)
+      return false;
+    putModule(output, content->source, name, content->position);
+    uint8_t kind = readByte(content);
+    uint32_t index = readU32(content);
+    putByte(output, kind);
+    putU32(output, kind == KIND_FUNCTION ? functionIndex(info, index) : index);
+  }
+  return !content->error;
+}
+
+static bool putStart(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  putU32(output, functionIndex(info, readU32(content)));
+  return !content->error;
+}
+
+static bool putElements(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  uint32_t count = readU32(content);
+  putU32(output, count);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    uint32_t flags = readU32(content);
+    if (flags > 7)
+      return false;
+    putU32(output, flags);
+    if (!(flags & 0x01)) //active
+    {
+      if (flags & 0x02)
+        putU32(output, readU32(content));
+      if (!putConstantExpression(info, content, output))
+        return false;
+    }
+    if (flags & 0x03) //element kind or reference type
+      putByte(output, readByte(content));
+    uint32_t items = readU32(content);
+    putU32(output, items);
+    for (uint32_t j = 0; j < items && !content->error; j++)
+    {
+      if (flags & 0x04)
+      {
+        if (!putConstantExpression(info, content, output))
+          return false;
+      }
+      else
+        putU32(output, functionIndex(info, readU32(content)));
+    }
+  }
+  return !content->error;
+}
+
+static bool putCode(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  uint32_t count = readU32(content);
+  putU32(output, count);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    uint32_t size = readU32(content);
+    if (content->error || size > (size_t) (content->end - content->position))
+      return false;
+    Reader body = {content->source, content->position, content->position + size, false};
+    content->position += size;
+
+    Output measure = {NULL, NULL, 0, false};
+    Reader measureBody = body;
+    if (!putBody(info, &measureBody, &measure))
+      return false;
+    putU32(output, measure.length);
+    if (output->writer)
+      putBody(info, &body, output);
+    else
+      output->length += measure.length; //a measurement does not read the body again
+  }
+  return !content->error;
+}
+
+static bool putRaw(const WasmFuelInfo *info, Reader *content, Output *output)
+{
+  (void) info;
+  putRest(output, content);
+  return true;
+}
+
+static SectionEmitter sectionEmitter(uint8_t id)
+{
+  switch (id)
+  {
+    case SECTION_TYPE: return putTypes;
+    case SECTION_IMPORT: return putImports;
+    case SECTION_GLOBAL: return putGlobals;
+    case SECTION_EXPORT: return putExports;
+    case SECTION_START: return putStart;
+    case SECTION_ELEMENT: return putElements;
+    case SECTION_CODE: return putCode;
+    default: return putRaw;
+  }
+}
+
+/**
+ * @fn
+ * Write a section: id, size and the instrumented content. The "name" section is dropped, other custom sections are copied.
+ */
+static bool putSection(const WasmFuelInfo *info, uint8_t id, const Reader *content, Output *output)
+{
+  if (id == SECTION_CUSTOM)
+  {
+    Reader name = *content;
+    uint32_t nameLength = readU32(&name);
+    if (name.error || nameLength > (size_t) (name.end - name.position))
+      return false;
+    char text[4];
+    for (uint32_t i = 0; i < nameLength && i < sizeof(text); i++)
+      text[i] = readByte(&name);
+    if (nameLength == 4 && !name.error && !memcmp(text, "name", 4))
+      return true;
+  }
+
+  SectionEmitter emitter = sectionEmitter(id);
+  Output measure = {NULL, NULL, 0, false};
+  Reader reader = *content;
+  if (!emitter(info, &reader, &measure) || reader.error || reader.position != reader.end)
+    return false;
+  putByte(output, id);
+  putU32(output, measure.length);
+  if (!output->writer)
+  {
+    output->length += measure.length; //a measurement does not read the section again
+    return true;
+  }
+  reader = *content;
+  emitter(info, &reader, output);
+  return true;
+}
+
+/**
+ * @fn
+ * Add the sections the instrumentation needs and the module does not have, in front of a section of a higher rank
+ * @param added uint32_t *, bits of the sections added so far
+ */
+static bool addSections(const WasmFuelInfo *info, uint8_t rank, uint32_t *added, Output *output)
+{
+  static const uint8_t required[] = {SECTION_TYPE, SECTION_IMPORT, SECTION_GLOBAL};
+  for (size_t i = 0; i < sizeof(required); i++)
+  {
+    uint8_t id = required[i];
+    if ((info->sections | *added) & (1u << id) || sectionRank[id] >= rank)
+      continue;
+    Reader empty = {NULL, 0, 0, false};
+    if (!putSection(info, id, &empty, output))
+      return false;
+    *added |= 1u << id;
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * Check the section order and count the entries the indices of the instrumentation depend on
+ */
+static bool scanModule(Source *source, WasmFuelInfo *info)
+{
+  memset(info, 0, sizeof(WasmFuelInfo));
+  Reader reader = {source, WASM_HEADER_SIZE, source->length, false};
+  uint8_t lastRank = 0;
+  while (reader.position < reader.end)
+  {
+    uint8_t id = readByte(&reader);
+    uint32_t size = readU32(&reader);
+    if (reader.error || id >= SECTION_COUNT || size > (size_t) (reader.end - reader.position))
+      return false;
+    Reader content = {source, reader.position, reader.position + size, false};
+    reader.position += size;
+    if (id == SECTION_CUSTOM)
+      continue;
+    if (sectionRank[id] <= lastRank)
+      return false;
+    lastRank = sectionRank[id];
+    info->sections |= 1u << id;
+
+    if (id == SECTION_TYPE)
+      info->types = readU32(&content);
+    else if (id == SECTION_GLOBAL)
+      info->globals += readU32(&content);
+    else if (id == SECTION_IMPORT)
+    {
+      uint32_t count = readU32(&content);
+      for (uint32_t i = 0; i < count && !content.error; i++)
+      {
+        skipName(&content);
+        skipName(&content);
+        switch (readByte(&content))
+        {
+          case KIND_FUNCTION:
+            readU32(&content);
+            info->functionImports++;
+            break;
+          case KIND_TABLE:
+            readByte(&content);
+            skipLimits(&content);
+            break;
+          case KIND_MEMORY:
+            skipLimits(&content);
+            break;
+          case KIND_GLOBAL:
+            readByte(&content);
+            readByte(&content);
+            info->globals++;
+            break;
+          case KIND_TAG:
+            readByte(&content);
+            readU32(&content);
+            break;
+          default:
+            return false;
+        }
+      }
+    }
+    if (content.error)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * Instrument the module of a source (see wasmFuelInstrument())
+ */
+static size_t instrument(Source *source, const WasmFuelInfo *info, WasmFuelWriter writer, void *context)
+{
+  WasmFuelInfo scanned;
+  Reader header = {source, 0, source->length, false};
+  uint8_t magic[WASM_HEADER_SIZE];
+  for (size_t i = 0; i < WASM_HEADER_SIZE; i++)
+    magic[i] = readByte(&header);
+  if (header.error || memcmp(magic, wasmHeader, WASM_HEADER_SIZE))
+    return 0;
+  if (!info)
+  {
+    if (!scanModule(source, &scanned))
+      return 0;
+    info = &scanned;
+  }
+
+  Output output = {writer, context, 0, false};
+  put(&output, wasmHeader, WASM_HEADER_SIZE);
+  uint32_t added = 0;
+  Reader reader = {source, WASM_HEADER_SIZE, source->length, false};
+  while (reader.position < reader.end)
+  {
+    uint8_t id = readByte(&reader);
+    uint32_t size = readU32(&reader);
+    //the scan may come from the caller, so the layout is checked again
+    if (reader.error || id >= SECTION_COUNT || size > (size_t) (reader.end - reader.position))
+      return 0;
+    Reader content = {source, reader.position, reader.position + size, false};
+    reader.position += size;
+    if (id != SECTION_CUSTOM && !addSections(info, sectionRank[id], &added, &output))
+      return 0;
+    if (!putSection(info, id, &content, &output))
+      return 0;
+  }
+  if (!addSections(info, 0xff, &added, &output) || output.error)
+    return 0;
+  return output.length;
+}
+
+size_t wasmFuelInstrument(const uint8_t *module, size_t length, const WasmFuelInfo *info, WasmFuelWriter writer, void *context)
+{
+  Source source;
+  source.read = NULL;
+  source.context = NULL;
+  source.length = length;
+  source.data = module;
+  source.offset = 0;
+  source.used = length;
+  return instrument(&source, info, writer, context);
+}
+
+size_t wasmFuelInstrumentSource(WasmFuelSource read, void *readContext, size_t length, const WasmFuelInfo *info, WasmFuelWriter writer,
+                                void *context)
+{
+  Source source;
+  source.read = read;
+  source.context = readContext;
+  source.length = length;
+  source.data = NULL;
+  source.offset = 0;
+  source.used = 0;
+  return instrument(&source, info, writer, context);
+}
@@ -0,0 +1,89 @@
+/**
+ * @file wasm_fuel.h
+ * @brief Fuel metering of wasm modules. wasm3 has no instruction budget, so a module is instrumented when it is installed
+ * (see wasm_partition.h): the interpreter then counts the executed instructions of the module itself, and a runaway module
+ * traps instead of blocking its task (see wasm_budget.h).
+ *
+ * The instrumented module has an additional mutable i32 global, the fuel, and imports the host function
+ * "fuel"."refuel" (i32) -> i32. At the entry of every function and at the head of every loop, the fuel is charged with the number
+ * of instructions of the function or loop body without the bodies of nested loops, an upper bound of the instructions executed
+ * until the next charge. When the fuel drops below 0, refuel() gets it and returns the new fuel, or traps the call:
+ *   global.get fuel; i32.const cost; i32.sub; global.set fuel
+ *   global.get fuel; i32.const 0; i32.lt_s; if; global.get fuel; call refuel; global.set fuel; end
+ * Every call and every loop iteration is charged, so no instruction of the module runs unmetered.
+ *
+ * The type, the import and the global are appended, so the indices of types and globals stay the same. The functions defined by
+ * the module move up by one (calls, exports, elements, start), the "name" section is dropped.
+ * Supported: MVP, sign extension, saturating conversions, bulk memory, reference types, multi-value and tail calls.
+ * Modules with SIMD or threads are rejected.
+ *
+ * Host check (from esp-now/): tools/fuel_check.cpp
+ */
+#ifndef WASM_FUEL_H
+#define WASM_FUEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WASM_FUEL_IMPORT_MODULE "fuel"
+#define WASM_FUEL_IMPORT_NAME "refuel"
+#ifndef WASM_FUEL_READ_SIZE
+#define WASM_FUEL_READ_SIZE 256 //bytes per read of a WasmFuelSource
+#endif
+
+/**
+ * Consumer of the instrumented module, called with consecutive pieces of it
+ * @param context void *, context of wasmFuelInstrument()
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return false to abort the instrumentation
+ */
+typedef bool (*WasmFuelWriter)(void *context, const uint8_t *data, size_t len);
+
+/**
+ * Reader of a module which is not in memory (e.g. a file), called with any offset: parts of the module are read several times
+ * @param context void *, readContext of wasmFuelInstrumentSource()
+ * @param offset size_t
+ * @param data uint8_t *, output
+ * @param len size_t, at most WASM_FUEL_READ_SIZE
+ * @return false if the data cannot be read
+ */
+typedef bool (*WasmFuelSource)(void *context, size_t offset, uint8_t *data, size_t len);
+
+/**
+ * Scan of a module: the entries the indices of the instrumentation depend on
+ */
+typedef struct {
+  uint32_t types; //entries of the type section, index of the type of refuel()
+  uint32_t functionImports; //index of refuel()
+  uint32_t globals; //imported and defined, index of the fuel
+  uint32_t sections; //bit per section id present in the module
+} WasmFuelInfo;
+
+/**
+ * @fn
+ * Instrument a module
+ * @param module const uint8_t *
+ * @param length size_t
+ * @param info const WasmFuelInfo *, scan of the module if it is known (e.g. from its validation, see wasm_validate.h), NULL: the module is scanned here
+ * @param writer WasmFuelWriter, NULL to measure the length of the instrumented module
+ * @param context void *
+ * @return length of the instrumented module, 0 if the module is malformed, uses an unsupported instruction or the writer aborted
+ */
+size_t wasmFuelInstrument(const uint8_t *module, size_t length, const WasmFuelInfo *info, WasmFuelWriter writer, void *context);
+
+/**
+ * @fn
+ * Instrument a module which is read in blocks of WASM_FUEL_READ_SIZE bytes, so it does not have to fit into RAM (see wasm_partition.h)
+ * @param read WasmFuelSource
+ * @param readContext void *
+ * @param length size_t, of the module
+ * @param info const WasmFuelInfo *, as wasmFuelInstrument()
+ * @param writer WasmFuelWriter, as wasmFuelInstrument()
+ * @param context void *
+ * @return as wasmFuelInstrument(), 0 also if the module cannot be read
+ */
+size_t wasmFuelInstrumentSource(WasmFuelSource read, void *readContext, size_t length, const WasmFuelInfo *info, WasmFuelWriter writer,
+                                void *context);
+
+#endif
@@ -0,0 +1,195 @@
+/**
+ * @file wasm_imports.cpp
+ * @brief Host functions for wasm modules (see wasm_imports.h).
+ */
+#include "wasm_imports.h"
+#include "dsp.h"
+
+static WasmHostHooks hostHooks = {NULL, NULL};
+
+/**
+ * @fn
+ * Check a buffer of the linear memory
+ * @return pointer to the buffer, NULL if it is out of the memory or not aligned
+ */
+static uint8_t *linearMemory(IM3Runtime runtime, uint32_t offset, uint64_t length, uint32_t alignment)
+{
+  uint32_t size = 0;
+  uint8_t *memory = m3_GetMemory(runtime, &size, 0);
+  if (!memory || offset > size || length > size - offset || offset % alignment)
+    return NULL;
+  return memory + offset;
+}
+
+#define FLOAT_BUFFER(offset, count) ((float *) linearMemory(runtime, offset, (uint64_t) (count) * sizeof(float), sizeof(float)))
+#define Q15_BUFFER(offset, count) ((int16_t *) linearMemory(runtime, offset, (uint64_t) (count) * sizeof(int16_t), sizeof(int16_t)))
+
+m3ApiRawFunction(importFir)
+{
+  m3ApiGetArg(uint32_t, input)
+  m3ApiGetArg(uint32_t, output)
+  m3ApiGetArg(uint32_t, count)
+  m3ApiGetArg(uint32_t, coefficients)
+  m3ApiGetArg(uint32_t, taps)
+  float *inputBuffer = FLOAT_BUFFER(input, count);
+  float *outputBuffer = FLOAT_BUFFER(output, count);
+  float *coefficientBuffer = FLOAT_BUFFER(coefficients, taps);
+  if (!inputBuffer || !outputBuffer || !coefficientBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  dspFir(inputBuffer, outputBuffer, count, coefficientBuffer, taps);
+  m3ApiSuccess();
+}
+
+m3ApiRawFunction(importBiquad)
+{
+  m3ApiGetArg(uint32_t, data)
+  m3ApiGetArg(uint32_t, count)
+  m3ApiGetArg(uint32_t, coefficients)
+  m3ApiGetArg(uint32_t, state)
+  float *dataBuffer = FLOAT_BUFFER(data, count);
+  float *coefficientBuffer = FLOAT_BUFFER(coefficients, 5);
+  float *stateBuffer = FLOAT_BUFFER(state, 2);
+  if (!dataBuffer || !coefficientBuffer || !stateBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  dspBiquad(dataBuffer, count, coefficientBuffer, stateBuffer);
+  m3ApiSuccess();
+}
+
+m3ApiRawFunction(importFft)
+{
+  m3ApiReturnType(int32_t)
+  m3ApiGetArg(uint32_t, data)
+  m3ApiGetArg(uint32_t, n)
+  m3ApiGetArg(int32_t, inverse)
+  float *dataBuffer = FLOAT_BUFFER(data, 2 * (uint64_t) n);
+  if (!dataBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  m3ApiReturn(dspFft(dataBuffer, n, inverse != 0) ? 0 : -1);
+}
+
+m3ApiRawFunction(importStatistics)
+{
+  m3ApiGetArg(uint32_t, data)
+  m3ApiGetArg(uint32_t, count)
+  m3ApiGetArg(uint32_t, result)
+  float *dataBuffer = FLOAT_BUFFER(data, count);
+  float *resultBuffer = FLOAT_BUFFER(result, 4);
+  if (!dataBuffer || !resultBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  dspStatistics(dataBuffer, count, resultBuffer);
+  m3ApiSuccess();
+}
+
+m3ApiRawFunction(importCrc32)
+{
+  m3ApiReturnType(uint32_t)
+  m3ApiGetArg(uint32_t, crc)
+  m3ApiGetArg(uint32_t, data)
+  m3ApiGetArg(uint32_t, len)
+  uint8_t *dataBuffer = linearMemory(runtime, data, len, 1);
+  if (!dataBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  m3ApiReturn(dspCrc32(crc, dataBuffer, len));
+}
+
+//q15Add and q15Mul, the kernel is the context of the import
+typedef void (*Q15Kernel)(const int16_t *a, const int16_t *b, int16_t *output, size_t count);
+
+m3ApiRawFunction(importQ15Binary)
+{
+  m3ApiGetArg(uint32_t, a)
+  m3ApiGetArg(uint32_t, b)
+  m3ApiGetArg(uint32_t, output)
+  m3ApiGetArg(uint32_t, count)
+  int16_t *aBuffer = Q15_BUFFER(a, count);
+  int16_t *bBuffer = Q15_BUFFER(b, count);
+  int16_t *outputBuffer = Q15_BUFFER(output, count);
+  if (!aBuffer || !bBuffer || !outputBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  ((Q15Kernel) _ctx->userdata)(aBuffer, bBuffer, outputBuffer, count);
+  m3ApiSuccess();
+}
+
+m3ApiRawFunction(importQ15Scale)
+{
+  m3ApiGetArg(uint32_t, a)
+  m3ApiGetArg(int32_t, scale)
+  m3ApiGetArg(uint32_t, output)
+  m3ApiGetArg(uint32_t, count)
+  int16_t *aBuffer = Q15_BUFFER(a, count);
+  int16_t *outputBuffer = Q15_BUFFER(output, count);
+  if (!aBuffer || !outputBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  dspQ15Scale(aBuffer, scale, outputBuffer, count);
+  m3ApiSuccess();
+}
+
+m3ApiRawFunction(importQ15Dot)
+{
+  m3ApiReturnType(int32_t)
+  m3ApiGetArg(uint32_t, a)
+  m3ApiGetArg(uint32_t, b)
+  m3ApiGetArg(uint32_t, count)
+  int16_t *aBuffer = Q15_BUFFER(a, count);
+  int16_t *bBuffer = Q15_BUFFER(b, count);
+  if (!aBuffer || !bBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  m3ApiReturn(dspQ15Dot(aBuffer, bBuffer, count));
+}
+
+m3ApiRawFunction(importMeshSend)
+{
+  m3ApiReturnType(int32_t)
+  m3ApiGetArg(uint32_t, node)
+  m3ApiGetArg(uint32_t, data)
+  m3ApiGetArg(uint32_t, len)
+  uint8_t *dataBuffer = linearMemory(runtime, data, len, 1);
+  if (!dataBuffer)
+    m3ApiTrap(m3Err_trapOutOfBoundsMemoryAccess);
+  m3ApiReturn(hostHooks.meshSend && hostHooks.meshSend(node, dataBuffer, len) ? 0 : -1);
+}
+
+m3ApiRawFunction(importSensorRead)
+{
+  m3ApiReturnType(int32_t)
+  m3ApiGetArg(int32_t, channel)
+  m3ApiReturn(hostHooks.sensorRead ? hostHooks.sensorRead(channel) : -1);
+}
+
+typedef struct {
+  const char *name;
+  const char *signature;
+  M3RawCall function;
+  const void *context;
+} WasmImport;
+
+static const WasmImport imports[] = {
+  {"fir", "v(iiiii)", importFir, NULL},
+  {"biquad", "v(iiii)", importBiquad, NULL},
+  {"fft", "i(iii)", importFft, NULL},
+  {"statistics", "v(iii)", importStatistics, NULL},
+  {"crc32", "i(iii)", importCrc32, NULL},
+  {"q15Add", "v(iiii)", importQ15Binary, (const void *) dspQ15Add},
+  {"q15Mul", "v(iiii)", importQ15Binary, (const void *) dspQ15Mul},
+  {"q15Scale", "v(iiii)", importQ15Scale, NULL},
+  {"q15Dot", "i(iii)", importQ15Dot, NULL},
+  {"meshSend", "i(iii)", importMeshSend, NULL},
+  {"sensorRead", "i(i)", importSensorRead, NULL},
+};
+
+void wasmImportsInit(const WasmHostHooks *hooks)
+{
+  hostHooks = *hooks;
+}
+
+M3Result wasmLinkImports(IM3Module module)
+{
+  for (size_t i = 0; i < sizeof(imports) / sizeof(imports[0]); i++)
+  {
+    M3Result result = m3_LinkRawFunctionEx(module, WASM_IMPORT_MODULE, imports[i].name, imports[i].signature, imports[i].function, imports[i].context);
+    //the module does not import this function
+    if (result && result != m3Err_functionLookupFailed)
+      return result;
+  }
+  return m3Err_none;
+}
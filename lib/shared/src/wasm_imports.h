@@ -0,0 +1,60 @@
+/**
+ * @file wasm_imports.h
+ * @brief Host functions a wasm module can import from the module "arduino" (declared for AssemblyScript in data/arduino.ts of the IDE).
+ * - Kernels of dsp.h over buffers in the linear memory: fir, biquad, fft, statistics, crc32, q15Add, q15Mul, q15Scale, q15Dot
+ * - Primitives of the sketch: meshSend, sensorRead (see WasmHostHooks)
+ *
+ * A buffer is an offset in the linear memory and must be aligned to its element size (4 bytes for f32, 2 bytes for Q15).
+ * A buffer out of the memory or not aligned traps the call (m3Err_trapOutOfBoundsMemoryAccess).
+ * Only the imports a module uses are linked, a module without imports loads as before.
+ *
+ * Signatures (wasm types):
+ * | name       | arguments                                                | result                    |
+ * | fir        | input, output, count, coefficients, taps                 |                           |
+ * | biquad     | data, count, coefficients (5 x f32), state (2 x f32)     |                           |
+ * | fft        | data (complex f32), n, inverse                           | 0, -1 if n is unsupported |
+ * | statistics | data, count, result (mean, variance, min, max)           |                           |
+ * | crc32      | crc, data, len                                           | crc                       |
+ * | q15Add     | a, b, output, count                                      |                           |
+ * | q15Mul     | a, b, output, count                                      |                           |
+ * | q15Scale   | a, scale, output, count                                  |                           |
+ * | q15Dot     | a, b, count                                              | Q15                       |
+ * | meshSend   | node, data, len                                          | 0, -1 if not sent         |
+ * | sensorRead | channel                                                  | value, -1 if unavailable  |
+ * All arguments and results are i32.
+ */
+#ifndef WASM_IMPORTS_H
+#define WASM_IMPORTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wasm3.h"
+
+#define WASM_IMPORT_MODULE "arduino"
+
+/**
+ * Primitives of the sketch, NULL if it has none
+ */
+typedef struct {
+  //send data to a node, false if it cannot be sent now
+  bool (*meshSend)(uint16_t node, const uint8_t *data, size_t len);
+  //read a sensor, e.g. an ADC channel, -1 if the channel does not exist
+  int32_t (*sensorRead)(int32_t channel);
+} WasmHostHooks;
+
+/**
+ * @fn
+ * Set the primitives of the sketch. Call it before the first module is loaded.
+ * @param hooks const WasmHostHooks *, copied
+ */
+void wasmImportsInit(const WasmHostHooks *hooks);
+
+/**
+ * @fn
+ * Link the host functions a module imports. Call it after m3_LoadModule() and before m3_FindFunction().
+ * @param module IM3Module
+ * @return m3Err_none, otherwise an import has a wrong signature
+ */
+M3Result wasmLinkImports(IM3Module module);
+
+#endif
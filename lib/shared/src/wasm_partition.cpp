@@ -0,0 +1,196 @@
+/**
+ * @file wasm_partition.cpp
+ * @brief Install and memory-map the module partitions (see wasm_partition.h).
+ */
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include "wasm_fuel.h"
+#include "wasm_partition.h"
+
+#define WASM_PARTITION_COPY_SIZE 256 //bytes per flash write or compare
+
+static const char *wasmPartitionLabels[WASM_PARTITION_SLOTS] = {"wasm0", "wasm1", "wasm2", "wasm3"};
+static spi_flash_mmap_handle_t wasmMapHandle[WASM_PARTITION_SLOTS];
+static bool wasmMapped[WASM_PARTITION_SLOTS];
+
+/**
+ * @fn
+ * Find the partition of a slot
+ */
+static const esp_partition_t *findWasmPartition(int slot)
+{
+  return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t) WASM_PARTITION_SUBTYPE, wasmPartitionLabels[slot]);
+}
+
+//consumer of the instrumented module (WasmFuelWriter): writes it into a partition, or compares it with the partition
+typedef struct {
+  const esp_partition_t *partition;
+  bool compare; //compare instead of write
+  size_t offset; //of the buffer in the module
+  size_t used;
+  uint8_t buffer[WASM_PARTITION_COPY_SIZE];
+} PartitionSink;
+
+/**
+ * @fn
+ * Write or compare the buffered part of the module
+ * @return false if it differs from the partition or cannot be written
+ */
+static bool flushSink(PartitionSink *sink)
+{
+  bool ok;
+  if (sink->compare)
+  {
+    uint8_t flashData[WASM_PARTITION_COPY_SIZE];
+    ok = esp_partition_read(sink->partition, WASM_PARTITION_HEADER_SIZE + sink->offset, flashData, sink->used) == ESP_OK
+         && !memcmp(sink->buffer, flashData, sink->used);
+  }
+  else
+    ok = esp_partition_write(sink->partition, WASM_PARTITION_HEADER_SIZE + sink->offset, sink->buffer, sink->used) == ESP_OK;
+  sink->offset += sink->used;
+  sink->used = 0;
+  return ok;
+}
+
+static bool writeSink(void *context, const uint8_t *data, size_t len)
+{
+  PartitionSink *sink = (PartitionSink *) context;
+  while (len)
+  {
+    size_t n = min(len, sizeof(sink->buffer) - sink->used);
+    memcpy(sink->buffer + sink->used, data, n);
+    sink->used += n;
+    data += n;
+    len -= n;
+    if (sink->used == sizeof(sink->buffer) && !flushSink(sink))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * WasmFuelSource of a module file, the instrumentation reads it in blocks instead of copying it into RAM
+ */
+static bool readFile(void *context, size_t offset, uint8_t *data, size_t len)
+{
+  File *file = (File *) context;
+  return (file->position() == offset || file->seek(offset)) && file->read(data, len) == len;
+}
+
+/**
+ * @fn
+ * Instrument a module into a partition, or compare the instrumented module with the partition
+ * @return false if the module differs or cannot be written
+ */
+static bool instrumentInto(const esp_partition_t *partition, bool compare, File *module, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  PartitionSink sink;
+  sink.partition = partition;
+  sink.compare = compare;
+  sink.offset = 0;
+  sink.used = 0;
+  return wasmFuelInstrumentSource(readFile, module, module->size(), info, writeSink, &sink) == instrumentedLength
+         && (!sink.used || flushSink(&sink));
+}
+
+/**
+ * @fn
+ * Compare a module with the instrumented module in a partition
+ */
+static bool isInstalled(const esp_partition_t *partition, File *module, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  uint32_t header[2];
+  if (esp_partition_read(partition, 0, header, sizeof(header)) != ESP_OK
+      || header[0] != WASM_PARTITION_MAGIC || header[1] != instrumentedLength)
+    return false;
+  return instrumentInto(partition, true, module, info, instrumentedLength);
+}
+
+/**
+ * @fn
+ * Write the instrumented module into a partition
+ */
+static bool writeModule(const esp_partition_t *partition, File *module, const WasmFuelInfo *info, size_t instrumentedLength)
+{
+  //erase whole sectors (4 KB)
+  size_t eraseSize = (instrumentedLength + WASM_PARTITION_HEADER_SIZE + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+  if (esp_partition_erase_range(partition, 0, eraseSize) != ESP_OK
+      || !instrumentInto(partition, false, module, info, instrumentedLength))
+    return false;
+
+  uint32_t header[2] = {WASM_PARTITION_MAGIC, instrumentedLength};
+  return esp_partition_write(partition, 0, header, sizeof(header)) == ESP_OK;
+}
+
+int wasmPartitionInstall(const char *path, uint32_t busySlots, const WasmFuelInfo *info)
+{
+  File module = SPIFFS.open(path, "r");
+  if (!module)
+  {
+    Serial.println("Cannot read the wasm file");
+    return -1;
+  }
+  size_t instrumentedLength = wasmFuelInstrumentSource(readFile, &module, module.size(), info, NULL, NULL);
+  if (!instrumentedLength)
+  {
+    Serial.println("Wasm module cannot be metered (see wasm_fuel.h)");
+    module.close();
+    return -1;
+  }
+
+  int slot = -1;
+  int freeSlot = -1;
+  for (int i = 0; i < WASM_PARTITION_SLOTS && slot < 0; i++)
+  {
+    const esp_partition_t *partition = findWasmPartition(i);
+    if ((busySlots & WASM_PARTITION_SLOT_MASK(i)) || !partition)
+      continue;
+    if (isInstalled(partition, &module, info, instrumentedLength))
+      slot = i;
+    else if (freeSlot < 0)
+      freeSlot = i;
+  }
+  if (slot < 0 && freeSlot < 0)
+    Serial.println("No wasm partition");
+  else if (slot < 0 && instrumentedLength + WASM_PARTITION_HEADER_SIZE > findWasmPartition(freeSlot)->size)
+    Serial.println("Wasm file does not fit into the partition");
+  else if (slot < 0)
+  {
+    wasmPartitionUnmap(freeSlot);
+    if (writeModule(findWasmPartition(freeSlot), &module, info, instrumentedLength))
+      slot = freeSlot;
+  }
+  module.close();
+  return slot;
+}
+
+const uint8_t *wasmPartitionMap(int slot, size_t *length)
+{
+  const esp_partition_t *partition = findWasmPartition(slot);
+  if (!partition)
+    return NULL;
+
+  uint32_t header[2];
+  if (esp_partition_read(partition, 0, header, sizeof(header)) != ESP_OK
+      || header[0] != WASM_PARTITION_MAGIC || header[1] + WASM_PARTITION_HEADER_SIZE > partition->size)
+    return NULL;
+
+  wasmPartitionUnmap(slot);
+  const void *data;
+  if (esp_partition_mmap(partition, 0, header[1] + WASM_PARTITION_HEADER_SIZE, SPI_FLASH_MMAP_DATA, &data, &wasmMapHandle[slot]) != ESP_OK)
+    return NULL;
+  wasmMapped[slot] = true;
+  *length = header[1];
+  return (const uint8_t *) data + WASM_PARTITION_HEADER_SIZE;
+}
+
+void wasmPartitionUnmap(int slot)
+{
+  if (slot < 0 || !wasmMapped[slot])
+    return;
+  spi_flash_munmap(wasmMapHandle[slot]);
+  wasmMapped[slot] = false;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file wasm_partition.h
+ * @brief Raw flash partitions ("wasm0" to "wasm3", see partitions.csv) holding the modules to execute.
+ * A partition is memory-mapped, so m3_ParseModule() reads the module from flash without copying it into RAM.
+ * A new module is installed into a slot which is not running (A/B slots), so it is loaded next to the running one.
+ * Several modules need two slots each. A slot without partition is skipped, so two partitions serve one module.
+ * The received module is still stored as SPIFFS file (/main.wasm) and installed into a slot before it is loaded.
+ * The slot holds the module metered (see wasm_fuel.h): the file is read in blocks of WASM_FUEL_READ_SIZE bytes and instrumented
+ * while it is written, so only metered modules are executed and the module does not have to fit into RAM. A module which cannot be metered is not installed.
+ * Partition layout:
+ * | magic (4 bytes) | length of the instrumented module (4 bytes) | instrumented module |
+ */
+#ifndef WASM_PARTITION_H
+#define WASM_PARTITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wasm_fuel.h"
+
+#define WASM_PARTITION_SLOTS 4 //partitions "wasm0" to "wasm3"
+#define WASM_PARTITION_SUBTYPE 0x40 //custom data subtype of the partitions
+#define WASM_PARTITION_MAGIC 0x4d534157 //"WASM"
+#define WASM_PARTITION_HEADER_SIZE 8
+#define WASM_PARTITION_SLOT_MASK(slot) ((slot) < 0 ? 0u : 1u << (slot)) //busy slot of wasmPartitionInstall(), none for -1
+
+/**
+ * @fn
+ * Instrument a module file into a slot. A slot which already holds the same module is used without writing.
+ * The header is written last, so an interrupted copy leaves no valid module behind.
+ * @param path const char *
+ * @param busySlots uint32_t, slots of the running modules which must not be written (WASM_PARTITION_SLOT_MASK())
+ * @param info const WasmFuelInfo *, scan of the file from its validation while it was received (see wasm_validate.h),
+ * so the instrumentation runs do not scan it again. NULL if it is not known.
+ * @return slot of the module, -1 if there is no free partition, the file does not fit, cannot be read or cannot be metered
+ */
+int wasmPartitionInstall(const char *path, uint32_t busySlots, const WasmFuelInfo *info);
+
+/**
+ * @fn
+ * Map the module of a slot into the address space. The mapping stays valid until wasmPartitionUnmap() or the next install into the slot.
+ * @param slot int
+ * @param length size_t *, output: module length
+ * @return module, NULL if the slot holds no module
+ */
+const uint8_t *wasmPartitionMap(int slot, size_t *length);
+
+/**
+ * @fn
+ * Release the mapping of a slot after its module is freed
+ * @param slot int
+ */
+void wasmPartitionUnmap(int slot);
+
+#endif
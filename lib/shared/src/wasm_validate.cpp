@@ -0,0 +1,672 @@
+/**
+ * @file wasm_validate.cpp
+ * @brief Streaming validation of a received module (see wasm_validate.h).
+ */
+#include <string.h>
+#include "wasm_validate.h"
+
+#define WASM_HEADER_SIZE 8
+#define WASM_PAGE_SIZE 65536
+#define WASM_MAX_PAGES 65536
+
+#define SECTION_CUSTOM 0
+#define SECTION_TYPE 1
+#define SECTION_IMPORT 2
+#define SECTION_FUNCTION 3
+#define SECTION_MEMORY 5
+#define SECTION_GLOBAL 6
+#define SECTION_EXPORT 7
+#define SECTION_CODE 10
+#define SECTION_DATA 11
+#define SECTION_COUNT 14 //ids 0 to 13
+#define SECTION_BIT(id) (1u << (id))
+#define BUFFERED_SECTIONS (SECTION_BIT(SECTION_TYPE) | SECTION_BIT(SECTION_IMPORT) | SECTION_BIT(SECTION_FUNCTION) \
+                           | SECTION_BIT(SECTION_MEMORY) | SECTION_BIT(SECTION_EXPORT))
+
+#define OP_END 0x0b
+#define OP_GLOBAL_GET 0x23
+#define OP_I32_CONST 0x41
+#define TYPE_I32 0x7f
+#define TYPE_I64 0x7e
+#define TYPE_F64 0x7c
+#define TYPE_V128 0x7b
+#define TYPE_FUNCTION 0x60
+#define KIND_FUNCTION 0
+#define KIND_TABLE 1
+#define KIND_MEMORY 2
+#define KIND_GLOBAL 3
+#define KIND_TAG 4
+
+//states of the validator
+#define STATE_HEADER 0
+#define STATE_SECTION_ID 1
+#define STATE_SECTION_SIZE 2
+#define STATE_BUFFER 3 //content of a buffered section
+#define STATE_SKIP 4 //content which is not checked
+#define STATE_STREAM 5 //content parsed byte by byte (global, code and data section), see step
+
+//steps of the sections parsed byte by byte
+#define STEP_COUNT 0
+#define STEP_DONE 1
+#define STEP_BODY_SIZE 2
+#define STEP_LOCAL_GROUPS 3
+#define STEP_LOCAL_COUNT 4
+#define STEP_LOCAL_TYPE 5
+#define STEP_BODY 6
+#define STEP_SEGMENT_FLAGS 7
+#define STEP_SEGMENT_MEMORY 8
+#define STEP_OFFSET_OPCODE 9
+#define STEP_OFFSET_CONST 10
+#define STEP_OFFSET_GLOBAL 11
+#define STEP_OFFSET_END 12
+#define STEP_SEGMENT_SIZE 13
+#define STEP_SEGMENT_DATA 14
+
+static const uint8_t wasmHeader[WASM_HEADER_SIZE] = {0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00};
+
+//order of the sections by id (see wasm_fuel.cpp)
+static const uint8_t sectionRank[SECTION_COUNT] = {0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 19, 11};
+
+typedef struct {
+  const uint8_t *position;
+  const uint8_t *end;
+  bool error;
+} Reader;
+
+static uint8_t readByte(Reader *reader)
+{
+  if (reader->position >= reader->end)
+  {
+    reader->error = true;
+    return 0;
+  }
+  return *reader->position++;
+}
+
+static uint32_t readU32(Reader *reader)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    uint8_t byte = readByte(reader);
+    value |= (uint32_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  reader->error = true;
+  return 0;
+}
+
+static void skipBytes(Reader *reader, uint32_t len)
+{
+  if (len > (size_t) (reader->end - reader->position))
+    reader->error = true;
+  else
+    reader->position += len;
+}
+
+static void skipName(Reader *reader)
+{
+  skipBytes(reader, readU32(reader));
+}
+
+static bool fail(WasmValidator *validator, const char *error)
+{
+  if (!validator->error)
+    validator->error = error;
+  return false;
+}
+
+/**
+ * @fn
+ * Read the limits of a memory and keep the size the runtime allocates
+ */
+static bool readMemory(WasmValidator *validator, Reader *content)
+{
+  if (validator->hasMemory)
+    return fail(validator, "more than one memory");
+  uint8_t flags = readByte(content);
+  uint32_t minimum = readU32(content);
+  uint32_t maximum = flags == 1 ? readU32(content) : WASM_MAX_PAGES;
+  if (flags > 1)
+    return fail(validator, "unsupported memory limits");
+  if (minimum > maximum || maximum > WASM_MAX_PAGES)
+    return fail(validator, "invalid memory limits");
+  uint64_t size = (uint64_t) minimum * WASM_PAGE_SIZE;
+  if (validator->config->memoryLimit && size > validator->config->memoryLimit)
+    size = validator->config->memoryLimit; //wasm3 allocates the limit only
+  validator->memorySize = size > 0xffffffffu ? 0xffffffffu : (uint32_t) size;
+  validator->hasMemory = true;
+  return true;
+}
+
+static bool parseTypes(WasmValidator *validator, Reader *content)
+{
+  validator->fuel.types = readU32(content);
+  for (uint32_t i = 0; i < validator->fuel.types && !content->error; i++)
+  {
+    if (readByte(content) != TYPE_FUNCTION)
+      return fail(validator, "unsupported type");
+    skipBytes(content, readU32(content)); //parameters
+    skipBytes(content, readU32(content)); //results
+  }
+  return true;
+}
+
+static bool parseImports(WasmValidator *validator, Reader *content)
+{
+  uint32_t count = readU32(content);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    skipName(content);
+    skipName(content);
+    switch (readByte(content))
+    {
+      case KIND_FUNCTION:
+        readU32(content);
+        validator->fuel.functionImports++;
+        break;
+      case KIND_TABLE:
+        readByte(content);
+        if (readByte(content) == 1)
+          readU32(content);
+        readU32(content);
+        break;
+      case KIND_MEMORY:
+        if (!readMemory(validator, content))
+          return false;
+        break;
+      case KIND_GLOBAL:
+        readByte(content);
+        readByte(content);
+        validator->fuel.globals++;
+        break;
+      case KIND_TAG:
+        readByte(content);
+        readU32(content);
+        break;
+      default:
+        return fail(validator, "unknown import kind");
+    }
+  }
+  return true;
+}
+
+static bool parseFunctions(WasmValidator *validator, Reader *content)
+{
+  validator->functions = readU32(content);
+  for (uint32_t i = 0; i < validator->functions && !content->error; i++)
+  {
+    if (readU32(content) >= validator->fuel.types && !(validator->unchecked & SECTION_BIT(SECTION_TYPE)))
+      return fail(validator, "function type out of range");
+  }
+  return true;
+}
+
+static bool parseMemories(WasmValidator *validator, Reader *content)
+{
+  uint32_t count = readU32(content);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    if (!readMemory(validator, content))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * Check the type of the entry with the type and function sections, which are still in the buffer
+ * @param function uint32_t, function index of the entry
+ */
+static bool checkEntry(WasmValidator *validator, uint32_t function)
+{
+  if (function < validator->fuel.functionImports)
+    return fail(validator, "entry function is imported");
+  if (validator->unchecked & (SECTION_BIT(SECTION_TYPE) | SECTION_BIT(SECTION_IMPORT) | SECTION_BIT(SECTION_FUNCTION)))
+    return true;
+  function -= validator->fuel.functionImports;
+  if (function >= validator->functions)
+    return fail(validator, "entry function out of range");
+
+  Reader functions = {validator->buffer + validator->functionStart, validator->buffer + validator->functionStart + validator->functionLength, false};
+  readU32(&functions);
+  for (uint32_t i = 0; i < function; i++)
+    readU32(&functions);
+  uint32_t type = readU32(&functions);
+
+  Reader types = {validator->buffer + validator->typeStart, validator->buffer + validator->typeStart + validator->typeLength, false};
+  readU32(&types);
+  for (uint32_t i = 0; i < type; i++)
+  {
+    readByte(&types);
+    skipBytes(&types, readU32(&types));
+    skipBytes(&types, readU32(&types));
+  }
+  readByte(&types);
+  uint32_t params = readU32(&types);
+  bool match = params == validator->config->entryParams;
+  for (uint32_t i = 0; i < params && match; i++)
+    match = readByte(&types) == TYPE_I32;
+  uint32_t results = readU32(&types);
+  match = match && results == validator->config->entryResults;
+  for (uint32_t i = 0; i < results && match; i++)
+    match = readByte(&types) == TYPE_I32;
+  if (functions.error || types.error || !match)
+    return fail(validator, "entry function has a wrong signature");
+  return true;
+}
+
+static bool parseExports(WasmValidator *validator, Reader *content)
+{
+  uint32_t count = readU32(content);
+  size_t entryLength = strlen(validator->config->entry);
+  for (uint32_t i = 0; i < count && !content->error; i++)
+  {
+    uint32_t nameLength = readU32(content);
+    const uint8_t *name = content->position;
+    skipBytes(content, nameLength);
+    uint8_t kind = readByte(content);
+    uint32_t index = readU32(content);
+    if (content->error || nameLength != entryLength || memcmp(name, validator->config->entry, entryLength))
+      continue;
+    if (kind != KIND_FUNCTION)
+      return fail(validator, "entry export is not a function");
+    if (!checkEntry(validator, index))
+      return false;
+    validator->entryFound = true;
+  }
+  return true;
+}
+
+/**
+ * @fn
+ * Parse a buffered section once it is complete
+ */
+static void parseSection(WasmValidator *validator)
+{
+  uint16_t start = validator->kept;
+  Reader content = {validator->buffer + start, validator->buffer + validator->buffered, false};
+  bool ok;
+  switch (validator->sectionId)
+  {
+    case SECTION_TYPE: ok = parseTypes(validator, &content); break;
+    case SECTION_IMPORT: ok = parseImports(validator, &content); break;
+    case SECTION_FUNCTION: ok = parseFunctions(validator, &content); break;
+    case SECTION_MEMORY: ok = parseMemories(validator, &content); break;
+    default: ok = parseExports(validator, &content); break;
+  }
+  if (!ok)
+    return;
+  if (content.error || content.position != content.end)
+  {
+    fail(validator, "malformed section");
+    return;
+  }
+
+  //the type and function sections are needed for the signature of the entry, the others are dropped
+  if (validator->sectionId == SECTION_TYPE)
+  {
+    validator->typeStart = start;
+    validator->typeLength = validator->buffered - start;
+    validator->kept = validator->buffered;
+  }
+  else if (validator->sectionId == SECTION_FUNCTION)
+  {
+    validator->functionStart = start;
+    validator->functionLength = validator->buffered - start;
+    validator->kept = validator->buffered;
+  }
+  validator->buffered = validator->kept;
+}
+
+/**
+ * @fn
+ * Add a byte to the LEB128 number being read
+ * @param number uint32_t *, output: the number when it is complete
+ * @return true if the number is complete
+ */
+static bool readLeb(WasmValidator *validator, uint8_t byte, bool isSigned, uint32_t *number)
+{
+  if (validator->lebShift == 28 && ((byte & 0x80) || (!isSigned && byte > 0x0f)))
+    return fail(validator, "malformed LEB128");
+  validator->lebValue |= (uint32_t) (byte & 0x7f) << validator->lebShift;
+  validator->lebShift += 7;
+  if (byte & 0x80)
+    return false;
+  *number = validator->lebValue;
+  if (isSigned && validator->lebShift < 32 && (byte & 0x40))
+    *number |= ~0u << validator->lebShift;
+  validator->lebValue = 0;
+  validator->lebShift = 0;
+  return true;
+}
+
+static void startSection(WasmValidator *validator, uint8_t id)
+{
+  if (id >= SECTION_COUNT)
+  {
+    fail(validator, "unknown section");
+    return;
+  }
+  if (id != SECTION_CUSTOM)
+  {
+    if (sectionRank[id] <= validator->lastRank)
+    {
+      fail(validator, "sections out of order");
+      return;
+    }
+    validator->lastRank = sectionRank[id];
+    validator->fuel.sections |= SECTION_BIT(id);
+  }
+  validator->sectionId = id;
+  validator->state = STATE_SECTION_SIZE;
+}
+
+/**
+ * @fn
+ * Choose how the content of a section is read
+ * @param size uint32_t, of the content, which starts after the current byte
+ */
+static void startContent(WasmValidator *validator, uint32_t size)
+{
+  uint8_t id = validator->sectionId;
+  if (size > 0xffffffffu - validator->offset - 1)
+  {
+    fail(validator, "malformed section size");
+    return;
+  }
+  validator->sectionEnd = validator->offset + 1 + size;
+  validator->state = STATE_SKIP;
+  if (BUFFERED_SECTIONS & SECTION_BIT(id))
+  {
+    if (size <= sizeof(validator->buffer) - validator->kept)
+      validator->state = STATE_BUFFER;
+    else
+      validator->unchecked |= SECTION_BIT(id);
+  }
+  else if (id == SECTION_GLOBAL || id == SECTION_CODE || id == SECTION_DATA)
+  {
+    validator->state = STATE_STREAM;
+    validator->step = STEP_COUNT;
+  }
+}
+
+static void endSection(WasmValidator *validator)
+{
+  if (validator->state == STATE_BUFFER)
+    parseSection(validator);
+  else if (validator->state == STATE_STREAM && validator->step != STEP_DONE)
+    fail(validator, "malformed section");
+  validator->state = STATE_SECTION_ID;
+}
+
+/**
+ * @fn
+ * Size of a local in the stack of wasm3, a lower bound
+ */
+static uint32_t localSize(uint8_t type)
+{
+  switch (type)
+  {
+    case TYPE_I64:
+    case TYPE_F64: return 8;
+    case TYPE_V128: return 16;
+    default: return 4;
+  }
+}
+
+/**
+ * @fn
+ * Next function body or data segment of a section parsed byte by byte
+ */
+static void nextEntry(WasmValidator *validator)
+{
+  validator->entries--;
+  if (!validator->entries)
+    validator->step = STEP_DONE;
+  else
+    validator->step = validator->sectionId == SECTION_CODE ? STEP_BODY_SIZE : STEP_SEGMENT_FLAGS;
+}
+
+/**
+ * @fn
+ * Start a function body or a data segment which ends after size bytes
+ */
+static bool startEntry(WasmValidator *validator, uint32_t size)
+{
+  if (size > validator->sectionEnd - validator->offset - 1)
+    return fail(validator, "malformed section");
+  validator->entryEnd = validator->offset + 1 + size;
+  return true;
+}
+
+/**
+ * @fn
+ * End of the local declarations of a function body, the instructions follow
+ */
+static void endLocals(WasmValidator *validator)
+{
+  //at least the end of the body
+  if (validator->offset + 1 >= validator->entryEnd)
+    fail(validator, "malformed function body");
+  validator->step = STEP_BODY;
+}
+
+/**
+ * @fn
+ * Parse the content of a global, code or data section
+ * @return bytes consumed, at least 1
+ */
+static size_t streamContent(WasmValidator *validator, const uint8_t *data, size_t len)
+{
+  uint8_t byte = *data;
+  uint32_t number;
+  if (validator->step >= STEP_LOCAL_GROUPS && validator->step <= STEP_LOCAL_TYPE && validator->offset >= validator->entryEnd)
+  {
+    fail(validator, "malformed function body");
+    return 1;
+  }
+  switch (validator->step)
+  {
+    case STEP_COUNT:
+      if (!readLeb(validator, byte, false, &number))
+        break;
+      validator->entries = number;
+      validator->step = STEP_DONE;
+      if (validator->sectionId == SECTION_GLOBAL)
+      {
+        validator->fuel.globals += number;
+        validator->state = STATE_SKIP;
+      }
+      else if (validator->sectionId == SECTION_CODE)
+      {
+        if (number != validator->functions && !(validator->unchecked & SECTION_BIT(SECTION_FUNCTION)))
+          fail(validator, "function and code counts differ");
+        if (number)
+          validator->step = STEP_BODY_SIZE;
+      }
+      else if (number)
+        validator->step = STEP_SEGMENT_FLAGS;
+      break;
+    case STEP_DONE:
+      fail(validator, "malformed section");
+      break;
+
+    case STEP_BODY_SIZE:
+      if (!readLeb(validator, byte, false, &number) || !startEntry(validator, number))
+        break;
+      validator->frameSize = 0;
+      validator->step = STEP_LOCAL_GROUPS;
+      break;
+    case STEP_LOCAL_GROUPS:
+      if (!readLeb(validator, byte, false, &validator->localGroups))
+        break;
+      if (validator->localGroups)
+        validator->step = STEP_LOCAL_COUNT;
+      else
+        endLocals(validator);
+      break;
+    case STEP_LOCAL_COUNT:
+      if (readLeb(validator, byte, false, &validator->localCount))
+        validator->step = STEP_LOCAL_TYPE;
+      break;
+    case STEP_LOCAL_TYPE:
+    {
+      uint64_t frameSize = validator->frameSize + (uint64_t) validator->localCount * localSize(byte);
+      if (frameSize > validator->config->stackSize)
+      {
+        fail(validator, "function locals exceed the stack");
+        break;
+      }
+      validator->frameSize = frameSize;
+      if (--validator->localGroups)
+        validator->step = STEP_LOCAL_COUNT;
+      else
+        endLocals(validator);
+      break;
+    }
+    case STEP_BODY:
+    case STEP_SEGMENT_DATA:
+    {
+      //instructions and data are not checked
+      size_t n = len < validator->entryEnd - validator->offset ? len : validator->entryEnd - validator->offset;
+      if (validator->offset + n == validator->entryEnd)
+        nextEntry(validator);
+      return n;
+    }
+
+    case STEP_SEGMENT_FLAGS:
+      if (!readLeb(validator, byte, false, &number))
+        break;
+      validator->segmentActive = number != 1;
+      if (number == 0)
+        validator->step = STEP_OFFSET_OPCODE;
+      else if (number == 1)
+        validator->step = STEP_SEGMENT_SIZE;
+      else if (number == 2)
+        validator->step = STEP_SEGMENT_MEMORY;
+      else
+        fail(validator, "unsupported data segment");
+      break;
+    case STEP_SEGMENT_MEMORY:
+      if (!readLeb(validator, byte, false, &number))
+        break;
+      if (number)
+        fail(validator, "unsupported data segment");
+      validator->step = STEP_OFFSET_OPCODE;
+      break;
+    case STEP_OFFSET_OPCODE:
+      if (!validator->hasMemory)
+        fail(validator, "data segment without memory");
+      else if (byte == OP_I32_CONST)
+        validator->step = STEP_OFFSET_CONST;
+      else if (byte == OP_GLOBAL_GET)
+        validator->step = STEP_OFFSET_GLOBAL;
+      else
+        fail(validator, "unsupported data segment offset");
+      break;
+    case STEP_OFFSET_CONST:
+      if (!readLeb(validator, byte, true, &validator->segmentOffset))
+        break;
+      validator->segmentOffsetKnown = true;
+      validator->step = STEP_OFFSET_END;
+      break;
+    case STEP_OFFSET_GLOBAL:
+      if (!readLeb(validator, byte, false, &number))
+        break;
+      validator->segmentOffsetKnown = false; //the value of an imported global is not known here
+      validator->step = STEP_OFFSET_END;
+      break;
+    case STEP_OFFSET_END:
+      if (byte != OP_END)
+        fail(validator, "unsupported data segment offset");
+      validator->step = STEP_SEGMENT_SIZE;
+      break;
+    case STEP_SEGMENT_SIZE:
+      if (!readLeb(validator, byte, false, &number) || !startEntry(validator, number))
+        break;
+      if (validator->segmentActive && validator->segmentOffsetKnown
+          && (uint64_t) validator->segmentOffset + number > validator->memorySize)
+      {
+        fail(validator, "data segment exceeds the memory");
+        break;
+      }
+      if (number)
+        validator->step = STEP_SEGMENT_DATA;
+      else
+        nextEntry(validator);
+      break;
+  }
+  return 1;
+}
+
+void wasmValidateBegin(WasmValidator *validator, const WasmValidateConfig *config)
+{
+  memset(validator, 0, offsetof(WasmValidator, buffer));
+  validator->config = config;
+  validator->state = STATE_HEADER;
+}
+
+bool wasmValidateFeed(WasmValidator *validator, const uint8_t *data, size_t len)
+{
+  while (len && !validator->error)
+  {
+    size_t n = 1;
+    uint32_t size;
+    switch (validator->state)
+    {
+      case STATE_HEADER:
+        if (*data != wasmHeader[validator->offset])
+          fail(validator, "bad wasm header");
+        else if (validator->offset + 1 == WASM_HEADER_SIZE)
+          validator->state = STATE_SECTION_ID;
+        break;
+      case STATE_SECTION_ID:
+        startSection(validator, *data);
+        break;
+      case STATE_SECTION_SIZE:
+        if (readLeb(validator, *data, false, &size))
+          startContent(validator, size);
+        break;
+      case STATE_BUFFER:
+        n = len < validator->sectionEnd - validator->offset ? len : validator->sectionEnd - validator->offset;
+        memcpy(validator->buffer + validator->buffered, data, n);
+        validator->buffered += n;
+        break;
+      case STATE_SKIP:
+        n = len < validator->sectionEnd - validator->offset ? len : validator->sectionEnd - validator->offset;
+        break;
+      case STATE_STREAM:
+        n = streamContent(validator, data, len);
+        break;
+    }
+    validator->offset += n;
+    data += n;
+    len -= n;
+    if (validator->state >= STATE_BUFFER && validator->offset == validator->sectionEnd && !validator->error)
+      endSection(validator);
+  }
+  return !validator->error;
+}
+
+const char *wasmValidateFinish(WasmValidator *validator)
+{
+  if (validator->error)
+    return validator->error;
+  if (validator->state != STATE_SECTION_ID)
+    fail(validator, "truncated module");
+  else if (validator->functions && !(validator->fuel.sections & SECTION_BIT(SECTION_CODE)))
+    fail(validator, "function and code counts differ");
+  else if (!validator->entryFound && !(validator->unchecked & SECTION_BIT(SECTION_EXPORT)))
+    fail(validator, "entry function is not exported");
+  return validator->error;
+}
+
+const WasmFuelInfo *wasmValidateFuelInfo(const WasmValidator *validator)
+{
+  if (validator->error || validator->state != STATE_SECTION_ID
+      || (validator->unchecked & (SECTION_BIT(SECTION_TYPE) | SECTION_BIT(SECTION_IMPORT))))
+    return NULL;
+  return &validator->fuel;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file wasm_validate.h
+ * @brief Streaming validation of a received module. The validator is fed the decoded module in chunks as it is staged, so a module
+ * which cannot run is rejected during the reception instead of at its load, after the whole transfer:
+ * - the header and the section layout: known ids, order, sizes within the module, no truncated section
+ * - the entry the host calls (e.g. calcWasm): exported as function with entryParams i32 parameters and entryResults i32 results
+ * - the linear memory: at most one, limits wasm3 supports, active data segments within the initial memory as wasm3 allocates it
+ *   (at most memoryLimit bytes, WASM_MEMORY_LIMIT)
+ * - the stack: the locals of every function fit into the stack of the runtime (stackSize bytes, at least 4 bytes per i32 or f32
+ *   and 8 per i64 or f64), a function with more locals can never run
+ * The type, import, function, memory and export sections are buffered until they are complete and parsed then, the others are
+ * parsed or skipped byte by byte, so the chunks may be cut anywhere. A section larger than the buffer is skipped and its checks
+ * are not done. The instructions are not checked: wasm3 and the instrumentation (see wasm_fuel.h) reject what they do not support.
+ *
+ * A valid module leaves the scan its instrumentation needs (see wasmValidateFuelInfo()), so the install of the module does not
+ * scan it again (see wasmPartitionInstall()).
+ *
+ * The functions do not access the flash or the radio, so they run on the host as well (see esp-now/tools/wasm_validate_check.cpp).
+ *
+ * Usage:
+ *   wasmValidateBegin(&validator, &config); //with the header of a transfer
+ *   if (!wasmValidateFeed(&validator, data, len)) ... //validator.error, the reception can stop
+ *   const char *error = wasmValidateFinish(&validator); //at the end of the reception
+ */
+#ifndef WASM_VALIDATE_H
+#define WASM_VALIDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wasm_fuel.h"
+
+#ifndef WASM_VALIDATE_BUFFER_SIZE
+#define WASM_VALIDATE_BUFFER_SIZE 512 //bytes of the buffered sections, the type and function sections stay until the export section
+#endif
+
+typedef struct {
+  const char *entry; //name of the exported function the host calls
+  uint8_t entryParams; //i32 parameters of the entry
+  uint8_t entryResults; //i32 results of the entry
+  uint32_t memoryLimit; //bytes of linear memory the runtime allocates at most (WASM_MEMORY_LIMIT), 0: no limit
+  uint32_t stackSize; //bytes of the wasm stack of the runtime (m3_NewRuntime())
+} WasmValidateConfig;
+
+typedef struct {
+  const WasmValidateConfig *config;
+  const char *error; //NULL while the module is valid so far
+  uint32_t offset; //bytes of the module so far
+  uint8_t state;
+  uint8_t step; //within the entries of a section parsed byte by byte
+  uint8_t sectionId;
+  uint8_t lastRank; //of the last section, the order of the sections
+  uint32_t sectionEnd; //module offset after the running section
+  uint32_t unchecked; //bit per section id which was too large to be buffered
+  uint32_t lebValue; //LEB128 number being read
+  uint8_t lebShift;
+  uint32_t entries; //left of the running section
+  uint32_t entryEnd; //module offset after the running function body or data segment
+  uint32_t localGroups; //left of the running function body
+  uint32_t localCount; //locals of the running local group
+  uint32_t frameSize; //bytes of the locals of the running function body
+  bool segmentActive; //the running data segment is copied into the memory at its load
+  bool segmentOffsetKnown; //the offset of the running data segment is a constant
+  uint32_t segmentOffset;
+  uint32_t functions; //defined by the module (function section)
+  bool hasMemory;
+  uint32_t memorySize; //bytes of linear memory the runtime allocates at the load
+  bool entryFound;
+  WasmFuelInfo fuel;
+  uint16_t typeStart, typeLength; //type section in buffer
+  uint16_t functionStart, functionLength; //function section in buffer
+  uint16_t kept; //bytes of buffer which stay (type and function section)
+  uint16_t buffered;
+  uint8_t buffer[WASM_VALIDATE_BUFFER_SIZE];
+} WasmValidator;
+
+/**
+ * @fn
+ * Start the validation of a module
+ * @param validator WasmValidator *
+ * @param config const WasmValidateConfig *, static
+ */
+void wasmValidateBegin(WasmValidator *validator, const WasmValidateConfig *config);
+
+/**
+ * @fn
+ * Add decoded module data, in order. Called in the radio callback.
+ * @param validator WasmValidator *
+ * @param data const uint8_t *
+ * @param len size_t
+ * @return false if the module is invalid (validator->error), also for the chunks after the first error
+ */
+bool wasmValidateFeed(WasmValidator *validator, const uint8_t *data, size_t len);
+
+/**
+ * @fn
+ * End of the module: it must end after a complete section and export the entry
+ * @param validator WasmValidator *
+ * @return NULL if the module is valid, otherwise the reason (static string)
+ */
+const char *wasmValidateFinish(WasmValidator *validator);
+
+/**
+ * @fn
+ * Scan of a validated module for its instrumentation (see wasmFuelInstrument())
+ * @param validator const WasmValidator *, after wasmValidateFinish()
+ * @return NULL if the module is invalid or its type or import section was too large to be parsed
+ */
+const WasmFuelInfo *wasmValidateFuelInfo(const WasmValidator *validator);
+
+#endif